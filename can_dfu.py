@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+# Upload an MCUboot signed image over CAN ISO-TP (src/canbus_dfu.c).
+# Requires: pip install python-can can-isotp
+#
+#   ./can_dfu.py -i can0 build/zephyr/zephyr.signed.bin --reboot
+#   ./can_dfu.py -i vcan0 build/zephyr/zephyr.signed.bin     (native_sim)
+
+import argparse
+import struct
+import sys
+import time
+import zlib
+
+import can
+import isotp
+
+DFU_RX_ID = 0x758
+DFU_TX_ID = 0x768
+
+CMD_START, CMD_DATA, CMD_FINISH, CMD_ABORT, CMD_STATUS, CMD_REBOOT = range(1, 7)
+EBADMSG = 77
+ERANGE = 34
+
+
+def request(stack, payload, timeout):
+    stack.send(payload)
+    reply = stack.recv(block=True, timeout=timeout)
+    if reply is None or len(reply) < 7 or reply[0] != (payload[0] | 0x80):
+        raise RuntimeError("no reply to cmd 0x%02X" % payload[0])
+    status = struct.unpack_from("<b", reply, 1)[0]
+    percent = reply[2]
+    next_offset = struct.unpack_from("<I", reply, 3)[0]
+    return status, percent, next_offset
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("image")
+    ap.add_argument("-i", "--interface", default="can0")
+    ap.add_argument("-b", "--block", type=int, default=1024)
+    ap.add_argument("--reboot", action="store_true")
+    args = ap.parse_args()
+
+    image = open(args.image, "rb").read()
+
+    bus = can.interface.Bus(channel=args.interface, interface="socketcan")
+    addr = isotp.Address(isotp.AddressingMode.Normal_11bits, txid=DFU_RX_ID, rxid=DFU_TX_ID)
+    stack = isotp.CanStack(bus, address=addr, params={"blocking_send": True})
+    stack.start()
+
+    try:
+        status, _, _ = request(stack, struct.pack("<BII", CMD_START, len(image), zlib.crc32(image)), 5)
+        if status:
+            sys.exit("start failed: %d" % status)
+
+        start = time.monotonic()
+        offset = 0
+        last = -1
+        while offset < len(image):
+            chunk = image[offset:offset + args.block]
+            hdr = struct.pack("<BII", CMD_DATA, offset, zlib.crc32(chunk))
+            status, percent, next_offset = request(stack, hdr + chunk, 5)
+            if status == -EBADMSG:
+                continue
+            if status and status != -ERANGE:
+                sys.exit("chunk at 0x%X failed: %d" % (offset, status))
+            offset = next_offset
+            if percent // 10 != last:
+                last = percent // 10
+                print("%3d%% %d/%d" % (percent, offset, len(image)))
+
+        status, _, _ = request(stack, bytes([CMD_FINISH]), 30)
+        elapsed = time.monotonic() - start
+        if status:
+            sys.exit("finish failed: %d" % status)
+        print("done: %d bytes in %.1f s, %d B/s" % (len(image), elapsed, len(image) / elapsed))
+
+        if args.reboot:
+            request(stack, bytes([CMD_REBOOT]), 5)
+    except (RuntimeError, KeyboardInterrupt) as e:
+        stack.send(bytes([CMD_ABORT]))
+        sys.exit(str(e))
+    finally:
+        stack.stop()
+        bus.shutdown()
+
+
+if __name__ == "__main__":
+    main()
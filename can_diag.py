@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+# Read diagnostic records over CAN ISO-TP (src/canbus_diag.c).
+# Requires: pip install python-can can-isotp
+#
+#   ./can_diag.py -i can0                 all records
+#   ./can_diag.py -i can0 heap threads    selected records
+
+import argparse
+import struct
+import sys
+
+import can
+import isotp
+
+DIAG_RX_ID = 0x759
+DIAG_TX_ID = 0x769
+
+CAN_STATES = ["error-active", "error-warning", "error-passive", "bus-off", "stopped"]
+GOPRO_STATES = ["unknown", "offline", "online", "connected", "need-pairing", "pairing"]
+
+
+class Reader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def take(self, fmt):
+        val = struct.unpack_from("<" + fmt, self.data, self.pos)
+        self.pos += struct.calcsize("<" + fmt)
+        return val if len(val) > 1 else val[0]
+
+    def str(self):
+        n = self.take("B")
+        s = self.data[self.pos:self.pos + n].decode(errors="replace")
+        self.pos += n
+        return s
+
+
+def rec_build(r):
+    ver = r.take("I")
+    print("kernel %d.%d.%d, uptime %d ms" % (ver >> 16, (ver >> 8) & 0xFF, ver & 0xFF, r.take("I")))
+    print("built %s for %s" % (r.str(), r.str()))
+
+
+def rec_heap(r):
+    print("heap free %d, allocated %d, max %d" % r.take("III"))
+
+
+def rec_threads(r):
+    for _ in range(r.take("B")):
+        name = r.str()
+        prio, size, used = r.take("bHH")
+        print("  %-8s prio %3d stack %5d used %5d (%d%%)" % (name, prio, size, used, used * 100 // max(size, 1)))
+
+
+def rec_can(r):
+    state, tec, rec = r.take("BBB")
+    print("can %s tec %d rec %d" % (CAN_STATES[state] if state < len(CAN_STATES) else state, tec, rec))
+    print("bus errors: bit %d stuff %d crc %d form %d ack %d overrun %d" % r.take("IIIIII"))
+    print("isotp stmin 0x%02X rx %d msgs %d bytes, overruns %d" % r.take("BIII"))
+    print("isotp rx errors %d recoveries %d down %d ms, tx errors %d recoveries %d" % r.take("IIIII"))
+
+
+def rec_ble(r):
+    print("gatt flags 0x%X writes %d (err %d) notif %d reads %d (err %d)" % r.take("IIIIII"))
+
+
+def rec_gopro(r):
+    state, record, battery, videos, addr_type = r.take("BBBIB")
+    addr = ":".join("%02X" % b for b in reversed(r.data[r.pos:r.pos + 6]))
+    r.pos += 6
+    print("gopro %s rec %d battery %d videos %d addr %s (%d)" %
+          (GOPRO_STATES[state] if state < len(GOPRO_STATES) else state, record, battery, videos, addr, addr_type))
+    print("name '%s' model '%s' fw '%s' serial '%s'" % (r.str(), r.str(), r.str(), r.str()))
+
+
+def rec_time(r):
+    master, valid, tz = r.take("BBh")
+    offset, precision, rtt = r.take("iII")
+    print("master %s tz %d min, offset %s, rtt %d ms" %
+          ("valid" if master else "none", tz,
+           "%d +/- %d ms" % (offset, precision // 2) if valid else "unknown", rtt))
+    print("frames %d checks %d syncs %d failures %d" % r.take("IIII"))
+
+
+LAT_STAGES = ["queue", "writer", "ack", "response", "to-ack", "to-response"]
+
+
+def rec_latency(r):
+    stages, buckets = r.take("BB")
+    for i in range(stages):
+        count, lo, hi, avg = r.take("IIII")
+        hist = [r.take("H") for _ in range(buckets)]
+        name = LAT_STAGES[i] if i < len(LAT_STAGES) else str(i)
+        if not count:
+            print("  %-11s no samples" % name)
+            continue
+        print("  %-11s n %d min %d avg %d max %d us" % (name, count, lo, avg, hi))
+        print("  %-11s %s" % ("", " ".join("<%dus:%d" % (2 << b, n) for b, n in enumerate(hist) if n)))
+
+
+def rec_cams(r):
+    for cam in range(r.take("B")):
+        state, record, battery, videos, addr_type = r.take("BBBIB")
+        addr = ":".join("%02X" % b for b in reversed(r.data[r.pos:r.pos + 6]))
+        r.pos += 6
+        print("  %d %-12s rec %d battery %3d videos %4d addr %s (%d) '%s'" %
+              (cam, GOPRO_STATES[state] if state < len(GOPRO_STATES) else state,
+               record, battery, videos, addr, addr_type, r.str()))
+
+
+def rec_group(r):
+    shots, partial, cams = r.take("IIB")
+    print("shots %d partial %d cameras %d" % (shots, partial, cams))
+    issue, skew, lo, hi, avg, count = r.take("IIIIII")
+    if not count:
+        print("skew: no samples")
+        return
+    print("last skew %d us (issue %d us), n %d min %d avg %d max %d us" % (skew, issue, count, lo, avg, hi))
+
+
+READY_PHASES = ["create", "connect", "security", "discovery", "subscribe", "hw-info", "startup", "total"]
+
+
+def rec_ready(r):
+    for i in range(r.take("B")):
+        count, stalls, lo, avg, hi, p95 = r.take("IIIIII")
+        name = READY_PHASES[i] if i < len(READY_PHASES) else str(i)
+        if not count:
+            print("  %-9s no samples, stalls %d" % (name, stalls))
+            continue
+        print("  %-9s n %d min %d avg %d max %d p95 %d ms, stalls %d" % (name, count, lo, avg, hi, p95, stalls))
+
+
+DIDS = {
+    "build": (0xF189, rec_build),
+    "heap": (0xFD01, rec_heap),
+    "threads": (0xFD02, rec_threads),
+    "can": (0xFD03, rec_can),
+    "ble": (0xFD04, rec_ble),
+    "gopro": (0xFD05, rec_gopro),
+    "time": (0xFD06, rec_time),
+    "latency": (0xFD07, rec_latency),
+    "cams": (0xFD08, rec_cams),
+    "group": (0xFD09, rec_group),
+    "ready": (0xFD0A, rec_ready),
+}
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("records", nargs="*", help=", ".join(DIDS))
+    ap.add_argument("-i", "--interface", default="can0")
+    args = ap.parse_args()
+
+    records = args.records or list(DIDS)
+    for name in records:
+        if name not in DIDS:
+            ap.error("unknown record '%s'" % name)
+
+    bus = can.interface.Bus(channel=args.interface, interface="socketcan")
+    addr = isotp.Address(isotp.AddressingMode.Normal_11bits, txid=DIAG_RX_ID, rxid=DIAG_TX_ID)
+    stack = isotp.CanStack(bus, address=addr, params={"blocking_send": True})
+    stack.start()
+
+    try:
+        for name in records:
+            did, parse = DIDS[name]
+            stack.send(struct.pack(">BH", 0x22, did))
+            resp = stack.recv(block=True, timeout=2)
+            if resp is None:
+                sys.exit("no reply")
+            if resp[0] == 0x7F:
+                print("%s: negative response 0x%02X" % (name, resp[2]))
+                continue
+            print("[%s]" % name)
+            parse(Reader(resp[3:]))
+    finally:
+        stack.stop()
+        bus.shutdown()
+
+
+if __name__ == "__main__":
+    main()
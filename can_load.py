@@ -0,0 +1,243 @@
+#!/usr/bin/env python3
+# CAN load generator: replays ISO-TP and command traffic at fixed rates and
+# measures reply latency and drops. Meant for native_sim on vcan0, works the
+# same against hardware on can0.
+# Requires: pip install python-can can-isotp
+#
+#   sudo ip link add dev vcan0 type vcan && sudo ip link set up vcan0
+#   ./build/zephyr/zephyr.exe
+#   ./can_load.py -i vcan0 --isotp-rate 20 --isotp-size 512 --cmd-rate 50 --ping-rate 10 -t 30
+#
+# Streams:
+#   isotp  GoproClient_bledata to an ISO-TP session. The BLE address is unused,
+#          so the device decodes and drops it without a camera. Latency is the
+#          full transfer time including flow control.
+#   cmd    single frames on 0x772, answered on 0x773 (camera connected)
+#          or 0x740 (offline). Default payload is Get Hardware Info.
+#   ping   diagnostic TesterPresent round trip on 0x759/0x769.
+# Device-side counters (diag DID 0xFD03) are read before and after the run.
+
+import argparse
+import collections
+import struct
+import threading
+import time
+
+import can
+import isotp
+
+SESSIONS = {"main": 0x753, "cmd": 0x754, "set": 0x755, "qry": 0x756, "net": 0x757}
+FC_OFFSET = 0x10
+
+CMD_ID = 0x772
+CMD_REPLY_IDS = (0x773, 0x740)
+
+DIAG_RX_ID = 0x759
+DIAG_TX_ID = 0x769
+
+BLE_ADDR_UNUSED = 0x7E
+
+
+class Stats:
+    def __init__(self, name):
+        self.name = name
+        self.sent = 0
+        self.drops = 0
+        self.lat = []
+        self.lock = threading.Lock()
+
+    def ok(self, seconds):
+        with self.lock:
+            self.lat.append(seconds * 1000.0)
+
+    def report(self):
+        lat = sorted(self.lat)
+        if lat:
+            pct = lambda p: lat[min(len(lat) - 1, int(len(lat) * p))]
+            lat_str = "min %.2f p50 %.2f p95 %.2f max %.2f ms" % (lat[0], pct(0.5), pct(0.95), lat[-1])
+        else:
+            lat_str = "no replies"
+        print("%-6s sent %6d ok %6d drops %5d  %s" % (self.name, self.sent, len(lat), self.drops, lat_str))
+
+
+def varint(n):
+    out = bytearray()
+    while True:
+        b = n & 0x7F
+        n >>= 7
+        out.append(b | (0x80 if n else 0))
+        if not n:
+            return bytes(out)
+
+
+def bledata(addr, payload):
+    return b"\x08" + varint(addr) + b"\x12" + varint(len(payload)) + payload
+
+
+def paced(rate, duration, stop, fn):
+    period = 1.0 / rate
+    deadline = time.monotonic()
+    end = deadline + duration
+    while not stop.is_set() and deadline < end:
+        fn()
+        deadline += period
+        delay = deadline - time.monotonic()
+        if delay > 0:
+            time.sleep(delay)
+
+
+def isotp_stack(bus, notifier, txid, rxid):
+    addr = isotp.Address(isotp.AddressingMode.Normal_11bits, txid=txid, rxid=rxid)
+    stack = isotp.NotifierBasedCanStack(bus, notifier, address=addr, params={"blocking_send": True})
+    stack.start()
+    return stack
+
+
+def run_isotp(bus, notifier, args, stop, stats):
+    rx_id = SESSIONS[args.session]
+    stack = isotp_stack(bus, notifier, rx_id, rx_id + FC_OFFSET)
+    payload = bledata(BLE_ADDR_UNUSED, bytes(i & 0xFF for i in range(args.isotp_size)))
+
+    def one():
+        stats.sent += 1
+        start = time.monotonic()
+        try:
+            stack.send(payload, send_timeout=args.timeout)
+            stats.ok(time.monotonic() - start)
+        except Exception:
+            stats.drops += 1
+
+    paced(args.isotp_rate, args.time, stop, one)
+    stack.stop()
+
+
+def run_cmd(bus, notifier, args, stop, stats):
+    pending = collections.deque()
+    lock = threading.Lock()
+    data = bytes.fromhex(args.cmd_data)
+
+    def on_msg(msg):
+        if msg.arbitration_id in CMD_REPLY_IDS:
+            with lock:
+                if pending:
+                    stats.ok(time.monotonic() - pending.popleft())
+
+    def expire():
+        now = time.monotonic()
+        with lock:
+            while pending and now - pending[0] > args.timeout:
+                pending.popleft()
+                stats.drops += 1
+
+    notifier.add_listener(on_msg)
+
+    def one():
+        expire()
+        with lock:
+            pending.append(time.monotonic())
+        stats.sent += 1
+        bus.send(can.Message(arbitration_id=CMD_ID, data=data, is_extended_id=False))
+
+    paced(args.cmd_rate, args.time, stop, one)
+    time.sleep(args.timeout)
+    expire()
+    with lock:
+        stats.drops += len(pending)
+    notifier.remove_listener(on_msg)
+
+
+def diag_request(stack, req, timeout):
+    stack.send(req)
+    return stack.recv(block=True, timeout=timeout)
+
+
+def run_ping(stack, args, stop, stats):
+    def one():
+        stats.sent += 1
+        start = time.monotonic()
+        resp = diag_request(stack, b"\x3E\x00", args.timeout)
+        if resp is not None and resp[0] == 0x7E:
+            stats.ok(time.monotonic() - start)
+        else:
+            stats.drops += 1
+
+    paced(args.ping_rate, args.time, stop, one)
+
+
+def device_counters(stack, timeout):
+    resp = diag_request(stack, b"\x22\xFD\x03", timeout)
+    if resp is None or resp[0] != 0x62:
+        return None
+    rec = resp[3:]
+    bus_errors = struct.unpack_from("<6I", rec, 3)
+    stmin, rx_msgs, rx_bytes, overruns = struct.unpack_from("<BIII", rec, 27)
+    rx_errors, recoveries = struct.unpack_from("<II", rec, 40)
+    return {"rx_msgs": rx_msgs, "rx_bytes": rx_bytes, "overruns": overruns, "rx_errors": rx_errors,
+            "recoveries": recoveries, "can_rx_overruns": bus_errors[5], "stmin": stmin}
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("-i", "--interface", default="vcan0")
+    ap.add_argument("-t", "--time", type=float, default=10, help="run time, s")
+    ap.add_argument("--timeout", type=float, default=1.0, help="reply timeout, s")
+    ap.add_argument("--session", choices=SESSIONS, default="main")
+    ap.add_argument("--isotp-rate", type=float, default=0, help="ISO-TP messages/s, 0 - off")
+    ap.add_argument("--isotp-size", type=int, default=256)
+    ap.add_argument("--cmd-rate", type=float, default=0, help="command frames/s, 0 - off")
+    ap.add_argument("--cmd-data", default="013C")
+    ap.add_argument("--ping-rate", type=float, default=10, help="diag pings/s, 0 - off")
+    args = ap.parse_args()
+
+    bus = can.interface.Bus(channel=args.interface, interface="socketcan")
+    notifier = can.Notifier(bus, [])
+    diag = isotp_stack(bus, notifier, DIAG_RX_ID, DIAG_TX_ID)
+    stop = threading.Event()
+
+    before = device_counters(diag, args.timeout)
+    if before is None:
+        print("diag service not answering, device counters skipped")
+
+    streams = []
+    if args.isotp_rate > 0:
+        streams.append((Stats("isotp"), run_isotp, (bus, notifier, args, stop)))
+    if args.cmd_rate > 0:
+        streams.append((Stats("cmd"), run_cmd, (bus, notifier, args, stop)))
+    if args.ping_rate > 0:
+        streams.append((Stats("ping"), run_ping, (diag, args, stop)))
+
+    threads = [threading.Thread(target=fn, args=a + (st,), daemon=True) for st, fn, a in streams]
+    start = time.monotonic()
+    for th in threads:
+        th.start()
+    try:
+        for th in threads:
+            th.join()
+    except KeyboardInterrupt:
+        stop.set()
+        for th in threads:
+            th.join()
+    elapsed = time.monotonic() - start
+
+    print("run %.1f s on %s" % (elapsed, args.interface))
+    for st, _, _ in streams:
+        st.report()
+
+    after = device_counters(diag, args.timeout) if before is not None else None
+    if after is not None:
+        delta = {k: after[k] - before[k] for k in before if k != "stmin"}
+        print("device: isotp rx %d msgs (%d B/s), overruns %d, rx errors %d, recoveries %d, "
+              "CAN rx overruns %d, stmin 0x%02X" %
+              (delta["rx_msgs"], delta["rx_bytes"] / elapsed, delta["overruns"], delta["rx_errors"],
+               delta["recoveries"], delta["can_rx_overruns"], after["stmin"]))
+        isotp_stats = next((st for st, fn, _ in streams if fn is run_isotp), None)
+        if isotp_stats is not None:
+            print("device-side isotp drops: %d" % (isotp_stats.sent - delta["rx_msgs"]))
+
+    diag.stop()
+    notifier.stop()
+    bus.shutdown()
+
+
+if __name__ == "__main__":
+    main()
@@ -22,6 +22,9 @@ LOG_MODULE_REGISTER(gopro_buttons, CONFIG_BUTTONS_LOG_LVL);
 #include <zephyr/logging/log.h>
 #include <zephyr/zbus/zbus.h>
 #include "gopro_client.h"
+#ifdef CONFIG_GOPRO_LATENCY_TRACE
+#include "gopro_latency.h"
+#endif
 
 static const struct gpio_dt_spec button_rec = GPIO_DT_SPEC_GET_OR(SW0_NODE, gpios,{0});
 static struct gpio_callback button_cb_data;
@@ -38,24 +41,31 @@ static const struct gopro_cmd_t gopro_stop_rec_msg = {
         .data = {0x03,0x01,0x01,0x00}
 };
 
-extern struct gopro_state_t gopro_state;
-
 ZBUS_CHAN_DECLARE(gopro_cmd_chan);
 
 
 void button_pressed(const struct device *dev, struct gpio_callback *cb, uint32_t pins){
 	int err;
 	// static uint8_t cmd_index = 0;
-	struct gopro_cmd_t *p_gopro_cmd;
-
-	LOG_INF("Button pressed at %" PRIu32 " pins: %d", k_cycle_get_32(),pins);
+	struct gopro_cmd_t gopro_cmd;
+	struct gopro_cmd_t *p_gopro_cmd = &gopro_cmd;
 
-	if(gopro_state.record == 1){
-		p_gopro_cmd = (struct gopro_cmd_t *)&gopro_stop_rec_msg;
+	if(gopro_client_recording()){
+		gopro_cmd = gopro_stop_rec_msg;
 	}else{
-		p_gopro_cmd = (struct gopro_cmd_t *)&gopro_start_rec_msg;
+		gopro_cmd = gopro_start_rec_msg;
 	}
 
+	#ifdef CONFIG_GOPRO_GROUP_SHUTTER
+	gopro_cmd.cam = GOPRO_CAM_ALL;
+	#endif
+
+	#ifdef CONFIG_GOPRO_LATENCY_TRACE
+	gopro_latency_stamp(&gopro_cmd);
+	#endif
+
+	LOG_INF("Button pressed at %" PRIu32 " pins: %d", k_cycle_get_32(),pins);
+
 	LOG_HEXDUMP_DBG(p_gopro_cmd,sizeof(struct gopro_cmd_t),"Button cmd:");
 
 	err = zbus_chan_pub(&gopro_cmd_chan, p_gopro_cmd, K_NO_WAIT);
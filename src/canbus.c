@@ -14,6 +14,17 @@
 
 #include <gopro_client.h>
 #include <canbus_isotp.h>
+#include <canbus_dfu.h>
+#include <canbus_diag.h>
+#ifdef CONFIG_GOPRO_TIME_SYNC
+#include <gopro_time.h>
+#endif
+#ifdef CONFIG_GOPRO_LATENCY_TRACE
+#include <gopro_latency.h>
+#endif
+#ifdef CONFIG_GOPRO_SCAN_POLICY
+#include <gopro_scan_policy.h>
+#endif
 
 //#define CAN_MCP_NODE	DT_ALIAS(cannode)
 
@@ -30,7 +41,7 @@ static void can_tx_subscriber_task(void *ptr1, void *ptr2, void *ptr3);
 static void can_data_subscriber_task(void *ptr1, void *ptr2, void *ptr3);
 static void can_tx_work_handler(struct k_work *work);
 
-extern struct gopro_state_t gopro_state;
+extern struct gopro_state_t gopro_state[CONFIG_GOPRO_CAM_MAX];
 
 K_SEM_DEFINE(can_tx_sem, 0, 1);
 
@@ -142,9 +153,18 @@ static void rx_callback_function(const struct device *dev, struct can_frame *fra
 {
     int err;
 	struct gopro_cmd_t gopro_cmd;    
+	uint8_t offset = 0;
 
 	memset(&gopro_cmd,0,sizeof(struct gopro_cmd_t));
 
+	#ifdef CONFIG_GOPRO_LATENCY_TRACE
+	gopro_latency_stamp(&gopro_cmd);
+	#endif
+
+	#ifdef CONFIG_GOPRO_SCAN_POLICY
+	gopro_scan_policy_can_rx();
+	#endif
+
 	switch (frame->id)
 	{
 	case GPCAN_INPUT_CMD_ID: //GoPro cmd
@@ -167,6 +187,27 @@ static void rx_callback_function(const struct device *dev, struct can_frame *fra
 		gopro_cmd.cmd_type = 0xFF;
 		break;
 
+	case GPCAN_INPUT_CAM_ID: //Команда для камеры по индексу
+		if(frame->dlc < 2){
+			return;
+		}
+		gopro_cmd.cam = frame->data[0] >> 4;
+		gopro_cmd.cmd_type = frame->data[0] & 0x0F;
+		if(gopro_cmd.cam == 0x0F){
+			gopro_cmd.cam = GOPRO_CAM_ALL;
+		}
+		if(gopro_cmd.cmd_type == 0x0F){
+			gopro_cmd.cmd_type = 0xFF;
+		}
+		offset = 1;
+		break;
+
+#ifdef CONFIG_GOPRO_TIME_SYNC
+	case GPCAN_INPUT_TIME_ID: //Время от мастера
+		gopro_time_master_set(frame->data, frame->dlc);
+		return;
+#endif
+
 	default:
 		return;
 		break;
@@ -174,10 +215,10 @@ static void rx_callback_function(const struct device *dev, struct can_frame *fra
 
 	if((frame->dlc > 0) && (frame->dlc <= GOPRO_CMD_DATA_LEN)){
 
-		gopro_cmd.len = frame->dlc;
+		gopro_cmd.len = frame->dlc - offset;
 		
-		for(uint32_t i=0; i<frame->dlc; i++){
-			gopro_cmd.data[i] = frame->data[i];
+		for(uint32_t i=0; i<gopro_cmd.len; i++){
+			gopro_cmd.data[i] = frame->data[i + offset];
 		}
 
 		err = zbus_chan_pub(&gopro_cmd_chan, &gopro_cmd, K_NO_WAIT);
@@ -279,6 +320,14 @@ int canbus_init(void){
 	CAN_TX_TIMER_START;
 	
 	canbus_isotp_init(can_dev);
+
+	#ifdef CONFIG_CAN_DFU
+	canbus_dfu_init(can_dev);
+	#endif
+
+	#ifdef CONFIG_CAN_DIAG
+	canbus_diag_init(can_dev);
+	#endif
 	
 	LOG_INF("CAN BUS init done at %d kb/s",CONFIG_CANBUS_BD);
     return 0;
@@ -342,21 +391,25 @@ static void can_tx_subscriber_task(void *ptr1, void *ptr2, void *ptr3){
 	}
 };
 
+BUILD_ASSERT(GPCAN_HEART_BEAT_ID + CONFIG_GOPRO_CAM_MAX <= GPCAN_REPLY_MSG_ERR_ID, "Heartbeat ID overlaps error reply");
+
 static void can_tx_work_handler(struct k_work *work){
 	struct can_frame tx_frame;
 
-	memset(&tx_frame,0,sizeof(struct can_frame));
+	for(uint32_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		memset(&tx_frame,0,sizeof(struct can_frame));
 
-	tx_frame.id = GPCAN_HEART_BEAT_ID;
-	tx_frame.dlc = 4;
-	tx_frame.flags = 0;
+		tx_frame.id = GPCAN_HEART_BEAT_ID + cam;
+		tx_frame.dlc = 4;
+		tx_frame.flags = 0;
 
-	tx_frame.data[0] = gopro_state.state;
-	tx_frame.data[1] = gopro_state.record; 
-	tx_frame.data[2] = gopro_state.battery;
-	tx_frame.data[3] = gopro_state.video_count; 
+		tx_frame.data[0] = gopro_state[cam].state;
+		tx_frame.data[1] = gopro_state[cam].record; 
+		tx_frame.data[2] = gopro_state[cam].battery;
+		tx_frame.data[3] = gopro_state[cam].video_count; 
 
-	zbus_chan_pub(&can_tx_chan, &tx_frame, K_NO_WAIT);
+		zbus_chan_pub(&can_tx_chan, &tx_frame, K_NO_WAIT);
+	}
 }
 
 static void can_tx_timer_handler(struct k_timer *dummy){
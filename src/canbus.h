@@ -1,7 +1,7 @@
 #ifndef GOPRO_CANBUS_H
 #define GOPRO_CANBUS_H
 
-#define GPCAN_HEART_BEAT_ID         0x734
+#define GPCAN_HEART_BEAT_ID         0x734      //+ индекс камеры, до 0x73F
 
 #define GPCAN_INPUT_CMD_ID          0x772
 #define GPCAN_REPLY_MSG_CMD_ID      0x773
@@ -17,6 +17,11 @@
 
 #define GPCAN_INPUT_CONTROL_ID      0x77A
 
+#define GPCAN_INPUT_TIME_ID         0x77C
+
+//data[0]: камера << 4 | канал (0-3 ручки, 0xF - control), далее данные. Камера 0xF - все
+#define GPCAN_INPUT_CAM_ID          0x77E
+
 #define GPCAN_REPLY_MSG_ERR_ID      0x740
 
 #define GPCAN_ENABLE_FILTER  
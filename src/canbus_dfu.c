@@ -0,0 +1,507 @@
+#include "canbus_dfu.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/dfu/flash_img.h>
+#include <zephyr/dfu/mcuboot.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/reboot.h>
+
+LOG_MODULE_REGISTER(canbus_dfu, CONFIG_CAN_LOG_LVL);
+
+#define DFU_SLOT_ID			FIXED_PARTITION_ID(slot1_partition)
+#define DFU_MSG_MAX			(CONFIG_CAN_DFU_BLOCK_SIZE + DFU_DATA_HDR_LEN)
+#define DFU_REBIND_DELAY_MS	10
+
+struct dfu_block_t{
+	uint8_t  data[DFU_MSG_MAX];
+	uint32_t len;
+};
+
+static void dfu_rx_thread(void *arg1, void *arg2, void *arg3);
+static void dfu_wr_thread(void *arg1, void *arg2, void *arg3);
+
+K_THREAD_STACK_DEFINE(dfu_rx_thread_stack, DFU_RX_THREAD_STACK_SIZE);
+K_THREAD_STACK_DEFINE(dfu_wr_thread_stack, DFU_WR_THREAD_STACK_SIZE);
+
+static struct k_thread dfu_rx_thread_data;
+static struct k_thread dfu_wr_thread_data;
+
+//Блоки принимаются по очереди: пока один пишется во flash, в другой идет прием
+K_MSGQ_DEFINE(dfu_write_q, sizeof(uint8_t), DFU_BLOCK_COUNT, 1);
+K_SEM_DEFINE(dfu_free_sem, DFU_BLOCK_COUNT, DFU_BLOCK_COUNT);
+K_MUTEX_DEFINE(dfu_mutex);
+
+static const struct isotp_msg_id dfu_rx_addr = {.std_id = ISOTP_DFU_RX_ID};
+static const struct isotp_msg_id dfu_tx_addr = {.std_id = ISOTP_DFU_TX_ID};
+
+static const struct isotp_fc_opts dfu_fc_opts = {
+	.bs = CONFIG_CAN_DFU_FC_BS,
+	.stmin = CONFIG_CAN_DFU_FC_STMIN,
+};
+
+static const struct device *dfu_can_dev;
+static struct isotp_recv_ctx dfu_recv_ctx;
+static struct isotp_send_ctx dfu_send_ctx;
+
+static struct dfu_block_t dfu_blocks[DFU_BLOCK_COUNT];
+static uint8_t dfu_block_idx;
+
+static struct flash_img_context dfu_img;
+static const struct flash_area *dfu_fa;
+
+static struct dfu_status_t dfu;
+static uint32_t dfu_image_crc;
+static uint32_t dfu_flash_crc;		//CRC прочитанного обратно из flash
+static uint32_t dfu_next_offset;
+static int64_t dfu_start_time;
+static uint8_t dfu_progress_step;
+
+void canbus_dfu_status(struct dfu_status_t *status){
+
+	k_mutex_lock(&dfu_mutex, K_FOREVER);
+	*status = dfu;
+	if(dfu.state == DFU_STATE_RECEIVING){
+		status->elapsed_ms = (uint32_t)(k_uptime_get() - dfu_start_time);
+	}
+	k_mutex_unlock(&dfu_mutex);
+}
+
+//state и err меняет и поток записи: читать только под мьютексом
+static int dfu_state_get(uint8_t *state){
+	int err;
+
+	k_mutex_lock(&dfu_mutex, K_FOREVER);
+	err = dfu.err;
+	if(state != NULL){
+		*state = dfu.state;
+	}
+	k_mutex_unlock(&dfu_mutex);
+
+	return err;
+}
+
+static void dfu_set_error(int err){
+
+	k_mutex_lock(&dfu_mutex, K_FOREVER);
+	if(dfu.err == 0){
+		dfu.err = err;
+		dfu.state = DFU_STATE_ERROR;
+	}
+	k_mutex_unlock(&dfu_mutex);
+}
+
+static uint8_t dfu_percent(void){
+
+	if(dfu.image_size == 0){
+		return 0;
+	}
+
+	return (uint8_t)(((uint64_t)dfu.verified * 100) / dfu.image_size);
+}
+
+//Чтение обратно всего, что stream_flash уже записал
+static int dfu_verify_written(void){
+	uint8_t tmp[64];
+	size_t written = flash_img_bytes_written(&dfu_img);
+	uint32_t verified = dfu.verified;
+	uint8_t percent;
+	int err;
+
+	while(verified < written){
+		size_t len = MIN(sizeof(tmp), written - verified);
+
+		err = flash_area_read(dfu_fa, verified, tmp, len);
+		if(err){
+			LOG_ERR("Flash read at 0x%X failed: %d",verified,err);
+			return err;
+		}
+
+		dfu_flash_crc = crc32_ieee_update(dfu_flash_crc, tmp, len);
+		verified += len;
+	}
+
+	k_mutex_lock(&dfu_mutex, K_FOREVER);
+	dfu.written = written;
+	dfu.verified = verified;
+	percent = dfu_percent();
+	k_mutex_unlock(&dfu_mutex);
+
+	if((percent / 10) != dfu_progress_step){
+		dfu_progress_step = percent / 10;
+		LOG_INF("DFU %d%%, %d of %d bytes",percent,verified,dfu.image_size);
+	}
+
+	return 0;
+}
+
+//Ожидание записи всех блоков, кроме того, что занят приемом
+static void dfu_wait_idle(void){
+
+	for(uint32_t i=0; i<(DFU_BLOCK_COUNT - 1); i++){
+		k_sem_take(&dfu_free_sem, K_FOREVER);
+	}
+
+	for(uint32_t i=0; i<(DFU_BLOCK_COUNT - 1); i++){
+		k_sem_give(&dfu_free_sem);
+	}
+}
+
+static void dfu_reply(uint8_t cmd, int status){
+	uint8_t reply[DFU_REPLY_LEN];
+	int ret;
+
+	reply[0] = cmd | DFU_CMD_REPLY;
+	reply[1] = (uint8_t)(int8_t)CLAMP(status, INT8_MIN, 0);
+	k_mutex_lock(&dfu_mutex, K_FOREVER);
+	reply[2] = dfu_percent();
+	k_mutex_unlock(&dfu_mutex);
+	sys_put_le32(dfu_next_offset, &reply[3]);
+
+	ret = isotp_send(&dfu_send_ctx, dfu_can_dev, reply, sizeof(reply), &dfu_tx_addr, &dfu_rx_addr, NULL, NULL);
+	if(ret != ISOTP_N_OK){
+		LOG_ERR("DFU reply failed [%d]",ret);
+	}
+}
+
+static int dfu_start(const uint8_t *data, uint32_t len){
+	uint32_t size;
+	int err;
+
+	if(len < 9){
+		return -EINVAL;
+	}
+
+	size = sys_get_le32(&data[1]);
+	if((size == 0) || (size > dfu_fa->fa_size)){
+		LOG_ERR("Image size %d, slot %d",size,dfu_fa->fa_size);
+		return -EFBIG;
+	}
+
+	dfu_wait_idle();
+
+	err = flash_img_init_id(&dfu_img, DFU_SLOT_ID);
+	if(err){
+		LOG_ERR("Flash img init failed: %d",err);
+		return err;
+	}
+
+	k_mutex_lock(&dfu_mutex, K_FOREVER);
+	memset(&dfu,0,sizeof(dfu));
+	dfu.state = DFU_STATE_RECEIVING;
+	dfu.image_size = size;
+	k_mutex_unlock(&dfu_mutex);
+
+	dfu_image_crc = sys_get_le32(&data[5]);
+	dfu_flash_crc = 0;
+	dfu_next_offset = 0;
+	dfu_progress_step = 0;
+	dfu_start_time = k_uptime_get();
+
+	LOG_INF("DFU start, %d bytes, crc 0x%08X",size,dfu_image_crc);
+	return 0;
+}
+
+//Возвращает 1, если блок передан на запись
+static int dfu_data(uint8_t idx){
+	struct dfu_block_t *block = &dfu_blocks[idx];
+	const uint8_t *payload = &block->data[DFU_DATA_HDR_LEN];
+	uint32_t offset, crc, len;
+	uint8_t state;
+	int err;
+
+	err = dfu_state_get(&state);
+	if(state != DFU_STATE_RECEIVING){
+		return (err != 0) ? err : -EPERM;
+	}
+
+	if(block->len <= DFU_DATA_HDR_LEN){
+		return -EINVAL;
+	}
+
+	offset = sys_get_le32(&block->data[1]);
+	crc = sys_get_le32(&block->data[5]);
+	len = block->len - DFU_DATA_HDR_LEN;
+
+	if(offset < dfu_next_offset){
+		LOG_DBG("Duplicate chunk at 0x%X",offset);
+		return 0;
+	}
+
+	if(offset > dfu_next_offset){
+		LOG_WRN("Chunk at 0x%X, expected 0x%X",offset,dfu_next_offset);
+		return -ERANGE;
+	}
+
+	if(offset + len > dfu.image_size){
+		return -EFBIG;
+	}
+
+	if(crc32_ieee(payload, len) != crc){
+		LOG_WRN("Chunk at 0x%X CRC mismatch",offset);
+		k_mutex_lock(&dfu_mutex, K_FOREVER);
+		dfu.crc_errors++;
+		k_mutex_unlock(&dfu_mutex);
+		return -EBADMSG;
+	}
+
+	if((offset == 0) && ((len < 4) || (sys_get_le32(payload) != DFU_IMAGE_MAGIC))){
+		LOG_ERR("Not an MCUboot image");
+		return -ENOEXEC;
+	}
+
+	dfu_next_offset += len;
+
+	k_mutex_lock(&dfu_mutex, K_FOREVER);
+	dfu.received = dfu_next_offset;
+	dfu.chunks++;
+	k_mutex_unlock(&dfu_mutex);
+
+	k_msgq_put(&dfu_write_q, &idx, K_FOREVER);
+	return 1;
+}
+
+static int dfu_finish(void){
+	uint32_t elapsed;
+	uint8_t state;
+	int err;
+
+	err = dfu_state_get(&state);
+	if(state != DFU_STATE_RECEIVING){
+		return (err != 0) ? err : -EPERM;
+	}
+
+	if(dfu_next_offset != dfu.image_size){
+		return -EINVAL;
+	}
+
+	dfu_wait_idle();
+
+	err = dfu_state_get(NULL);
+	if(err != 0){
+		return err;
+	}
+
+	err = flash_img_buffered_write(&dfu_img, NULL, 0, true);
+	if(err == 0){
+		err = dfu_verify_written();
+	}
+
+	if(err == 0 && dfu_flash_crc != dfu_image_crc){
+		LOG_ERR("Image CRC 0x%08X, expected 0x%08X",dfu_flash_crc,dfu_image_crc);
+		err = -EBADMSG;
+	}
+
+	if(err == 0){
+		err = boot_request_upgrade(BOOT_UPGRADE_TEST);
+	}
+
+	if(err != 0){
+		dfu_set_error(err);
+		return err;
+	}
+
+	elapsed = (uint32_t)(k_uptime_get() - dfu_start_time);
+
+	k_mutex_lock(&dfu_mutex, K_FOREVER);
+	dfu.state = DFU_STATE_DONE;
+	dfu.elapsed_ms = elapsed;
+	k_mutex_unlock(&dfu_mutex);
+
+	LOG_INF("DFU done: %d bytes in %d ms, %d B/s",dfu.image_size,elapsed,(uint32_t)(((uint64_t)dfu.image_size * 1000) / MAX(elapsed, 1)));
+	return 0;
+}
+
+static void dfu_abort(void){
+
+	dfu_wait_idle();
+
+	k_mutex_lock(&dfu_mutex, K_FOREVER);
+	dfu.state = DFU_STATE_IDLE;
+	dfu.err = 0;
+	k_mutex_unlock(&dfu_mutex);
+
+	dfu_next_offset = 0;
+	LOG_INF("DFU aborted");
+}
+
+static int dfu_recv(struct dfu_block_t *block){
+	struct net_buf *buf;
+	int rem_len;
+
+	block->len = 0;
+
+	do {
+		rem_len = isotp_recv_net(&dfu_recv_ctx, &buf, K_FOREVER);
+		if(rem_len < 0){
+			return rem_len;
+		}
+
+		while (buf != NULL) {
+			if(block->len + buf->len <= DFU_MSG_MAX){
+				memcpy(&block->data[block->len], buf->data, buf->len);
+			}
+			block->len += buf->len;
+			buf = net_buf_frag_del(NULL, buf);
+		}
+	} while (rem_len > 0);
+
+	if(block->len > DFU_MSG_MAX){
+		LOG_ERR("DFU message %d bytes, max %d",block->len,DFU_MSG_MAX);
+		return -EMSGSIZE;
+	}
+
+	return 0;
+}
+
+static void dfu_bind(void){
+	int ret;
+
+	while((ret = isotp_bind(&dfu_recv_ctx, dfu_can_dev, &dfu_rx_addr, &dfu_tx_addr, &dfu_fc_opts, K_FOREVER)) != ISOTP_N_OK){
+		LOG_ERR("DFU bind failed [%d]",ret);
+		k_msleep(DFU_REBIND_DELAY_MS);
+	}
+
+	LOG_INF("DFU bound to 0x%0X",ISOTP_DFU_RX_ID);
+}
+
+static void dfu_rx_thread(void *arg1, void *arg2, void *arg3){
+	struct dfu_block_t *block;
+	uint8_t state;
+	uint8_t cmd;
+	int ret;
+
+	dfu_bind();
+
+	while (1) {
+		k_sem_take(&dfu_free_sem, K_FOREVER);
+		block = &dfu_blocks[dfu_block_idx];
+
+		ret = dfu_recv(block);
+		if(ret != 0){
+			k_sem_give(&dfu_free_sem);
+
+			if(ret != -EMSGSIZE){
+				LOG_ERR("DFU receive error [%d], rebind",ret);
+				isotp_unbind(&dfu_recv_ctx);
+				dfu_bind();
+				continue;
+			}
+
+			dfu_reply(block->data[0], ret);
+			continue;
+		}
+
+		cmd = block->data[0];
+
+		switch (cmd)
+		{
+		case DFU_CMD_DATA:
+			ret = dfu_data(dfu_block_idx);
+			if(ret == 1){
+				dfu_block_idx = (dfu_block_idx + 1) % DFU_BLOCK_COUNT;
+				ret = 0;
+			}else{
+				k_sem_give(&dfu_free_sem);
+			}
+			//Подтверждение до записи во flash, хост сразу шлет следующий блок
+			dfu_reply(cmd, ret);
+			continue;
+
+		case DFU_CMD_START:
+			ret = dfu_start(block->data, block->len);
+			break;
+
+		case DFU_CMD_FINISH:
+			ret = dfu_finish();
+			break;
+
+		case DFU_CMD_ABORT:
+			dfu_abort();
+			ret = 0;
+			break;
+
+		case DFU_CMD_STATUS:
+			ret = dfu_state_get(NULL);
+			break;
+
+		case DFU_CMD_REBOOT:
+			dfu_state_get(&state);
+			ret = (state == DFU_STATE_DONE) ? 0 : -EPERM;
+			break;
+
+		default:
+			LOG_WRN("Unknown DFU cmd 0x%02X",cmd);
+			ret = -ENOTSUP;
+			break;
+		}
+
+		k_sem_give(&dfu_free_sem);
+		dfu_reply(cmd, ret);
+
+		if((cmd == DFU_CMD_REBOOT) && (ret == 0)){
+			LOG_INF("Reboot to new image");
+			LOG_PANIC();
+			sys_reboot(SYS_REBOOT_COLD);
+		}
+	}
+}
+
+static void dfu_wr_thread(void *arg1, void *arg2, void *arg3){
+	struct dfu_block_t *block;
+	uint8_t idx;
+	int err;
+
+	while (1) {
+		k_msgq_get(&dfu_write_q, &idx, K_FOREVER);
+		block = &dfu_blocks[idx];
+
+		if(dfu_state_get(NULL) == 0){
+			err = flash_img_buffered_write(&dfu_img, &block->data[DFU_DATA_HDR_LEN], block->len - DFU_DATA_HDR_LEN, false);
+			if(err == 0){
+				err = dfu_verify_written();
+			}
+
+			if(err != 0){
+				LOG_ERR("DFU flash write failed: %d",err);
+				dfu_set_error(err);
+			}
+		}
+
+		k_sem_give(&dfu_free_sem);
+	}
+}
+
+void canbus_dfu_init(const struct device *can_dev){
+	k_tid_t tid;
+	int err;
+
+	dfu_can_dev = can_dev;
+
+	err = flash_area_open(DFU_SLOT_ID, &dfu_fa);
+	if(err){
+		LOG_ERR("Failed to open DFU slot: %d",err);
+		return;
+	}
+
+	//Запуск после обновления прошел, иначе MCUboot вернет старый образ
+	if(!boot_is_img_confirmed()){
+		err = boot_write_img_confirmed();
+		LOG_INF("Image confirmed: %d",err);
+	}
+
+	tid = k_thread_create(&dfu_wr_thread_data, dfu_wr_thread_stack, K_THREAD_STACK_SIZEOF(dfu_wr_thread_stack), dfu_wr_thread, NULL, NULL, NULL, DFU_WR_THREAD_PRIORITY, 0, K_NO_WAIT);
+	if (!tid) {
+		LOG_ERR("ERROR spawning DFU write thread");
+	}else{
+		k_thread_name_set(tid, "dfuwr");
+	}
+
+	tid = k_thread_create(&dfu_rx_thread_data, dfu_rx_thread_stack, K_THREAD_STACK_SIZEOF(dfu_rx_thread_stack), dfu_rx_thread, NULL, NULL, NULL, DFU_RX_THREAD_PRIORITY, 0, K_NO_WAIT);
+	if (!tid) {
+		LOG_ERR("ERROR spawning DFU rx thread");
+	}else{
+		k_thread_name_set(tid, "dfurx");
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef CAN_DFU_H
+#define CAN_DFU_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/can.h>
+#include <zephyr/canbus/isotp.h>
+
+#define DFU_RX_THREAD_PRIORITY 		8
+#define DFU_RX_THREAD_STACK_SIZE	2048
+#define DFU_WR_THREAD_PRIORITY 		10
+#define DFU_WR_THREAD_STACK_SIZE	1536
+
+/* Отдельная пара адресов: запросы и FC хоста на RX_ID, ответы и FC устройства на TX_ID */
+#define ISOTP_DFU_RX_ID				0x758
+#define ISOTP_DFU_TX_ID				0x768
+
+#define DFU_BLOCK_COUNT				2
+#define DFU_DATA_HDR_LEN			9		//cmd, offset, crc32
+#define DFU_REPLY_LEN				7		//Влезает в один кадр CAN
+
+#define DFU_IMAGE_MAGIC				0x96f3b83d
+
+/*
+Запрос:
+START  [0x01][size u32][crc32 u32]
+DATA   [0x02][offset u32][crc32 u32][data...]
+FINISH [0x03]
+ABORT  [0x04]
+STATUS [0x05]
+REBOOT [0x06]
+Ответ:
+[cmd|0x80][status i8][percent u8][next offset u32]
+Все числа little-endian, crc32 - IEEE.
+*/
+enum dfu_cmd_t{
+	DFU_CMD_START = 0x01,
+	DFU_CMD_DATA = 0x02,
+	DFU_CMD_FINISH = 0x03,
+	DFU_CMD_ABORT = 0x04,
+	DFU_CMD_STATUS = 0x05,
+	DFU_CMD_REBOOT = 0x06,
+	DFU_CMD_REPLY = 0x80
+};
+
+enum dfu_state_t{
+	DFU_STATE_IDLE,
+	DFU_STATE_RECEIVING,
+	DFU_STATE_DONE,
+	DFU_STATE_ERROR
+};
+
+struct dfu_status_t{
+	uint8_t  state;
+	int 	 err;
+	uint32_t image_size;
+	uint32_t received;
+	uint32_t written;
+	uint32_t verified;
+	uint32_t chunks;
+	uint32_t crc_errors;
+	uint32_t elapsed_ms;
+};
+
+void canbus_dfu_init(const struct device *can_dev);
+void canbus_dfu_status(struct dfu_status_t *status);
+
+#endif
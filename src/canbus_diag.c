@@ -0,0 +1,537 @@
+#include "canbus_diag.h"
+#include "canbus_isotp.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/sys_heap.h>
+#include <zephyr/version.h>
+
+#include <gopro_client.h>
+#ifdef CONFIG_GOPRO_TIME_SYNC
+#include <gopro_time.h>
+#endif
+#ifdef CONFIG_GOPRO_LATENCY_TRACE
+#include <gopro_latency.h>
+#endif
+#ifdef CONFIG_GOPRO_GROUP_SHUTTER
+#include <gopro_group.h>
+#endif
+#ifdef CONFIG_GOPRO_READY_TRACE
+#include <gopro_ready.h>
+#endif
+
+LOG_MODULE_REGISTER(canbus_diag, CONFIG_CAN_LOG_LVL);
+
+#define DIAG_REBIND_DELAY_MS	10
+#define DIAG_THREAD_NAME_LEN	8
+
+struct diag_buf_t{
+	uint8_t  *data;
+	uint32_t len;
+	uint32_t size;
+	bool 	 overflow;
+};
+
+static void diag_thread(void *arg1, void *arg2, void *arg3);
+
+K_THREAD_STACK_DEFINE(diag_thread_stack, DIAG_THREAD_STACK_SIZE);
+static struct k_thread diag_thread_data;
+
+extern struct gopro_state_t gopro_state[CONFIG_GOPRO_CAM_MAX];
+extern struct bt_gopro_client gopro_client[CONFIG_GOPRO_CAM_MAX];
+extern struct gopro_client_stat_t gopro_client_stat;
+
+#ifdef CONFIG_SYS_HEAP_RUNTIME_STATS
+extern struct sys_heap _system_heap;
+#endif
+
+static const struct isotp_msg_id diag_rx_addr = {.std_id = ISOTP_DIAG_RX_ID};
+static const struct isotp_msg_id diag_tx_addr = {.std_id = ISOTP_DIAG_TX_ID};
+static const struct isotp_fc_opts diag_fc_opts = {.bs = 0, .stmin = 0};
+
+static const struct device *diag_can_dev;
+static struct isotp_recv_ctx diag_recv_ctx;
+static struct isotp_send_ctx diag_send_ctx;
+
+static uint8_t diag_req[DIAG_REQ_MAX];
+static uint8_t diag_resp[DIAG_RESP_MAX];
+
+static void diag_put(struct diag_buf_t *buf, const void *data, uint32_t len){
+
+	if(buf->len + len > buf->size){
+		buf->overflow = true;
+		return;
+	}
+
+	memcpy(&buf->data[buf->len], data, len);
+	buf->len += len;
+}
+
+static void diag_put_u8(struct diag_buf_t *buf, uint8_t val){
+	diag_put(buf, &val, 1);
+}
+
+static void diag_put_u16(struct diag_buf_t *buf, uint16_t val){
+	uint8_t tmp[2];
+
+	sys_put_le16(val, tmp);
+	diag_put(buf, tmp, sizeof(tmp));
+}
+
+static void diag_put_u32(struct diag_buf_t *buf, uint32_t val){
+	uint8_t tmp[4];
+
+	sys_put_le32(val, tmp);
+	diag_put(buf, tmp, sizeof(tmp));
+}
+
+static void diag_put_str(struct diag_buf_t *buf, const char *str, uint32_t max_len){
+	uint8_t len = (uint8_t)MIN(strnlen(str, max_len), UINT8_MAX);
+
+	diag_put_u8(buf, len);
+	diag_put(buf, str, len);
+}
+
+static int diag_did_build(struct diag_buf_t *buf){
+	static const char build_date[] = __DATE__ " " __TIME__;
+
+	diag_put_u32(buf, sys_kernel_version_get());
+	diag_put_u32(buf, k_uptime_get_32());
+	diag_put_str(buf, build_date, sizeof(build_date));
+	diag_put_str(buf, CONFIG_BOARD, sizeof(CONFIG_BOARD));
+
+	return 0;
+}
+
+static int diag_did_heap(struct diag_buf_t *buf){
+#ifdef CONFIG_SYS_HEAP_RUNTIME_STATS
+	struct sys_memory_stats heap_stats;
+	int ret;
+
+	ret = sys_heap_runtime_stats_get(&_system_heap, &heap_stats);
+	if(ret < 0){
+		return ret;
+	}
+
+	diag_put_u32(buf, heap_stats.free_bytes);
+	diag_put_u32(buf, heap_stats.allocated_bytes);
+	diag_put_u32(buf, heap_stats.max_allocated_bytes);
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static void diag_thread_cb(const struct k_thread *thread, void *user_data){
+	struct diag_buf_t *buf = user_data;
+	const char *name = k_thread_name_get((k_tid_t)thread);
+	size_t unused = 0;
+
+#if defined(CONFIG_INIT_STACKS) && defined(CONFIG_THREAD_STACK_INFO)
+	k_thread_stack_space_get(thread, &unused);
+#endif
+
+	diag_put_str(buf, (name != NULL) ? name : "?", DIAG_THREAD_NAME_LEN);
+	diag_put_u8(buf, (uint8_t)(int8_t)k_thread_priority_get((k_tid_t)thread));
+#ifdef CONFIG_THREAD_STACK_INFO
+	diag_put_u16(buf, (uint16_t)thread->stack_info.size);
+	diag_put_u16(buf, (uint16_t)(thread->stack_info.size - unused));
+#else
+	diag_put_u16(buf, 0);
+	diag_put_u16(buf, 0);
+#endif
+
+	if(!buf->overflow){
+		buf->data[0]++;
+	}
+}
+
+static int diag_did_threads(struct diag_buf_t *buf){
+	struct diag_buf_t list;
+
+	if(buf->len >= buf->size){
+		buf->overflow = true;
+		return 0;
+	}
+
+	//Первый байт - число потоков, считается в callback
+	list.data = &buf->data[buf->len];
+	list.data[0] = 0;
+	list.len = 1;
+	list.size = buf->size - buf->len;
+	list.overflow = false;
+
+	k_thread_foreach_unlocked(diag_thread_cb, &list);
+
+	buf->len += list.len;
+	buf->overflow |= list.overflow;
+
+	return 0;
+}
+
+static int diag_did_can(struct diag_buf_t *buf){
+	struct can_bus_err_cnt err_cnt = {0};
+	enum can_state state = CAN_STATE_STOPPED;
+	struct isotp_fc_stat_t fc_stat[ISOTP_SESSION_END];
+	struct isotp_fc_stat_t fc_sum = {0};
+	struct isotp_health_t health;
+
+	can_get_state(diag_can_dev, &state, &err_cnt);
+	canbus_isotp_fc_get(NULL, fc_stat);
+	canbus_isotp_health_get(&health);
+
+	//Формат DID прежний: сумма по сессиям, STmin самой медленной
+	for(uint32_t i=0; i<ISOTP_SESSION_END; i++){
+		if(canbus_isotp_stmin_us(fc_stat[i].stmin) > canbus_isotp_stmin_us(fc_sum.stmin)){
+			fc_sum.stmin = fc_stat[i].stmin;
+		}
+		fc_sum.rx_msgs += fc_stat[i].rx_msgs;
+		fc_sum.rx_bytes += fc_stat[i].rx_bytes;
+		fc_sum.overruns += fc_stat[i].overruns;
+	}
+
+	diag_put_u8(buf, state);
+	diag_put_u8(buf, err_cnt.tx_err_cnt);
+	diag_put_u8(buf, err_cnt.rx_err_cnt);
+
+#ifdef CONFIG_CAN_STATS
+	diag_put_u32(buf, can_stats_get_bit_errors(diag_can_dev));
+	diag_put_u32(buf, can_stats_get_stuff_errors(diag_can_dev));
+	diag_put_u32(buf, can_stats_get_crc_errors(diag_can_dev));
+	diag_put_u32(buf, can_stats_get_form_errors(diag_can_dev));
+	diag_put_u32(buf, can_stats_get_ack_errors(diag_can_dev));
+	diag_put_u32(buf, can_stats_get_rx_overruns(diag_can_dev));
+#else
+	for(uint32_t i=0; i<6; i++){
+		diag_put_u32(buf, 0);
+	}
+#endif
+
+	diag_put_u8(buf, fc_sum.stmin);
+	diag_put_u32(buf, fc_sum.rx_msgs);
+	diag_put_u32(buf, fc_sum.rx_bytes);
+	diag_put_u32(buf, fc_sum.overruns);
+	diag_put_u32(buf, health.rx_errors);
+	diag_put_u32(buf, health.rx_recoveries);
+	diag_put_u32(buf, health.rx_unavail_ms);
+	diag_put_u32(buf, health.tx_errors);
+	diag_put_u32(buf, health.tx_recoveries);
+
+	return 0;
+}
+
+static int diag_did_ble(struct diag_buf_t *buf){
+
+	diag_put_u32(buf, (uint32_t)atomic_get(&gopro_client[GOPRO_CAM_MAIN].state));
+	diag_put_u32(buf, gopro_client_stat.writes);
+	diag_put_u32(buf, gopro_client_stat.write_errors);
+	diag_put_u32(buf, gopro_client_stat.notifications);
+	diag_put_u32(buf, gopro_client_stat.reads);
+	diag_put_u32(buf, gopro_client_stat.read_errors);
+
+	return 0;
+}
+
+static int diag_did_gopro(struct diag_buf_t *buf){
+	struct gopro_state_t *state = &gopro_state[GOPRO_CAM_MAIN];
+
+	diag_put_u8(buf, state->state);
+	diag_put_u8(buf, state->record);
+	diag_put_u8(buf, state->battery);
+	diag_put_u32(buf, state->video_count);
+	diag_put_u8(buf, state->addr.type);
+	diag_put(buf, state->addr.a.val, sizeof(state->addr.a.val));
+	diag_put_str(buf, state->name, sizeof(state->name));
+	diag_put_str(buf, state->model_name, sizeof(state->model_name));
+	diag_put_str(buf, state->firmware_version, sizeof(state->firmware_version));
+	diag_put_str(buf, state->serial_number, sizeof(state->serial_number));
+
+	return 0;
+}
+
+static int diag_did_cams(struct diag_buf_t *buf){
+	struct gopro_state_t *state;
+
+	diag_put_u8(buf, CONFIG_GOPRO_CAM_MAX);
+
+	for(uint32_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		state = &gopro_state[cam];
+
+		diag_put_u8(buf, state->state);
+		diag_put_u8(buf, state->record);
+		diag_put_u8(buf, state->battery);
+		diag_put_u32(buf, state->video_count);
+		diag_put_u8(buf, state->addr.type);
+		diag_put(buf, state->addr.a.val, sizeof(state->addr.a.val));
+		diag_put_str(buf, state->name, sizeof(state->name));
+	}
+
+	return 0;
+}
+
+/* shots u32, partial u32, cams u8, issue skew u32, skew u32, min u32, max u32, avg u32, count u32 (мкс) */
+static int diag_did_group(struct diag_buf_t *buf){
+#ifdef CONFIG_GOPRO_GROUP_SHUTTER
+	struct gopro_group_stat_t stat;
+
+	gopro_group_stat_get(&stat);
+
+	diag_put_u32(buf, stat.shots);
+	diag_put_u32(buf, stat.partial);
+	diag_put_u8(buf, stat.cams);
+	diag_put_u32(buf, stat.issue_skew_us);
+	diag_put_u32(buf, stat.skew_us);
+	diag_put_u32(buf, stat.skew_min_us);
+	diag_put_u32(buf, stat.skew_max_us);
+	diag_put_u32(buf, stat.skew_count ? (uint32_t)(stat.skew_sum_us / stat.skew_count) : 0);
+	diag_put_u32(buf, stat.skew_count);
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static int diag_did_time(struct diag_buf_t *buf){
+#ifdef CONFIG_GOPRO_TIME_SYNC
+	struct gopro_time_stat_t stat;
+
+	gopro_time_stat_get(&stat);
+
+	diag_put_u8(buf, stat.master_valid);
+	diag_put_u8(buf, stat.offset_valid);
+	diag_put_u16(buf, (uint16_t)stat.tz_min);
+	diag_put_u32(buf, (uint32_t)stat.offset_ms);
+	diag_put_u32(buf, stat.precision_ms);
+	diag_put_u32(buf, stat.rtt_ms);
+	diag_put_u32(buf, stat.master_frames);
+	diag_put_u32(buf, stat.checks);
+	diag_put_u32(buf, stat.syncs);
+	diag_put_u32(buf, stat.failures);
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* stages u8, buckets u8, по этапу: count u32, min u32, max u32, avg u32 (мкс), корзины u16 */
+static int diag_did_latency(struct diag_buf_t *buf){
+#ifdef CONFIG_GOPRO_LATENCY_TRACE
+	struct gopro_lat_hist_t hist;
+
+	diag_put_u8(buf, GP_LAT_STAGE_END);
+	diag_put_u8(buf, GP_LAT_BUCKETS);
+
+	for(uint32_t i=0; i<GP_LAT_STAGE_END; i++){
+		gopro_latency_hist_get(i, &hist);
+
+		diag_put_u32(buf, hist.count);
+		diag_put_u32(buf, hist.min_us);
+		diag_put_u32(buf, hist.max_us);
+		diag_put_u32(buf, hist.count ? (uint32_t)(hist.sum_us / hist.count) : 0);
+
+		for(uint32_t j=0; j<GP_LAT_BUCKETS; j++){
+			diag_put_u16(buf, hist.bucket[j]);
+		}
+	}
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* phases u8, по этапу: count u32, stalls u32, min u32, avg u32, max u32, p95 u32 (мс) */
+static int diag_did_ready(struct diag_buf_t *buf){
+#ifdef CONFIG_GOPRO_READY_TRACE
+	struct gopro_ready_stat_t stat;
+
+	diag_put_u8(buf, GP_READY_PHASE_END);
+
+	for(uint32_t i=0; i<GP_READY_PHASE_END; i++){
+		gopro_ready_stat_get(i, &stat);
+
+		diag_put_u32(buf, stat.count);
+		diag_put_u32(buf, stat.stalls);
+		diag_put_u32(buf, stat.min_ms);
+		diag_put_u32(buf, stat.avg_ms);
+		diag_put_u32(buf, stat.max_ms);
+		diag_put_u32(buf, stat.p95_ms);
+	}
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+static int diag_read_did(uint16_t did, struct diag_buf_t *buf){
+	uint8_t tmp[2];
+
+	//DID как в UDS, старшим байтом вперед
+	sys_put_be16(did, tmp);
+	diag_put(buf, tmp, sizeof(tmp));
+
+	switch (did)
+	{
+	case DIAG_DID_BUILD:
+		return diag_did_build(buf);
+	case DIAG_DID_HEAP:
+		return diag_did_heap(buf);
+	case DIAG_DID_THREADS:
+		return diag_did_threads(buf);
+	case DIAG_DID_CAN:
+		return diag_did_can(buf);
+	case DIAG_DID_BLE:
+		return diag_did_ble(buf);
+	case DIAG_DID_GOPRO:
+		return diag_did_gopro(buf);
+	case DIAG_DID_TIME:
+		return diag_did_time(buf);
+	case DIAG_DID_LATENCY:
+		return diag_did_latency(buf);
+	case DIAG_DID_CAMS:
+		return diag_did_cams(buf);
+	case DIAG_DID_GROUP:
+		return diag_did_group(buf);
+	case DIAG_DID_READY:
+		return diag_did_ready(buf);
+	default:
+		return -ENOENT;
+	}
+}
+
+static uint32_t diag_negative(uint8_t sid, uint8_t nrc){
+
+	diag_resp[0] = DIAG_SID_NEGATIVE;
+	diag_resp[1] = sid;
+	diag_resp[2] = nrc;
+
+	return 3;
+}
+
+static uint32_t diag_process(uint32_t req_len){
+	struct diag_buf_t buf;
+	uint8_t sid = diag_req[0];
+
+	buf.data = diag_resp;
+	buf.len = 0;
+	buf.size = sizeof(diag_resp);
+	buf.overflow = false;
+
+	switch (sid)
+	{
+	case DIAG_SID_READ_DID:
+		if((req_len < 3) || ((req_len - 1) % 2)){
+			return diag_negative(sid, DIAG_NRC_BAD_LENGTH);
+		}
+
+		diag_put_u8(&buf, sid + DIAG_SID_POSITIVE);
+
+		//Несколько DID в одном запросе, записи идут подряд
+		for(uint32_t i=1; i<req_len; i+=2){
+			uint16_t did = sys_get_be16(&diag_req[i]);
+
+			if(diag_read_did(did, &buf) != 0){
+				LOG_WRN("DID 0x%04X not available",did);
+				return diag_negative(sid, DIAG_NRC_OUT_OF_RANGE);
+			}
+		}
+
+		if(buf.overflow){
+			return diag_negative(sid, DIAG_NRC_TOO_LONG);
+		}
+
+		return buf.len;
+
+	case DIAG_SID_TESTER_PRESENT:
+		diag_resp[0] = sid + DIAG_SID_POSITIVE;
+		diag_resp[1] = (req_len > 1) ? diag_req[1] : 0;
+		return 2;
+
+	default:
+		return diag_negative(sid, DIAG_NRC_NOT_SUPPORTED);
+	}
+}
+
+static int diag_recv(uint32_t *len){
+	struct net_buf *buf;
+	int rem_len;
+
+	*len = 0;
+
+	do {
+		rem_len = isotp_recv_net(&diag_recv_ctx, &buf, K_FOREVER);
+		if(rem_len < 0){
+			return rem_len;
+		}
+
+		while (buf != NULL) {
+			if(*len + buf->len <= sizeof(diag_req)){
+				memcpy(&diag_req[*len], buf->data, buf->len);
+			}
+			*len += buf->len;
+			buf = net_buf_frag_del(NULL, buf);
+		}
+	} while (rem_len > 0);
+
+	return 0;
+}
+
+static void diag_bind(void){
+	int ret;
+
+	while((ret = isotp_bind(&diag_recv_ctx, diag_can_dev, &diag_rx_addr, &diag_tx_addr, &diag_fc_opts, K_FOREVER)) != ISOTP_N_OK){
+		LOG_ERR("Diag bind failed [%d]",ret);
+		k_msleep(DIAG_REBIND_DELAY_MS);
+	}
+
+	LOG_INF("Diag bound to 0x%0X",ISOTP_DIAG_RX_ID);
+}
+
+static void diag_thread(void *arg1, void *arg2, void *arg3){
+	uint32_t req_len, resp_len;
+	int ret;
+
+	diag_bind();
+
+	while (1) {
+		ret = diag_recv(&req_len);
+		if(ret != 0){
+			LOG_ERR("Diag receive error [%d], rebind",ret);
+			isotp_unbind(&diag_recv_ctx);
+			diag_bind();
+			continue;
+		}
+
+		if(req_len == 0){
+			continue;
+		}
+
+		if(req_len > sizeof(diag_req)){
+			resp_len = diag_negative(diag_req[0], DIAG_NRC_BAD_LENGTH);
+		}else{
+			resp_len = diag_process(req_len);
+		}
+
+		ret = isotp_send(&diag_send_ctx, diag_can_dev, diag_resp, resp_len, &diag_tx_addr, &diag_rx_addr, NULL, NULL);
+		if(ret != ISOTP_N_OK){
+			LOG_ERR("Diag reply failed [%d]",ret);
+		}
+	}
+}
+
+void canbus_diag_init(const struct device *can_dev){
+	k_tid_t tid;
+
+	diag_can_dev = can_dev;
+
+	tid = k_thread_create(&diag_thread_data, diag_thread_stack, K_THREAD_STACK_SIZEOF(diag_thread_stack), diag_thread, NULL, NULL, NULL, DIAG_THREAD_PRIORITY, 0, K_NO_WAIT);
+	if (!tid) {
+		LOG_ERR("ERROR spawning diag thread");
+	}else{
+		k_thread_name_set(tid, "diag");
+	}
+}
@@ -0,0 +1,49 @@
+#ifndef CAN_DIAG_H
+#define CAN_DIAG_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/drivers/can.h>
+#include <zephyr/canbus/isotp.h>
+
+#define DIAG_THREAD_PRIORITY 		11
+#define DIAG_THREAD_STACK_SIZE		2048
+
+/* Запросы и FC тестера на RX_ID, ответы и FC устройства на TX_ID */
+#define ISOTP_DIAG_RX_ID			0x759
+#define ISOTP_DIAG_TX_ID			0x769
+
+#define DIAG_REQ_MAX				64
+#define DIAG_RESP_MAX				512
+
+/* Сервисы в стиле UDS (ISO 14229) */
+#define DIAG_SID_READ_DID			0x22
+#define DIAG_SID_TESTER_PRESENT		0x3E
+#define DIAG_SID_NEGATIVE			0x7F
+#define DIAG_SID_POSITIVE			0x40	//Прибавляется к SID запроса
+
+#define DIAG_NRC_NOT_SUPPORTED		0x11
+#define DIAG_NRC_BAD_LENGTH			0x13
+#define DIAG_NRC_TOO_LONG			0x14
+#define DIAG_NRC_OUT_OF_RANGE		0x31
+
+/*
+Запрос 0x22 [DID u16]... , ответ 0x62 [DID u16][запись]...
+DID big-endian, числа в записях little-endian, строки: [len u8][символы].
+*/
+enum diag_did_t{
+	DIAG_DID_BUILD = 0xF189,	//версия ядра u32, uptime мс u32, дата сборки, плата
+	DIAG_DID_HEAP = 0xFD01,		//free u32, allocated u32, max allocated u32
+	DIAG_DID_THREADS = 0xFD02,	//count u8, {имя, prio i8, size u16, used u16}
+	DIAG_DID_CAN = 0xFD03,		//состояние контроллера и счетчики ISO-TP
+	DIAG_DID_BLE = 0xFD04,		//счетчики GATT
+	DIAG_DID_GOPRO = 0xFD05,	//gopro_state
+	DIAG_DID_TIME = 0xFD06,		//синхронизация часов камеры
+	DIAG_DID_LATENCY = 0xFD07,	//гистограммы задержки команд CMD по этапам
+	DIAG_DID_CAMS = 0xFD08,		//count u8, {state, rec, battery u8, videos u32, addr, имя} по камерам
+	DIAG_DID_GROUP = 0xFD09,	//разброс старта группового затвора
+	DIAG_DID_READY = 0xFD0A,	//время подъема камеры по этапам подключения
+};
+
+void canbus_diag_init(const struct device *can_dev);
+
+#endif
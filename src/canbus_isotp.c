@@ -1,19 +1,18 @@
 #include "canbus_isotp.h"
 #include <gopro_client.h>
+#include "gopro_protobuf.h"
+#include <zephyr/settings/settings.h>
 
 LOG_MODULE_REGISTER(canbus_isotp, CONFIG_CAN_LOG_LVL);
 
 static void isotp_rx_thread(void *arg1, void *arg2, void *arg3);
 static void isotp_tx_thread(void *arg1, void *arg2, void *arg3);
 
-struct k_sem can_isotp_rx_sem;
 extern struct k_sem can_reply_sem;
 
-K_THREAD_STACK_DEFINE(isotp_rx_thread_stack, ISOTP_RX_THREAD_STACK_SIZE);
+K_THREAD_STACK_ARRAY_DEFINE(isotp_rx_thread_stack, ISOTP_SESSION_END, ISOTP_RX_THREAD_STACK_SIZE);
 K_THREAD_STACK_DEFINE(isotp_tx_thread_stack, ISOTP_TX_THREAD_STACK_SIZE);
 
-ZBUS_CHAN_DECLARE(can_rx_ble_chan);
-
 ZBUS_CHAN_DEFINE(can_tx_ble_chan,                           	/* Name */
          struct mem_pkt_t,                       		      	/* Message type */
          NULL,                                       	/* Validator */
@@ -24,16 +23,73 @@ ZBUS_CHAN_DEFINE(can_tx_ble_chan,                           	/* Name */
 
 ZBUS_MSG_SUBSCRIBER_DEFINE(can_tx_ble_subscriber);
 
-struct k_thread isotp_rx_thread_data;
 struct k_thread isotp_tx_thread_data;
 
-struct isotp_recv_ctx isotp_recv_ctx;
+struct isotp_session_t{
+	const char 				*name;
+	struct isotp_msg_id 	rx_addr;
+	struct isotp_msg_id 	tx_addr;
+	int 					channel;		//Канал GoPro, -1 для общей сессии
+	int 					priority;
+	struct isotp_recv_ctx 	recv_ctx;
+	bool 					bound;
+	struct k_thread 		thread;
+	//Адаптация STmin и статистика у каждой сессии свои, под isotp_fc_mutex
+	uint8_t 				stmin_level;
+	uint32_t 				adapt_clean;
+	uint32_t 				adapt_window;
+	struct isotp_fc_stat_t 	stat;
+};
 
-const struct isotp_msg_id isotp_rx_addr = {
-	.std_id = 0x753,
+//Состояние чтения цепочки net_buf декодером protobuf
+struct isotp_stream_t{
+	struct isotp_session_t 	*session;
+	struct net_buf 			*buf;
+	int 					rem_len;		//Еще не принято из CAN
+	int 					err;
 };
-const struct isotp_msg_id isotp_tx_addr = {
-	.std_id = 0x763,
+
+static struct isotp_session_t isotp_sessions[ISOTP_SESSION_END] = {
+	[ISOTP_SESSION_MAIN] = {
+		.name = "isotprx",
+		.rx_addr = {.std_id = ISOTP_MAIN_RX_ID},
+		.tx_addr = {.std_id = ISOTP_MAIN_FC_ID},
+		.channel = -1,
+		.priority = ISOTP_RX_THREAD_PRIORITY,
+		.adapt_window = CONFIG_ISOTP_FC_ADAPT_WINDOW,
+	},
+	[ISOTP_SESSION_CMD] = {
+		.name = "isotpcmd",
+		.rx_addr = {.std_id = ISOTP_CMD_RX_ID},
+		.tx_addr = {.std_id = ISOTP_CMD_FC_ID},
+		.channel = GP_CNTRL_HANDLE_CMD,
+		.priority = ISOTP_RX_URGENT_PRIORITY,
+		.adapt_window = CONFIG_ISOTP_FC_ADAPT_WINDOW,
+	},
+	[ISOTP_SESSION_SETTINGS] = {
+		.name = "isotpset",
+		.rx_addr = {.std_id = ISOTP_SETTINGS_RX_ID},
+		.tx_addr = {.std_id = ISOTP_SETTINGS_FC_ID},
+		.channel = GP_CNTRL_HANDLE_SETTINGS,
+		.priority = ISOTP_RX_THREAD_PRIORITY,
+		.adapt_window = CONFIG_ISOTP_FC_ADAPT_WINDOW,
+	},
+	[ISOTP_SESSION_QUERY] = {
+		.name = "isotpqry",
+		.rx_addr = {.std_id = ISOTP_QUERY_RX_ID},
+		.tx_addr = {.std_id = ISOTP_QUERY_FC_ID},
+		.channel = GP_CNTRL_HANDLE_QUERY,
+		.priority = ISOTP_RX_THREAD_PRIORITY,
+		.adapt_window = CONFIG_ISOTP_FC_ADAPT_WINDOW,
+	},
+	[ISOTP_SESSION_NET] = {
+		.name = "isotpnet",
+		.rx_addr = {.std_id = ISOTP_NET_RX_ID},
+		.tx_addr = {.std_id = ISOTP_NET_FC_ID},
+		.channel = GP_CNTRL_HANDLE_NET,
+		.priority = ISOTP_RX_BULK_PRIORITY,
+		.adapt_window = CONFIG_ISOTP_FC_ADAPT_WINDOW,
+	},
 };
 
 const struct isotp_msg_id tx_reply = {
@@ -44,22 +100,366 @@ const struct isotp_msg_id rx_reply = {
 	.std_id = 0x784,
 };
 
-const struct isotp_fc_opts isotp_fc_opts = {.bs = 8, .stmin = 10};
+//Значения STmin по возрастанию задержки, шаги адаптивного режима
+static const uint8_t isotp_stmin_levels[] = {0x00, 0xF1, 0xF2, 0xF4, 0xF6, 0xF9, 1, 2, 3, 5, 10, 20, 50, 127};
+
+#define ISOTP_STMIN_LEVEL_MAX		(ARRAY_SIZE(isotp_stmin_levels) - 1)
+#define ISOTP_FC_ADAPT_WINDOW_MAX	(CONFIG_ISOTP_FC_ADAPT_WINDOW * 64)
+
+static struct isotp_fc_cfg_t isotp_fc_cfg = {
+	.bs = CONFIG_ISOTP_FC_BS,
+	.stmin = CONFIG_ISOTP_FC_STMIN,
+	.adaptive = IS_ENABLED(CONFIG_ISOTP_FC_ADAPTIVE),
+};
+
+static atomic_t isotp_rebind = ATOMIC_INIT(0);	//Битовая маска сессий, смена настроек FC
+static atomic_t isotp_stmin_apply = ATOMIC_INIT(0);	//Битовая маска сессий, шаг адаптивного STmin
+
+K_MUTEX_DEFINE(isotp_fc_mutex);
+K_SEM_DEFINE(isotp_bench_sem, 0, 1);
+
+static int isotp_bench_result;
+
+/* Бенчмарк переводит контроллер в loopback: только отдельный, не рабочая шина */
+#if DT_NODE_HAS_STATUS(DT_ALIAS(isotp_bench), okay)
+BUILD_ASSERT(!DT_SAME_NODE(DT_ALIAS(isotp_bench), DT_CHOSEN(zephyr_canbus)), "isotp-bench must not be the bridge CAN");
+static const struct device *const isotp_bench_dev = DEVICE_DT_GET(DT_ALIAS(isotp_bench));
+#else
+static const struct device *const isotp_bench_dev = NULL;
+#endif
+
+static struct isotp_health_t isotp_health;
+static struct k_spinlock isotp_health_lock;
+static int64_t isotp_tx_down_since;
+
+uint32_t canbus_isotp_stmin_us(uint8_t stmin){
+
+	if(stmin <= 0x7F){
+		return stmin * 1000;
+	}
+
+	if((stmin >= 0xF1) && (stmin <= 0xF9)){
+		return (stmin - 0xF0) * 100;
+	}
+
+	return 127000;
+}
+
+static bool isotp_stmin_valid(uint8_t stmin){
+	return (stmin <= 0x7F) || ((stmin >= 0xF1) && (stmin <= 0xF9));
+}
+
+static uint8_t isotp_stmin_level_find(uint8_t stmin){
+	uint32_t stmin_us = canbus_isotp_stmin_us(stmin);
+
+	for(uint32_t i=0; i<ARRAY_SIZE(isotp_stmin_levels); i++){
+		if(canbus_isotp_stmin_us(isotp_stmin_levels[i]) >= stmin_us){
+			return i;
+		}
+	}
+
+	return ISOTP_STMIN_LEVEL_MAX;
+}
+
+static void isotp_fc_update(const struct isotp_fc_cfg_t *cfg){
+
+	k_mutex_lock(&isotp_fc_mutex, K_FOREVER);
+	isotp_fc_cfg = *cfg;
+	for(uint32_t i=0; i<ISOTP_SESSION_END; i++){
+		isotp_sessions[i].stmin_level = isotp_stmin_level_find(cfg->stmin);
+		isotp_sessions[i].adapt_clean = 0;
+		isotp_sessions[i].adapt_window = CONFIG_ISOTP_FC_ADAPT_WINDOW;
+	}
+	k_mutex_unlock(&isotp_fc_mutex);
+
+	atomic_set(&isotp_rebind, BIT_MASK(ISOTP_SESSION_END));
+}
+
+static int isotp_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg){
+	const char *next;
+	struct isotp_fc_cfg_t cfg;
+	int rc;
+
+	if (settings_name_steq(name, "fc", &next) && !next) {
+		if (len != sizeof(cfg)) {
+			return -EINVAL;
+		}
+
+		rc = read_cb(cb_arg, &cfg, sizeof(cfg));
+		if (rc < 0) {
+			return rc;
+		}
+
+		if(!isotp_stmin_valid(cfg.stmin)){
+			LOG_WRN("Saved STmin 0x%02X invalid, skip",cfg.stmin);
+			return 0;
+		}
+
+		isotp_fc_update(&cfg);
+		LOG_INF("ISO-TP FC loaded: bs=%d stmin=0x%02X adaptive=%d",cfg.bs,cfg.stmin,cfg.adaptive);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(isotp, "isotp", NULL, isotp_settings_set, NULL, NULL);
+
+int canbus_isotp_fc_set(uint8_t bs, uint8_t stmin, bool adaptive){
+	struct isotp_fc_cfg_t cfg;
+	int err;
+
+	if(!isotp_stmin_valid(stmin)){
+		LOG_ERR("Invalid STmin 0x%02X",stmin);
+		return -EINVAL;
+	}
+
+	cfg.bs = bs;
+	cfg.stmin = stmin;
+	cfg.adaptive = adaptive;
+
+	isotp_fc_update(&cfg);
+
+	err = settings_save_one("isotp/fc", &cfg, sizeof(cfg));
+	if(err){
+		LOG_ERR("Failed to save ISO-TP FC settings: %d",err);
+	}
+
+	return err;
+}
+
+//stat - массив на ISOTP_SESSION_END сессий
+void canbus_isotp_fc_get(struct isotp_fc_cfg_t *cfg, struct isotp_fc_stat_t *stat){
+
+	k_mutex_lock(&isotp_fc_mutex, K_FOREVER);
+	if(cfg != NULL){
+		*cfg = isotp_fc_cfg;
+	}
+	if(stat != NULL){
+		for(uint32_t i=0; i<ISOTP_SESSION_END; i++){
+			stat[i] = isotp_sessions[i].stat;
+		}
+	}
+	k_mutex_unlock(&isotp_fc_mutex);
+}
+
+static bool isotp_is_overrun(int err){
+
+	switch (err)
+	{
+	case ISOTP_N_TIMEOUT_CR:
+	case ISOTP_N_WRONG_SN:
+	case ISOTP_N_BUFFER_OVERFLW:
+	case ISOTP_NO_NET_BUF_LEFT:
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/*
+Уровень STmin у каждой сессии свой, переполнение на одной не тормозит остальные.
+Отступ STmin применяется привязкой при восстановлении после ошибки.
+Сужение - перепривязкой сессии, простаивающей ISOTP_FC_APPLY_IDLE:
+между пакетами, без First Frame в процессе приема.
+*/
+static void isotp_fc_adapt(struct isotp_session_t *session, int result, bool multi_frame){
+
+	k_mutex_lock(&isotp_fc_mutex, K_FOREVER);
+
+	if(isotp_is_overrun(result)){
+		session->stat.overruns++;
+	}
+
+	if(!isotp_fc_cfg.adaptive){
+		k_mutex_unlock(&isotp_fc_mutex);
+		return;
+	}
+
+	if(isotp_is_overrun(result)){
+		session->adapt_clean = 0;
+		session->adapt_window = MIN(session->adapt_window * 2, ISOTP_FC_ADAPT_WINDOW_MAX);
+
+		if(session->stmin_level < ISOTP_STMIN_LEVEL_MAX){
+			session->stmin_level++;
+			session->stat.backoffs++;
+			LOG_WRN("ISO-TP %s overrun [%d], STmin back off to 0x%02X",session->name,result,isotp_stmin_levels[session->stmin_level]);
+		}
+	}else if((result == 0) && multi_frame){
+		session->adapt_clean++;
+
+		if((session->adapt_clean >= session->adapt_window) && (session->stmin_level > 0)){
+			session->adapt_clean = 0;
+			session->stmin_level--;
+			session->stat.tightened++;
+			atomic_set_bit(&isotp_stmin_apply, session - isotp_sessions);
+			LOG_DBG("ISO-TP %s STmin tighten to 0x%02X",session->name,isotp_stmin_levels[session->stmin_level]);
+		}
+	}
+
+	k_mutex_unlock(&isotp_fc_mutex);
+}
+
+static int isotp_rx_bind(struct isotp_session_t *session, const struct device *can_dev){
+	struct isotp_fc_opts opts;
+	int ret;
+
+	//Привязка с текущим уровнем, отложенный шаг больше не нужен
+	atomic_clear_bit(&isotp_stmin_apply, session - isotp_sessions);
+
+	k_mutex_lock(&isotp_fc_mutex, K_FOREVER);
+	opts.bs = isotp_fc_cfg.bs;
+	opts.stmin = isotp_fc_cfg.adaptive ? isotp_stmin_levels[session->stmin_level] : isotp_fc_cfg.stmin;
+	session->stat.stmin = opts.stmin;
+	k_mutex_unlock(&isotp_fc_mutex);
+
+	//recv_ctx хранит копию opts
+	ret = isotp_bind(&session->recv_ctx, can_dev, &session->rx_addr, &session->tx_addr, &opts, K_FOREVER);
+	session->bound = (ret == ISOTP_N_OK);
+	if(session->bound){
+		LOG_INF("ISO-TP %s bound to 0x%0X, bs=%d stmin=0x%02X",session->name,session->rx_addr.std_id,opts.bs,opts.stmin);
+	}
+
+	return ret;
+}
+
+static void isotp_rx_unbind(struct isotp_session_t *session){
+
+	if(session->bound){
+		isotp_unbind(&session->recv_ctx);
+		session->bound = false;
+	}
+}
+
+/*
+Сброс контекста приема: отвязка и привязка заново до успеха.
+Время от ошибки до готовности к приему идет в статистику.
+*/
+static void isotp_rx_recover(struct isotp_session_t *session, const struct device *can_dev, int reason){
+	int64_t start = k_uptime_get();
+	uint32_t delay = ISOTP_RECOVER_DELAY_MIN_MS;
+	uint32_t down_ms;
+	k_spinlock_key_t key;
+	int ret;
+
+	LOG_WRN("ISO-TP %s recover after [%d]",session->name,reason);
+
+	isotp_rx_unbind(session);
+
+	while((ret = isotp_rx_bind(session, can_dev)) != ISOTP_N_OK){
+		LOG_ERR("ISO-TP %s bind failed [%d], retry in %d ms",session->name,ret,delay);
+
+		key = k_spin_lock(&isotp_health_lock);
+		isotp_health.rx_bind_failures++;
+		k_spin_unlock(&isotp_health_lock, key);
+
+		k_msleep(delay);
+		delay = MIN(delay * 2, ISOTP_RECOVER_DELAY_MAX_MS);
+	}
+
+	down_ms = (uint32_t)(k_uptime_get() - start);
+
+	key = k_spin_lock(&isotp_health_lock);
+	isotp_health.rx_recoveries++;
+	isotp_health.rx_unavail_ms += down_ms;
+	isotp_health.rx_recover_max_ms = MAX(isotp_health.rx_recover_max_ms, down_ms);
+	k_spin_unlock(&isotp_health_lock, key);
+
+	LOG_INF("ISO-TP %s recovered in %d ms",session->name,down_ms);
+}
+
+static void isotp_rx_error(struct isotp_session_t *session, const struct device *can_dev, int err){
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&isotp_health_lock);
+	isotp_health.rx_errors++;
+	k_spin_unlock(&isotp_health_lock, key);
+
+	isotp_fc_adapt(session, err, false);
+
+	//Новые параметры FC (и шаг адаптации) применяются той же привязкой
+	atomic_clear_bit(&isotp_rebind, session - isotp_sessions);
+	isotp_rx_recover(session, can_dev, err);
+}
+
+static void isotp_rx_rebind_check(struct isotp_session_t *session, const struct device *can_dev, bool idle){
+	bool rebind = atomic_test_and_clear_bit(&isotp_rebind, session - isotp_sessions);
+
+	if(idle && atomic_test_bit(&isotp_stmin_apply, session - isotp_sessions)){
+		rebind = true;
+	}
+
+	if(!rebind){
+		return;
+	}
+
+	isotp_rx_unbind(session);
+	if(isotp_rx_bind(session, can_dev) != ISOTP_N_OK){
+		isotp_rx_recover(session, can_dev, ISOTP_N_ERROR);
+	}
+}
+
+static void isotp_tx_result(int err){
+	k_spinlock_key_t key;
+	int64_t now = k_uptime_get();
+
+	key = k_spin_lock(&isotp_health_lock);
+	if(err != ISOTP_N_OK){
+		isotp_health.tx_errors++;
+		if(isotp_tx_down_since == 0){
+			isotp_tx_down_since = now;
+		}
+	}else if(isotp_tx_down_since != 0){
+		isotp_health.tx_recoveries++;
+		isotp_health.tx_unavail_ms += (uint32_t)(now - isotp_tx_down_since);
+		isotp_tx_down_since = 0;
+	}
+	k_spin_unlock(&isotp_health_lock, key);
+}
+
+void canbus_isotp_health_get(struct isotp_health_t *health){
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&isotp_health_lock);
+	*health = isotp_health;
+	k_spin_unlock(&isotp_health_lock, key);
+}
+
+const char *canbus_isotp_session_name(uint8_t session){
+
+	if(session >= ISOTP_SESSION_END){
+		return NULL;
+	}
+
+	return isotp_sessions[session].name;
+}
+
+int canbus_isotp_session_channel(uint8_t session){
+
+	if(session >= ISOTP_SESSION_END){
+		return -1;
+	}
+
+	return isotp_sessions[session].channel;
+}
 
 void canbus_isotp_init(const struct device *can_dev){
 	k_tid_t tid;
 
     LOG_DBG("Init ISO-TP with can_dev=0x%0X", (uint32_t)can_dev);
 
-    k_sem_init(&can_isotp_rx_sem, 1, 1);
+	for(uint32_t i=0; i<ISOTP_SESSION_END; i++){
+		struct isotp_session_t *session = &isotp_sessions[i];
 
-	tid = k_thread_create(&isotp_rx_thread_data, isotp_rx_thread_stack, K_THREAD_STACK_SIZEOF(isotp_rx_thread_stack), isotp_rx_thread, (void *)can_dev, NULL, NULL, ISOTP_RX_THREAD_PRIORITY, 0, K_NO_WAIT);
-	if (!tid) {
-		LOG_ERR("ERROR spawning ISO-TP rx thread\n");
-	}else{
-		k_thread_name_set(tid, "isotprx");
+		tid = k_thread_create(&session->thread, isotp_rx_thread_stack[i], K_THREAD_STACK_SIZEOF(isotp_rx_thread_stack[i]), isotp_rx_thread, (void *)can_dev, session, NULL, session->priority, 0, K_NO_WAIT);
+		if (!tid) {
+			LOG_ERR("ERROR spawning ISO-TP %s thread\n",session->name);
+		}else{
+			k_thread_name_set(tid, session->name);
+		}
 	}
-	
+
 	tid = k_thread_create(&isotp_tx_thread_data, isotp_tx_thread_stack, K_THREAD_STACK_SIZEOF(isotp_tx_thread_stack), isotp_tx_thread, (void *)can_dev, NULL, NULL, ISOTP_TX_THREAD_PRIORITY, 0, K_NO_WAIT);
 	if (!tid) {
 		LOG_ERR("ERROR spawning ISO-TP rx thread\n");
@@ -69,81 +469,132 @@ void canbus_isotp_init(const struct device *can_dev){
 
 }
 
+static int isotp_stream_next(struct isotp_stream_t *stream){
+
+	stream->rem_len = isotp_recv_net(&stream->session->recv_ctx, &stream->buf, K_FOREVER);
+	if(stream->rem_len < 0){
+		LOG_ERR("Receiving error [%d]", stream->rem_len);
+		stream->err = stream->rem_len;
+		stream->buf = NULL;
+	}
+
+	return stream->err;
+}
+
+/*
+Чтение protobuf прямо из фрагментов ISO-TP. Фрагмент освобождается,
+как только прочитан, следующий блок принимается по мере необходимости.
+*/
+static bool isotp_stream_read(pb_istream_t *istream, pb_byte_t *out, size_t count){
+	struct isotp_stream_t *stream = istream->state;
+	size_t chunk;
+
+	while(count > 0){
+		if(stream->buf == NULL){
+			if((stream->err != 0) || (stream->rem_len == 0)){
+				PB_RETURN_ERROR(istream, "isotp stream end");
+			}
+
+			if(isotp_stream_next(stream) != 0){
+				PB_RETURN_ERROR(istream, "isotp recv failed");
+			}
+			continue;
+		}
+
+		chunk = MIN(count, stream->buf->len);
+		if(out != NULL){
+			memcpy(out, stream->buf->data, chunk);
+			out += chunk;
+		}
+		net_buf_pull(stream->buf, chunk);
+		count -= chunk;
+
+		if(stream->buf->len == 0){
+			stream->buf = net_buf_frag_del(NULL, stream->buf);
+		}
+	}
+
+	return true;
+}
+
+//Остаток пакета, не нужный декодеру, принимается и освобождается
+static void isotp_stream_drain(struct isotp_stream_t *stream){
+
+	while(1){
+		while (stream->buf != NULL) {
+			stream->buf = net_buf_frag_del(NULL, stream->buf);
+		}
+
+		if((stream->err != 0) || (stream->rem_len == 0)){
+			return;
+		}
+
+		isotp_stream_next(stream);
+	}
+}
+
 static void isotp_rx_thread(void *arg1, void *arg2, void *arg3){
 	const struct device *can_dev = arg1;
+	struct isotp_session_t *session = arg2;
+	struct isotp_stream_t stream;
+	pb_istream_t istream;
 	int ret, rem_len;
-	int err;
+	uint32_t msg_len;
 	struct net_buf *buf;
-	struct mem_pkt_t mem_pkt;
+	bool multi_frame;
 
-	LOG_DBG("Bind ISO-TP RX, dev 0x%0X",(uint32_t)can_dev);
-	ret = isotp_bind(&isotp_recv_ctx, can_dev, &isotp_rx_addr, &isotp_tx_addr, &isotp_fc_opts, K_FOREVER);
+	LOG_DBG("Bind ISO-TP %s, dev 0x%0X",session->name,(uint32_t)can_dev);
+	ret = isotp_rx_bind(session, can_dev);
 
 	if(ret != ISOTP_N_OK){
-		LOG_ERR("Failed to bind ISO-TP to rx ID %d [%d]\n", isotp_rx_addr.std_id, ret);
-		return;
+		LOG_ERR("Failed to bind ISO-TP to rx ID %d [%d]\n", session->rx_addr.std_id, ret);
+		isotp_rx_recover(session, can_dev, ret);
 	}
-	memset(&mem_pkt,0,sizeof(struct mem_pkt_t));
 
 	while (1) {
-		if( k_sem_take(&can_isotp_rx_sem, K_MSEC(2000)) == 0) {
-			LOG_DBG("Semaphore lock %d",ret);
-			if(mem_pkt.data != NULL){
-				LOG_DBG("Free isotp mem");
-				k_free(mem_pkt.data);
-			}
-			memset(&mem_pkt,0,sizeof(struct mem_pkt_t));
+		//Ожидание начала пакета, смена FC параметров только между пакетами
+		while((rem_len = isotp_recv_net(&session->recv_ctx, &buf,
+				atomic_test_bit(&isotp_stmin_apply, session - isotp_sessions) ? ISOTP_FC_APPLY_IDLE : ISOTP_RX_POLL_TIMEOUT)) == ISOTP_RECV_TIMEOUT){
+			isotp_rx_rebind_check(session, can_dev, true);
+		}
 
-			do {
-				rem_len = isotp_recv_net(&isotp_recv_ctx, &buf, K_FOREVER);
+		if (rem_len < 0) {
+			LOG_ERR("Receiving error [%d]\n", rem_len);
+			isotp_rx_error(session, can_dev, rem_len);
+			continue;
+		}
 
-				if(mem_pkt.data == NULL){ //Начало пакета, выделение памяти
-					uint32_t alloc_size = rem_len + buf->len;
-					LOG_DBG("Start recieving pkt, allocate %d bytes",alloc_size);
+		multi_frame = (rem_len > 0);
+		msg_len = net_buf_frags_len(buf) + rem_len;
+		LOG_DBG("%s: start receiving %d bytes",session->name,msg_len);
 
-					mem_pkt.data = k_malloc(alloc_size);
+		stream.session = session;
+		stream.buf = buf;
+		stream.rem_len = rem_len;
+		stream.err = 0;
 
-					if (mem_pkt.data != NULL) {
-						memset(mem_pkt.data, 0, alloc_size);
-						mem_pkt.len = alloc_size;
-					} else {
-						LOG_ERR("Memory not allocated");
-					}
-				}
-				
-				if (rem_len < 0) {
-					LOG_ERR("Receiving error [%d]\n", rem_len);
-					mem_pkt.len = -1;
-					break;
-				}
+		memset(&istream,0,sizeof(pb_istream_t));
+		istream.callback = isotp_stream_read;
+		istream.state = &stream;
+		istream.bytes_left = msg_len;
 
-				if(mem_pkt.data != NULL){
-					while (buf != NULL) {
-						memcpy(&mem_pkt.data[mem_pkt.index],buf->data,buf->len);
-						mem_pkt.index += buf->len;
-						LOG_DBG("ISO-TP Proceed %d bytes, %d total",buf->len,mem_pkt.index);
-						buf = net_buf_frag_del(NULL, buf);
-					}
-				}
-			} while (rem_len);
+		ret = gopro_pb_bledata_decode(&istream, session->channel);
+		isotp_stream_drain(&stream);
 
-			if(mem_pkt.len < 0){
-				k_sem_give(&can_isotp_rx_sem);
-				break;
-			}
+		if(stream.err != 0){
+			isotp_rx_error(session, can_dev, stream.err);
+			continue;
+		}
 
-			LOG_INF("Got %d bytes of %d in total", mem_pkt.index, mem_pkt.len);
+		isotp_fc_adapt(session, ISOTP_N_OK, multi_frame);
+		isotp_rx_rebind_check(session, can_dev, false);
 
-			err = zbus_chan_pub(&can_rx_ble_chan, &mem_pkt, K_NO_WAIT);
-			if(err != 0){
-				LOG_ERR("Chan pub failed: %d",err);
-				k_sem_give(&can_isotp_rx_sem);
-				break;
-			}
-	}else{
-		LOG_WRN("Semaphore busy");
-	}
-	
+		k_mutex_lock(&isotp_fc_mutex, K_FOREVER);
+		session->stat.rx_msgs++;
+		session->stat.rx_bytes += msg_len;
+		k_mutex_unlock(&isotp_fc_mutex);
+
+		LOG_INF("%s: got %d bytes, decode %s", session->name, msg_len, (ret == 0) ? "ok" : "failed");
 	}
 }
 
@@ -156,6 +607,7 @@ void isotpsend_callback(int error_nr, void *arg){
 		LOG_ERR("Send failed, err: %d",error_nr);
 	}
 
+	isotp_tx_result(error_nr);
 	k_free(data);
 	k_sem_give(&can_reply_sem);
 	LOG_DBG("Mem free, sem give");
@@ -174,14 +626,136 @@ static void isotp_tx_thread(void *arg1, void *arg2, void *arg3){
 	while(1){
 		while (!zbus_sub_wait_msg(&can_tx_ble_subscriber, &chan, &mem_pkt, K_FOREVER)) {
 			if (&can_tx_ble_chan == chan) {
-				
+
 				LOG_DBG("Get %d bytes for ISOTP send",mem_pkt.len);
 
 				ret = isotp_send(&send_ctx, can_dev, mem_pkt.data, mem_pkt.len, &tx_reply, &rx_reply, isotpsend_callback, mem_pkt.data);
 				if (ret != ISOTP_N_OK) {
+					//Callback не будет вызван, освобождаем сами, иначе can_reply заблокирован навсегда
 					LOG_ERR("Error while sending data to ID %0X [%d]\n", tx_reply.std_id, ret);
+					isotpsend_callback(ret, mem_pkt.data);
 				}
 			}
 		}
 	}
-};
\ No newline at end of file
+};
+
+static void isotp_bench_sent(int error_nr, void *arg){
+	isotp_bench_result = error_nr;
+	k_sem_give(&isotp_bench_sem);
+}
+
+static int isotp_bench_mode(can_mode_t mode){
+	int err;
+
+	err = can_stop(isotp_bench_dev);
+	if(err != 0 && err != -EALREADY){
+		return err;
+	}
+
+	err = can_set_mode(isotp_bench_dev, mode);
+	if(err != 0){
+		return err;
+	}
+
+	return can_start(isotp_bench_dev);
+}
+
+int canbus_isotp_bench(uint8_t bs, uint8_t stmin, uint32_t size, uint32_t *bytes_per_sec){
+	static struct isotp_recv_ctx bench_recv_ctx;
+	static struct isotp_send_ctx bench_send_ctx;
+	const struct isotp_msg_id bench_rx_addr = {.std_id = ISOTP_BENCH_RX_ID};
+	const struct isotp_msg_id bench_fc_addr = {.std_id = ISOTP_BENCH_FC_ID};
+	const struct isotp_fc_opts bench_opts = {.bs = bs, .stmin = stmin};
+	can_mode_t cap;
+	struct net_buf *buf;
+	uint8_t *data;
+	uint32_t received = 0;
+	int64_t start;
+	uint64_t elapsed_us;
+	int rem_len;
+	int ret;
+
+	if(isotp_bench_dev == NULL){
+		LOG_ERR("No isotp-bench CAN controller");
+		return -ENOTSUP;
+	}
+
+	if(!device_is_ready(isotp_bench_dev)){
+		return -ENODEV;
+	}
+
+	if((size == 0) || (size > 4095) || !isotp_stmin_valid(stmin)){
+		return -EINVAL;
+	}
+
+	ret = can_get_capabilities(isotp_bench_dev, &cap);
+	if((ret != 0) || ((cap & CAN_MODE_LOOPBACK) == 0)){
+		LOG_ERR("CAN loopback not supported");
+		return -ENOTSUP;
+	}
+
+	data = k_malloc(size);
+	if(data == NULL){
+		return -ENOMEM;
+	}
+
+	for(uint32_t i=0; i<size; i++){
+		data[i] = (uint8_t)i;
+	}
+
+	ret = isotp_bench_mode(CAN_MODE_LOOPBACK);
+	if(ret != 0){
+		LOG_ERR("Failed to set loopback mode: %d",ret);
+		goto restore;
+	}
+
+	ret = isotp_bind(&bench_recv_ctx, isotp_bench_dev, &bench_rx_addr, &bench_fc_addr, &bench_opts, K_MSEC(100));
+	if(ret != ISOTP_N_OK){
+		LOG_ERR("Bench bind failed [%d]",ret);
+		ret = -EIO;
+		goto restore;
+	}
+
+	k_sem_reset(&isotp_bench_sem);
+	start = k_uptime_ticks();
+
+	ret = isotp_send(&bench_send_ctx, isotp_bench_dev, data, size, &bench_rx_addr, &bench_fc_addr, isotp_bench_sent, NULL);
+	if(ret == ISOTP_N_OK){
+		do {
+			rem_len = isotp_recv_net(&bench_recv_ctx, &buf, ISOTP_BENCH_TIMEOUT);
+			if(rem_len < 0){
+				ret = rem_len;
+				break;
+			}
+
+			while (buf != NULL) {
+				received += buf->len;
+				buf = net_buf_frag_del(NULL, buf);
+			}
+		} while (rem_len);
+
+		if(k_sem_take(&isotp_bench_sem, ISOTP_BENCH_TIMEOUT) != 0){
+			ret = ISOTP_N_TIMEOUT_A;
+		}else if(ret == ISOTP_N_OK){
+			ret = isotp_bench_result;
+		}
+	}
+
+	elapsed_us = k_ticks_to_us_ceil64(k_uptime_ticks() - start);
+	isotp_unbind(&bench_recv_ctx);
+
+	if(ret == ISOTP_N_OK){
+		*bytes_per_sec = (uint32_t)(((uint64_t)received * USEC_PER_SEC) / MAX(elapsed_us, 1));
+		LOG_DBG("Bench bs=%d stmin=0x%02X: %d bytes in %llu us",bs,stmin,received,elapsed_us);
+	}else{
+		LOG_ERR("Bench transfer failed [%d]",ret);
+		ret = -EIO;
+	}
+
+restore:
+	can_stop(isotp_bench_dev);
+
+	k_free(data);
+	return ret;
+}
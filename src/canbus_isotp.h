@@ -11,11 +11,82 @@
 
 
 #define ISOTP_RX_THREAD_PRIORITY 	9
-#define ISOTP_RX_THREAD_STACK_SIZE	4096
+#define ISOTP_RX_URGENT_PRIORITY 	7
+#define ISOTP_RX_BULK_PRIORITY 		10
+#define ISOTP_RX_THREAD_STACK_SIZE	2048
 
 #define ISOTP_TX_THREAD_PRIORITY 	9
 #define ISOTP_TX_THREAD_STACK_SIZE	4096
 
+#define ISOTP_RX_POLL_TIMEOUT		K_MSEC(1000)
+#define ISOTP_FC_APPLY_IDLE			K_MSEC(20)		//Тишина на сессии перед перепривязкой с новым STmin
+
+/* Повторная привязка после ошибки, задержка между попытками удваивается */
+#define ISOTP_RECOVER_DELAY_MIN_MS	2
+#define ISOTP_RECOVER_DELAY_MAX_MS	200
+
+/* Общая сессия, канал BLE задается полем ble_addr */
+#define ISOTP_MAIN_RX_ID			0x753
+#define ISOTP_MAIN_FC_ID			0x763
+
+/* Отдельная пара адресов на каждый канал управления GoPro */
+#define ISOTP_CMD_RX_ID				0x754
+#define ISOTP_CMD_FC_ID				0x764
+#define ISOTP_SETTINGS_RX_ID		0x755
+#define ISOTP_SETTINGS_FC_ID		0x765
+#define ISOTP_QUERY_RX_ID			0x756
+#define ISOTP_QUERY_FC_ID			0x766
+#define ISOTP_NET_RX_ID				0x757
+#define ISOTP_NET_FC_ID				0x767
+
+#define ISOTP_BENCH_RX_ID			0x7F0
+#define ISOTP_BENCH_FC_ID			0x7F1
+#define ISOTP_BENCH_TIMEOUT			K_MSEC(10000)
+
+enum isotp_session_list_t{
+	ISOTP_SESSION_MAIN,
+	ISOTP_SESSION_CMD,
+	ISOTP_SESSION_SETTINGS,
+	ISOTP_SESSION_QUERY,
+	ISOTP_SESSION_NET,
+	ISOTP_SESSION_END
+};
+
+struct isotp_fc_cfg_t{
+	uint8_t bs;
+	uint8_t stmin;
+	uint8_t adaptive;
+};
+
+struct isotp_fc_stat_t{
+	uint8_t  stmin;				//STmin используемый сейчас
+	uint32_t rx_msgs;
+	uint32_t rx_bytes;
+	uint32_t overruns;
+	uint32_t tightened;
+	uint32_t backoffs;
+};
+
+struct isotp_health_t{
+	uint32_t rx_errors;
+	uint32_t rx_recoveries;
+	uint32_t rx_bind_failures;
+	uint32_t rx_unavail_ms;			//Суммарное время без приема
+	uint32_t rx_recover_max_ms;
+	uint32_t tx_errors;
+	uint32_t tx_recoveries;
+	uint32_t tx_unavail_ms;
+};
+
 void canbus_isotp_init(const struct device *can_dev);
+int canbus_isotp_session_channel(uint8_t session);
+const char *canbus_isotp_session_name(uint8_t session);
+
+int canbus_isotp_fc_set(uint8_t bs, uint8_t stmin, bool adaptive);
+void canbus_isotp_fc_get(struct isotp_fc_cfg_t *cfg, struct isotp_fc_stat_t stat[ISOTP_SESSION_END]);
+uint32_t canbus_isotp_stmin_us(uint8_t stmin);
+void canbus_isotp_health_get(struct isotp_health_t *health);
+
+int canbus_isotp_bench(uint8_t bs, uint8_t stmin, uint32_t size, uint32_t *bytes_per_sec);
 
-#endif
\ No newline at end of file
+#endif
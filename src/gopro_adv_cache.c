@@ -0,0 +1,189 @@
+#include "gopro_adv_cache.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/bluetooth/gap.h>
+
+LOG_MODULE_REGISTER(gopro_adv_cache, CONFIG_BLE_LOG_LVL);
+
+//Рабочий кэш сканера, отдельный экземпляр - только у самопроверки
+struct adv_cache_inst_t{
+	struct gopro_adv_cache_t entry[CONFIG_GOPRO_ADV_CACHE_SIZE];
+	struct gopro_adv_cache_stat_t stat;
+};
+
+static struct k_spinlock adv_cache_lock;
+static struct adv_cache_inst_t adv_cache;
+
+/* FNV-1a, рекламный пакет не длиннее 31 байта */
+static uint32_t adv_cache_hash(const struct net_buf_simple *adv){
+	uint32_t hash = 2166136261U;
+
+	for(uint32_t i=0; i<adv->len; i++){
+		hash ^= adv->data[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+static struct gopro_adv_cache_t *adv_cache_find(struct adv_cache_inst_t *cache, const bt_addr_le_t *addr){
+
+	for(uint32_t i=0; i<ARRAY_SIZE(cache->entry); i++){
+		if(bt_addr_le_eq(&cache->entry[i].addr, addr)){
+			return &cache->entry[i];
+		}
+	}
+
+	return NULL;
+}
+
+static uint32_t adv_cache_seen(const struct gopro_adv_cache_t *entry){
+	uint32_t seen_ms = entry->seen_ms[GP_ADV_PDU_ADV];
+
+	if((entry->valid & BIT(GP_ADV_PDU_SCAN_RSP)) && ((int32_t)(entry->seen_ms[GP_ADV_PDU_SCAN_RSP] - seen_ms) > 0)){
+		seen_ms = entry->seen_ms[GP_ADV_PDU_SCAN_RSP];
+	}
+
+	return seen_ms;
+}
+
+//Свободная запись или самая старая
+static struct gopro_adv_cache_t *adv_cache_slot(struct adv_cache_inst_t *cache, uint32_t now){
+	struct gopro_adv_cache_t *oldest = &cache->entry[0];
+
+	for(uint32_t i=0; i<ARRAY_SIZE(cache->entry); i++){
+		if(bt_addr_le_eq(&cache->entry[i].addr, BT_ADDR_LE_ANY)){
+			return &cache->entry[i];
+		}
+
+		if((now - adv_cache_seen(&cache->entry[i])) > (now - adv_cache_seen(oldest))){
+			oldest = &cache->entry[i];
+		}
+	}
+
+	cache->stat.evictions++;
+	return oldest;
+}
+
+enum gopro_adv_pdu_t gopro_adv_cache_pdu(uint8_t adv_type, uint16_t adv_props){
+
+	if((adv_type == BT_GAP_ADV_TYPE_SCAN_RSP) || (adv_props & BT_GAP_ADV_PROP_SCAN_RESPONSE)){
+		return GP_ADV_PDU_SCAN_RSP;
+	}
+
+	return GP_ADV_PDU_ADV;
+}
+
+static bool adv_cache_lookup(struct adv_cache_inst_t *cache, const bt_addr_le_t *addr, enum gopro_adv_pdu_t pdu, uint32_t hash, uint8_t state, uint32_t now){
+	struct gopro_adv_cache_t *entry;
+	bool hit = false;
+
+	cache->stat.lookups++;
+
+	entry = adv_cache_find(cache, addr);
+	if(entry == NULL){
+		entry = adv_cache_slot(cache, now);
+		memset(entry, 0, sizeof(*entry));
+		bt_addr_le_copy(&entry->addr, addr);
+	}else if(!(entry->valid & BIT(pdu))){
+		//Первый пакет этого типа
+	}else if((entry->hash[pdu] != hash) || (entry->state[pdu] != state)){
+		cache->stat.changed++;
+	}else if((now - entry->seen_ms[pdu]) >= CONFIG_GOPRO_ADV_CACHE_TTL_MS){
+		cache->stat.expired++;
+	}else{
+		cache->stat.hits++;
+		hit = true;
+	}
+
+	if(!hit){
+		entry->hash[pdu] = hash;
+		entry->state[pdu] = state;
+		entry->seen_ms[pdu] = now;
+		entry->valid |= BIT(pdu);
+	}
+
+	return hit;
+}
+
+/* true - тот же пакет при том же состоянии камеры, разбирать не нужно */
+bool gopro_adv_cache_hit(const bt_addr_le_t *addr, enum gopro_adv_pdu_t pdu, const struct net_buf_simple *adv, uint8_t state){
+	k_spinlock_key_t key;
+	uint32_t now = k_uptime_get_32();
+	uint32_t hash = adv_cache_hash(adv);
+	bool hit;
+
+	if(pdu >= GP_ADV_PDU_END){
+		return false;
+	}
+
+	key = k_spin_lock(&adv_cache_lock);
+	hit = adv_cache_lookup(&adv_cache, addr, pdu, hash, state, now);
+	k_spin_unlock(&adv_cache_lock, key);
+
+	return hit;
+}
+
+//Разрыв или ошибка подключения: следующая реклама разбирается сразу
+void gopro_adv_cache_invalidate(const bt_addr_le_t *addr){
+	struct gopro_adv_cache_t *entry;
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&adv_cache_lock);
+	entry = adv_cache_find(&adv_cache, addr);
+	if(entry != NULL){
+		memset(entry, 0, sizeof(*entry));
+	}
+	k_spin_unlock(&adv_cache_lock, key);
+}
+
+void gopro_adv_cache_flush(void){
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&adv_cache_lock);
+	memset(adv_cache.entry, 0, sizeof(adv_cache.entry));
+	k_spin_unlock(&adv_cache_lock, key);
+
+	LOG_DBG("Advertising cache flushed");
+}
+
+void gopro_adv_cache_stat_get(struct gopro_adv_cache_stat_t *stat){
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&adv_cache_lock);
+	*stat = adv_cache.stat;
+	k_spin_unlock(&adv_cache_lock, key);
+}
+
+/*
+Неизменная пара ADV_IND/SCAN_RSP со второго круга должна попадать в кэш.
+Проверка идет на своем экземпляре: записи и статистика сканера не трогаются.
+*/
+int gopro_adv_cache_check(void){
+	static struct adv_cache_inst_t cache;
+	static const bt_addr_le_t addr = {
+		.type = BT_ADDR_LE_RANDOM,
+		.a.val = {0x01, 0x00, 0x00, 0x00, 0x00, 0xC0},
+	};
+	static const enum gopro_adv_pdu_t pdu[] = {GP_ADV_PDU_ADV, GP_ADV_PDU_SCAN_RSP};
+	uint8_t adv_data[] = {0x02, 0x01, 0x06, 0x03, 0x03, 0xA6, 0xFE};
+	uint8_t rsp_data[] = {0x0F, 0xFF, 0xF2, 0x02, 0x02, 0x01, 0x3F, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
+	struct net_buf_simple buf[2];
+	uint32_t now = k_uptime_get_32();
+	int err = 0;
+
+	memset(&cache, 0, sizeof(cache));
+	net_buf_simple_init_with_data(&buf[0], adv_data, sizeof(adv_data));
+	net_buf_simple_init_with_data(&buf[1], rsp_data, sizeof(rsp_data));
+
+	for(uint32_t round=0; round<3; round++){
+		for(uint32_t i=0; i<ARRAY_SIZE(pdu); i++){
+			if(adv_cache_lookup(&cache, &addr, pdu[i], adv_cache_hash(&buf[i]), 0, now) != (round > 0)){
+				LOG_ERR("Adv cache check: round %d pdu %d",round,pdu[i]);
+				err = -EFAULT;
+			}
+		}
+	}
+
+	return err;
+}
@@ -0,0 +1,43 @@
+#ifndef GOPRO_ADV_CACHE_H
+#define GOPRO_ADV_CACHE_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+#include <zephyr/net/buf.h>
+
+/* ADV_IND и SCAN_RSP одной камеры чередуются, хэш у каждого свой */
+enum gopro_adv_pdu_t{
+	GP_ADV_PDU_ADV,
+	GP_ADV_PDU_SCAN_RSP,
+	GP_ADV_PDU_END
+};
+
+/*
+Последняя реклама по адресу и типу пакета: хэш данных и состояние камеры на момент разбора.
+Одинаковая реклама при том же состоянии не разбирается повторно до истечения
+CONFIG_GOPRO_ADV_CACHE_TTL_MS, чтобы неудачное подключение все же повторялось.
+*/
+struct gopro_adv_cache_t{
+	bt_addr_le_t addr;
+	uint32_t hash[GP_ADV_PDU_END];
+	uint32_t seen_ms[GP_ADV_PDU_END];
+	uint8_t  state[GP_ADV_PDU_END];
+	uint8_t  valid;			//Маска пакетов, которые уже видели
+};
+
+struct gopro_adv_cache_stat_t{
+	uint32_t lookups;
+	uint32_t hits;			//Реклама отброшена без разбора
+	uint32_t changed;		//Адрес известен, данные или состояние другие
+	uint32_t expired;
+	uint32_t evictions;
+};
+
+enum gopro_adv_pdu_t gopro_adv_cache_pdu(uint8_t adv_type, uint16_t adv_props);
+bool gopro_adv_cache_hit(const bt_addr_le_t *addr, enum gopro_adv_pdu_t pdu, const struct net_buf_simple *adv, uint8_t state);
+void gopro_adv_cache_invalidate(const bt_addr_le_t *addr);
+void gopro_adv_cache_flush(void);
+void gopro_adv_cache_stat_get(struct gopro_adv_cache_stat_t *stat);
+int  gopro_adv_cache_check(void);
+
+#endif
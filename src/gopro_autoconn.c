@@ -0,0 +1,152 @@
+#include "gopro_autoconn.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/bluetooth/bluetooth.h>
+
+LOG_MODULE_REGISTER(gopro_autoconn, CONFIG_BLE_LOG_LVL);
+
+/*
+Связанные камеры в accept list контроллера: при сканировании хост получает
+рекламу только от них, при автоподключении контроллер сам подключается
+к первой доступной. Список можно менять, только пока нет сканирования
+и автоподключения.
+*/
+
+static uint8_t accept_listed;
+static atomic_t auto_pending;
+static uint8_t backoff_step;
+static int64_t attempt_start[GP_CONN_PATH_END];
+static struct gopro_autoconn_stat_t autoconn_stat;
+
+void gopro_autoconn_list_clear(void){
+	int err;
+
+	#ifdef CONFIG_GOPRO_AUTO_CONNECT
+	if(atomic_cas(&auto_pending, 1, 0)){
+		err = bt_conn_create_auto_stop();
+		if(err){
+			LOG_WRN("Auto connect stop failed: %d",err);
+		}
+	}
+	#endif
+
+	err = bt_le_filter_accept_list_clear();
+	if(err){
+		LOG_WRN("Accept list clear failed: %d",err);
+	}
+
+	accept_listed = 0;
+}
+
+int gopro_autoconn_list_add(const bt_addr_le_t *addr){
+	int err;
+
+	err = bt_le_filter_accept_list_add(addr);
+	if(err){
+		LOG_WRN("Accept list add failed: %d",err);
+		return err;
+	}
+
+	accept_listed++;
+
+	return 0;
+}
+
+uint8_t gopro_autoconn_listed(void){
+	return accept_listed;
+}
+
+/* Начало попытки; повторные запуски сканирования до подключения время не сбрасывают */
+void gopro_autoconn_attempt(enum gopro_conn_path_t path){
+	if(attempt_start[path] == 0){
+		attempt_start[path] = k_uptime_get();
+	}
+}
+
+/* Итог подключения. Для ошибки автоподключения возвращает паузу перед повтором, мс */
+uint32_t gopro_autoconn_result(enum gopro_conn_path_t path, uint8_t err){
+	struct gopro_conn_lat_t *lat = &autoconn_stat.lat[path];
+	uint32_t delay_ms = 0;
+	uint32_t ms;
+
+	if(path == GP_CONN_PATH_AUTO){
+		atomic_set(&auto_pending, 0);
+	}
+
+	if(err){
+		lat->failures++;
+
+		if(path == GP_CONN_PATH_AUTO){
+			delay_ms = MIN((uint32_t)CONFIG_GOPRO_AUTO_CONNECT_BACKOFF_MIN_MS << backoff_step, CONFIG_GOPRO_AUTO_CONNECT_BACKOFF_MAX_MS);
+			if(delay_ms < CONFIG_GOPRO_AUTO_CONNECT_BACKOFF_MAX_MS){
+				backoff_step++;
+			}
+			autoconn_stat.backoff_ms = delay_ms;
+			LOG_WRN("Auto connect failed (0x%02X), retry in %d ms",err,delay_ms);
+		}
+
+		return delay_ms;
+	}
+
+	if(path == GP_CONN_PATH_AUTO){
+		backoff_step = 0;
+		autoconn_stat.backoff_ms = 0;
+	}
+
+	if(attempt_start[path] == 0){
+		return 0;
+	}
+
+	ms = (uint32_t)(k_uptime_get() - attempt_start[path]);
+	attempt_start[path] = 0;
+
+	if((lat->count == 0) || (ms < lat->min_ms)){
+		lat->min_ms = ms;
+	}
+	if(ms > lat->max_ms){
+		lat->max_ms = ms;
+	}
+	lat->sum_ms += ms;
+	lat->count++;
+
+	LOG_INF("Connected via %s in %d ms",(path == GP_CONN_PATH_AUTO) ? "accept list" : "scan",ms);
+
+	return 0;
+}
+
+#ifdef CONFIG_GOPRO_AUTO_CONNECT
+int gopro_autoconn_start(const struct bt_conn_le_create_param *create_param, const struct bt_le_conn_param *conn_param){
+	int err;
+
+	if(accept_listed == 0){
+		return -ENOENT;
+	}
+
+	if(atomic_get(&auto_pending)){
+		return -EALREADY;
+	}
+
+	err = bt_conn_le_create_auto(create_param, conn_param);
+	if(err){
+		LOG_ERR("Auto connect failed to start: %d",err);
+		return err;
+	}
+
+	atomic_set(&auto_pending, 1);
+	gopro_autoconn_attempt(GP_CONN_PATH_AUTO);
+	LOG_INF("Auto connect to %d bonded cameras",accept_listed);
+
+	return 0;
+}
+
+bool gopro_autoconn_pending(void){
+	return atomic_get(&auto_pending);
+}
+#endif
+
+void gopro_autoconn_stat_get(struct gopro_autoconn_stat_t *stat){
+	*stat = autoconn_stat;
+	stat->listed = accept_listed;
+	stat->pending = atomic_get(&auto_pending);
+	stat->backoff_step = backoff_step;
+}
@@ -0,0 +1,44 @@
+#ifndef GOPRO_AUTOCONN_H
+#define GOPRO_AUTOCONN_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+
+/* Путь подключения: рекламу разбирает хост или контроллер подключается сам по accept list */
+enum gopro_conn_path_t{
+	GP_CONN_PATH_SCAN,
+	GP_CONN_PATH_AUTO,
+	GP_CONN_PATH_END
+};
+
+struct gopro_conn_lat_t{
+	uint32_t count;
+	uint32_t min_ms;
+	uint32_t max_ms;
+	uint64_t sum_ms;
+	uint32_t failures;
+};
+
+struct gopro_autoconn_stat_t{
+	uint8_t  listed;			//Адресов в accept list
+	bool	 pending;			//bt_conn_le_create_auto запущен
+	uint8_t  backoff_step;
+	uint32_t backoff_ms;
+	struct gopro_conn_lat_t lat[GP_CONN_PATH_END];	//От начала попытки до connected
+};
+
+void gopro_autoconn_list_clear(void);
+int gopro_autoconn_list_add(const bt_addr_le_t *addr);
+uint8_t gopro_autoconn_listed(void);
+
+void gopro_autoconn_attempt(enum gopro_conn_path_t path);
+uint32_t gopro_autoconn_result(enum gopro_conn_path_t path, uint8_t err);
+
+#ifdef CONFIG_GOPRO_AUTO_CONNECT
+int gopro_autoconn_start(const struct bt_conn_le_create_param *create_param, const struct bt_le_conn_param *conn_param);
+bool gopro_autoconn_pending(void);
+#endif
+
+void gopro_autoconn_stat_get(struct gopro_autoconn_stat_t *stat);
+
+#endif
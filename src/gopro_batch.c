@@ -0,0 +1,224 @@
+#include "gopro_batch.h"
+#include "gopro_ids.h"
+#include "gopro_poll.h"
+#include "gopro_protobuf.h"
+
+#include <zephyr/logging/log.h>
+#include <string.h>
+
+LOG_MODULE_REGISTER(gopro_batch, CONFIG_BLE_LOG_LVL);
+
+#define BATCH_ID_WORDS		(256 / 32)
+
+enum gopro_batch_kind_t{
+	GP_BATCH_STATUS,
+	GP_BATCH_SETTING,
+	GP_BATCH_KIND_END
+};
+
+/* ID, которые ждут ответа для CAN, по камерам */
+struct gopro_batch_wait_t{
+	uint32_t ids[BATCH_ID_WORDS];
+	uint32_t last_ms;
+};
+
+static struct k_spinlock batch_lock;
+static struct gopro_batch_wait_t batch_wait[CONFIG_GOPRO_CAM_MAX][GP_BATCH_KIND_END];
+static struct gopro_batch_stat_t batch_stat;
+
+static int batch_kind(uint8_t query){
+
+	switch (query)
+	{
+	case GOPRO_QUERY_STATUS_GET_STATUS:
+		return GP_BATCH_STATUS;
+	case GOPRO_QUERY_STATUS_GET_SETTING:
+		return GP_BATCH_SETTING;
+	default:
+		return -ENOTSUP;
+	}
+}
+
+/* Только одиночный запрос: запрос списка ID хост уже собрал сам */
+int gopro_batch_put(const struct gopro_cmd_t *gopro_cmd){
+	struct gopro_batch_wait_t *wait;
+	k_spinlock_key_t key;
+	uint8_t id;
+	bool dup;
+	int kind;
+	int err;
+
+	if((gopro_cmd->cmd_type != GP_CNTRL_HANDLE_QUERY) || (gopro_cmd->cam >= CONFIG_GOPRO_CAM_MAX)){
+		return -ENOTSUP;
+	}
+
+	if((gopro_cmd->len != 3) || (gopro_cmd->data[0] != 2)){
+		return -ENOTSUP;
+	}
+
+	kind = batch_kind(gopro_cmd->data[1]);
+	if(kind < 0){
+		return kind;
+	}
+
+	id = gopro_cmd->data[2];
+	wait = &batch_wait[gopro_cmd->cam][kind];
+
+	//Отметка раньше запроса: ответ не должен обогнать ее
+	key = k_spin_lock(&batch_lock);
+	dup = (wait->ids[id / 32] & BIT(id % 32)) != 0;
+	wait->ids[id / 32] |= BIT(id % 32);
+	wait->last_ms = k_uptime_get_32();
+	k_spin_unlock(&batch_lock, key);
+
+	if(kind == GP_BATCH_STATUS){
+		err = gopro_poll_status(gopro_cmd->cam, id);
+	}else{
+		err = gopro_poll_setting(gopro_cmd->cam, id);
+	}
+
+	key = k_spin_lock(&batch_lock);
+	if(err){
+		//Камера еще не поднята планировщиком - запрос уходит как есть
+		if(!dup){
+			wait->ids[id / 32] &= ~BIT(id % 32);
+		}
+	}else{
+		batch_stat.requests++;
+		if(dup){
+			batch_stat.duplicates++;
+		}
+	}
+	k_spin_unlock(&batch_lock, key);
+
+	return err;
+}
+
+//feature, result и один TLV: ID, длина, значение до 255 байт
+static void batch_fanout_put(int32_t ble_addr, uint8_t feature, uint8_t result, const uint8_t *tlv, uint32_t tlv_len){
+	k_spinlock_key_t key;
+	uint8_t data[2 + 2 + UINT8_MAX];
+	int err = -EINVAL;
+
+	if(tlv_len <= (sizeof(data) - 2)){
+		data[0] = feature;
+		data[1] = result;
+		memcpy(&data[2], tlv, tlv_len);
+
+		err = can_reply(ble_addr, data, tlv_len + 2);
+	}
+
+	if(err){
+		key = k_spin_lock(&batch_lock);
+		batch_stat.drops++;
+		k_spin_unlock(&batch_lock, key);
+	}
+}
+
+/*
+Из разбора ответа камеры. TLV с ID, которых ждет CAN, уходят отдельными ответами,
+TLV собственных запросов планировщика отбрасываются, остальные (списком от хоста) -
+одним ответом, как пришли.
+false - ответ не из пакета, пересылается на CAN целиком.
+*/
+bool gopro_batch_reply(const struct gopro_packet_t *gopro_packet){
+	struct gopro_batch_wait_t *wait;
+	k_spinlock_key_t key;
+	int32_t ble_addr = GOPRO_BLE_ADDR(gopro_packet->cam, GP_CNTRL_HANDLE_QUERY);
+	const uint8_t *pdata = gopro_packet->data;
+	uint32_t length = gopro_packet->total_len;
+	uint32_t ids[BATCH_ID_WORDS];
+	uint32_t index = 2;
+	uint32_t claimed = 0;
+	uint32_t owned = 0;
+	uint8_t *rest;
+	uint32_t rest_len = 0;
+	uint32_t waiting = 0;
+	int kind;
+
+	if((gopro_packet->packet_type != GP_CNTRL_HANDLE_QUERY) || (gopro_packet->cam >= CONFIG_GOPRO_CAM_MAX) || (length < 2)){
+		return false;
+	}
+
+	kind = batch_kind(gopro_packet->feature);
+	if(kind < 0){
+		return false;
+	}
+
+	wait = &batch_wait[gopro_packet->cam][kind];
+
+	key = k_spin_lock(&batch_lock);
+	if((int32_t)(k_uptime_get_32() - wait->last_ms) > GOPRO_BATCH_STALE_MS){
+		memset(wait->ids, 0, sizeof(wait->ids));
+	}
+	memcpy(ids, wait->ids, sizeof(ids));
+	for(uint32_t i=0; i<BATCH_ID_WORDS; i++){
+		waiting |= ids[i];
+	}
+
+	//Ошибка на весь запрос: один ответ получат все ждущие
+	if(gopro_packet->action != 0){
+		memset(wait->ids, 0, sizeof(wait->ids));
+	}
+	k_spin_unlock(&batch_lock, key);
+
+	if((gopro_packet->action != 0) || (waiting == 0)){
+		return false;
+	}
+
+	rest = k_malloc(length);
+	if(rest == NULL){
+		return false;
+	}
+
+	while((index + 2) <= length){
+		uint8_t id = pdata[index];
+		uint32_t tlv_len = 2 + pdata[index + 1];
+
+		if((index + tlv_len) > length){
+			break;
+		}
+
+		if(ids[id / 32] & BIT(id % 32)){
+			ids[id / 32] &= ~BIT(id % 32);
+			batch_fanout_put(ble_addr, gopro_packet->feature, gopro_packet->action, &pdata[index], tlv_len);
+			claimed++;
+			gopro_poll_own_take(gopro_packet->cam, gopro_packet->feature, id);
+
+			key = k_spin_lock(&batch_lock);
+			wait->ids[id / 32] &= ~BIT(id % 32);
+			k_spin_unlock(&batch_lock, key);
+		}else if(gopro_poll_own_take(gopro_packet->cam, gopro_packet->feature, id)){
+			owned++;
+		}else{
+			memcpy(&rest[rest_len], &pdata[index], tlv_len);
+			rest_len += tlv_len;
+		}
+
+		index += tlv_len;
+	}
+
+	if((claimed > 0) && (rest_len > 0)){
+		batch_fanout_put(ble_addr, gopro_packet->feature, gopro_packet->action, rest, rest_len);
+	}
+	k_free(rest);
+
+	//Только ID планировщика - ответ его, на CAN не нужен
+	if(claimed == 0){
+		return (owned > 0) && (rest_len == 0);
+	}
+
+	key = k_spin_lock(&batch_lock);
+	batch_stat.replies += claimed;
+	k_spin_unlock(&batch_lock, key);
+
+	return true;
+}
+
+void gopro_batch_stat_get(struct gopro_batch_stat_t *stat){
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&batch_lock);
+	*stat = batch_stat;
+	k_spin_unlock(&batch_lock, key);
+}
@@ -0,0 +1,27 @@
+#ifndef GOPRO_BATCH_H
+#define GOPRO_BATCH_H
+
+#include <zephyr/kernel.h>
+
+#include "gopro_client.h"
+#include "gopro_packet.h"
+
+#define GOPRO_BATCH_STALE_MS		3000	//Запрос без ответа дольше - ответ уже не ждем
+
+/*
+Одиночные GET_STATUS/GET_SETTING {2, cmd, id} с CAN собираются планировщиком
+опроса в один запрос. Ответ со списком TLV снова делится на одиночные ответы,
+как если бы каждый запрос ушел отдельно.
+*/
+struct gopro_batch_stat_t{
+	uint32_t requests;
+	uint32_t duplicates;		//ID уже ждал ответа
+	uint32_t replies;			//Одиночные ответы на CAN
+	uint32_t drops;
+};
+
+int gopro_batch_put(const struct gopro_cmd_t *gopro_cmd);
+bool gopro_batch_reply(const struct gopro_packet_t *gopro_packet);
+void gopro_batch_stat_get(struct gopro_batch_stat_t *stat);
+
+#endif
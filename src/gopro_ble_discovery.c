@@ -7,26 +7,56 @@
 #include <zephyr/settings/settings.h>
 #include <zephyr/drivers/hwinfo.h>
 #include "gopro_control.h"
+#include "gopro_writer.h"
+#ifdef CONFIG_GOPRO_LATENCY_TRACE
+#include "gopro_latency.h"
+#endif
+#ifdef CONFIG_GOPRO_TIME_SYNC
+#include "gopro_time.h"
+#endif
+#ifdef CONFIG_GOPRO_GATT_CACHE
+#include "gopro_gatt_cache.h"
+#endif
+#ifdef CONFIG_GOPRO_LINK_POLICY
+#include "gopro_conn_policy.h"
+#endif
+#ifdef CONFIG_GOPRO_GROUP_SHUTTER
+#include "gopro_group.h"
+#endif
+#ifdef CONFIG_GOPRO_ADV_CACHE
+#include "gopro_adv_cache.h"
+#endif
+#ifdef CONFIG_GOPRO_SCAN_POLICY
+#include "gopro_scan_policy.h"
+#endif
+#ifdef CONFIG_GOPRO_ACCEPT_LIST
+#include "gopro_autoconn.h"
+#endif
+#ifdef CONFIG_GOPRO_READY_TRACE
+#include "gopro_ready.h"
+#endif
+#ifdef CONFIG_GOPRO_POLL
+#include "gopro_poll.h"
+#endif
+#ifdef CONFIG_GOPRO_QUERY_BATCH
+#include "gopro_batch.h"
+#endif
+#ifdef CONFIG_GOPRO_PRESET_CACHE
+#include "gopro_preset.h"
+#endif
 //#include <hw_id.h>
 
 #define  LOG_LVL	CONFIG_BLE_LOG_LVL
 
 LOG_MODULE_REGISTER(gopro_discovery, LOG_LVL);
 
-extern struct k_sem ble_write_sem;
-extern struct k_sem ble_read_sem;
-extern struct k_sem get_hw_sem;
-
-const struct bt_uuid *uuid_list[] = {BT_UUID_GOPRO_WIFI_SERVICE,BT_UUID_GOPRO_SERVICE,BT_UUID_GOPRO_NET_SERVICE};
+extern struct gopro_state_t gopro_state[CONFIG_GOPRO_CAM_MAX];
 
-static void discovery_complete(struct bt_gatt_dm *dm, void *context);
-static void discovery_service_not_found(struct bt_conn *conn, void *context);
-static void discovery_error(struct bt_conn *conn, int err,void *context);
-
-static int handles_assign(struct bt_gatt_dm *dm,  struct bt_gopro_client *nus_c);
+static void discovery_complete(struct bt_gopro_client *gp_client, int err);
 
 static void discovery_start_work_handler(struct k_work *work);
 static void discovery_finish_work_handler(struct k_work *work);
+static void bringup_work_handler(struct k_work *work);
 
 static void auth_cancel(struct bt_conn *conn);
 static void pairing_complete(struct bt_conn *conn, bool bonded);
@@ -51,18 +81,12 @@ static void gatt_discover(struct bt_conn *conn);
 bool gopro_cmd_validator(const void* msg, size_t msg_size);
 static void gopro_cmd_subscriber_task(void *ptr1, void *ptr2, void *ptr3);
 
-static struct bt_conn *default_conn;
-struct bt_gopro_client gopro_client;
+/* Соединение камеры хранится в gopro_client[cam].conn, индекс совпадает с gopro_state */
+struct bt_gopro_client gopro_client[CONFIG_GOPRO_CAM_MAX];
 
 //static struct k_work scan_work;
 K_WORK_DELAYABLE_DEFINE(scan_work, scan_work_handler);
 
-struct bt_gatt_dm_cb discovery_cb = {
-	.completed         = discovery_complete,
-	.service_not_found = discovery_service_not_found,
-	.error_found       = discovery_error
-};
-
 static struct bt_conn_auth_cb conn_auth_callbacks = {
 	.cancel = auth_cancel,
 	.oob_data_request = NULL,
@@ -130,8 +154,22 @@ const static struct gopro_cmd_t *startup_query_list[] = {
 };
 
 BT_SCAN_CB_INIT(scan_cb, scan_filter_match, scan_filter_no_match, scan_connecting_error, scan_connecting);
-K_WORK_DEFINE(discovery_finish_work, discovery_finish_work_handler);
-K_WORK_DEFINE(discovery_start_work, discovery_start_work_handler);
+
+static struct k_work discovery_finish_work[CONFIG_GOPRO_CAM_MAX];
+static struct k_work discovery_start_work[CONFIG_GOPRO_CAM_MAX];
+
+/* Подъем после discovery: события, которых еще ждем, и повторы запросов к камере */
+struct gopro_bringup_t{
+	uint32_t pending;
+	uint32_t sent_ms;
+	uint8_t  tries;
+};
+
+BUILD_ASSERT(GP_BRINGUP_END <= 32, "Bring-up mask is 32 bit");
+
+static struct k_spinlock bringup_lock;
+static struct gopro_bringup_t bringup[CONFIG_GOPRO_CAM_MAX];
+static struct k_work_delayable bringup_work[CONFIG_GOPRO_CAM_MAX];
 BT_CONN_CB_DEFINE(conn_callbacks) = {
 	.connected = connected,
 	.disconnected = disconnected,
@@ -142,7 +180,7 @@ BT_CONN_CB_DEFINE(conn_callbacks) = {
 #ifndef BT_AUTO_CONNECT
 struct bt_conn_le_create_param *conn_params = BT_CONN_LE_CREATE_PARAM(BT_CONN_LE_OPT_CODED | BT_CONN_LE_OPT_NO_1M,BT_GAP_SCAN_FAST_INTERVAL,BT_GAP_SCAN_FAST_INTERVAL);
 
-static int ble_connect(void);
+static int ble_connect(uint8_t cam);
 #endif
 
 #define MY_STACK_SIZE 2048
@@ -193,6 +231,13 @@ int gopro_bt_start(void){
 	k_work_queue_init(&my_work_q);
 	k_work_queue_start(&my_work_q, my_stack_area, K_THREAD_STACK_SIZEOF(my_stack_area), MY_PRIORITY, NULL);
 
+	for(uint8_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		gopro_client[cam].cam = cam;
+		k_work_init(&discovery_start_work[cam], discovery_start_work_handler);
+		k_work_init(&discovery_finish_work[cam], discovery_finish_work_handler);
+		k_work_init_delayable(&bringup_work[cam], bringup_work_handler);
+	}
+
 	err = bt_conn_auth_cb_register(&conn_auth_callbacks);
 	if (err) {
 		LOG_ERR("Failed to register authorization callbacks.");
@@ -255,126 +300,273 @@ int gopro_bt_start(void){
 }
 
 static void discovery_start_work_handler(struct k_work *work){
-    int err;
-    char uuid_str[50];
-	static uint8_t uuid_index = 0;
+	uint8_t cam = work - discovery_start_work;
+	struct bt_gopro_client *gp_client = &gopro_client[cam];
+	int err;
+
+	if(gp_client->conn == NULL){
+		return;
+	}
 
-	if(uuid_index >= (sizeof(uuid_list)/sizeof(uuid_list[0]))){
-		LOG_DBG("List end, stop discovery");
-		k_work_submit_to_queue	(&my_work_q,&discovery_finish_work);
+	atomic_clear_bit(&gp_client->state,GP_FLAG_GATT_CACHED);
+
+	#ifdef CONFIG_GOPRO_GATT_CACHE
+	if(gopro_gatt_cache_load(gp_client, bt_conn_get_dst(gp_client->conn)) == 0){
+		atomic_set_bit(&gp_client->state,GP_FLAG_GATT_CACHED);
+		#ifdef CONFIG_GOPRO_READY_TRACE
+		gopro_ready_mark(cam, GP_READY_DISCOVERY);
+		#endif
+		k_work_submit_to_queue(&my_work_q,&discovery_finish_work[cam]);
 		return;
 	}
+	#endif
 
-	bt_uuid_to_str(uuid_list[uuid_index], uuid_str, 50);
-	LOG_DBG("Start discovery UUID [%d] %s",uuid_index,uuid_str);
+	LOG_DBG("Start GATT discovery, camera %d",cam);
 
-	err = bt_gatt_dm_start(default_conn, uuid_list[uuid_index], &discovery_cb, &gopro_client);
+	err = bt_gopro_discover(gp_client, gp_client->conn, discovery_complete);
 	if (err) {
 		LOG_ERR("could not start the discovery procedure, error code: %d", err);
 	}
-	uuid_index++;
 }
 
-static void discovery_complete(struct bt_gatt_dm *dm, void *context){
-	struct bt_gopro_client *nus = context;
+static void discovery_complete(struct bt_gopro_client *gp_client, int err){
 
-	LOG_INF("Service discovery complete");
+	if(err){
+		LOG_ERR("GATT discovery failed: %d", err);
+		bt_conn_disconnect(gp_client->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		return;
+	}
 
-	#if LOG_LVL == LOG_LEVEL_DBG
-	bt_gatt_dm_data_print(dm);
+	LOG_INF("Service discovery complete, camera %d",gp_client->cam);
+	#ifdef CONFIG_GOPRO_READY_TRACE
+	gopro_ready_mark(gp_client->cam, GP_READY_DISCOVERY);
 	#endif
+	k_work_submit_to_queue(&my_work_q,&discovery_finish_work[gp_client->cam]);
+}
+
+#ifdef CONFIG_GOPRO_GATT_CACHE
+/* Кэш проверяется по прошивке из HW info, новые handle сохраняются только после ответа камеры */
+static int discovery_cache_check(struct bt_gopro_client *gp_client, bool hw_info_ok){
+	const bt_addr_le_t *addr = bt_conn_get_dst(gp_client->conn);
+	const char *firmware_version = gopro_state[gp_client->cam].firmware_version;
 
-	handles_assign(dm, nus);
-	bt_gatt_dm_data_release(dm);
-	k_work_submit(&discovery_start_work);
+	if(!atomic_test_bit(&gp_client->state,GP_FLAG_GATT_CACHED)){
+		if(hw_info_ok){
+			gopro_gatt_cache_store(gp_client, addr, firmware_version);
+		}
+		return 0;
+	}
+
+	if(hw_info_ok && gopro_gatt_cache_fw_match(addr, firmware_version)){
+		LOG_DBG("GATT cache valid");
+		return 0;
+	}
+
+	LOG_WRN("GATT cache stale (fw %s), rediscover",firmware_version);
+	atomic_clear_bit(&gp_client->state,GP_FLAG_GATT_CACHED);
+	gopro_gatt_cache_invalidate(addr);
+	bt_conn_disconnect(gp_client->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+
+	return -ESTALE;
 }
+#endif
 
-static void discovery_finish_work_handler(struct k_work *work){
+static void bringup_send(uint8_t cam, const struct gopro_cmd_t *cmd){
+	struct gopro_cmd_t gopro_cmd = *cmd;
 	int err;
 
-	LOG_DBG("Read WIFI SSID chars");
-	bt_gopro_client_get(&gopro_client,GP_WIFI_HANDLE_SSID);
-	k_sem_take(&ble_read_sem,K_FOREVER);
-
-	LOG_DBG("Read WIFI PASS chars");
-	bt_gopro_client_get(&gopro_client,GP_WIFI_HANDLE_PASS);
-	k_sem_take(&ble_read_sem,K_FOREVER);
+	//Напрямую в очередь записи: validator и поток zbus тут не нужны
+	gopro_cmd.cam = cam;
+	err = gopro_writer_put(&gopro_cmd, K_NO_WAIT);
+	if(err != 0){
+		LOG_ERR("Camera %d startup write failed: %d",cam,err);
+	}
+}
 
-	LOG_DBG("Start subscribe");
-	gopro_set_subscribe(&gopro_client, GP_CNTRL_HANDLE_CMD);
-	gopro_set_subscribe(&gopro_client, GP_CNTRL_HANDLE_SETTINGS);
-	gopro_set_subscribe(&gopro_client, GP_CNTRL_HANDLE_QUERY);
-	gopro_set_subscribe(&gopro_client, GP_CNTRL_HANDLE_NET);
+/* Повтор того, на что камера еще не ответила: сразу после соединения она может молчать */
+static void bringup_resend(uint8_t cam, uint32_t pending){
+	k_spinlock_key_t key;
 
-	LOG_DBG("Set connected mode");
-	gopro_led_mode_set(LED_NUM_BT,LED_MODE_ON);
-	gopro_client_set_sate(GP_STATE_CONNECTED);
+	key = k_spin_lock(&bringup_lock);
+	bringup[cam].sent_ms = k_uptime_get_32();
+	bringup[cam].tries++;
+	k_spin_unlock(&bringup_lock, key);
 
-	for(uint32_t i=0; i<GET_HW_POLL_COUNT; i++){
+	if(pending & BIT(GP_BRINGUP_HW_INFO)){
 		LOG_DBG("Poll HW Info");
-		
-		err = zbus_chan_pub(&gopro_cmd_chan, &gopro_get_hw_info,K_NO_WAIT);
-		if(err != 0){
-			LOG_ERR("Chan pub failed: %d",err);
-		}
+		bringup_send(cam, &gopro_get_hw_info);
+	}
 
-		err = k_sem_take(&get_hw_sem,K_MSEC(1000));
-		if(err == 0){
-			LOG_DBG("Get Status OK, start sending data");
-			break;
-		}
+	if(pending & BIT(GP_BRINGUP_REG_STATUS)){
+		bringup_send(cam, &gopro_query_register);
+	}
+}
+
+static void bringup_finish(uint8_t cam, bool hw_info_ok){
+	struct bt_gopro_client *gp_client = &gopro_client[cam];
 
+	LOG_INF("Camera %d bring-up done",cam);
+
+	#ifdef CONFIG_GOPRO_GATT_CACHE
+	if(discovery_cache_check(gp_client, hw_info_ok) != 0){
+		return;
 	}
+	#else
+	ARG_UNUSED(hw_info_ok);
+	#endif
 
-	if(atomic_test_bit(&gopro_client.state,GP_FLAG_JUST_PAIRED)){
+	if(atomic_test_bit(&gp_client->state,GP_FLAG_JUST_PAIRED)){
 		LOG_DBG("Just paired, send RequestPairingFinish");
-		atomic_clear_bit(&gopro_client.state,GP_FLAG_JUST_PAIRED);
-		gopro_finish_pairing();
+		atomic_clear_bit(&gp_client->state,GP_FLAG_JUST_PAIRED);
+		gopro_finish_pairing(cam);
 	}
 
-	LOG_DBG("Push subscribe to TX chan");
-	for(uint32_t i=0; i < sizeof(startup_query_list)/sizeof(startup_query_list[0]); i++){
-		//LOG_HEXDUMP_DBG(startup_query_list[i]->data,startup_query_list[i]->len,"Push to TX chan:");
-		err = zbus_chan_pub(&gopro_cmd_chan, startup_query_list[i], K_MSEC(100));
-		if(err != 0){
-			LOG_ERR("Chan pub failed: %d",err);
-		}
+	atomic_clear_bit(&gp_client->state,GP_FLAG_FORCE_CONNECT);
+
+	#ifdef CONFIG_GOPRO_TIME_SYNC
+	if(cam == GOPRO_CAM_MAIN){
+		gopro_time_sync_request();
 	}
+	#endif
+
+	#ifdef CONFIG_GOPRO_POLL
+	gopro_poll_connected(cam);
+	#endif
+
+	#ifdef CONFIG_GOPRO_PRESET_CACHE
+	gopro_preset_connected(cam);
+	#endif
 
-	atomic_clear_bit(&gopro_client.state,GP_FLAG_FORCE_CONNECT);
+	//Свободные слоты: искать остальные камеры
+	if(gopro_client_connected_count() < CONFIG_GOPRO_CAM_MAX){
+		k_work_schedule(&scan_work, K_MSEC(50));
+	}
 }
 
-static void discovery_service_not_found(struct bt_conn *conn, void *context){
-	LOG_WRN("Service not found");
-	k_work_submit(&discovery_start_work);
+/*
+CCC, HW info и регистрация статусов уходят подряд, ATT выполняет их по порядку.
+SSID и пароль читаются только по запросу: gopro_client_wifi_get.
+Шаг подъема - по событию из callback или по таймеру повтора.
+*/
+static void discovery_finish_work_handler(struct k_work *work){
+	uint8_t cam = work - discovery_finish_work;
+	struct bt_gopro_client *gp_client = &gopro_client[cam];
+	k_spinlock_key_t key;
+
+	if(gp_client->conn == NULL){
+		return;
+	}
+
+	key = k_spin_lock(&bringup_lock);
+	bringup[cam].pending = BIT_MASK(GP_BRINGUP_END);
+	bringup[cam].tries = 0;
+	k_spin_unlock(&bringup_lock, key);
+
+	LOG_DBG("Start subscribe");
+	for(uint32_t i=0; i<GP_CNTRL_HANDLE_END; i++){
+		if(gopro_set_subscribe(gp_client, i) != 0){
+			gopro_bringup_event(cam, GP_BRINGUP_SUB(i));
+		}
+	}
+
+	LOG_DBG("Set connected mode, camera %d",cam);
+	gopro_led_mode_set(LED_NUM_BT,LED_MODE_ON);
+	gopro_client_set_sate(cam, GP_STATE_CONNECTED);
+
+	bringup_resend(cam, BIT(GP_BRINGUP_HW_INFO));
+
+	LOG_DBG("Push startup queries");
+	for(uint32_t i=0; i < ARRAY_SIZE(startup_query_list); i++){
+		bringup_send(cam, startup_query_list[i]);
+	}
+
+	k_work_reschedule_for_queue(&my_work_q, &bringup_work[cam], K_MSEC(BRINGUP_RETRY_MS));
 }
 
-static void discovery_error(struct bt_conn *conn, int err,void *context){
-	LOG_WRN("Error while discovering GATT database: (%d)", err);
-	//k_work_submit(&discovery_start_work);
+static void bringup_work_handler(struct k_work *work){
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	uint8_t cam = dwork - bringup_work;
+	k_spinlock_key_t key;
+	uint32_t pending;
+	uint32_t elapsed;
+	uint8_t tries;
+
+	if(gopro_client[cam].conn == NULL){
+		return;
+	}
+
+	key = k_spin_lock(&bringup_lock);
+	pending = bringup[cam].pending;
+	elapsed = k_uptime_get_32() - bringup[cam].sent_ms;
+	tries = bringup[cam].tries;
+	if((pending != 0) && (elapsed >= BRINGUP_RETRY_MS) && (tries >= GET_HW_POLL_COUNT)){
+		bringup[cam].pending = 0;
+	}
+	k_spin_unlock(&bringup_lock, key);
+
+	if(pending == 0){
+		bringup_finish(cam, true);
+		return;
+	}
+
+	if(elapsed < BRINGUP_RETRY_MS){
+		k_work_reschedule_for_queue(&my_work_q, dwork, K_MSEC(BRINGUP_RETRY_MS - elapsed));
+		return;
+	}
+
+	if(tries >= GET_HW_POLL_COUNT){
+		LOG_WRN("Camera %d bring-up timeout, pending 0x%02X",cam,pending);
+		bringup_finish(cam, (pending & BIT(GP_BRINGUP_HW_INFO)) == 0);
+		return;
+	}
+
+	//Чтения и CCC завершает ATT (ответ, ошибка или разрыв), повторяются только запросы к камере
+	if(pending & (BIT(GP_BRINGUP_HW_INFO) | BIT(GP_BRINGUP_REG_STATUS))){
+		bringup_resend(cam, pending);
+	}
+
+	k_work_reschedule_for_queue(&my_work_q, dwork, K_MSEC(BRINGUP_RETRY_MS));
 }
 
-static int handles_assign(struct bt_gatt_dm *dm,  struct bt_gopro_client *nus_c){
-    char uuid_str[50];
-	const struct bt_gatt_dm_attr *gatt_service_attr = bt_gatt_dm_service_get(dm);
-	const struct bt_gatt_service_val *gatt_service = bt_gatt_dm_attr_service_val(gatt_service_attr);
-	int ret_val = -1;
+/* Из callback чтения, подписки и разбора ответов камеры */
+void gopro_bringup_event(uint8_t cam, enum gopro_bringup_event_t event){
+	k_spinlock_key_t key;
+	uint32_t pending;
 
-	if (bt_uuid_cmp(gatt_service->uuid, BT_UUID_GOPRO_SERVICE) == 0) {
-		LOG_DBG("Gopro main service");
-		ret_val=bt_gopro_handles_assign(dm, nus_c);
-	}else if(bt_uuid_cmp(gatt_service->uuid, BT_UUID_GOPRO_WIFI_SERVICE) == 0){
-		LOG_DBG("Gopro wifi service");
-		ret_val=bt_gopro_wifi_handles_assign(dm, nus_c);
-	}else if(bt_uuid_cmp(gatt_service->uuid, BT_UUID_GOPRO_NET_SERVICE) == 0){
-		LOG_DBG("Gopro net service");
-		ret_val=bt_gopro_net_handle_assign(dm, nus_c);
-	}else{
-		bt_uuid_to_str(gatt_service->uuid, uuid_str, 50);
-		LOG_WRN("No worker for UUID %s",uuid_str);
+	if((cam >= CONFIG_GOPRO_CAM_MAX) || (event >= GP_BRINGUP_END)){
+		return;
+	}
+
+	key = k_spin_lock(&bringup_lock);
+	if(!(bringup[cam].pending & BIT(event))){
+		k_spin_unlock(&bringup_lock, key);
+		return;
+	}
+	bringup[cam].pending &= ~BIT(event);
+	pending = bringup[cam].pending;
+	k_spin_unlock(&bringup_lock, key);
+
+	#ifdef CONFIG_GOPRO_READY_TRACE
+	switch (event)
+	{
+	case GP_BRINGUP_HW_INFO:
+		gopro_ready_mark(cam, GP_READY_HW_INFO);
+		break;
+
+	case GP_BRINGUP_REG_STATUS:
+		break;
+
+	default:
+		if(!(pending & (BIT_MASK(GP_CNTRL_HANDLE_END) << GP_BRINGUP_SUB_CMD))){
+			gopro_ready_mark(cam, GP_READY_SUBSCRIBE);
+		}
+		break;
 	}
+	#endif
 
-	return ret_val;
+	if(pending == 0){
+		k_work_reschedule_for_queue(&my_work_q, &bringup_work[cam], K_NO_WAIT);
+	}
 }
 
 static void auth_cancel(struct bt_conn *conn){
@@ -387,7 +579,13 @@ static void pairing_complete(struct bt_conn *conn, bool bonded){
 	char addr[BT_ADDR_LE_STR_LEN];
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 	LOG_INF("Pairing completed: %s, bonded: %d", addr, bonded);
-	atomic_set_bit(&gopro_client.state,GP_FLAG_JUST_PAIRED);
+
+	int cam = gopro_client_cam_by_conn(conn);
+	if(cam >= 0){
+		atomic_set_bit(&gopro_client[cam].state,GP_FLAG_JUST_PAIRED);
+		//Новое сопряжение бывает после сброса сетей на камере
+		gopro_client_wifi_invalidate(cam);
+	}
 }
 
 static void pairing_failed(struct bt_conn *conn, enum bt_security_err reason){
@@ -400,6 +598,8 @@ static void scan_work_handler(struct k_work *item){
 	ARG_UNUSED(item);
 	int err;
 	uint8_t filter_mode = 0;
+	int scan_type = BT_SCAN_TYPE_SCAN_ACTIVE;
+	struct bt_le_scan_param scan_param = *BT_LE_SCAN_PASSIVE;
 
 	err = bt_scan_stop();
 	if (err != 0 && err != -EALREADY) {
@@ -409,6 +609,14 @@ static void scan_work_handler(struct k_work *item){
 		LOG_INF("Scan stopped");
 	}
 
+	#ifdef CONFIG_GOPRO_ADV_CACHE
+	gopro_adv_cache_flush();
+	#endif
+
+	#ifdef CONFIG_GOPRO_ACCEPT_LIST
+	gopro_autoconn_list_clear();
+	#endif
+
 	bt_scan_filter_remove_all();
 	bt_foreach_bond(BT_ID_DEFAULT, try_add_address_filter, &filter_mode);
 
@@ -429,16 +637,61 @@ static void scan_work_handler(struct k_work *item){
 		return;
 	}
 
-	err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
+	#ifdef CONFIG_GOPRO_AUTO_CONNECT
+	//Связанные камеры подключает контроллер, хост просыпается только на connected
+	#ifdef CONFIG_GOPRO_LINK_POLICY
+	err = gopro_autoconn_start(conn_params, gopro_conn_policy_create_param());
+	#else
+	err = gopro_autoconn_start(conn_params, BT_LE_CONN_PARAM_DEFAULT);
+	#endif
+	if(err == 0){
+		led_idle_timer_start(1);
+		return;
+	}
+	#endif
+
+	#ifdef CONFIG_GOPRO_SCAN_POLICY
+	scan_type = gopro_scan_policy_get(&scan_param);
+	#endif
+
+	#ifdef CONFIG_GOPRO_ACCEPT_LIST
+	if(gopro_autoconn_listed() > 0){
+		scan_param.options |= BT_LE_SCAN_OPT_FILTER_ACCEPT_LIST;
+	}
+	#endif
+
+	bt_scan_params_set(&scan_param);
+
+	err = bt_scan_start(scan_type);
 	if (err) {
 		LOG_ERR("Scanning failed to start (err %d)", err);
 		return;
 	}
 
+	#ifdef CONFIG_GOPRO_ACCEPT_LIST
+	gopro_autoconn_attempt(GP_CONN_PATH_SCAN);
+	#endif
+
 	led_idle_timer_start(1);
 	LOG_INF("Scan started");
 }
 
+/* Перезапуск с новыми параметрами, если сейчас идет сканирование, а не подключение */
+void gopro_bt_scan_restart(void){
+
+	for(uint8_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		if((gopro_client[cam].conn != NULL) && (gopro_client_get_state(cam) != GP_STATE_CONNECTED)){
+			return;
+		}
+	}
+
+	if(gopro_client_connected_count() >= CONFIG_GOPRO_CAM_MAX){
+		return;
+	}
+
+	k_work_schedule(&scan_work, K_NO_WAIT);
+}
+
 static void try_add_address_filter(const struct bt_bond_info *info, void *user_data){
 	int err;
 	char addr[BT_ADDR_LE_STR_LEN];
@@ -463,6 +716,10 @@ static void try_add_address_filter(const struct bt_bond_info *info, void *user_d
 
 	LOG_INF("Address filter added: %s", addr);
 	*filter_mode |= BT_SCAN_ADDR_FILTER;
+
+	#ifdef CONFIG_GOPRO_ACCEPT_LIST
+	gopro_autoconn_list_add(&info->addr);
+	#endif
 }
 
 static void scan_filter_no_match(struct bt_scan_device_info *device_info, bool connectable){
@@ -470,6 +727,50 @@ static void scan_filter_no_match(struct bt_scan_device_info *device_info, bool c
 	// bt_addr_le_to_str(device_info->recv_info->addr, addr,  sizeof(addr));
 }
 
+static bool scan_slot_free(void){
+
+	for(uint8_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		if(gopro_client[cam].conn == NULL){
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool eir_status_found(struct bt_data *data, void *user_data){
+	int *status = user_data;
+
+	if((data->type == 255) && (data->data_len == 14)){
+		*status = data->data[3];
+		return false;
+	}
+
+	return true;
+}
+
+/* Камера без слота: занять слот, если она включена или в режиме сопряжения */
+static int scan_slot_claim(struct bt_scan_device_info *device_info){
+	struct net_buf_simple_state adv_state;
+	int status = -1;
+	int cam;
+
+	net_buf_simple_save(device_info->adv_data, &adv_state);
+	bt_data_parse(device_info->adv_data, eir_status_found, &status);
+	net_buf_simple_restore(device_info->adv_data, &adv_state);
+
+	if((status != 1) && (status != 5)){
+		return -ENOENT;
+	}
+
+	cam = gopro_client_cam_get(device_info->recv_info->addr);
+	if(cam < 0){
+		LOG_DBG("No free camera slot");
+	}
+
+	return cam;
+}
+
 static void scan_filter_match(struct bt_scan_device_info *device_info,struct bt_scan_filter_match *filter_match, bool connectable){
 	char addr[BT_ADDR_LE_STR_LEN];
 
@@ -483,24 +784,78 @@ static void scan_filter_match(struct bt_scan_device_info *device_info,struct bt_
 		bt_addr_le_copy(&last_addr,device_info->recv_info->addr);
 	}
 
-	gopro_client_set_device_addr((bt_addr_le_t *)device_info->recv_info->addr);
+	int cam = gopro_client_cam_find(device_info->recv_info->addr);
+
+	if((cam >= 0) && (gopro_client[cam].conn != NULL)){
+		return;
+	}
+
+	#ifdef CONFIG_GOPRO_SCAN_POLICY
+	gopro_scan_policy_seen();
+	#endif
+
+	#ifdef CONFIG_GOPRO_ADV_CACHE
+	//Разбор зависит от данных рекламы, состояния слота и флага принудительного подключения
+	uint8_t adv_state;
+
+	if(cam >= 0){
+		adv_state = gopro_client_get_state(cam);
+		if(atomic_test_bit(&gopro_client[cam].state,GP_FLAG_FORCE_CONNECT)){
+			adv_state |= BIT(7);
+		}
+	}else{
+		adv_state = scan_slot_free() ? BIT(6) : 0;
+	}
+
+	enum gopro_adv_pdu_t adv_pdu = gopro_adv_cache_pdu(device_info->recv_info->adv_type, device_info->recv_info->adv_props);
+
+	if(gopro_adv_cache_hit(device_info->recv_info->addr, adv_pdu, device_info->adv_data, adv_state)){
+		return;
+	}
+	#endif
+
+	//Новой камере слот дается, только когда она ждет подключения
+	if(cam < 0){
+		cam = scan_slot_claim(device_info);
+		if(cam < 0){
+			return;
+		}
+	}
+
+	#ifdef CONFIG_GOPRO_READY_TRACE
+	gopro_ready_mark(cam, GP_READY_MATCH);
+	#endif
+
 	led_idle_timer_start(1);
-	bt_data_parse(device_info->adv_data,eir_found,(void *)device_info->recv_info->addr);
+	bt_data_parse(device_info->adv_data,eir_found,UINT_TO_POINTER(cam));
 }
 
 static void scan_connecting_error(struct bt_scan_device_info *device_info){
+	int cam = gopro_client_cam_find(device_info->recv_info->addr);
+
 	LOG_WRN("Scan Connecting failed");
-	atomic_clear_bit(&gopro_client.state,GP_FLAG_FORCE_CONNECT);
+	if(cam >= 0){
+		atomic_clear_bit(&gopro_client[cam].state,GP_FLAG_FORCE_CONNECT);
+	}
 }
 
 static void scan_connecting(struct bt_scan_device_info *device_info, struct bt_conn *conn){
+	int cam = gopro_client_cam_get(device_info->recv_info->addr);
+
 	LOG_DBG("Scan connecting");
-	default_conn = bt_conn_ref(conn);
+	if(cam >= 0){
+		gopro_client[cam].conn = bt_conn_ref(conn);
+	}
 }
 
 #ifndef BT_AUTO_CONNECT
-static int ble_connect(void){
+static int ble_connect(uint8_t cam){
 	int err;
+
+	if(gopro_client[cam].conn != NULL){
+		return -EALREADY;
+	}
+
 	err = bt_scan_stop();
 
 	if (err != 0 && err != -EALREADY) {
@@ -508,33 +863,54 @@ static int ble_connect(void){
 		return err;
 	}
 
-	err = bt_conn_le_create(gopro_client_get_device_addr(), conn_params,BT_LE_CONN_PARAM_DEFAULT,&default_conn);
+	#ifdef CONFIG_GOPRO_LINK_POLICY
+	err = bt_conn_le_create(gopro_client_get_device_addr(cam), conn_params,gopro_conn_policy_create_param(),&gopro_client[cam].conn);
+	#else
+	err = bt_conn_le_create(gopro_client_get_device_addr(cam), conn_params,BT_LE_CONN_PARAM_DEFAULT,&gopro_client[cam].conn);
+	#endif
 
 	if(err != 0){
 		LOG_ERR("Conn failed, err: %d",err);
+
+		#ifdef CONFIG_GOPRO_ADV_CACHE
+		gopro_adv_cache_invalidate(gopro_client_get_device_addr(cam));
+		#endif
+	}
+	#ifdef CONFIG_GOPRO_READY_TRACE
+	else{
+		gopro_ready_mark(cam, GP_READY_CREATE);
 	}
+	#endif
 
 	return err;
 }
 #endif
 
+/* Индикатор BT показывает поиск, только пока нет ни одной подключенной камеры */
+static void eir_led_mode_set(enum led_mode_t mode){
+	if(gopro_client_connected_count() == 0){
+		gopro_led_mode_set(LED_NUM_BT,mode);
+	}
+}
+
 static bool eir_found(struct bt_data *data, void *user_data){
+	uint8_t cam = POINTER_TO_UINT(user_data);
 
 	LOG_DBG("Eir found");
 
 	if(data->type == 9){
-		gopro_client_setname((char *)data->data,data->data_len);
+		gopro_client_setname(cam,(char *)data->data,data->data_len);
 	}else if((data->type == 255) && (data->data_len == 14) ){
 		
 		switch (data->data[3])
 		{
 		case 0:
-			gopro_led_mode_set(LED_NUM_BT,LED_MODE_BLINK_1S);
-			gopro_client_set_sate(GP_STATE_OFFLINE);
+			eir_led_mode_set(LED_MODE_BLINK_1S);
+			gopro_client_set_sate(cam, GP_STATE_OFFLINE);
 			
-			if(atomic_test_bit(&gopro_client.state,GP_FLAG_FORCE_CONNECT)){
+			if(atomic_test_bit(&gopro_client[cam].state,GP_FLAG_FORCE_CONNECT)){
 				LOG_DBG("Camera OFFLINE, force connect");
-				ble_connect();	
+				ble_connect(cam);	
 			}else{
 				LOG_DBG("No force connect, skip");
 			}
@@ -542,23 +918,31 @@ static bool eir_found(struct bt_data *data, void *user_data){
 			break;
 		
 		case 1:
-			gopro_led_mode_set(LED_NUM_BT,LED_MODE_BLINK_300MS);
-			gopro_client_set_sate(GP_STATE_ONLINE);
+			eir_led_mode_set(LED_MODE_BLINK_300MS);
+			gopro_client_set_sate(cam, GP_STATE_ONLINE);
+
+			#ifdef CONFIG_GOPRO_SCAN_POLICY
+			gopro_scan_policy_online();
+			#endif
 		
 			#ifndef BT_AUTO_CONNECT
 			LOG_DBG("Camera ON, connecting");
-			ble_connect();
+			ble_connect(cam);
 			#endif
 			
 			break;
 
 		case 5:
-			gopro_led_mode_set(LED_NUM_BT,LED_MODE_BLINK_100MS);
-			gopro_client_set_sate(GP_STATE_PAIRING);
+			eir_led_mode_set(LED_MODE_BLINK_100MS);
+			gopro_client_set_sate(cam, GP_STATE_PAIRING);
+
+			#ifdef CONFIG_GOPRO_SCAN_POLICY
+			gopro_scan_policy_online();
+			#endif
 			LOG_DBG("Camera Pairing");
 
 			#ifndef BT_AUTO_CONNECT
-			ble_connect();
+			ble_connect(cam);
 			#endif
 
 			break;
@@ -575,32 +959,92 @@ static bool eir_found(struct bt_data *data, void *user_data){
 	return true;
 };
 
+#ifdef CONFIG_GOPRO_AUTO_CONNECT
+/* Соединение от bt_conn_le_create_auto: слот по адресу, ошибка - повтор с паузой */
+static int autoconn_claim(struct bt_conn *conn, uint8_t conn_err){
+	uint32_t delay_ms;
+	int cam;
+
+	delay_ms = gopro_autoconn_result(GP_CONN_PATH_AUTO, conn_err);
+	if(conn_err){
+		k_work_reschedule(&scan_work, K_MSEC(delay_ms));
+		return -EIO;
+	}
+
+	cam = gopro_client_cam_get(bt_conn_get_dst(conn));
+	if((cam < 0) || (gopro_client[cam].conn != NULL)){
+		LOG_WRN("No free camera slot, disconnect");
+		bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		return -ENOMEM;
+	}
+
+	gopro_client[cam].conn = bt_conn_ref(conn);
+	gopro_client_set_sate(cam, GP_STATE_ONLINE);
+
+	return cam;
+}
+#endif
+
 static void connected(struct bt_conn *conn, uint8_t conn_err){
-	static struct bt_gatt_exchange_params exchange_params;
 	char addr[BT_ADDR_LE_STR_LEN];
 	int err;
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
+	int cam = gopro_client_cam_by_conn(conn);
+
+	#ifdef CONFIG_GOPRO_AUTO_CONNECT
+	if((cam < 0) && gopro_autoconn_pending()){
+		cam = autoconn_claim(conn, conn_err);
+		if(cam < 0){
+			return;
+		}
+	}else
+	#endif
+	#ifdef CONFIG_GOPRO_ACCEPT_LIST
+	if(cam >= 0){
+		gopro_autoconn_result(GP_CONN_PATH_SCAN, conn_err);
+	}
+	#endif
+
 	if (conn_err) {
 		LOG_INF("Failed to connect to %s, 0x%02x %s", addr, conn_err, bt_hci_err_to_str(conn_err));
 
-		if (default_conn == conn) {
-			bt_conn_unref(default_conn);
-			default_conn = NULL;
+		if (cam >= 0) {
+			#ifdef CONFIG_GOPRO_READY_TRACE
+			gopro_ready_abort(cam);
+			#endif
+
+			bt_conn_unref(gopro_client[cam].conn);
+			gopro_client[cam].conn = NULL;
 			k_work_schedule(&scan_work, K_MSEC(50));
 		}
 
 		return;
 	}
 
-	LOG_INF("Connected: %s", addr);
+	if(cam < 0){
+		LOG_WRN("Connected %s without camera slot",addr);
+		return;
+	}
+
+	LOG_INF("Connected: %s, camera %d", addr, cam);
+
+	#ifdef CONFIG_GOPRO_READY_TRACE
+	gopro_ready_mark(cam, GP_READY_CONNECTED);
+	#endif
+
+	#ifdef CONFIG_GOPRO_LINK_POLICY
+	gopro_conn_policy_connected(conn);
+	#endif
 	
 	led_idle_timer_start(0);
-	gopro_led_mode_set(LED_NUM_REC,LED_MODE_OFF);
+	if(!gopro_client_recording()){
+		gopro_led_mode_set(LED_NUM_REC,LED_MODE_OFF);
+	}
 
-	exchange_params.func = exchange_func;
-	err = bt_gatt_exchange_mtu(conn, &exchange_params);
+	gopro_client[cam].exchange_params.func = exchange_func;
+	err = bt_gatt_exchange_mtu(conn, &gopro_client[cam].exchange_params);
 	if (err) {
 		LOG_WRN("MTU exchange failed (err %d)", err);
 	}
@@ -627,16 +1071,45 @@ static void disconnected(struct bt_conn *conn, uint8_t reason){
 
 	LOG_INF("Disconnected: %s, reason 0x%02x %s", addr, reason, bt_hci_err_to_str(reason));
 
-	gopro_led_mode_set(LED_NUM_BT,LED_MODE_BLINK_5S);
-	gopro_led_mode_set(LED_NUM_REC,LED_MODE_OFF);
+	#ifdef CONFIG_GOPRO_LINK_POLICY
+	gopro_conn_policy_disconnected(conn);
+	#endif
+
+	int cam = gopro_client_cam_by_conn(conn);
 
-	if (default_conn != conn) {
-		LOG_WRN("Con != default connection");
+	if (cam < 0) {
+		LOG_WRN("Con is not a camera connection");
 		return;
 	}
 
-	bt_conn_unref(default_conn);
-	default_conn = NULL;
+	#ifdef CONFIG_GOPRO_READY_TRACE
+	gopro_ready_abort(cam);
+	#endif
+
+	k_work_cancel_delayable(&bringup_work[cam]);
+	#ifdef CONFIG_GOPRO_POLL
+	gopro_poll_disconnected(cam);
+	#endif
+	#ifdef CONFIG_GOPRO_PRESET_CACHE
+	gopro_preset_disconnected(cam);
+	#endif
+	gopro_writer_reset(cam);
+	gopro_client_set_sate(cam, GP_STATE_UNKNOWN);
+
+	bt_conn_unref(gopro_client[cam].conn);
+	gopro_client[cam].conn = NULL;
+
+	if(gopro_client_connected_count() == 0){
+		gopro_led_mode_set(LED_NUM_BT,LED_MODE_BLINK_5S);
+	}
+
+	if(!gopro_client_recording()){
+		gopro_led_mode_set(LED_NUM_REC,LED_MODE_OFF);
+	}
+
+	#ifdef CONFIG_GOPRO_SCAN_POLICY
+	gopro_scan_policy_disconnected();
+	#endif
 
 	k_work_schedule(&scan_work, K_MSEC(3000));
 }
@@ -648,6 +1121,11 @@ static void security_changed(struct bt_conn *conn, bt_security_t level,enum bt_s
 
 	if (!err) {
 		LOG_INF("Security changed: %s level %u", addr, level);
+
+		#ifdef CONFIG_GOPRO_READY_TRACE
+		gopro_ready_mark(gopro_client_cam_by_conn(conn), GP_READY_SECURITY);
+		#endif
+
 		gatt_discover(conn);
 
 	} else {
@@ -655,7 +1133,7 @@ static void security_changed(struct bt_conn *conn, bt_security_t level,enum bt_s
 			bt_security_err_to_str(err));
 	
 			if(err == BT_SECURITY_ERR_PIN_OR_KEY_MISSING){
-				gopro_client_set_sate(GP_STATE_NEED_PAIRING);
+				gopro_client_set_sate(gopro_client_cam_by_conn(conn), GP_STATE_NEED_PAIRING);
 				gopro_led_mode_set(LED_NUM_REC,LED_MODE_BLINK_300MS);
 			}
 	
@@ -672,14 +1150,15 @@ static void exchange_func(struct bt_conn *conn, uint8_t err, struct bt_gatt_exch
 }
 
 static void gatt_discover(struct bt_conn *conn){
+	int cam = gopro_client_cam_by_conn(conn);
 
-	if (conn != default_conn) {
+	if (cam < 0) {
 		LOG_WRN("Not valid conn");
 		return;
 	}
 
 	LOG_DBG("Start dicovery func");
-	k_work_submit(&discovery_start_work);
+	k_work_submit(&discovery_start_work[cam]);
 }
 
 static void gopro_cmd_subscriber_task(void *ptr1, void *ptr2, void *ptr3){
@@ -692,21 +1171,36 @@ static void gopro_cmd_subscriber_task(void *ptr1, void *ptr2, void *ptr3){
 
 	while (!zbus_sub_wait_msg(&gopro_cmd_subscriber, &chan, &gopro_cmd, K_FOREVER)) {
 		if (&gopro_cmd_chan == chan) {
+				#ifdef CONFIG_GOPRO_LATENCY_TRACE
+				gopro_latency_dequeue(&gopro_cmd);
+				#endif
+
 				LOG_HEXDUMP_DBG(gopro_cmd.data, gopro_cmd.len,"CMD Data to send:");
 
 				if(gopro_ctrl_parse(&gopro_cmd) == 1){ //Control packet, skip sending to ble
 					continue;
 				}
-				
-				err = bt_gopro_client_send(&gopro_client, &gopro_cmd);
 
-				if (err) {
-					LOG_WRN("Failed to send data over BLE connection (err %d)", err);
+				#ifdef CONFIG_GOPRO_QUERY_BATCH
+				if(gopro_batch_put(&gopro_cmd) == 0){ //Уйдет общим запросом планировщика
+					continue;
 				}
+				#endif
+
+				#ifdef CONFIG_GOPRO_GROUP_SHUTTER
+				if(gopro_cmd.cam == GOPRO_CAM_ALL){
+					err = gopro_group_send(&gopro_cmd);
+					if (err) {
+						LOG_WRN("Failed to queue group command (err %d)", err);
+					}
+					continue;
+				}
+				#endif
 
-				err = k_sem_take(&ble_write_sem, BLE_WRITE_TIMEOUT);
+				//Не ждет: заполненная очередь одной характеристики не должна задерживать остальные
+				err = gopro_writer_put(&gopro_cmd, K_NO_WAIT);
 				if (err) {
-					LOG_WRN("Data send timeout");
+					LOG_WRN("Failed to queue data for BLE connection (err %d)", err);
 				}
 			}
 	}
@@ -719,8 +1213,16 @@ bool gopro_cmd_validator(const void* msg, size_t msg_size) {
 		return 1;
 	}
 
-	if(gopro_client_get_state() != GP_STATE_CONNECTED){
-		LOG_ERR("Not connected state");
+	#ifdef CONFIG_GOPRO_GROUP_SHUTTER
+	if(gopro_cmd->cam == GOPRO_CAM_ALL){
+		if(gopro_client_connected_count() == 0){
+			LOG_ERR("No connected cameras");
+			return 0;
+		}
+	}else
+	#endif
+	if(gopro_client_get_state(gopro_cmd->cam) != GP_STATE_CONNECTED){
+		LOG_ERR("Camera %d not connected",gopro_cmd->cam);
 		return 0;
 	}
 
@@ -21,10 +21,25 @@
 
 //#define DISCOVERY_TIMEOUT   K_MSEC(5000)
 #define DISCOVERY_TIMEOUT   K_FOREVER
-#define BLE_WRITE_TIMEOUT	K_MSEC(1200)
 #define GET_HW_POLL_COUNT   20
+#define BRINGUP_RETRY_MS    1000		//Повтор HW info и регистрации статусов
+
+/* События подъема камеры после discovery, каждое ждется один раз */
+enum gopro_bringup_event_t{
+	GP_BRINGUP_SUB_CMD,
+	GP_BRINGUP_SUB_SETTINGS,
+	GP_BRINGUP_SUB_QUERY,
+	GP_BRINGUP_SUB_NET,
+	GP_BRINGUP_HW_INFO,
+	GP_BRINGUP_REG_STATUS,
+	GP_BRINGUP_END
+};
+
+#define GP_BRINGUP_SUB(handle)	(GP_BRINGUP_SUB_CMD + (handle))
 
 int gopro_bt_start(void);
+void gopro_bt_scan_restart(void);
 void gopro_start_discovery(struct bt_conn *conn, struct bt_gopro_client *gopro_client);
+void gopro_bringup_event(uint8_t cam, enum gopro_bringup_event_t event);
 
 #endif
\ No newline at end of file
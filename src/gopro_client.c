@@ -13,13 +13,22 @@
 #include <gopro_packet.h>
 #include <gopro_protobuf.h>
 #include <leds.h>
+#include <gopro_writer.h>
+#include <gopro_ble_discovery.h>
+#ifdef CONFIG_GOPRO_LATENCY_TRACE
+#include <gopro_latency.h>
+#endif
+#ifdef CONFIG_GOPRO_GATT_CACHE
+#include <gopro_gatt_cache.h>
+#endif
+#ifdef CONFIG_GOPRO_GROUP_SHUTTER
+#include <gopro_group.h>
+#endif
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(gopro_c, CONFIG_BLE_LOG_LVL);
 
-K_SEM_DEFINE(ble_write_sem, 0, 1);
-
-extern struct bt_gopro_client gopro_client;
+extern struct bt_gopro_client gopro_client[CONFIG_GOPRO_CAM_MAX];
 
 static uint8_t on_read_default(struct bt_conn *conn, uint8_t err, struct bt_gatt_read_params *params, const void *data, uint16_t length);
 static uint8_t on_read_ssid(struct bt_conn *conn, uint8_t err, struct bt_gatt_read_params *params, const void *data, uint16_t length);
@@ -27,44 +36,164 @@ static uint8_t on_read_pass(struct bt_conn *conn, uint8_t err, struct bt_gatt_re
 
 uint8_t (*read_func[GP_WIFI_HANDLE_END])(struct bt_conn *conn, uint8_t err, struct bt_gatt_read_params *params, const void *data, uint16_t length) = {on_read_ssid,on_read_pass,on_read_default,on_read_default};
 
-struct gopro_state_t gopro_state;
+struct gopro_state_t gopro_state[CONFIG_GOPRO_CAM_MAX];
+struct gopro_client_stat_t gopro_client_stat;
 
-K_SEM_DEFINE(ble_read_sem, 0, 1);
+/* SSID и пароль в gopro_state читаются по запросу и живут между соединениями */
+enum gopro_wifi_cache_flag_t{
+	GP_WIFI_SSID_VALID,
+	GP_WIFI_PASS_VALID,
+	GP_WIFI_SSID_READING,
+	GP_WIFI_PASS_READING,
+};
 
-int gopro_client_set_device_addr(bt_addr_le_t* addr){
+struct gopro_wifi_cache_t{
+	bt_addr_le_t addr;		//Камера, чьи данные лежат в слоте
+	atomic_t flags;
+};
 
-	gopro_state.addr = *addr;
-	return 0;
+static struct gopro_wifi_cache_t wifi_cache[CONFIG_GOPRO_CAM_MAX];
+
+/* Слот уже известной камеры, новый не занимается */
+int gopro_client_cam_find(const bt_addr_le_t *addr){
+
+	for(uint8_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		if(bt_addr_le_cmp(&gopro_state[cam].addr, addr) == 0){
+			return cam;
+		}
+	}
+
+	return -ENOENT;
 }
 
-bt_addr_le_t* gopro_client_get_device_addr(void){
+/*
+Слот камеры по адресу: своя запись, затем пустой слот, затем любой без соединения.
+Вызывается только перед подключением, чужой слот очищается полностью.
+*/
+int gopro_client_cam_get(const bt_addr_le_t *addr){
+	int empty_cam = -1;
+	int free_cam = -1;
+
+	for(uint8_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		if(bt_addr_le_cmp(&gopro_state[cam].addr, addr) == 0){
+			return cam;
+		}
+
+		if(gopro_client[cam].conn != NULL){
+			continue;
+		}
+
+		if((empty_cam < 0) && (bt_addr_le_cmp(&gopro_state[cam].addr, BT_ADDR_LE_ANY) == 0)){
+			empty_cam = cam;
+		}
 
-	bt_addr_le_t *addr = &gopro_state.addr;
+		if(free_cam < 0){
+			free_cam = cam;
+		}
+	}
+
+	if(empty_cam >= 0){
+		free_cam = empty_cam;
+	}
+
+	if(free_cam < 0){
+		return -ENOMEM;
+	}
+
+	memset(&gopro_state[free_cam], 0, sizeof(gopro_state[free_cam]));
+	bt_addr_le_copy(&gopro_state[free_cam].addr, addr);
+
+	//Данные Wi-Fi прежней камеры слота не отдавать
+	atomic_clear(&wifi_cache[free_cam].flags);
+	bt_addr_le_copy(&wifi_cache[free_cam].addr, addr);
+
+	return free_cam;
+}
+
+int gopro_client_cam_by_conn(const struct bt_conn *conn){
+
+	for(uint8_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		if((conn != NULL) && (gopro_client[cam].conn == conn)){
+			return cam;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static struct bt_gopro_client *gopro_client_by_conn(const struct bt_conn *conn){
+	int cam = gopro_client_cam_by_conn(conn);
+
+	return (cam < 0) ? NULL : &gopro_client[cam];
+}
+
+uint8_t gopro_client_connected_count(void){
+	uint8_t count = 0;
+
+	for(uint8_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		if(gopro_state[cam].state == GP_STATE_CONNECTED){
+			count++;
+		}
+	}
+
+	return count;
+}
+
+bool gopro_client_recording(void){
+
+	for(uint8_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		if((gopro_state[cam].state == GP_STATE_CONNECTED) && (gopro_state[cam].record > 0)){
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bt_addr_le_t* gopro_client_get_device_addr(uint8_t cam){
+
+	bt_addr_le_t *addr = &gopro_state[cam].addr;
 	
 	return addr;
 }
 
-int gopro_client_set_sate(enum gopro_state_list_t  state){
+int gopro_client_set_sate(uint8_t cam, enum gopro_state_list_t  state){
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return -EINVAL;
+	}
 
 	if(state >= GP_STATE_END){
 		LOG_ERR("Invalid state num %d of %d", state, GP_STATE_END-1);
 		return -1;
 	}
 
-	if(gopro_state.state != state){
-		gopro_state.state = state;
-		LOG_DBG("Set GoPro state: %d", gopro_state.state);
+	if(gopro_state[cam].state != state){
+		gopro_state[cam].state = state;
+		LOG_DBG("Set GoPro %d state: %d", cam, gopro_state[cam].state);
 		//gopro_client_update_state();
 	}
 
 	return 0;
 }
 
-enum gopro_state_list_t gopro_client_get_state(void){
-	return gopro_state.state;
+enum gopro_state_list_t gopro_client_get_state(uint8_t cam){
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return GP_STATE_UNKNOWN;
+	}
+
+	return gopro_state[cam].state;
 }
 
-int gopro_client_setname(char *name, uint8_t len){
+int gopro_client_setname(uint8_t cam, char *name, uint8_t len){
+	struct gopro_state_t *state;
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return -EINVAL;
+	}
+
+	state = &gopro_state[cam];
 
 	if(len >= GOPRO_NAME_LEN){
 		LOG_ERR("GoPro name out of bound %d of %d",len,GOPRO_NAME_LEN-1);
@@ -72,17 +201,17 @@ int gopro_client_setname(char *name, uint8_t len){
 	}
 
 	if( (len > 0) && (name != NULL) ){
-		if(strncmp(gopro_state.name,name,len) == 0){
+		if(strncmp(state->name,name,len) == 0){
 			//LOG_DBG("GoPro name already set");
 			return 0;
 		}
 
-		memcpy(gopro_state.name,name,len);
-		gopro_state.name[len]=0;
+		memcpy(state->name,name,len);
+		state->name[len]=0;
 
-		LOG_DBG("Set GoPro name: %s", gopro_state.name);
+		LOG_DBG("Set GoPro %d name: %s", cam, state->name);
 	}else{
-		memset(gopro_state.name,0,GOPRO_NAME_LEN);
+		memset(state->name,0,GOPRO_NAME_LEN);
 	}
 	
 	//gopro_client_update_state();
@@ -96,28 +225,34 @@ int gopro_client_setname(char *name, uint8_t len){
 
 static uint8_t on_notify_received(struct bt_conn *conn, struct bt_gatt_subscribe_params *params, const void *data, uint16_t length)
 {
-	struct gopro_cmd_t gopro_cmd;
+	struct gopro_cmd_t gopro_cmd = {0};
+	struct bt_gopro_client *gp_client = gopro_client_by_conn(conn);
 	uint8_t *pdata = (uint8_t *)data;
 
+	if(gp_client == NULL){
+		LOG_ERR("Notification from unknown connection");
+		return BT_GATT_ITER_STOP;
+	}
+
 	if (!data) {
 		LOG_DBG("[UNSUBSCRIBED]");
 
-		if(params->value_handle == gopro_client.notif_params[GP_CNTRL_HANDLE_SETTINGS].value_handle){
+		if(params->value_handle == gp_client->notif_params[GP_CNTRL_HANDLE_SETTINGS].value_handle){
 			LOG_DBG("Setting notify");
 			params->value_handle = 0;
-			atomic_clear_bit(&gopro_client.state, GP_FLAG_SETTINGS_NOTIF_ENABLED);
-		}else if (params->value_handle == gopro_client.notif_params[GP_CNTRL_HANDLE_CMD].value_handle){
+			atomic_clear_bit(&gp_client->state, GP_FLAG_SETTINGS_NOTIF_ENABLED);
+		}else if (params->value_handle == gp_client->notif_params[GP_CNTRL_HANDLE_CMD].value_handle){
 			LOG_DBG("CMD notify");
 			params->value_handle = 0;
-			atomic_clear_bit(&gopro_client.state, GP_FLAG_CMD_NOTIF_ENABLED);
-		}else if (params->value_handle == gopro_client.notif_params[GP_CNTRL_HANDLE_QUERY].value_handle){
+			atomic_clear_bit(&gp_client->state, GP_FLAG_CMD_NOTIF_ENABLED);
+		}else if (params->value_handle == gp_client->notif_params[GP_CNTRL_HANDLE_QUERY].value_handle){
 			LOG_DBG("Query notify");
 			params->value_handle = 0;
-			atomic_clear_bit(&gopro_client.state, GP_FLAG_QUERY_NOTIF_ENABLED);
-		}else if (params->value_handle == gopro_client.notif_params[GP_CNTRL_HANDLE_NET].value_handle){
+			atomic_clear_bit(&gp_client->state, GP_FLAG_QUERY_NOTIF_ENABLED);
+		}else if (params->value_handle == gp_client->notif_params[GP_CNTRL_HANDLE_NET].value_handle){
 			LOG_DBG("Net notify");
 			params->value_handle = 0;
-			atomic_clear_bit(&gopro_client.state, GP_FLAG_NET_NOTIF_ENABLED);
+			atomic_clear_bit(&gp_client->state, GP_FLAG_NET_NOTIF_ENABLED);
 		}else{
 			LOG_ERR("Recieve unknown handle 0x%0X",params->value_handle);
 			return BT_GATT_ITER_CONTINUE;
@@ -127,11 +262,13 @@ static uint8_t on_notify_received(struct bt_conn *conn, struct bt_gatt_subscribe
 	}
 
 	LOG_DBG("[NOTIFICATION] length %u handle 0x%0X", length, params->value_handle);
+	gopro_client_stat.notifications++;
 
 	gopro_cmd.cmd_type = 0xFF;
+	gopro_cmd.cam = gp_client->cam;
 	
 	for(uint32_t i=0; i<GP_CNTRL_HANDLE_END; i++){
-		if(params->value_handle == gopro_client.notif_params[i].value_handle){
+		if(params->value_handle == gp_client->notif_params[i].value_handle){
 			gopro_cmd.cmd_type = i;
 			break;	
 		}
@@ -142,6 +279,10 @@ static uint8_t on_notify_received(struct bt_conn *conn, struct bt_gatt_subscribe
 		return BT_GATT_ITER_CONTINUE;
 	}
 
+	#ifdef CONFIG_GOPRO_LATENCY_TRACE
+	gopro_latency_response(gp_client->cam, gopro_cmd.cmd_type, pdata, length);
+	#endif
+
 	if(length > GOPRO_CMD_DATA_LEN){
 		gopro_cmd.len = GOPRO_CMD_DATA_LEN;
 		LOG_WRN("Reply Len > Buf Len");
@@ -158,34 +299,86 @@ static uint8_t on_notify_received(struct bt_conn *conn, struct bt_gatt_subscribe
 	return BT_GATT_ITER_CONTINUE;
 }
 
+static const uint32_t write_pending_flag[GP_CNTRL_HANDLE_END] = {
+	[GP_CNTRL_HANDLE_CMD] = GP_FLAG_CMD_WRITE_PENDING,
+	[GP_CNTRL_HANDLE_SETTINGS] = GP_FLAG_SETTINGS_WRITE_PENDING,
+	[GP_CNTRL_HANDLE_QUERY] = GP_FLAG_QUERY_WRITE_PENDING,
+	[GP_CNTRL_HANDLE_NET] = GP_FLAG_NET_WRITE_PENDING,
+};
+
 static void on_sent_data(struct bt_conn *conn, uint8_t err, struct bt_gatt_write_params *params){
-	
-	if(params->handle == gopro_client.write_params[GP_CNTRL_HANDLE_SETTINGS].handle){
-		LOG_DBG("Setiings sent");
-		atomic_clear_bit(&gopro_client.state, GP_FLAG_SETTINGS_WRITE_PENDING);
-	}else if (params->handle == gopro_client.write_params[GP_CNTRL_HANDLE_CMD].handle){
-		LOG_DBG("CMD sent");
-		atomic_clear_bit(&gopro_client.state, GP_FLAG_CMD_WRITE_PENDING);
-	}else if (params->handle == gopro_client.write_params[GP_CNTRL_HANDLE_QUERY].handle){
-		LOG_DBG("Query sent");
-		atomic_clear_bit(&gopro_client.state, GP_FLAG_QUERY_WRITE_PENDING);
-	}else if (params->handle == gopro_client.write_params[GP_CNTRL_HANDLE_NET].handle){
-		LOG_DBG("Net sent");
-		atomic_clear_bit(&gopro_client.state, GP_FLAG_NET_WRITE_PENDING);
-	}else{
+	struct bt_gopro_client *gp_client;
+	uint32_t handle_index;
+
+	gp_client = gopro_client_by_conn(conn);
+	if(gp_client == NULL){
+		LOG_ERR("Write response from unknown connection");
+		return;
+	}
+
+	handle_index = params - gp_client->write_params;
+
+	if(handle_index >= GP_CNTRL_HANDLE_END){
 		LOG_ERR("Recieve unknown handle 0x%0X",params->handle);
 		return;
 	}
 
-	//atomic_clear_bit(&gopro_client.state, GP_FLAG_CMD_WRITE_PENDING);
-	k_sem_give(&ble_write_sem);
+	LOG_DBG("Handle %d sent",handle_index);
+	atomic_clear_bit(&gp_client->state, write_pending_flag[handle_index]);
+
+	#ifdef CONFIG_GOPRO_LATENCY_TRACE
+	gopro_latency_sent(gp_client->cam, handle_index, err);
+	#endif
+
+	#ifdef CONFIG_GOPRO_GROUP_SHUTTER
+	gopro_group_sent(gp_client->cam, handle_index, err);
+	#endif
+
+	gopro_writer_sent(gp_client->cam, handle_index);
 
 	if (err) {
+		gopro_client_stat.write_errors++;
 		LOG_WRN("ATT error code: 0x%02X", err);
+		bt_gopro_client_att_error(gp_client, err);
+	}else{
+		gopro_client_stat.writes++;
 	}
 
 }
 
+static void on_sent_cmd(struct bt_conn *conn, void *user_data){
+	int cam = gopro_client_cam_by_conn(conn);
+
+	gopro_client_stat.writes++;
+
+	if(cam >= 0){
+		gopro_writer_sent(cam, POINTER_TO_UINT(user_data));
+	}
+}
+
+/* Продолжение пакета можно отправить без ответа, если характеристика это разрешает */
+bool bt_gopro_client_unacked(const struct bt_gopro_client *gp_client, const struct gopro_cmd_t *gopro_cmd){
+
+	if(gopro_cmd->cmd_type >= GP_CNTRL_HANDLE_END){
+		return false;
+	}
+
+	if((gp_client->handles[gopro_cmd->cmd_type].write_props & BT_GATT_CHRC_WRITE_WITHOUT_RESP) == 0){
+		return false;
+	}
+
+	return (gopro_cmd->len > 0) && (gopro_cmd->data[0] & 0x80);
+}
+
+bool bt_gopro_client_write_busy(const struct bt_gopro_client *gp_client, uint32_t handle_index){
+
+	if(handle_index >= GP_CNTRL_HANDLE_END){
+		return true;
+	}
+
+	return atomic_test_bit(&gp_client->state, write_pending_flag[handle_index]);
+}
+
 int bt_gopro_client_send(struct bt_gopro_client *gp_client, struct gopro_cmd_t *gopro_cmd){
 	int err;
 	uint32_t flag_bit;
@@ -197,53 +390,60 @@ int bt_gopro_client_send(struct bt_gopro_client *gp_client, struct gopro_cmd_t *
 	}
 
 	if(gopro_cmd->cmd_type >= GP_CNTRL_HANDLE_END){
-		LOG_ERR("Unknown cmd type");
+		LOG_ERR("Invalid cmd type: %d",gopro_cmd->cmd_type);
 		return -ENOTSUP;
 	}
 
+	if(gopro_cmd->len > GOPRO_CMD_DATA_LEN){
+		return -EINVAL;
+	}
+
 	handle_index = gopro_cmd->cmd_type;
 
-	switch (handle_index)
-	{
-	case GP_CNTRL_HANDLE_CMD:
-		LOG_DBG("Send CMD");
-		flag_bit = GP_FLAG_CMD_WRITE_PENDING;
-		break;
-	case GP_CNTRL_HANDLE_SETTINGS:
-		LOG_DBG("Send SETTINGS");
-		flag_bit = GP_FLAG_SETTINGS_WRITE_PENDING;
-		break;
-	case GP_CNTRL_HANDLE_QUERY:
-		LOG_DBG("Send QUERY");
-		flag_bit = GP_FLAG_QUERY_WRITE_PENDING;
-		break;
-	case GP_CNTRL_HANDLE_NET:
-		LOG_DBG("Send NET");
-		flag_bit = GP_FLAG_NET_WRITE_PENDING;
-		break;
-	
-	default:
-		LOG_ERR("Invalid cmd type: %d",gopro_cmd->cmd_type);
-		return -ENOTSUP;
-		break;
+	//Данные копируются в буфер стека сразу, параметры записи не нужны
+	if(bt_gopro_client_unacked(gp_client, gopro_cmd)){
+		LOG_DBG("Send cmd handle: 0x%0X %d bytes",gp_client->handles[handle_index].write, gopro_cmd->len);
+
+		err = bt_gatt_write_without_response_cb(gp_client->conn, gp_client->handles[handle_index].write,
+							gopro_cmd->data, gopro_cmd->len, false, on_sent_cmd, UINT_TO_POINTER(handle_index));
+		if (err) {
+			gopro_client_stat.write_errors++;
+			LOG_ERR("Gatt write cmd failed: %d",err);
+		}
+
+		return err;
 	}
 
+	flag_bit = write_pending_flag[handle_index];
+
 	if (atomic_test_and_set_bit(&gp_client->state, flag_bit)) {
 		LOG_ERR("Flag already set");
 		return -EALREADY;
 	}
 
-	LOG_DBG("Send handle: 0x%0X %d bytes",gp_client->write_params[handle_index].handle, gopro_cmd->len);
+	LOG_DBG("Send handle: 0x%0X %d bytes",gp_client->handles[handle_index].write, gopro_cmd->len);
+
+	//Запрос ждет ответа после возврата, данные должны жить до on_sent_data
+	memcpy(gp_client->write_buf[handle_index], gopro_cmd->data, gopro_cmd->len);
 
 	gp_client->write_params[handle_index].handle = gp_client->handles[handle_index].write;
 	gp_client->write_params[handle_index].func = on_sent_data;
 	gp_client->write_params[handle_index].offset = 0;
-	gp_client->write_params[handle_index].data = gopro_cmd->data;
+	gp_client->write_params[handle_index].data = gp_client->write_buf[handle_index];
 	gp_client->write_params[handle_index].length = gopro_cmd->len;
 
+	#ifdef CONFIG_GOPRO_LATENCY_TRACE
+	gopro_latency_issue(gopro_cmd);
+	#endif
+
+	#ifdef CONFIG_GOPRO_GROUP_SHUTTER
+	gopro_group_issue(gopro_cmd);
+	#endif
+
 	err = bt_gatt_write(gp_client->conn, &gp_client->write_params[handle_index]);
 	if (err) {
 		atomic_clear_bit(&gp_client->state, flag_bit);
+		gopro_client_stat.write_errors++;
 		LOG_ERR("Gatt write failed: %d",err);
 	}
 
@@ -256,23 +456,26 @@ static uint8_t on_read_ssid(struct bt_conn *conn, uint8_t err, struct bt_gatt_re
 	/* Retrieve module context. */
 	nus_c = CONTAINER_OF(params, struct bt_gopro_client, read_wifi_params[GP_WIFI_HANDLE_SSID]);
 	
-	k_sem_give(&ble_read_sem);
+	atomic_clear_bit(&wifi_cache[nus_c->cam].flags, GP_WIFI_SSID_READING);
 
 	if (err) {
 		LOG_ERR("Read char error %d",err);
+		gopro_client_stat.read_errors++;
+		bt_gopro_client_att_error(nus_c, err);
 		return BT_GATT_ITER_STOP;
 	}
 
 	//LOG_DBG("Handle: %d SSID handle: %d",params->single.handle, nus_c->wifihandles[GP_WIFI_HANDLE_SSID]);
 
 	if(params->single.handle == nus_c->wifihandles[GP_WIFI_HANDLE_SSID]){
-		memset(gopro_state.wifi_ssid,0,sizeof(gopro_state.wifi_ssid));
+		memset(gopro_state[nus_c->cam].wifi_ssid,0,sizeof(gopro_state[nus_c->cam].wifi_ssid));
 		
-		uint8_t str_size = (length >= (sizeof(gopro_state.wifi_ssid)+1)) ? sizeof(gopro_state.wifi_ssid)-1 : length;
-		memcpy(gopro_state.wifi_ssid,data,str_size);
-		gopro_state.wifi_ssid[str_size]=0;
+		uint8_t str_size = (length >= (sizeof(gopro_state[nus_c->cam].wifi_ssid)+1)) ? sizeof(gopro_state[nus_c->cam].wifi_ssid)-1 : length;
+		memcpy(gopro_state[nus_c->cam].wifi_ssid,data,str_size);
+		gopro_state[nus_c->cam].wifi_ssid[str_size]=0;
+		atomic_set_bit(&wifi_cache[nus_c->cam].flags, GP_WIFI_SSID_VALID);
 		
-		LOG_INF("Get AP SSID %s",gopro_state.wifi_ssid);
+		LOG_INF("Get AP SSID %s",gopro_state[nus_c->cam].wifi_ssid);
 	}else{
 		LOG_HEXDUMP_DBG(data,length,"Read CHAR data:");
 	}
@@ -286,23 +489,26 @@ static uint8_t on_read_pass(struct bt_conn *conn, uint8_t err, struct bt_gatt_re
 	/* Retrieve module context. */
 	nus_c = CONTAINER_OF(params, struct bt_gopro_client, read_wifi_params[GP_WIFI_HANDLE_PASS]);
 
-	k_sem_give(&ble_read_sem);
+	atomic_clear_bit(&wifi_cache[nus_c->cam].flags, GP_WIFI_PASS_READING);
 	
 	if (err) {
 		LOG_ERR("Read char error %d",err);
+		gopro_client_stat.read_errors++;
+		bt_gopro_client_att_error(nus_c, err);
 		return BT_GATT_ITER_STOP;
 	}
 
 	//LOG_DBG("Handle: %d PASS handle: %d",params->single.handle, nus_c->wifihandles[GP_WIFI_HANDLE_PASS]);
 
 	if(params->single.handle == nus_c->wifihandles[GP_WIFI_HANDLE_PASS]){
-		memset(gopro_state.wifi_pass,0,sizeof(gopro_state.wifi_pass));
+		memset(gopro_state[nus_c->cam].wifi_pass,0,sizeof(gopro_state[nus_c->cam].wifi_pass));
 		
-		uint8_t str_size = (length >= (sizeof(gopro_state.wifi_pass)+1)) ? sizeof(gopro_state.wifi_pass)-1 : length;
-		memcpy(gopro_state.wifi_pass,data,str_size);
-		gopro_state.wifi_pass[str_size]=0;
+		uint8_t str_size = (length >= (sizeof(gopro_state[nus_c->cam].wifi_pass)+1)) ? sizeof(gopro_state[nus_c->cam].wifi_pass)-1 : length;
+		memcpy(gopro_state[nus_c->cam].wifi_pass,data,str_size);
+		gopro_state[nus_c->cam].wifi_pass[str_size]=0;
+		atomic_set_bit(&wifi_cache[nus_c->cam].flags, GP_WIFI_PASS_VALID);
 		
-		LOG_INF("Get AP PASS %s",gopro_state.wifi_pass);
+		LOG_INF("Get AP PASS %s",gopro_state[nus_c->cam].wifi_pass);
 	}else{
 		LOG_HEXDUMP_DBG(data,length,"Read CHAR data:");
 	}
@@ -311,9 +517,14 @@ static uint8_t on_read_pass(struct bt_conn *conn, uint8_t err, struct bt_gatt_re
 }
 
 static uint8_t on_read_default(struct bt_conn *conn, uint8_t err, struct bt_gatt_read_params *params, const void *data, uint16_t length){
-	
+	struct bt_gopro_client *gp_client = gopro_client_by_conn(conn);
+
 	if (err) {
 		LOG_ERR("Read char error %d",err);
+		gopro_client_stat.read_errors++;
+		if(gp_client != NULL){
+			bt_gopro_client_att_error(gp_client, err);
+		}
 		return BT_GATT_ITER_STOP;
 	}
 
@@ -334,302 +545,341 @@ int bt_gopro_client_get(struct bt_gopro_client *nus_c, uint16_t handle){
 		return -1;
 	}
 
+	if(nus_c->wifihandles[handle] == 0){
+		return -ENOENT;
+	}
+
 	nus_c->read_wifi_params[handle].func=read_func[handle];
 	nus_c->read_wifi_params[handle].single.handle=nus_c->wifihandles[handle];
 	nus_c->read_wifi_params[handle].single.offset=0;
 	nus_c->read_wifi_params[handle].handle_count=1;
 
+	gopro_client_stat.reads++;
 	err = bt_gatt_read(nus_c->conn,&nus_c->read_wifi_params[handle]);
 	if(err){
+		gopro_client_stat.read_errors++;
 		LOG_ERR("Failed read gatt, err (%d) %s", err, bt_gatt_err_to_str(err));
 	}
 
 	return err;
 }
 
-int bt_gopro_wifi_handles_assign(struct bt_gatt_dm *dm,  struct bt_gopro_client *nus_c){
-	const struct bt_gatt_dm_attr *gatt_service_attr = bt_gatt_dm_service_get(dm);
-	const struct bt_gatt_service_val *gatt_service = bt_gatt_dm_attr_service_val(gatt_service_attr);
-	struct bt_gatt_dm_attr *gatt_chrc;
-	struct bt_gatt_dm_attr *gatt_desc;
-
-	if (bt_uuid_cmp(gatt_service->uuid, BT_UUID_GOPRO_WIFI_SERVICE)) {
-		LOG_ERR("Not valid GoPro WIFI Service UUID");
-		return -ENOTSUP;
+/*
+SSID и пароль нужны редко, чтение не стоит на пути к готовности камеры.
+0 - данные в gopro_state[cam], -EINPROGRESS - чтение запущено, спросить позже.
+*/
+int gopro_client_wifi_get(uint8_t cam){
+	struct gopro_wifi_cache_t *cache;
+	struct bt_gopro_client *gp_client;
+	const bt_addr_le_t *addr;
+	int err = 0;
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return -EINVAL;
 	}
-	memset(&nus_c->wifihandles, 0xFF, sizeof(nus_c->wifihandles));
 
-	/* SSID */
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_WIFI_SSID);
-	LOG_DBG("DM: 0x%0X UUID: 0x%0X",(uint32_t)dm,(uint32_t)BT_UUID_GOPRO_WIFI_SSID);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing characteristic for SSID");
-		return -EINVAL;
+	cache = &wifi_cache[cam];
+	gp_client = &gopro_client[cam];
+
+	if(gp_client->conn == NULL){
+		if(bt_addr_le_cmp(&cache->addr, &gopro_state[cam].addr) != 0){
+			return -ENOTCONN;
+		}
+		return (atomic_test_bit(&cache->flags, GP_WIFI_SSID_VALID) && atomic_test_bit(&cache->flags, GP_WIFI_PASS_VALID)) ? 0 : -ENOTCONN;
 	}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_WIFI_SSID);
-	if (!gatt_desc) {
-		LOG_ERR("Missing descriptor in characteristic for SSID.");
-		return -EINVAL;
+	//Слот занят другой камерой: старые данные не ее
+	addr = bt_conn_get_dst(gp_client->conn);
+	if(bt_addr_le_cmp(&cache->addr, addr) != 0){
+		atomic_clear_bit(&cache->flags, GP_WIFI_SSID_VALID);
+		atomic_clear_bit(&cache->flags, GP_WIFI_PASS_VALID);
+		bt_addr_le_copy(&cache->addr, addr);
 	}
-	
-	LOG_DBG("Found handle for SSID characteristic");
-	nus_c->wifihandles[GP_WIFI_HANDLE_SSID] = gatt_desc->handle;
-
-	/* PASS */
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_WIFI_PASS);
-	LOG_DBG("DM: 0x%0X UUID: 0x%0X",(uint32_t)dm,(uint32_t)BT_UUID_GOPRO_WIFI_PASS);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing characteristic for PASS");
-		return -EINVAL;
+
+	if(atomic_test_bit(&cache->flags, GP_WIFI_SSID_VALID) && atomic_test_bit(&cache->flags, GP_WIFI_PASS_VALID)){
+		return 0;
 	}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_WIFI_PASS);
-	if (!gatt_desc) {
-		LOG_ERR("Missing descriptor in characteristic for PASS.");
-		return -EINVAL;
+	//Оба чтения уходят подряд, ATT выполнит их одно за другим
+	if(!atomic_test_bit(&cache->flags, GP_WIFI_SSID_VALID) && !atomic_test_and_set_bit(&cache->flags, GP_WIFI_SSID_READING)){
+		err = bt_gopro_client_get(gp_client, GP_WIFI_HANDLE_SSID);
+		if(err){
+			atomic_clear_bit(&cache->flags, GP_WIFI_SSID_READING);
+			return err;
+		}
 	}
-	
-	LOG_DBG("Found handle for PASS characteristic");
-	nus_c->wifihandles[GP_WIFI_HANDLE_PASS] = gatt_desc->handle;
-
-	/* POWER */
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_WIFI_POWER);
-	LOG_DBG("DM: 0x%0X UUID: 0x%0X",(uint32_t)dm,(uint32_t)BT_UUID_GOPRO_WIFI_POWER);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing characteristic for POWER");
-		return -EINVAL;
+
+	if(!atomic_test_bit(&cache->flags, GP_WIFI_PASS_VALID) && !atomic_test_and_set_bit(&cache->flags, GP_WIFI_PASS_READING)){
+		err = bt_gopro_client_get(gp_client, GP_WIFI_HANDLE_PASS);
+		if(err){
+			atomic_clear_bit(&cache->flags, GP_WIFI_PASS_READING);
+			return err;
+		}
 	}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_WIFI_POWER);
-	if (!gatt_desc) {
-		LOG_ERR("Missing descriptor in characteristic for POWER.");
-		return -EINVAL;
+	return -EINPROGRESS;
+}
+
+/* Сброс сети на камере или новое сопряжение: следующий запрос читает заново */
+void gopro_client_wifi_invalidate(uint8_t cam){
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return;
 	}
-	
-	LOG_DBG("Found handle for POWER characteristic");
-	nus_c->wifihandles[GP_WIFI_HANDLE_POWER] = gatt_desc->handle;
-
-	/* STATE */
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_WIFI_STATE);
-	LOG_DBG("DM: 0x%0X UUID: 0x%0X",(uint32_t)dm,(uint32_t)BT_UUID_GOPRO_WIFI_STATE);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing characteristic for STATE");
-		return -EINVAL;
+
+	atomic_clear_bit(&wifi_cache[cam].flags, GP_WIFI_SSID_VALID);
+	atomic_clear_bit(&wifi_cache[cam].flags, GP_WIFI_PASS_VALID);
+}
+
+/* SSID точки доступа приходит в HW info при каждом подключении: другой - пароль тоже сменился */
+void gopro_client_wifi_check_ssid(uint8_t cam, const char *ssid, uint8_t len){
+
+	if((cam >= CONFIG_GOPRO_CAM_MAX) || !atomic_test_bit(&wifi_cache[cam].flags, GP_WIFI_SSID_VALID)){
+		return;
 	}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_WIFI_STATE);
-	if (!gatt_desc) {
-		LOG_ERR("Missing descriptor in characteristic for STATE.");
-		return -EINVAL;
+	if((strlen(gopro_state[cam].wifi_ssid) != len) || (memcmp(gopro_state[cam].wifi_ssid, ssid, len) != 0)){
+		LOG_INF("Camera %d AP SSID changed, drop WiFi cache",cam);
+		gopro_client_wifi_invalidate(cam);
 	}
-	
-	LOG_DBG("Found handle for STATE characteristic");
-	nus_c->wifihandles[GP_WIFI_HANDLE_STATE] = gatt_desc->handle;
+}
 
-	nus_c->conn = bt_gatt_dm_conn_get(dm);
-	return 0;
+enum gopro_char_role_t{
+	GP_CHAR_WRITE,
+	GP_CHAR_NOTIFY,
+	GP_CHAR_WIFI,
 };
 
-int bt_gopro_handles_assign(struct bt_gatt_dm *dm,  struct bt_gopro_client *nus_c){
-	const struct bt_gatt_dm_attr *gatt_service_attr = bt_gatt_dm_service_get(dm);
-	const struct bt_gatt_service_val *gatt_service = bt_gatt_dm_attr_service_val(gatt_service_attr);
-	struct bt_gatt_dm_attr *gatt_chrc;
-	struct bt_gatt_dm_attr *gatt_desc;
+struct gopro_char_desc_t{
+	const struct bt_uuid *uuid;
+	uint8_t role;
+	uint8_t index;
+};
 
-	if (bt_uuid_cmp(gatt_service->uuid, BT_UUID_GOPRO_SERVICE)) {
-		LOG_ERR("Not valid GoPro Service UUID");
-		return -ENOTSUP;
-	}
-	memset(&nus_c->handles, 0xFF, sizeof(nus_c->handles));
+/* Все нужные характеристики трех сервисов GoPro */
+static const struct gopro_char_desc_t gopro_chars[] = {
+	{BT_UUID_GOPRO_CMD_WRITE,		GP_CHAR_WRITE,	GP_CNTRL_HANDLE_CMD},
+	{BT_UUID_GOPRO_CMD_NOTIFY,		GP_CHAR_NOTIFY,	GP_CNTRL_HANDLE_CMD},
+	{BT_UUID_GOPRO_SETTINGS_WRITE,	GP_CHAR_WRITE,	GP_CNTRL_HANDLE_SETTINGS},
+	{BT_UUID_GOPRO_SETTINGS_NOTIFY,	GP_CHAR_NOTIFY,	GP_CNTRL_HANDLE_SETTINGS},
+	{BT_UUID_GOPRO_QUERY_WRITE,		GP_CHAR_WRITE,	GP_CNTRL_HANDLE_QUERY},
+	{BT_UUID_GOPRO_QUERY_NOTIFY,	GP_CHAR_NOTIFY,	GP_CNTRL_HANDLE_QUERY},
+	{BT_UUID_GOPRO_NET_WRITE,		GP_CHAR_WRITE,	GP_CNTRL_HANDLE_NET},
+	{BT_UUID_GOPRO_NET_NOTIFY,		GP_CHAR_NOTIFY,	GP_CNTRL_HANDLE_NET},
+	{BT_UUID_GOPRO_WIFI_SSID,		GP_CHAR_WIFI,	GP_WIFI_HANDLE_SSID},
+	{BT_UUID_GOPRO_WIFI_PASS,		GP_CHAR_WIFI,	GP_WIFI_HANDLE_PASS},
+	{BT_UUID_GOPRO_WIFI_POWER,		GP_CHAR_WIFI,	GP_WIFI_HANDLE_POWER},
+	{BT_UUID_GOPRO_WIFI_STATE,		GP_CHAR_WIFI,	GP_WIFI_HANDLE_STATE},
+};
 
-	/* CMD */
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_CMD_NOTIFY);
-	LOG_DBG("DM: 0x%0X UUID: 0x%0X",(uint32_t)dm,(uint32_t)BT_UUID_GOPRO_CMD_NOTIFY);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing Notify characteristic for CMD");
-		return -EINVAL;
-	}
+static uint16_t *gopro_char_handle(struct bt_gopro_client *gp_client, const struct gopro_char_desc_t *desc){
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_CMD_NOTIFY);
-	if (!gatt_desc) {
-		LOG_ERR("Missing Notify value descriptor in characteristic for CMD.");
-		return -EINVAL;
+	switch (desc->role)
+	{
+	case GP_CHAR_WRITE:
+		return &gp_client->handles[desc->index].write;
+	case GP_CHAR_NOTIFY:
+		return &gp_client->handles[desc->index].notify;
+	default:
+		return &gp_client->wifihandles[desc->index];
 	}
-	
-	LOG_DBG("Found handle for Notify characteristic for CMD.");
-	nus_c->handles[GP_CNTRL_HANDLE_CMD].notify = gatt_desc->handle;
+}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GATT_CCC);
-	if (!gatt_desc) {
-		LOG_ERR("Missing GoPro Notify CCC in characteristic.");
-		return -EINVAL;
+static void gopro_discover_done(struct bt_gopro_client *gp_client, int err){
+	struct bt_gopro_discover_t *disc = &gp_client->discover;
+
+	if(err == 0){
+		for(uint32_t i=0; i<ARRAY_SIZE(gopro_chars); i++){
+			if(*gopro_char_handle(gp_client, &gopro_chars[i]) != 0){
+				continue;
+			}
+
+			//Без Wi-Fi характеристик камера управляется, без control - нет
+			if(gopro_chars[i].role == GP_CHAR_WIFI){
+				LOG_WRN("Missing WiFi characteristic %d",gopro_chars[i].index);
+			}else{
+				LOG_ERR("Missing characteristic %d:%d",gopro_chars[i].role,gopro_chars[i].index);
+				err = -EINVAL;
+			}
+		}
 	}
-	LOG_DBG("Found handle for CCC of GoPro Notify characteristic. 0x%0X",gatt_desc->handle);
-	nus_c->handles[GP_CNTRL_HANDLE_CMD].notify_ccc = gatt_desc->handle;
 
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_CMD_WRITE);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing Write characteristic.");
-		return -EINVAL;
+	if(err == 0){
+		LOG_INF("GATT discovery done in %d ms, %d characteristics",(int)(k_uptime_get() - disc->start),disc->chars);
 	}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_CMD_WRITE);
-	if (!gatt_desc) {
-		LOG_ERR("Missing GoPro Write value descriptor in characteristic.");
-		return -EINVAL;
-	}
-	LOG_DBG("Found handle for Write characteristic.");
-	nus_c->handles[GP_CNTRL_HANDLE_CMD].write = gatt_desc->handle;
+	disc->cb(gp_client, err);
+}
 
-	LOG_INF("CMD Handles assigned succesfull.");
-	/* CMD */
-	
-	/* SETTINGS */
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_SETTINGS_NOTIFY);
-	LOG_DBG("DM: 0x%0X UUID: 0x%0X",(uint32_t)dm,(uint32_t)BT_UUID_GOPRO_SETTINGS_NOTIFY);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing Notify characteristic for SETTINGS");
-		return -EINVAL;
-	}
+static uint8_t gopro_discover_ccc_cb(struct bt_conn *conn, const struct bt_gatt_attr *attr, struct bt_gatt_discover_params *params);
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_SETTINGS_NOTIFY);
-	if (!gatt_desc) {
-		LOG_ERR("Missing Notify value descriptor in characteristic for SETTINGS.");
-		return -EINVAL;
-	}
-	
-	LOG_DBG("Found handle for Notify characteristic for SETTINGS.");
-	nus_c->handles[GP_CNTRL_HANDLE_SETTINGS].notify = gatt_desc->handle;
+/* CCC ищется только там, где между значением и следующей характеристикой больше одного handle */
+static void gopro_discover_ccc_next(struct bt_gopro_client *gp_client){
+	struct bt_gopro_discover_t *disc = &gp_client->discover;
+	struct bt_gopro_client_handles *handles;
+	int err;
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GATT_CCC);
-	if (!gatt_desc) {
-		LOG_ERR("Missing GoPro Notify CCC in characteristic.");
-		return -EINVAL;
-	}
-	LOG_DBG("Found handle for CCC of GoPro Notify characteristic. 0x%0X",gatt_desc->handle);
-	nus_c->handles[GP_CNTRL_HANDLE_SETTINGS].notify_ccc = gatt_desc->handle;
+	while(disc->ccc_index < GP_CNTRL_HANDLE_END){
+		handles = &gp_client->handles[disc->ccc_index];
 
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_SETTINGS_WRITE);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing Write characteristic.");
-		return -EINVAL;
-	}
+		if(handles->notify == 0){
+			gopro_discover_done(gp_client, -EINVAL);
+			return;
+		}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_SETTINGS_WRITE);
-	if (!gatt_desc) {
-		LOG_ERR("Missing GoPro Write value descriptor in characteristic.");
-		return -EINVAL;
-	}
-	LOG_DBG("Found handle for Write characteristic.");
-	nus_c->handles[GP_CNTRL_HANDLE_SETTINGS].write = gatt_desc->handle;
+		if(disc->ccc_end[disc->ccc_index] == handles->notify + 1){
+			handles->notify_ccc = handles->notify + 1;
+			disc->ccc_index++;
+			continue;
+		}
 
-	LOG_INF("SETTINGS Handles assigned succesfull.");
-	/* SETTINGS */
+		disc->params.uuid = BT_UUID_GATT_CCC;
+		disc->params.func = gopro_discover_ccc_cb;
+		disc->params.start_handle = handles->notify + 1;
+		disc->params.end_handle = disc->ccc_end[disc->ccc_index];
+		disc->params.type = BT_GATT_DISCOVER_DESCRIPTOR;
 
-	/* QUERY */
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_QUERY_NOTIFY);
-	LOG_DBG("DM: 0x%0X UUID: 0x%0X",(uint32_t)dm,(uint32_t)BT_UUID_GOPRO_QUERY_NOTIFY);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing Notify characteristic for QUERY");
-		return -EINVAL;
+		err = bt_gatt_discover(gp_client->conn, &disc->params);
+		if(err){
+			LOG_ERR("CCC discovery failed: %d",err);
+			gopro_discover_done(gp_client, err);
+		}
+		return;
 	}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_QUERY_NOTIFY);
-	if (!gatt_desc) {
-		LOG_ERR("Missing Notify value descriptor in characteristic for QUERY.");
-		return -EINVAL;
-	}
-	
-	LOG_DBG("Found handle for Notify characteristic for QUERY.");
-	nus_c->handles[GP_CNTRL_HANDLE_QUERY].notify = gatt_desc->handle;
+	gopro_discover_done(gp_client, 0);
+}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GATT_CCC);
-	if (!gatt_desc) {
-		LOG_ERR("Missing GoPro Notify CCC in characteristic.");
-		return -EINVAL;
+static uint8_t gopro_discover_ccc_cb(struct bt_conn *conn, const struct bt_gatt_attr *attr, struct bt_gatt_discover_params *params){
+	struct bt_gopro_client *gp_client = CONTAINER_OF(params, struct bt_gopro_client, discover.params);
+	struct bt_gopro_discover_t *disc = &gp_client->discover;
+
+	if(!attr){
+		LOG_ERR("Missing CCC for %d",disc->ccc_index);
+		gopro_discover_done(gp_client, -EINVAL);
+		return BT_GATT_ITER_STOP;
 	}
-	LOG_DBG("Found handle for CCC of GoPro Notify characteristic. 0x%0X",gatt_desc->handle);
-	nus_c->handles[GP_CNTRL_HANDLE_QUERY].notify_ccc = gatt_desc->handle;
 
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_QUERY_WRITE);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing Write characteristic.");
-		return -EINVAL;
+	gp_client->handles[disc->ccc_index].notify_ccc = attr->handle;
+	disc->ccc_index++;
+	gopro_discover_ccc_next(gp_client);
+
+	return BT_GATT_ITER_STOP;
+}
+
+static uint8_t gopro_discover_char_cb(struct bt_conn *conn, const struct bt_gatt_attr *attr, struct bt_gatt_discover_params *params){
+	struct bt_gopro_client *gp_client = CONTAINER_OF(params, struct bt_gopro_client, discover.params);
+	struct bt_gopro_discover_t *disc = &gp_client->discover;
+	const struct bt_gatt_chrc *chrc;
+
+	if(!attr){
+		LOG_DBG("Characteristic discovery done, %d found",disc->chars);
+		disc->ccc_index = 0;
+		gopro_discover_ccc_next(gp_client);
+		return BT_GATT_ITER_STOP;
 	}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_QUERY_WRITE);
-	if (!gatt_desc) {
-		LOG_ERR("Missing GoPro Write value descriptor in characteristic.");
-		return -EINVAL;
+	disc->chars++;
+
+	//Объявление следующей характеристики закрывает диапазон дескрипторов предыдущей
+	if(disc->pending < GP_CNTRL_HANDLE_END){
+		disc->ccc_end[disc->pending] = attr->handle - 1;
+		disc->pending = GP_CNTRL_HANDLE_END;
 	}
-	LOG_DBG("Found handle for Write characteristic.");
-	nus_c->handles[GP_CNTRL_HANDLE_QUERY].write = gatt_desc->handle;
 
-	LOG_INF("QUERY Handles assigned succesfull.");
-	/* CMD */
+	chrc = attr->user_data;
 
-	/* Assign connection instance. */
-	nus_c->conn = bt_gatt_dm_conn_get(dm);
-	return 0;
+	for(uint32_t i=0; i<ARRAY_SIZE(gopro_chars); i++){
+		if(bt_uuid_cmp(chrc->uuid, gopro_chars[i].uuid) == 0){
+			*gopro_char_handle(gp_client, &gopro_chars[i]) = chrc->value_handle;
+			if(gopro_chars[i].role == GP_CHAR_WRITE){
+				gp_client->handles[gopro_chars[i].index].write_props = chrc->properties;
+			}
+			LOG_DBG("Char %d:%d value handle 0x%0X",gopro_chars[i].role,gopro_chars[i].index,chrc->value_handle);
+
+			if(gopro_chars[i].role == GP_CHAR_NOTIFY){
+				disc->pending = gopro_chars[i].index;
+			}
+			break;
+		}
+	}
+
+	return BT_GATT_ITER_CONTINUE;
 }
 
-int bt_gopro_net_handle_assign(struct bt_gatt_dm *dm,  struct bt_gopro_client *nus_c){
-	const struct bt_gatt_dm_attr *gatt_service_attr = bt_gatt_dm_service_get(dm);
-	const struct bt_gatt_service_val *gatt_service = bt_gatt_dm_attr_service_val(gatt_service_attr);
-	struct bt_gatt_dm_attr *gatt_chrc;
-	struct bt_gatt_dm_attr *gatt_desc;
+/*
+Один проход поиска характеристик по всей базе вместо трех bt_gatt_dm_start
+по сервисам. CCC берется из раскладки handle, отдельный запрос
+дескрипторов нужен только если после значения есть что-то кроме CCC.
+*/
+int bt_gopro_discover(struct bt_gopro_client *gp_client, struct bt_conn *conn, bt_gopro_discover_cb cb){
+	struct bt_gopro_discover_t *disc = &gp_client->discover;
+	int err;
 
-	if (bt_uuid_cmp(gatt_service->uuid, BT_UUID_GOPRO_NET_SERVICE)) {
-		LOG_ERR("Not valid GoPro Net UUID");
-		return -ENOTSUP;
-	}
-	memset(&nus_c->handles[GP_CNTRL_HANDLE_NET], 0xFF, sizeof(nus_c->handles[GP_CNTRL_HANDLE_NET]));
+	memset(gp_client->handles, 0, sizeof(gp_client->handles));
+	memset(gp_client->wifihandles, 0, sizeof(gp_client->wifihandles));
 
-	/* Network Management Response */
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_NET_NOTIFY);
-	LOG_DBG("DM: 0x%0X UUID: 0x%0X",(uint32_t)dm,(uint32_t)BT_UUID_GOPRO_NET_NOTIFY);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing Notify characteristic for NET");
-		return -EINVAL;
+	for(uint32_t i=0; i<GP_CNTRL_HANDLE_END; i++){
+		disc->ccc_end[i] = BT_ATT_LAST_ATTRIBUTE_HANDLE;
 	}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_NET_NOTIFY);
-	if (!gatt_desc) {
-		LOG_ERR("Missing Notify value descriptor in characteristic for NET.");
-		return -EINVAL;
+	disc->cb = cb;
+	disc->pending = GP_CNTRL_HANDLE_END;
+	disc->chars = 0;
+	disc->start = k_uptime_get();
+
+	disc->params.uuid = NULL;
+	disc->params.func = gopro_discover_char_cb;
+	disc->params.start_handle = BT_ATT_FIRST_ATTRIBUTE_HANDLE;
+	disc->params.end_handle = BT_ATT_LAST_ATTRIBUTE_HANDLE;
+	disc->params.type = BT_GATT_DISCOVER_CHARACTERISTIC;
+
+	gp_client->conn = conn;
+
+	err = bt_gatt_discover(conn, &disc->params);
+	if(err){
+		LOG_ERR("Characteristic discovery failed: %d",err);
 	}
-	
-	LOG_DBG("Found handle for Notify characteristic for NET.");
-	nus_c->handles[GP_CNTRL_HANDLE_NET].notify = gatt_desc->handle;
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GATT_CCC);
-	if (!gatt_desc) {
-		LOG_ERR("Missing GoPro Notify CCC in characteristic.");
-		return -EINVAL;
+	return err;
+}
+
+/* Handle из кэша могли устареть: первая ошибка ATT сбрасывает кэш и соединение, дальше полный поиск */
+void bt_gopro_client_att_error(struct bt_gopro_client *gp_client, uint8_t err){
+#ifdef CONFIG_GOPRO_GATT_CACHE
+	struct bt_conn_info info;
+
+	//При разрыве связи запросы завершаются с ошибкой, handle тут ни при чем
+	if((gp_client->conn == NULL) || (bt_conn_get_info(gp_client->conn, &info) != 0) || (info.state != BT_CONN_STATE_CONNECTED)){
+		return;
 	}
-	LOG_DBG("Found handle for CCC of GoPro Notify characteristic. 0x%0X",gatt_desc->handle);
-	nus_c->handles[GP_CNTRL_HANDLE_NET].notify_ccc = gatt_desc->handle;
 
-	gatt_chrc = (struct bt_gatt_dm_attr *)bt_gatt_dm_char_by_uuid(dm, BT_UUID_GOPRO_NET_WRITE);
-	if (!gatt_chrc) {
-		LOG_ERR("Missing Write characteristic.");
-		return -EINVAL;
+	if(!atomic_test_and_clear_bit(&gp_client->state, GP_FLAG_GATT_CACHED)){
+		return;
 	}
 
-	gatt_desc = (struct bt_gatt_dm_attr *)bt_gatt_dm_desc_by_uuid(dm, gatt_chrc, BT_UUID_GOPRO_NET_WRITE);
-	if (!gatt_desc) {
-		LOG_ERR("Missing GoPro Write value descriptor in characteristic.");
-		return -EINVAL;
+	LOG_WRN("ATT error 0x%02X on cached handles, rediscover",err);
+	gopro_gatt_cache_invalidate(bt_conn_get_dst(gp_client->conn));
+	bt_conn_disconnect(gp_client->conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+#else
+	ARG_UNUSED(gp_client);
+	ARG_UNUSED(err);
+#endif
+}
+
+static void on_subscribed(struct bt_conn *conn, uint8_t err, struct bt_gatt_subscribe_params *params){
+	struct bt_gopro_client *gp_client = gopro_client_by_conn(conn);
+
+	if(gp_client == NULL){
+		return;
 	}
-	LOG_DBG("Found handle for Write characteristic.");
-	nus_c->handles[GP_CNTRL_HANDLE_NET].write = gatt_desc->handle;
 
-	LOG_INF("NET Handles assigned succesfull.");
+	if (err) {
+		LOG_ERR("Subscribe 0x%0X failed, ATT error 0x%02X",params->ccc_handle,err);
+		bt_gopro_client_att_error(gp_client, err);
+	}
 
-	/* Assign connection instance. */
-	nus_c->conn = bt_gatt_dm_conn_get(dm);
-	return 0;
+	gopro_bringup_event(gp_client->cam, GP_BRINGUP_SUB(params - gp_client->notif_params));
 }
 
 int gopro_set_subscribe(struct bt_gopro_client *gp_client, enum gopro_control_handle_list_t gopro_handle){
@@ -667,6 +917,7 @@ int gopro_set_subscribe(struct bt_gopro_client *gp_client, enum gopro_control_ha
 	LOG_DBG("Hanndle: %d",gopro_handle);
 
 	gp_client->notif_params[gopro_handle].notify = on_notify_received;
+	gp_client->notif_params[gopro_handle].subscribe = on_subscribed;
 	gp_client->notif_params[gopro_handle].value = BT_GATT_CCC_NOTIFY;
 	gp_client->notif_params[gopro_handle].value_handle = gp_client->handles[gopro_handle].notify;
 	gp_client->notif_params[gopro_handle].ccc_handle = gp_client->handles[gopro_handle].notify_ccc;
@@ -682,5 +933,5 @@ int gopro_set_subscribe(struct bt_gopro_client *gp_client, enum gopro_control_ha
 		LOG_DBG("[SUBSCRIBED] for %d handle",gopro_handle);
 	}
 
-	return 0;
+	return err;
 }
@@ -59,6 +59,9 @@
 #define GOPRO_NAME_LEN						20
 #define GOPRO_CMD_DATA_LEN					20
 
+#define GOPRO_CAM_MAIN						0		//Кнопки, CAN без адреса камеры, Wi-Fi и время
+#define GOPRO_CAM_ALL						0xFF	//Всем подключенным камерам
+
 enum gopro_state_list_t{
     GP_STATE_UNKNOWN,
     GP_STATE_OFFLINE,
@@ -95,7 +98,8 @@ enum gopro_flag_t{
 	GP_FLAG_SETTINGS_WRITE_PENDING,
 	GP_FLAG_QUERY_WRITE_PENDING,
 	GP_FLAG_NET_WRITE_PENDING,
-	GP_FLAG_FORCE_CONNECT
+	GP_FLAG_FORCE_CONNECT,
+	GP_FLAG_GATT_CACHED
 };
 
 struct my_cohn_net_t{
@@ -120,10 +124,21 @@ struct gopro_state_t {
 	struct my_cohn_net_t		cohn_net;
 };
 
+struct gopro_client_stat_t{
+	uint32_t writes;
+	uint32_t write_errors;
+	uint32_t notifications;
+	uint32_t reads;
+	uint32_t read_errors;
+};
+
 struct gopro_cmd_t {
 	uint32_t len;
 	uint32_t cmd_type;
 	uint8_t  data[GOPRO_CMD_DATA_LEN];
+	uint8_t  cam;			//Индекс камеры, по умолчанию основная
+	uint32_t t_ingress;		//k_cycle_get_32() на входе (кнопка, CAN), 0 - без трассировки
+	uint32_t t_dequeue;
 };
 
 struct mem_pkt_t{
@@ -136,35 +151,64 @@ struct bt_gopro_client_handles {
 	uint16_t write;			
 	uint16_t notify;		
 	uint16_t notify_ccc; 	
+	uint8_t  write_props;	//BT_GATT_CHRC_* характеристики записи
+};
+
+struct bt_gopro_client;
+
+typedef void (*bt_gopro_discover_cb)(struct bt_gopro_client *gp_client, int err);
+
+struct bt_gopro_discover_t {
+	struct bt_gatt_discover_params 	params;
+	bt_gopro_discover_cb 			cb;
+	uint16_t 						ccc_end[GP_CNTRL_HANDLE_END];	//Последний handle характеристики с CCC
+	uint8_t 						pending;						//Характеристика, чья граница еще не известна
+	uint8_t 						ccc_index;
+	uint32_t 						chars;
+	int64_t 						start;
 };
 
 struct bt_gopro_client {
 	struct bt_conn *conn;
+	uint8_t cam;
 	atomic_t state;
 	struct bt_gopro_client_handles handles[GP_CNTRL_HANDLE_END];
 	uint16_t wifihandles[GP_WIFI_HANDLE_END];
 	struct bt_gatt_subscribe_params notif_params[GP_CNTRL_HANDLE_END];
 	struct bt_gatt_write_params 	write_params[GP_CNTRL_HANDLE_END];
+	uint8_t 						write_buf[GP_CNTRL_HANDLE_END][GOPRO_CMD_DATA_LEN];
 	struct bt_gatt_read_params 		read_wifi_params[GP_WIFI_HANDLE_END];
+	struct bt_gatt_exchange_params 	exchange_params;
+	struct bt_gopro_discover_t 		discover;
 };
 
 void gopro_client_update_state(void);
 
-int gopro_client_set_device_addr(bt_addr_le_t* addr);
-bt_addr_le_t* gopro_client_get_device_addr(void);
+int gopro_client_cam_find(const bt_addr_le_t *addr);
+int gopro_client_cam_get(const bt_addr_le_t *addr);
+int gopro_client_cam_by_conn(const struct bt_conn *conn);
+uint8_t gopro_client_connected_count(void);
+bool gopro_client_recording(void);
+
+bt_addr_le_t* gopro_client_get_device_addr(uint8_t cam);
+
+int gopro_client_set_sate(uint8_t cam, enum gopro_state_list_t  state);
+enum gopro_state_list_t gopro_client_get_state(uint8_t cam);
 
-int gopro_client_set_sate(enum gopro_state_list_t  state);
-enum gopro_state_list_t gopro_client_get_state(void);
+int gopro_client_setname(uint8_t cam, char *name, uint8_t len);
 
-int gopro_client_setname(char *name, uint8_t len);
+int gopro_client_wifi_get(uint8_t cam);
+void gopro_client_wifi_invalidate(uint8_t cam);
+void gopro_client_wifi_check_ssid(uint8_t cam, const char *ssid, uint8_t len);
 
-int bt_gopro_net_handle_assign(struct bt_gatt_dm *dm,  struct bt_gopro_client *nus_c);
-int bt_gopro_handles_assign(struct bt_gatt_dm *dm, struct bt_gopro_client *nus);
-int bt_gopro_wifi_handles_assign(struct bt_gatt_dm *dm,  struct bt_gopro_client *nus_c);
+int bt_gopro_discover(struct bt_gopro_client *gp_client, struct bt_conn *conn, bt_gopro_discover_cb cb);
+void bt_gopro_client_att_error(struct bt_gopro_client *gp_client, uint8_t err);
 
 int gopro_set_subscribe(struct bt_gopro_client *nus_c, enum gopro_control_handle_list_t gopro_handle);
 
 int bt_gopro_client_send(struct bt_gopro_client *nus, struct gopro_cmd_t *gopro_cmd);
+bool bt_gopro_client_unacked(const struct bt_gopro_client *gp_client, const struct gopro_cmd_t *gopro_cmd);
+bool bt_gopro_client_write_busy(const struct bt_gopro_client *gp_client, uint32_t handle_index);
 int bt_gopro_client_get(struct bt_gopro_client *nus_c, uint16_t handle);
 
 
@@ -0,0 +1,234 @@
+#include "gopro_conn_policy.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/bluetooth/gap.h>
+
+LOG_MODULE_REGISTER(gopro_link, CONFIG_BLE_LOG_LVL);
+
+/*
+Активный режим держится CONFIG_GOPRO_LINK_IDLE_DELAY_MS после последней
+команды CMD/NET, затем соединение переводится в экономный режим.
+Режим один на все камеры: интервалы соединений одинаковые, и команды
+группового затвора попадают в соседние connection event.
+*/
+
+struct link_policy_t{
+	struct bt_le_conn_param 	param;
+	struct bt_conn_le_phy_param phy;
+};
+
+static void link_active_work_handler(struct k_work *work);
+static void link_idle_work_handler(struct k_work *work);
+
+static void link_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout);
+static void link_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param);
+
+K_WORK_DEFINE(link_active_work, link_active_work_handler);
+K_WORK_DELAYABLE_DEFINE(link_idle_work, link_idle_work_handler);
+
+BT_CONN_CB_DEFINE(link_conn_callbacks) = {
+	.le_param_updated = link_param_updated,
+	.le_phy_updated = link_phy_updated,
+};
+
+static const struct link_policy_t link_policy[GP_LINK_MODE_END] = {
+	[GP_LINK_ACTIVE] = {
+		.param = BT_LE_CONN_PARAM_INIT(CONFIG_GOPRO_LINK_ACTIVE_INT_MIN, CONFIG_GOPRO_LINK_ACTIVE_INT_MAX, 0, CONFIG_GOPRO_LINK_TIMEOUT),
+		.phy = {
+			.options = BT_CONN_LE_PHY_OPT_NONE,
+			.pref_tx_phy = BT_GAP_LE_PHY_2M,
+			.pref_rx_phy = BT_GAP_LE_PHY_2M,
+		},
+	},
+	[GP_LINK_IDLE] = {
+		.param = BT_LE_CONN_PARAM_INIT(CONFIG_GOPRO_LINK_IDLE_INT_MIN, CONFIG_GOPRO_LINK_IDLE_INT_MAX, CONFIG_GOPRO_LINK_IDLE_LATENCY, CONFIG_GOPRO_LINK_TIMEOUT),
+#ifdef CONFIG_GOPRO_LINK_IDLE_PHY_CODED
+		.phy = {
+			.options = BT_CONN_LE_PHY_OPT_CODED_S8,
+			.pref_tx_phy = BT_GAP_LE_PHY_CODED,
+			.pref_rx_phy = BT_GAP_LE_PHY_CODED,
+		},
+#else
+		.phy = {
+			.options = BT_CONN_LE_PHY_OPT_NONE,
+			.pref_tx_phy = BT_GAP_LE_PHY_1M,
+			.pref_rx_phy = BT_GAP_LE_PHY_1M,
+		},
+#endif
+	},
+};
+
+static const char *const link_mode_str[GP_LINK_MODE_END] = {"none", "active", "idle"};
+
+static struct bt_conn *link_conn[CONFIG_GOPRO_CAM_MAX];
+static atomic_t link_mode = ATOMIC_INIT(GP_LINK_NONE);
+static struct gopro_link_stat_t link_stat;
+
+/* Параметры сразу при создании соединения, чтобы поиск сервисов не ждал обновления */
+const struct bt_le_conn_param *gopro_conn_policy_create_param(void){
+	return &link_policy[GP_LINK_ACTIVE].param;
+}
+
+static int link_find(const struct bt_conn *conn){
+
+	for(uint32_t i=0; i<CONFIG_GOPRO_CAM_MAX; i++){
+		if(link_conn[i] == conn){
+			return i;
+		}
+	}
+
+	return -ENOENT;
+}
+
+static bool link_any(void){
+
+	for(uint32_t i=0; i<CONFIG_GOPRO_CAM_MAX; i++){
+		if(link_conn[i] != NULL){
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void link_apply(enum gopro_link_mode_t mode){
+	const struct link_policy_t *policy = &link_policy[mode];
+	bool applied = false;
+	int err;
+
+	for(uint32_t i=0; i<CONFIG_GOPRO_CAM_MAX; i++){
+		if(link_conn[i] == NULL){
+			continue;
+		}
+
+		err = bt_conn_le_param_update(link_conn[i], &policy->param);
+		if((err != 0) && (err != -EALREADY)){
+			LOG_WRN("Conn param update failed: %d",err);
+			link_stat.update_errors++;
+			atomic_set(&link_mode, GP_LINK_NONE);	//Повторить при следующей активности
+			continue;
+		}
+
+		err = bt_conn_le_phy_update(link_conn[i], &policy->phy);
+		if((err != 0) && (err != -EALREADY)){
+			LOG_WRN("PHY update failed: %d",err);
+			link_stat.update_errors++;
+		}
+
+		applied = true;
+	}
+
+	if(!applied){
+		return;
+	}
+
+	if(mode == GP_LINK_ACTIVE){
+		link_stat.to_active++;
+	}else{
+		link_stat.to_idle++;
+	}
+
+	LOG_DBG("Link %s: interval %d-%d latency %d timeout %d, phy 0x%0X",link_mode_str[mode],
+		policy->param.interval_min,policy->param.interval_max,policy->param.latency,policy->param.timeout,policy->phy.pref_tx_phy);
+}
+
+static void link_active_work_handler(struct k_work *work){
+	if(atomic_get(&link_mode) == GP_LINK_ACTIVE){
+		link_apply(GP_LINK_ACTIVE);
+	}
+}
+
+static void link_idle_work_handler(struct k_work *work){
+	if(atomic_cas(&link_mode, GP_LINK_ACTIVE, GP_LINK_IDLE)){
+		link_apply(GP_LINK_IDLE);
+	}
+}
+
+void gopro_conn_policy_connected(struct bt_conn *conn){
+	int i;
+
+	if(link_find(conn) >= 0){
+		return;
+	}
+
+	i = link_find(NULL);
+	if(i < 0){
+		LOG_WRN("No free link slot");
+		return;
+	}
+	link_conn[i] = bt_conn_ref(conn);
+
+	//Соединение создано с активными параметрами, остается сменить PHY. Остальные камеры тоже в активный
+	atomic_set(&link_mode, GP_LINK_ACTIVE);
+	k_work_submit(&link_active_work);
+	k_work_reschedule(&link_idle_work, K_MSEC(CONFIG_GOPRO_LINK_IDLE_DELAY_MS));
+}
+
+void gopro_conn_policy_disconnected(struct bt_conn *conn){
+	int i = link_find(conn);
+
+	if((conn == NULL) || (i < 0)){
+		return;
+	}
+
+	bt_conn_unref(link_conn[i]);
+	link_conn[i] = NULL;
+
+	if(!link_any()){
+		atomic_set(&link_mode, GP_LINK_NONE);
+		k_work_cancel_delayable(&link_idle_work);
+	}
+}
+
+void gopro_conn_policy_activity(void){
+
+	if(!link_any()){
+		return;
+	}
+
+	if(atomic_set(&link_mode, GP_LINK_ACTIVE) != GP_LINK_ACTIVE){
+		k_work_submit(&link_active_work);
+	}
+
+	k_work_reschedule(&link_idle_work, K_MSEC(CONFIG_GOPRO_LINK_IDLE_DELAY_MS));
+}
+
+void gopro_conn_policy_stat_get(struct gopro_link_stat_t *stat){
+	struct bt_conn_info info;
+
+	*stat = link_stat;
+	stat->mode = atomic_get(&link_mode);
+
+	//Интервалы у всех камер одинаковые, показывается первое соединение
+	for(uint32_t i=0; i<CONFIG_GOPRO_CAM_MAX; i++){
+		if((link_conn[i] == NULL) || (bt_conn_get_info(link_conn[i], &info) != 0)){
+			continue;
+		}
+
+		stat->interval = info.le.interval;
+		stat->latency = info.le.latency;
+		stat->timeout = info.le.timeout;
+		stat->tx_phy = info.le.phy->tx_phy;
+		stat->rx_phy = info.le.phy->rx_phy;
+		break;
+	}
+}
+
+static void link_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t latency, uint16_t timeout){
+
+	if(link_find(conn) < 0){
+		return;
+	}
+
+	LOG_INF("Conn params (%s): interval %d.%02d ms, latency %d, timeout %d ms",link_mode_str[atomic_get(&link_mode)],
+		(interval * 125) / 100, (interval * 125) % 100, latency, timeout * 10);
+}
+
+static void link_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param){
+
+	if(link_find(conn) < 0){
+		return;
+	}
+
+	LOG_INF("PHY (%s): tx 0x%0X rx 0x%0X",link_mode_str[atomic_get(&link_mode)],param->tx_phy,param->rx_phy);
+}
@@ -0,0 +1,32 @@
+#ifndef GOPRO_CONN_POLICY_H
+#define GOPRO_CONN_POLICY_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/conn.h>
+
+enum gopro_link_mode_t{
+	GP_LINK_NONE,
+	GP_LINK_ACTIVE,		//Поиск сервисов, команды, NET: короткий интервал, 2M
+	GP_LINK_IDLE,		//Запись/ожидание: длинный интервал с пропуском событий
+	GP_LINK_MODE_END
+};
+
+struct gopro_link_stat_t{
+	enum gopro_link_mode_t mode;
+	uint16_t interval;		//Текущие значения от контроллера, интервал в 1.25 мс
+	uint16_t latency;
+	uint16_t timeout;		//10 мс
+	uint8_t  tx_phy;
+	uint8_t  rx_phy;
+	uint32_t to_active;
+	uint32_t to_idle;
+	uint32_t update_errors;
+};
+
+const struct bt_le_conn_param *gopro_conn_policy_create_param(void);
+void gopro_conn_policy_connected(struct bt_conn *conn);
+void gopro_conn_policy_disconnected(struct bt_conn *conn);
+void gopro_conn_policy_activity(void);
+void gopro_conn_policy_stat_get(struct gopro_link_stat_t *stat);
+
+#endif
@@ -6,13 +6,18 @@
 #include <zephyr/bluetooth/bluetooth.h>
 
 #include "gopro_protobuf.h"
+#ifdef CONFIG_GOPRO_PRESET_CACHE
+#include <zephyr/sys/byteorder.h>
+#include "gopro_preset.h"
+#endif
 
 LOG_MODULE_REGISTER(gopro_control, CONFIG_BLE_LOG_LVL);
-extern struct bt_gopro_client gopro_client;
-extern struct gopro_state_t gopro_state;
+extern struct bt_gopro_client gopro_client[CONFIG_GOPRO_CAM_MAX];
+extern struct gopro_state_t gopro_state[CONFIG_GOPRO_CAM_MAX];
 
 int gopro_ctrl_parse(struct gopro_cmd_t *gopro_cmd){
     int ret_value = 0;
+    uint8_t cam = gopro_cmd->cam;
 
     if((gopro_cmd->cmd_type == 0xFF) && (gopro_cmd->len==1)){
 
@@ -25,14 +30,61 @@ int gopro_ctrl_parse(struct gopro_cmd_t *gopro_cmd){
             break;
 
         case 0xAF:
-            LOG_INF("Force connect CMD");
-            atomic_set_bit(&gopro_client.state,GP_FLAG_FORCE_CONNECT);
+            LOG_INF("Force connect CMD, camera %d",cam);
+            for(uint32_t i=0; i<CONFIG_GOPRO_CAM_MAX; i++){
+                if((cam >= CONFIG_GOPRO_CAM_MAX) || (cam == i)){
+                    atomic_set_bit(&gopro_client[i].state,GP_FLAG_FORCE_CONNECT);
+                }
+            }
             ret_value = 1;
             break;
             
         case 0xBB:
-            LOG_INF("Request GoPro NAME");
-            can_reply(0xFF,gopro_state.name,strlen(gopro_state.name));
+            if(cam >= CONFIG_GOPRO_CAM_MAX){
+                cam = GOPRO_CAM_MAIN;
+            }
+            LOG_INF("Request GoPro NAME, camera %d",cam);
+            can_reply(GOPRO_BLE_ADDR(cam, 0xFF),gopro_state[cam].name,strlen(gopro_state[cam].name));
+            ret_value = 1;
+            break;
+
+        #ifdef CONFIG_GOPRO_PRESET_CACHE
+        case GOPRO_CTRL_PRESET_TABLE:
+            if(cam >= CONFIG_GOPRO_CAM_MAX){
+                cam = GOPRO_CAM_MAIN;
+            }
+            LOG_INF("Request preset table, camera %d",cam);
+            gopro_preset_table_send(cam);
+            ret_value = 1;
+            break;
+        #endif
+
+        default:
+            break;
+        }
+    }
+
+    #ifdef CONFIG_GOPRO_PRESET_CACHE
+    if((gopro_cmd->cmd_type == 0xFF) && (gopro_cmd->len > 1)){
+        if(cam >= CONFIG_GOPRO_CAM_MAX){
+            cam = GOPRO_CAM_MAIN;
+        }
+
+        switch (gopro_cmd->data[0])
+        {
+        case GOPRO_CTRL_PRESET_LOAD_ID:
+            if(gopro_cmd->len == 5){
+                int32_t id = (int32_t)sys_get_be32(&gopro_cmd->data[1]);
+
+                LOG_INF("Load preset 0x%08X, camera %d",id,cam);
+                gopro_preset_load_id(cam, id);
+            }
+            ret_value = 1;
+            break;
+
+        case GOPRO_CTRL_PRESET_LOAD_MODE:
+            LOG_INF("Load preset for mode %d, camera %d",gopro_cmd->data[1],cam);
+            gopro_preset_load_mode(cam, gopro_cmd->data[1]);
             ret_value = 1;
             break;
 
@@ -40,6 +92,7 @@ int gopro_ctrl_parse(struct gopro_cmd_t *gopro_cmd){
             break;
         }
     }
+    #endif
 
     return ret_value;
 }
\ No newline at end of file
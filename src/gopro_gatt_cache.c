@@ -0,0 +1,227 @@
+#include "gopro_gatt_cache.h"
+
+#include <stdio.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/bluetooth/conn.h>
+
+LOG_MODULE_REGISTER(gopro_gatt_cache, CONFIG_BLE_LOG_LVL);
+
+K_MUTEX_DEFINE(gatt_cache_mutex);
+
+static struct gopro_gatt_cache_t gatt_cache[CONFIG_GOPRO_GATT_CACHE_SIZE];
+static uint32_t gatt_cache_seq;
+
+/* Запись в settings из work: вызовы идут из callback'ов BT RX */
+static void gatt_cache_flush_handler(struct k_work *work);
+K_WORK_DEFINE(gatt_cache_flush_work, gatt_cache_flush_handler);
+
+static uint32_t gatt_cache_dirty;					//сохранить gatt_cache[i]
+static uint32_t gatt_cache_del;						//удалить ключ gatt_cache_del_addr[i]
+static bt_addr_le_t gatt_cache_del_addr[CONFIG_GOPRO_GATT_CACHE_SIZE];
+
+BUILD_ASSERT(CONFIG_GOPRO_GATT_CACHE_SIZE <= 32, "GATT cache bitmask");
+
+static void gatt_cache_key(const bt_addr_le_t *addr, char *key){
+	const uint8_t *a = addr->a.val;
+
+	snprintf(key, GATT_CACHE_KEY_LEN, "gpgatt/%u%02x%02x%02x%02x%02x%02x", addr->type, a[5], a[4], a[3], a[2], a[1], a[0]);
+}
+
+static struct gopro_gatt_cache_t *gatt_cache_find(const bt_addr_le_t *addr){
+
+	for(uint32_t i=0; i<ARRAY_SIZE(gatt_cache); i++){
+		if(bt_addr_le_eq(&gatt_cache[i].addr, addr)){
+			return &gatt_cache[i];
+		}
+	}
+
+	return NULL;
+}
+
+static struct gopro_gatt_cache_t *gatt_cache_slot(const bt_addr_le_t *addr){
+	struct gopro_gatt_cache_t *entry = gatt_cache_find(addr);
+
+	if(entry == NULL){
+		entry = gatt_cache_find(BT_ADDR_LE_ANY);
+	}
+
+	return entry;
+}
+
+static struct gopro_gatt_cache_t *gatt_cache_lru(void){
+	struct gopro_gatt_cache_t *entry = &gatt_cache[0];
+
+	for(uint32_t i=1; i<ARRAY_SIZE(gatt_cache); i++){
+		if((int32_t)(gatt_cache[i].last_used - entry->last_used) < 0){
+			entry = &gatt_cache[i];
+		}
+	}
+
+	return entry;
+}
+
+/* Ключ старой записи удаляется, только если она успела попасть в settings */
+static void gatt_cache_drop(struct gopro_gatt_cache_t *entry){
+	uint32_t idx = entry - gatt_cache;
+
+	if((gatt_cache_del & BIT(idx)) == 0){
+		bt_addr_le_copy(&gatt_cache_del_addr[idx], &entry->addr);
+		gatt_cache_del |= BIT(idx);
+	}
+	gatt_cache_dirty &= ~BIT(idx);
+	bt_addr_le_copy(&entry->addr, BT_ADDR_LE_ANY);
+}
+
+static void gatt_cache_flush_handler(struct k_work *work){
+	struct gopro_gatt_cache_t entry;
+	bt_addr_le_t del_addr;
+	char key[GATT_CACHE_KEY_LEN];
+	bool save, del;
+	int err;
+
+	for(uint32_t i=0; i<ARRAY_SIZE(gatt_cache); i++){
+		k_mutex_lock(&gatt_cache_mutex, K_FOREVER);
+		del = (gatt_cache_del & BIT(i)) != 0;
+		save = (gatt_cache_dirty & BIT(i)) != 0;
+		gatt_cache_del &= ~BIT(i);
+		gatt_cache_dirty &= ~BIT(i);
+		bt_addr_le_copy(&del_addr, &gatt_cache_del_addr[i]);
+		entry = gatt_cache[i];
+		k_mutex_unlock(&gatt_cache_mutex);
+
+		if(del){
+			gatt_cache_key(&del_addr, key);
+			settings_delete(key);
+		}
+
+		if(save){
+			gatt_cache_key(&entry.addr, key);
+			err = settings_save_one(key, &entry, sizeof(entry));
+			if(err){
+				LOG_ERR("Failed to save GATT cache: %d",err);
+			}else{
+				LOG_DBG("GATT cache saved, fw %s",entry.firmware_version);
+			}
+		}
+	}
+}
+
+static int gatt_cache_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg){
+	struct gopro_gatt_cache_t entry;
+	struct gopro_gatt_cache_t *slot;
+	int rc;
+
+	//Формат записи поменялся - просто перечитать handle при подключении
+	if (len != sizeof(entry)) {
+		return 0;
+	}
+
+	rc = read_cb(cb_arg, &entry, sizeof(entry));
+	if (rc < 0) {
+		return rc;
+	}
+
+	entry.firmware_version[sizeof(entry.firmware_version) - 1] = 0;
+
+	k_mutex_lock(&gatt_cache_mutex, K_FOREVER);
+	slot = gatt_cache_slot(&entry.addr);
+	if(slot != NULL){
+		*slot = entry;
+		if((int32_t)(entry.last_used - gatt_cache_seq) >= 0){
+			gatt_cache_seq = entry.last_used + 1;
+		}
+	}
+	k_mutex_unlock(&gatt_cache_mutex);
+
+	if(slot == NULL){
+		LOG_WRN("GATT cache full, skip %s",name);
+	}
+
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(gpgatt, "gpgatt", NULL, gatt_cache_settings_set, NULL, NULL);
+
+int gopro_gatt_cache_load(struct bt_gopro_client *gp_client, const bt_addr_le_t *addr){
+	struct gopro_gatt_cache_t *entry;
+	int err = -ENOENT;
+
+	if(!bt_le_bond_exists(BT_ID_DEFAULT, addr)){
+		return -ENOENT;
+	}
+
+	k_mutex_lock(&gatt_cache_mutex, K_FOREVER);
+	entry = gatt_cache_find(addr);
+	if(entry != NULL){
+		memcpy(gp_client->handles, entry->handles, sizeof(gp_client->handles));
+		memcpy(gp_client->wifihandles, entry->wifihandles, sizeof(gp_client->wifihandles));
+		entry->last_used = gatt_cache_seq++;
+		LOG_INF("GATT handles from cache, fw %s",entry->firmware_version);
+		err = 0;
+	}
+	k_mutex_unlock(&gatt_cache_mutex);
+
+	return err;
+}
+
+int gopro_gatt_cache_store(const struct bt_gopro_client *gp_client, const bt_addr_le_t *addr, const char *firmware_version){
+	struct gopro_gatt_cache_t *entry;
+
+	if((firmware_version[0] == 0) || !bt_le_bond_exists(BT_ID_DEFAULT, addr)){
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&gatt_cache_mutex, K_FOREVER);
+
+	entry = gatt_cache_slot(addr);
+	if(entry == NULL){
+		//Вытеснить давно не использованную запись
+		entry = gatt_cache_lru();
+		gatt_cache_drop(entry);
+	}
+
+	bt_addr_le_copy(&entry->addr, addr);
+	strncpy(entry->firmware_version, firmware_version, sizeof(entry->firmware_version) - 1);
+	entry->firmware_version[sizeof(entry->firmware_version) - 1] = 0;
+	memcpy(entry->handles, gp_client->handles, sizeof(entry->handles));
+	memcpy(entry->wifihandles, gp_client->wifihandles, sizeof(entry->wifihandles));
+	entry->last_used = gatt_cache_seq++;
+	gatt_cache_dirty |= BIT(entry - gatt_cache);
+
+	k_mutex_unlock(&gatt_cache_mutex);
+
+	k_work_submit(&gatt_cache_flush_work);
+
+	return 0;
+}
+
+bool gopro_gatt_cache_fw_match(const bt_addr_le_t *addr, const char *firmware_version){
+	struct gopro_gatt_cache_t *entry;
+	bool match = false;
+
+	k_mutex_lock(&gatt_cache_mutex, K_FOREVER);
+	entry = gatt_cache_find(addr);
+	if(entry != NULL){
+		match = (strncmp(entry->firmware_version, firmware_version, sizeof(entry->firmware_version)) == 0);
+	}
+	k_mutex_unlock(&gatt_cache_mutex);
+
+	return match;
+}
+
+void gopro_gatt_cache_invalidate(const bt_addr_le_t *addr){
+	struct gopro_gatt_cache_t *entry;
+
+	k_mutex_lock(&gatt_cache_mutex, K_FOREVER);
+	entry = gatt_cache_find(addr);
+	if(entry != NULL){
+		gatt_cache_drop(entry);
+		LOG_INF("GATT cache invalidated");
+	}
+	k_mutex_unlock(&gatt_cache_mutex);
+
+	if(entry != NULL){
+		k_work_submit(&gatt_cache_flush_work);
+	}
+}
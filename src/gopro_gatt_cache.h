@@ -0,0 +1,29 @@
+#ifndef GOPRO_GATT_CACHE_H
+#define GOPRO_GATT_CACHE_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/addr.h>
+
+#include "gopro_client.h"
+
+#define GATT_CACHE_KEY_LEN		32
+
+/*
+Handle GoPro для связанной камеры, ключ settings: gpgatt/<тип><адрес hex>.
+Запись действительна, пока прошивка камеры совпадает с сохраненной.
+При переполнении вытесняется запись с наименьшим last_used.
+*/
+struct gopro_gatt_cache_t{
+	bt_addr_le_t 					addr;
+	char 							firmware_version[20];
+	struct bt_gopro_client_handles 	handles[GP_CNTRL_HANDLE_END];
+	uint16_t 						wifihandles[GP_WIFI_HANDLE_END];
+	uint32_t 						last_used;
+};
+
+int gopro_gatt_cache_load(struct bt_gopro_client *gp_client, const bt_addr_le_t *addr);
+int gopro_gatt_cache_store(const struct bt_gopro_client *gp_client, const bt_addr_le_t *addr, const char *firmware_version);
+bool gopro_gatt_cache_fw_match(const bt_addr_le_t *addr, const char *firmware_version);
+void gopro_gatt_cache_invalidate(const bt_addr_le_t *addr);
+
+#endif
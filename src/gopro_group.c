@@ -0,0 +1,168 @@
+#include "gopro_group.h"
+#include "gopro_writer.h"
+
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(gopro_group, CONFIG_BLE_LOG_LVL);
+
+/* Текущий выстрел: метка команды и времена записи по камерам */
+struct gopro_group_shot_t{
+	uint32_t stamp;
+	uint32_t mask;			//Камеры, которым ушла команда
+	uint32_t issued;
+	uint32_t acked;
+	uint32_t t_issue[CONFIG_GOPRO_CAM_MAX];
+	uint32_t t_ack[CONFIG_GOPRO_CAM_MAX];
+};
+
+BUILD_ASSERT(CONFIG_GOPRO_CAM_MAX <= 32, "Camera mask is 32 bit");
+
+static struct k_spinlock group_lock;
+static struct gopro_group_shot_t group_shot;
+static struct gopro_group_stat_t group_stat;
+
+static uint32_t group_spread_us(const uint32_t *t, uint32_t mask){
+	uint32_t first = 0;
+	uint32_t last = 0;
+	bool init = false;
+
+	for(uint32_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		if(!(mask & BIT(cam))){
+			continue;
+		}
+
+		//Времена близки, сравнение через разность переживает переполнение счетчика
+		if(!init || ((int32_t)(t[cam] - first) < 0)){
+			first = t[cam];
+		}
+		if(!init || ((int32_t)(t[cam] - last) > 0)){
+			last = t[cam];
+		}
+		init = true;
+	}
+
+	return k_cyc_to_us_floor32(last - first);
+}
+
+/*
+Команда всем камерам под k_sched_lock: writer не вклинится между очередями,
+и CMD всех камер уходят в одном проходе планировщика записи.
+*/
+int gopro_group_send(const struct gopro_cmd_t *gopro_cmd){
+	struct gopro_cmd_t cmd = *gopro_cmd;
+	k_spinlock_key_t key;
+	uint32_t mask = 0;
+	int err;
+
+	if(cmd.t_ingress == 0){
+		cmd.t_ingress = k_cycle_get_32() | 1;
+	}
+
+	key = k_spin_lock(&group_lock);
+	if(group_shot.mask && (group_shot.acked != group_shot.mask)){
+		group_stat.partial++;
+	}
+	memset(&group_shot, 0, sizeof(group_shot));
+	group_shot.stamp = cmd.t_ingress;
+	k_spin_unlock(&group_lock, key);
+
+	k_sched_lock();
+	for(uint8_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		if(gopro_client_get_state(cam) != GP_STATE_CONNECTED){
+			continue;
+		}
+
+		cmd.cam = cam;
+		err = gopro_writer_put(&cmd, K_NO_WAIT);
+		if(err){
+			LOG_WRN("Camera %d group command dropped (err %d)",cam,err);
+			continue;
+		}
+
+		mask |= BIT(cam);
+	}
+
+	key = k_spin_lock(&group_lock);
+	if(group_shot.stamp == cmd.t_ingress){
+		group_shot.mask = mask;
+	}
+	if(mask && (cmd.cmd_type == GP_CNTRL_HANDLE_CMD)){
+		group_stat.shots++;
+		group_stat.cams = POPCOUNT(mask);
+	}
+	k_spin_unlock(&group_lock, key);
+	k_sched_unlock();
+
+	return (mask == 0) ? -ENOMSG : 0;
+}
+
+void gopro_group_issue(const struct gopro_cmd_t *gopro_cmd){
+	k_spinlock_key_t key;
+
+	if((gopro_cmd->cmd_type != GP_CNTRL_HANDLE_CMD) || (gopro_cmd->cam >= CONFIG_GOPRO_CAM_MAX)){
+		return;
+	}
+
+	key = k_spin_lock(&group_lock);
+	if((gopro_cmd->t_ingress != 0) && (gopro_cmd->t_ingress == group_shot.stamp)){
+		group_shot.t_issue[gopro_cmd->cam] = k_cycle_get_32();
+		group_shot.issued |= BIT(gopro_cmd->cam);
+	}
+	k_spin_unlock(&group_lock, key);
+}
+
+void gopro_group_sent(uint8_t cam, uint32_t handle_index, uint8_t err){
+	struct gopro_group_stat_t *stat = &group_stat;
+	k_spinlock_key_t key;
+	uint32_t now = k_cycle_get_32();
+	uint32_t skew_us = 0;
+	bool done = false;
+
+	if((handle_index != GP_CNTRL_HANDLE_CMD) || (cam >= CONFIG_GOPRO_CAM_MAX)){
+		return;
+	}
+
+	key = k_spin_lock(&group_lock);
+	if((group_shot.issued & BIT(cam)) && !(group_shot.acked & BIT(cam))){
+		if(err){
+			//Камера не приняла команду, выстрел неполный
+			group_shot.mask &= ~BIT(cam);
+			group_shot.issued &= ~BIT(cam);
+			stat->partial++;
+		}else{
+			group_shot.t_ack[cam] = now;
+			group_shot.acked |= BIT(cam);
+		}
+
+		if(group_shot.mask && (group_shot.acked == group_shot.mask)){
+			skew_us = group_spread_us(group_shot.t_ack, group_shot.acked);
+
+			stat->issue_skew_us = group_spread_us(group_shot.t_issue, group_shot.issued);
+			stat->skew_us = skew_us;
+			if((stat->skew_count == 0) || (skew_us < stat->skew_min_us)){
+				stat->skew_min_us = skew_us;
+			}
+			if(skew_us > stat->skew_max_us){
+				stat->skew_max_us = skew_us;
+			}
+			stat->skew_sum_us += skew_us;
+			stat->skew_count++;
+
+			group_shot.mask = 0;
+			done = true;
+		}
+	}
+	k_spin_unlock(&group_lock, key);
+
+	if(done){
+		LOG_INF("Group shutter skew %d us",skew_us);
+	}
+}
+
+void gopro_group_stat_get(struct gopro_group_stat_t *stat){
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&group_lock);
+	*stat = group_stat;
+	k_spin_unlock(&group_lock, key);
+}
@@ -0,0 +1,29 @@
+#ifndef GOPRO_GROUP_H
+#define GOPRO_GROUP_H
+
+#include <zephyr/kernel.h>
+
+#include "gopro_client.h"
+
+/*
+Групповой затвор: одна команда CMD всем подключенным камерам.
+Разброс старта - разница времени подтверждения записи между камерами.
+*/
+struct gopro_group_stat_t{
+	uint32_t shots;
+	uint32_t partial;			//Не все камеры подтвердили до следующего выстрела
+	uint8_t  cams;				//Камер в последнем выстреле
+	uint32_t issue_skew_us;		//Последний: разброс bt_gatt_write
+	uint32_t skew_us;			//Последний: разброс подтверждений
+	uint32_t skew_min_us;
+	uint32_t skew_max_us;
+	uint64_t skew_sum_us;
+	uint32_t skew_count;
+};
+
+int gopro_group_send(const struct gopro_cmd_t *gopro_cmd);
+void gopro_group_issue(const struct gopro_cmd_t *gopro_cmd);
+void gopro_group_sent(uint8_t cam, uint32_t handle_index, uint8_t err);
+void gopro_group_stat_get(struct gopro_group_stat_t *stat);
+
+#endif
@@ -0,0 +1,160 @@
+#include "gopro_latency.h"
+
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(gopro_latency, CONFIG_BLE_LOG_LVL);
+
+/* Запрос CMD в полете: одна запись с ответом на характеристику каждой камеры */
+struct gopro_lat_trace_t{
+	bool	 active;
+	bool	 sent;
+	uint8_t  feature;
+	uint32_t t_ingress;
+	uint32_t t_dequeue;
+	uint32_t t_issue;
+	uint32_t t_sent;
+};
+
+static struct k_spinlock lat_lock;
+static struct gopro_lat_trace_t lat_trace[CONFIG_GOPRO_CAM_MAX];
+static struct gopro_lat_hist_t lat_hist[GP_LAT_STAGE_END];
+
+static uint32_t lat_us(uint32_t from, uint32_t to){
+	return k_cyc_to_us_floor32(to - from);
+}
+
+static void lat_add(enum gopro_lat_stage_t stage, uint32_t us){
+	struct gopro_lat_hist_t *hist = &lat_hist[stage];
+	uint32_t bucket;
+
+	bucket = (us > 1) ? (31 - __builtin_clz(us)) : 0;
+	bucket = MIN(bucket, GP_LAT_BUCKETS - 1);
+
+	if((hist->count == 0) || (us < hist->min_us)){
+		hist->min_us = us;
+	}
+
+	if(us > hist->max_us){
+		hist->max_us = us;
+	}
+
+	hist->count++;
+	hist->sum_us += us;
+
+	if(hist->bucket[bucket] < UINT16_MAX){
+		hist->bucket[bucket]++;
+	}
+}
+
+/* Только первый пакет команды CMD со входной меткой: продолжения и ответы без запроса не считаются */
+void gopro_latency_issue(const struct gopro_cmd_t *gopro_cmd){
+	struct gopro_lat_trace_t *trace;
+	k_spinlock_key_t key;
+
+	if((gopro_cmd->cmd_type != GP_CNTRL_HANDLE_CMD) || (gopro_cmd->t_ingress == 0) || (gopro_cmd->len < 2)){
+		return;
+	}
+
+	if(gopro_cmd->cam >= CONFIG_GOPRO_CAM_MAX){
+		return;
+	}
+
+	trace = &lat_trace[gopro_cmd->cam];
+
+	key = k_spin_lock(&lat_lock);
+	trace->active = true;
+	trace->sent = false;
+	trace->feature = gopro_cmd->data[1];
+	trace->t_ingress = gopro_cmd->t_ingress;
+	trace->t_dequeue = gopro_cmd->t_dequeue;
+	trace->t_issue = k_cycle_get_32();
+	k_spin_unlock(&lat_lock, key);
+}
+
+void gopro_latency_sent(uint8_t cam, uint32_t handle_index, uint8_t err){
+	struct gopro_lat_trace_t *trace;
+	k_spinlock_key_t key;
+	uint32_t now = k_cycle_get_32();
+
+	if((handle_index != GP_CNTRL_HANDLE_CMD) || (cam >= CONFIG_GOPRO_CAM_MAX)){
+		return;
+	}
+
+	trace = &lat_trace[cam];
+
+	key = k_spin_lock(&lat_lock);
+	if(trace->active && !trace->sent){
+		if(err){
+			trace->active = false;
+		}else{
+			trace->sent = true;
+			trace->t_sent = now;
+
+			lat_add(GP_LAT_QUEUE, lat_us(trace->t_ingress, trace->t_dequeue));
+			lat_add(GP_LAT_WRITER, lat_us(trace->t_dequeue, trace->t_issue));
+			lat_add(GP_LAT_ACK, lat_us(trace->t_issue, now));
+			lat_add(GP_LAT_TO_ACK, lat_us(trace->t_ingress, now));
+		}
+	}
+	k_spin_unlock(&lat_lock, key);
+}
+
+/* Ответ на команду: [заголовок 5 или 13 бит][id команды][статус]... */
+void gopro_latency_response(uint8_t cam, uint32_t handle_index, const uint8_t *data, uint16_t len){
+	struct gopro_lat_trace_t *trace;
+	k_spinlock_key_t key;
+	uint32_t now = k_cycle_get_32();
+	uint32_t total_us = 0;
+	uint8_t header_len;
+	bool done = false;
+
+	if((handle_index != GP_CNTRL_HANDLE_CMD) || (cam >= CONFIG_GOPRO_CAM_MAX) || (len < 2) || (data[0] & 0x80)){
+		return;
+	}
+
+	header_len = ((data[0] & 0x60) == 0x20) ? 2 : 1;
+	if(((data[0] & 0x60) > 0x20) || (len <= header_len)){
+		return;
+	}
+
+	trace = &lat_trace[cam];
+
+	key = k_spin_lock(&lat_lock);
+	if(trace->active && trace->sent && (data[header_len] == trace->feature)){
+		trace->active = false;
+		total_us = lat_us(trace->t_ingress, now);
+
+		lat_add(GP_LAT_RESPONSE, lat_us(trace->t_sent, now));
+		lat_add(GP_LAT_TO_RESPONSE, total_us);
+		done = true;
+	}
+	k_spin_unlock(&lat_lock, key);
+
+	if(done){
+		LOG_DBG("Camera %d CMD 0x%02X reply in %d us",cam,data[header_len],total_us);
+	}
+}
+
+void gopro_latency_hist_get(enum gopro_lat_stage_t stage, struct gopro_lat_hist_t *hist){
+	k_spinlock_key_t key;
+
+	if(stage >= GP_LAT_STAGE_END){
+		memset(hist, 0, sizeof(*hist));
+		return;
+	}
+
+	key = k_spin_lock(&lat_lock);
+	*hist = lat_hist[stage];
+	k_spin_unlock(&lat_lock, key);
+}
+
+void gopro_latency_reset(void){
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&lat_lock);
+	memset(lat_hist, 0, sizeof(lat_hist));
+	for(uint32_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		lat_trace[cam].active = false;
+	}
+	k_spin_unlock(&lat_lock, key);
+}
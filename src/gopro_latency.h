@@ -0,0 +1,46 @@
+#ifndef GOPRO_LATENCY_H
+#define GOPRO_LATENCY_H
+
+#include <zephyr/kernel.h>
+
+#include "gopro_client.h"
+
+#define GP_LAT_BUCKETS		20		//log2 мкс: [2^i, 2^(i+1)), последняя корзина - все что больше
+
+/*
+Этапы команды CMD (затвор, highlight) от входа до ответа камеры.
+Входная метка ставится в обработчике кнопки или CAN rx_callback.
+*/
+enum gopro_lat_stage_t{
+	GP_LAT_QUEUE,			//вход -> выборка из gopro_cmd_chan
+	GP_LAT_WRITER,			//выборка -> bt_gatt_write
+	GP_LAT_ACK,				//bt_gatt_write -> on_sent_data
+	GP_LAT_RESPONSE,		//on_sent_data -> уведомление с ответом
+	GP_LAT_TO_ACK,			//вход -> on_sent_data
+	GP_LAT_TO_RESPONSE,		//вход -> ответ
+	GP_LAT_STAGE_END
+};
+
+struct gopro_lat_hist_t{
+	uint32_t count;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t sum_us;
+	uint16_t bucket[GP_LAT_BUCKETS];
+};
+
+static inline void gopro_latency_stamp(struct gopro_cmd_t *gopro_cmd){
+	gopro_cmd->t_ingress = k_cycle_get_32() | 1;	//0 - команда без трассировки
+}
+
+static inline void gopro_latency_dequeue(struct gopro_cmd_t *gopro_cmd){
+	gopro_cmd->t_dequeue = k_cycle_get_32();
+}
+
+void gopro_latency_issue(const struct gopro_cmd_t *gopro_cmd);
+void gopro_latency_sent(uint8_t cam, uint32_t handle_index, uint8_t err);
+void gopro_latency_response(uint8_t cam, uint32_t handle_index, const uint8_t *data, uint16_t len);
+void gopro_latency_hist_get(enum gopro_lat_stage_t stage, struct gopro_lat_hist_t *hist);
+void gopro_latency_reset(void);
+
+#endif
@@ -4,20 +4,36 @@
 
 #include "gopro_protobuf.h"
 #include "gopro_client.h"
+#include "gopro_ble_discovery.h"
 #include "leds.h"
+#ifdef CONFIG_GOPRO_TIME_SYNC
+#include "gopro_time.h"
+#endif
+#ifdef CONFIG_GOPRO_READY_TRACE
+#include "gopro_ready.h"
+#endif
+#ifdef CONFIG_GOPRO_QUERY_BATCH
+#include "gopro_batch.h"
+#endif
+#ifdef CONFIG_GOPRO_PRESET_CACHE
+#include "gopro_preset.h"
+#endif
+#ifdef CONFIG_GOPRO_POLL
+#include "gopro_poll.h"
+#endif
 
-K_SEM_DEFINE(get_hw_sem, 0, 1);
 LOG_MODULE_REGISTER(gopro_packet, CONFIG_PARSE_LOG_LVL);
 
 #ifdef CONFIG_HAS_CANBUS
 ZBUS_CHAN_DECLARE(can_txdata_chan);
 #endif
 
-struct gopro_packet_t gopro_packet;
+/* Сборка многопакетных ответов у каждой камеры своя */
+static struct gopro_packet_t gopro_packet[CONFIG_GOPRO_CAM_MAX];
 
-extern struct gopro_state_t gopro_state;
+extern struct gopro_state_t gopro_state[CONFIG_GOPRO_CAM_MAX];
 
-static int gopro_parse_query_status_reply(const void *data, uint16_t length);
+static int gopro_parse_query_status_reply(struct gopro_state_t *state, const void *data, uint16_t length);
 
 static void gopro_packet_parse_cmd(struct gopro_packet_t *gopro_packet);
 static void gopro_packet_parse_query(struct gopro_packet_t *gopro_packet);
@@ -176,49 +192,63 @@ void gopro_packet_get_pkt_ptr(const struct gopro_cmd_t *gopro_cmd, uint8_t *inde
 
 };
 
-static int gopro_parse_query_status_reply(const void *data, uint16_t length){
+//Индикатор записи горит, пока пишет хотя бы одна камера
+static void gopro_packet_rec_led(void){
+	if(gopro_client_recording()){
+		gopro_led_mode_set(LED_NUM_REC,LED_MODE_ON);
+	}else{
+		gopro_led_mode_set(LED_NUM_REC,LED_MODE_OFF);
+	}
+}
+
+/* Ответ GET_STATUS: [команда][результат] и дальше [id][len][значение] по каждому запрошенному ID */
+static int gopro_parse_query_status_reply(struct gopro_state_t *state, const void *data, uint16_t length){
 	uint8_t *pdata = (uint8_t *)data;
-	int total_data_len;
-	int result;
-	int id;
+	uint32_t index = 2;
 
-	total_data_len = length;
-	id = pdata[0];
-	result = pdata[1];
-
-	uint8_t status_id = pdata[2];
-	uint8_t status_len = pdata[3];
-
-	switch (status_id)
-	{
-	case GOPRO_STATUS_ID_VIDEO_NUM:
-		gopro_state.video_count = 0;
-		for(uint32_t i=0; i<status_len; i++){
-			gopro_state.video_count = (gopro_state.video_count*256) + pdata[4+i];
-		}	
-		LOG_INF("Video count: %d",gopro_state.video_count);
-		break;
-
-	case GOPRO_STATUS_ID_BAT_PERCENT:
-		gopro_state.battery = pdata[4];
-		LOG_INF("Battery: %d",gopro_state.battery);
-		break;
-
-	case GOPRO_STATUS_ID_ENCODING:
-		gopro_state.record = pdata[4];
-		LOG_INF("Encoding: %d",gopro_state.record);
-
-		if(gopro_state.record > 0){
-			gopro_led_mode_set(LED_NUM_REC,LED_MODE_ON);
-		}else{
-			gopro_led_mode_set(LED_NUM_REC,LED_MODE_OFF);
+	while((index + 2) <= length){
+		uint8_t status_id = pdata[index];
+		uint8_t status_len = pdata[index + 1];
+		uint8_t *value = &pdata[index + 2];
+
+		index += 2 + status_len;
+		if(index > length){
+			LOG_WRN("Truncated status %d",status_id);
+			break;
 		}
 
-		break;
+		//Камера не знает этот ID
+		if(status_len == 0){
+			continue;
+		}
+
+		switch (status_id)
+		{
+		case GOPRO_STATUS_ID_VIDEO_NUM:
+			state->video_count = 0;
+			for(uint32_t i=0; i<status_len; i++){
+				state->video_count = (state->video_count*256) + value[i];
+			}	
+			LOG_INF("Video count: %d",state->video_count);
+			break;
+
+		case GOPRO_STATUS_ID_BAT_PERCENT:
+			state->battery = value[0];
+			LOG_INF("Battery: %d",state->battery);
+			break;
+
+		case GOPRO_STATUS_ID_ENCODING:
+			state->record = value[0];
+			LOG_INF("Encoding: %d",state->record);
+
+			gopro_packet_rec_led();
 
-	default:
-		LOG_WRN("Unknown status %d (0x%0X)",id,id);
-		break;
+			break;
+
+		default:
+			LOG_DBG("Unknown status %d (0x%0X)",status_id,status_id);
+			break;
+		}
 	}
 
 	//gopro_client_update_state();
@@ -226,7 +256,7 @@ static int gopro_parse_query_status_reply(const void *data, uint16_t length){
 	return 0;
 }
 
-static int gopro_parse_query_status_notify(const void *data, uint16_t length){
+static int gopro_parse_query_status_notify(struct gopro_state_t *state, const void *data, uint16_t length){
 	uint8_t *pdata = (uint8_t *)data;
 	int total_data_len;
 	int result;
@@ -260,31 +290,27 @@ static int gopro_parse_query_status_notify(const void *data, uint16_t length){
 		switch (id)
 		{
 		case GOPRO_STATUS_ID_ENCODING:
-			gopro_state.record = *pdata++;
+			state->record = *pdata++;
 			total_data_len--;
-			LOG_INF("Encoding: %d",gopro_state.record);
+			LOG_INF("Encoding: %d",state->record);
 
-			if(gopro_state.record > 0){
-				gopro_led_mode_set(LED_NUM_REC,LED_MODE_ON);
-			}else{
-				gopro_led_mode_set(LED_NUM_REC,LED_MODE_OFF);
-			}
+			gopro_packet_rec_led();
 
 			break;
 
 		case GOPRO_STATUS_ID_VIDEO_NUM:
-			gopro_state.video_count = 0;
+			state->video_count = 0;
 			for(uint32_t i=0; i<id_len; i++){
 				total_data_len--;
-				gopro_state.video_count = (gopro_state.video_count*256) + *pdata++;
+				state->video_count = (state->video_count*256) + *pdata++;
 			}	
-			LOG_INF("Video Count: %d",gopro_state.video_count);
+			LOG_INF("Video Count: %d",state->video_count);
 			break;
 
 		case GOPRO_STATUS_ID_BAT_PERCENT:
-			gopro_state.battery = *pdata++;
+			state->battery = *pdata++;
 			total_data_len--;
-			LOG_INF("Battery: %d",gopro_state.battery);
+			LOG_INF("Battery: %d",state->battery);
 			break;
 	
 
@@ -303,39 +329,47 @@ static int gopro_parse_query_status_notify(const void *data, uint16_t length){
 
 
 void gopro_packet_build(struct gopro_cmd_t *gopro_cmd){
+    struct gopro_packet_t *packet;
 
     gopro_packet_type_t packet_type = gopro_packet_get_type(gopro_cmd);
 
+    if(gopro_cmd->cam >= CONFIG_GOPRO_CAM_MAX){
+        LOG_ERR("Invalid camera %d",gopro_cmd->cam);
+        return;
+    }
+
+    packet = &gopro_packet[gopro_cmd->cam];
+
     LOG_HEXDUMP_DBG(gopro_cmd->data,gopro_cmd->len,"INPUT DATA");
 
     if(packet_type == gopro_packet_cont){
         uint8_t packet_num = gopro_cmd->data[0] & 0x0F;
-		LOG_DBG("Continuation Packet number %d for feature 0x%0X action 0x%0X",packet_num,gopro_packet.feature,gopro_packet.action);
+		LOG_DBG("Continuation Packet number %d for feature 0x%0X action 0x%0X",packet_num,packet->feature,packet->action);
 
-        gopro_packet_get_data_ptr(gopro_cmd,&gopro_packet.data_start_index,&gopro_packet.data_len);
+        gopro_packet_get_data_ptr(gopro_cmd,&packet->data_start_index,&packet->data_len);
 
-        if(gopro_packet.data == NULL){
+        if(packet->data == NULL){
             LOG_ERR("No memory ptr");
             return;
         }
         
-        if((gopro_packet.data_len+gopro_packet.saved_len) > gopro_packet.total_len){
-            LOG_ERR("Data size overflow, %d bytes of %d",(gopro_packet.data_len+gopro_packet.saved_len),gopro_packet.total_len);
-            k_free(gopro_packet.data);
-            gopro_packet.data = 0;
+        if((packet->data_len+packet->saved_len) > packet->total_len){
+            LOG_ERR("Data size overflow, %d bytes of %d",(packet->data_len+packet->saved_len),packet->total_len);
+            k_free(packet->data);
+            packet->data = 0;
             return;
         }
 
-        memcpy(&gopro_packet.data[gopro_packet.saved_len],&gopro_cmd->data[gopro_packet.data_start_index],gopro_packet.data_len);
+        memcpy(&packet->data[packet->saved_len],&gopro_cmd->data[packet->data_start_index],packet->data_len);
 
-        gopro_packet.saved_len += gopro_packet.data_len;
+        packet->saved_len += packet->data_len;
 
-        if(gopro_packet.saved_len == gopro_packet.total_len){
+        if(packet->saved_len == packet->total_len){
             LOG_INF("Full multi-packet saved");
-            //LOG_HEXDUMP_DBG(gopro_packet.data,gopro_packet.total_len,"Total packet");
-            gopro_packet_parse(&gopro_packet);
-            k_free(gopro_packet.data);
-            gopro_packet.data = 0;
+            //LOG_HEXDUMP_DBG(packet->data,packet->total_len,"Total packet");
+            gopro_packet_parse(packet);
+            k_free(packet->data);
+            packet->data = 0;
         }
  
     }else{
@@ -350,54 +384,74 @@ void gopro_packet_build(struct gopro_cmd_t *gopro_cmd){
         //     }
         // }
         // #endif
-        if(gopro_packet.data != NULL){
+        if(packet->data != NULL){
             LOG_WRN("Mem not free");
-            k_free(gopro_packet.data);
+            k_free(packet->data);
         }
         
-        memset(&gopro_packet,0,sizeof(struct gopro_packet_t));
-        gopro_packet.packet_type = gopro_cmd->cmd_type;
-        gopro_packet_get_feature(gopro_cmd,&gopro_packet.feature,&gopro_packet.action);
-        gopro_packet_get_data_ptr(gopro_cmd,&gopro_packet.data_start_index,&gopro_packet.data_len);
-        gopro_packet_get_pkt_ptr(gopro_cmd,&gopro_packet.pkt_start_index,&gopro_packet.pkt_len);
-        gopro_packet.total_len = gopro_packet_get_len(gopro_cmd);
-        gopro_packet.packet_len = gopro_packet.total_len-2; // Feature, action
-
-        if(gopro_packet.total_len == 0){
+        memset(packet,0,sizeof(struct gopro_packet_t));
+        packet->cam = gopro_cmd->cam;
+        packet->packet_type = gopro_cmd->cmd_type;
+        gopro_packet_get_feature(gopro_cmd,&packet->feature,&packet->action);
+        gopro_packet_get_data_ptr(gopro_cmd,&packet->data_start_index,&packet->data_len);
+        gopro_packet_get_pkt_ptr(gopro_cmd,&packet->pkt_start_index,&packet->pkt_len);
+        packet->total_len = gopro_packet_get_len(gopro_cmd);
+        packet->packet_len = packet->total_len-2; // Feature, action
+
+        if(packet->total_len == 0){
             LOG_ERR("Total len = 0, Skip packet");
             return;
         }
         
-        gopro_packet.data = k_malloc(gopro_packet.total_len);
+        packet->data = k_malloc(packet->total_len);
         
-        if(gopro_packet.data == NULL){
-            LOG_ERR("Can't allocate %d bytes",gopro_packet.total_len);
+        if(packet->data == NULL){
+            LOG_ERR("Can't allocate %d bytes",packet->total_len);
             return;
         }else{
-            LOG_DBG("Allocated %d bytes done",gopro_packet.total_len);
+            LOG_DBG("Allocated %d bytes done",packet->total_len);
         }
 
-        memset(gopro_packet.data,0,gopro_packet.total_len);
+        memset(packet->data,0,packet->total_len);
 
-        LOG_DBG("Copy %d bytes ",gopro_packet.pkt_len);
-        memcpy(gopro_packet.data,&gopro_cmd->data[gopro_packet.pkt_start_index],gopro_packet.pkt_len);
+        LOG_DBG("Copy %d bytes ",packet->pkt_len);
+        memcpy(packet->data,&gopro_cmd->data[packet->pkt_start_index],packet->pkt_len);
 
-        gopro_packet.saved_len = gopro_packet.pkt_len;
+        packet->saved_len = packet->pkt_len;
 
-        if(gopro_packet.saved_len == gopro_packet.total_len){
+        if(packet->saved_len == packet->total_len){
             LOG_INF("Full single-packet saved");
-            //LOG_HEXDUMP_DBG(gopro_packet.data,gopro_packet.total_len,"Total packet");
-            gopro_packet_parse(&gopro_packet);
-            k_free(gopro_packet.data);
-            gopro_packet.data = 0;
+            //LOG_HEXDUMP_DBG(packet->data,packet->total_len,"Total packet");
+            gopro_packet_parse(packet);
+            k_free(packet->data);
+            packet->data = 0;
         }
     }
 }
 
 
 void gopro_packet_parse(struct gopro_packet_t *gopro_packet){
+    bool forward = true;
 
-    can_reply(gopro_packet->packet_type,(uint8_t *)gopro_packet->data,gopro_packet->total_len);
+    #ifdef CONFIG_GOPRO_QUERY_BATCH
+    forward = !gopro_batch_reply(gopro_packet);
+    #endif
+
+    #ifdef CONFIG_GOPRO_PRESET_CACHE
+    if(forward){
+        forward = !gopro_preset_claim(gopro_packet);
+    }
+    #endif
+
+    #ifdef CONFIG_GOPRO_POLL
+    if(forward){
+        forward = !gopro_poll_claim(gopro_packet);
+    }
+    #endif
+
+    if(forward){
+        can_reply(GOPRO_BLE_ADDR(gopro_packet->cam, gopro_packet->packet_type),(uint8_t *)gopro_packet->data,gopro_packet->total_len);
+    }
 
     switch (gopro_packet->packet_type){
 
@@ -427,6 +481,7 @@ void gopro_packet_parse(struct gopro_packet_t *gopro_packet){
 }
 
 static void gopro_parse_response_hw_info(struct gopro_packet_t *gopro_packet){
+    struct gopro_state_t *state = &gopro_state[gopro_packet->cam];
     uint8_t *pdata = &gopro_packet->data[2];
     uint32_t len = gopro_packet->packet_len;
     uint32_t index = 0;
@@ -451,14 +506,14 @@ static void gopro_parse_response_hw_info(struct gopro_packet_t *gopro_packet){
     uint8_t model_name_length = pdata[index];
     index++;
     
-    if(model_name_length >= sizeof(gopro_state.model_name)){
+    if(model_name_length >= sizeof(state->model_name)){
         LOG_ERR("Invalid model name len");
         return;
     }
-    memcpy(gopro_state.model_name,&pdata[index],model_name_length);
-    gopro_state.model_name[model_name_length]=0;
+    memcpy(state->model_name,&pdata[index],model_name_length);
+    state->model_name[model_name_length]=0;
     index += model_name_length;
-    LOG_INF("Model name: %s",gopro_state.model_name);
+    LOG_INF("Model name: %s",state->model_name);
 
     uint8_t deprecated_length = pdata[index];
     index++;
@@ -467,50 +522,51 @@ static void gopro_parse_response_hw_info(struct gopro_packet_t *gopro_packet){
     //FW Version
     uint8_t firmware_version_length = pdata[index];
     index++;
-    if(firmware_version_length >= sizeof(gopro_state.firmware_version)){
+    if(firmware_version_length >= sizeof(state->firmware_version)){
         LOG_ERR("Invalid firmware_version len");
         return;
     }
-    memcpy(gopro_state.firmware_version,&pdata[index],firmware_version_length);
-    gopro_state.firmware_version[firmware_version_length]=0;
+    memcpy(state->firmware_version,&pdata[index],firmware_version_length);
+    state->firmware_version[firmware_version_length]=0;
     index += firmware_version_length;
-    LOG_INF("Firmware: %s",gopro_state.firmware_version);
+    LOG_INF("Firmware: %s",state->firmware_version);
 
     //Serial Number
     uint8_t serial_number_length = pdata[index];
     index++;
-    if(serial_number_length >= sizeof(gopro_state.serial_number)){
+    if(serial_number_length >= sizeof(state->serial_number)){
         LOG_ERR("Invalid serial_number len");
         return;
     }
-    memcpy(gopro_state.serial_number,&pdata[index],serial_number_length);
-    gopro_state.serial_number[serial_number_length]=0;
+    memcpy(state->serial_number,&pdata[index],serial_number_length);
+    state->serial_number[serial_number_length]=0;
     index += serial_number_length;
-    LOG_INF("Serial: %s",gopro_state.serial_number);
+    LOG_INF("Serial: %s",state->serial_number);
 
     //AP SSID
     uint8_t ap_ssid_length = pdata[index];
     index++;
-    if(ap_ssid_length >= sizeof(gopro_state.wifi_ssid)){
+    if(ap_ssid_length >= sizeof(state->wifi_ssid)){
         LOG_ERR("Invalid ap_ssid len");
         return;
     }
-    memcpy(gopro_state.wifi_ssid,&pdata[index],ap_ssid_length);
-    gopro_state.wifi_ssid[ap_ssid_length]=0;
+    gopro_client_wifi_check_ssid(gopro_packet->cam, (const char *)&pdata[index], ap_ssid_length);
+    memcpy(state->wifi_ssid,&pdata[index],ap_ssid_length);
+    state->wifi_ssid[ap_ssid_length]=0;
     index += ap_ssid_length;
-    LOG_INF("AP SSID: %s",gopro_state.wifi_ssid);
+    LOG_INF("AP SSID: %s",state->wifi_ssid);
 
     //AP MAC
     uint8_t ap_mac_address_length = pdata[index];
     index++;
-    if(ap_mac_address_length >= sizeof(gopro_state.ap_mac)){
+    if(ap_mac_address_length >= sizeof(state->ap_mac)){
         LOG_ERR("Invalid ap_mac_address_length len");
         return;
     }
-    memcpy(gopro_state.ap_mac,&pdata[index],ap_mac_address_length);
-    gopro_state.ap_mac[ap_mac_address_length]=0;
+    memcpy(state->ap_mac,&pdata[index],ap_mac_address_length);
+    state->ap_mac[ap_mac_address_length]=0;
     index += ap_mac_address_length;
-    LOG_INF("AP MAC: %s",gopro_state.ap_mac);
+    LOG_INF("AP MAC: %s",state->ap_mac);
 
     index += 11; //reserved data not part of the payload
     if(index == len){
@@ -550,7 +606,7 @@ static void gopro_packet_parse_cmd(struct gopro_packet_t *gopro_packet){
         case 0:
             LOG_INF("Status OK");
             gopro_parse_response_hw_info(gopro_packet);
-            k_sem_give(&get_hw_sem);
+            gopro_bringup_event(gopro_packet->cam, GP_BRINGUP_HW_INFO);
             break;
         case 1:
             LOG_ERR("Status Error");
@@ -565,8 +621,22 @@ static void gopro_packet_parse_cmd(struct gopro_packet_t *gopro_packet){
         }
     }
 
+    if(gopro_packet->feature == 0x0E){
+        LOG_DBG("Get Date Time response");
+        #ifdef CONFIG_GOPRO_TIME_SYNC
+        if(gopro_packet->cam == GOPRO_CAM_MAIN){
+            gopro_time_on_get_reply(gopro_packet);
+        }
+        #endif
+    }
+
     if(gopro_packet->feature == 0x0F){
         LOG_DBG("Get Set Local Time response");
+        #ifdef CONFIG_GOPRO_TIME_SYNC
+        if(gopro_packet->cam == GOPRO_CAM_MAIN){
+            gopro_time_on_set_reply(gopro_packet->action);
+        }
+        #endif
         switch (gopro_packet->action)
         {
         case 0:
@@ -598,6 +668,13 @@ static void gopro_packet_parse_query(struct gopro_packet_t *gopro_packet){
         case 0xEE:
             gopro_parse_response_cohn_cert(&gopro_packet->data[2],gopro_packet->packet_len);
             break;
+
+        #ifdef CONFIG_GOPRO_PRESET_CACHE
+        case GOPRO_PRESET_ACTION_REPLY:
+        case GOPRO_PRESET_ACTION_NOTIFY:
+            gopro_preset_parse(gopro_packet);
+            break;
+        #endif
             
         default:
             LOG_WRN("Unknown QUERY action 0xF5:0x%0X",gopro_packet->action);
@@ -607,7 +684,13 @@ static void gopro_packet_parse_query(struct gopro_packet_t *gopro_packet){
 
     if( (gopro_packet->feature == GOPRO_QUERY_STATUS_REG_STATUS)||(gopro_packet->feature == GOPRO_QUERY_STATUS_REG_STATUS_NOTIFY)){
         if(gopro_packet->action == 0){
-            gopro_parse_query_status_notify(gopro_packet->data, gopro_packet->total_len);
+            gopro_parse_query_status_notify(&gopro_state[gopro_packet->cam], gopro_packet->data, gopro_packet->total_len);
+            if(gopro_packet->feature == GOPRO_QUERY_STATUS_REG_STATUS){
+                #ifdef CONFIG_GOPRO_READY_TRACE
+                gopro_ready_mark(gopro_packet->cam, GP_READY_STARTUP);
+                #endif
+                gopro_bringup_event(gopro_packet->cam, GP_BRINGUP_REG_STATUS);
+            }
         }else{
             LOG_ERR("REG Result not OK: %d",gopro_packet->action);
         }	
@@ -615,7 +698,7 @@ static void gopro_packet_parse_query(struct gopro_packet_t *gopro_packet){
 
     if(gopro_packet->feature == GOPRO_QUERY_STATUS_GET_STATUS){
         if(gopro_packet->action == 0){
-            gopro_parse_query_status_reply(gopro_packet->data, gopro_packet->total_len);
+            gopro_parse_query_status_reply(&gopro_state[gopro_packet->cam], gopro_packet->data, gopro_packet->total_len);
         }else{
             LOG_ERR("REG Result not OK: %d",gopro_packet->action);
         }	
@@ -15,6 +15,7 @@ struct gopro_packet_t {
     uint8_t   pkt_start_index;      //Индекс начала полезной нагрузки в текущем пакете, поле feature
     uint8_t   data_start_index;     //Индекс начала данных в текущем пакете
     uint8_t   packet_type;          //Источник пакета, (cmd, query, settings...)
+    uint8_t   cam;                  //Камера, от которой пришел пакет
     uint8_t   feature;              
     uint8_t   action;
     uint8_t   *data;
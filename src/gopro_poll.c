@@ -0,0 +1,468 @@
+#include "gopro_poll.h"
+#include "gopro_ids.h"
+#include "gopro_writer.h"
+
+#include <zephyr/logging/log.h>
+#ifdef CONFIG_GOPRO_TIME_SYNC
+#include "gopro_time.h"
+#endif
+
+LOG_MODULE_REGISTER(gopro_poll, CONFIG_BLE_LOG_LVL);
+
+#define POLL_ID_WORDS			(256 / 32)
+#define POLL_IDS_PER_MSG		(GOPRO_CMD_DATA_LEN - 2)	//Длина и команда
+#define POLL_IDLE_MS			(60 * MSEC_PER_SEC)			//Нечего делать: проверить позже
+
+enum gopro_poll_kind_t{
+	GP_POLL_STATUS,
+	GP_POLL_SETTING,
+	GP_POLL_KIND_END
+};
+
+/* Очередь ID и сроки периодических запросов одной камеры, время - uptime в мс */
+struct gopro_poll_cam_t{
+	bool	 active;
+	bool	 req_pending;
+	uint32_t req_ms;
+	uint32_t keepalive_ms;
+	uint32_t refresh_ms;
+	uint32_t ids[GP_POLL_KIND_END][POLL_ID_WORDS];
+	uint32_t own[GP_POLL_KIND_END][POLL_ID_WORDS];		//Запрошены самим планировщиком
+	uint8_t  keepalive_wait;							//Keep-alive без ответа
+};
+
+static void poll_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(poll_work, poll_work_handler);
+
+static struct k_spinlock poll_lock;
+static struct gopro_poll_cam_t poll_cam[CONFIG_GOPRO_CAM_MAX];
+static struct gopro_poll_stat_t poll_stat;
+static uint32_t poll_next_ms;		//Ближайший назначенный запуск
+#ifdef CONFIG_GOPRO_TIME_SYNC
+static uint32_t poll_time_ms;
+#endif
+
+static const uint8_t poll_query_cmd[GP_POLL_KIND_END] = {
+	[GP_POLL_STATUS] = GOPRO_QUERY_STATUS_GET_STATUS,
+	[GP_POLL_SETTING] = GOPRO_QUERY_STATUS_GET_SETTING,
+};
+
+/* Статусы, которые обновляются, даже если push регистрации потерялся */
+static const uint8_t poll_refresh_status[] = {
+	GOPRO_STATUS_ID_ENCODING,
+	GOPRO_STATUS_ID_VIDEO_NUM,
+	GOPRO_STATUS_ID_BAT_PERCENT,
+};
+
+static int poll_kind(uint8_t query){
+
+	switch (query)
+	{
+	case GOPRO_QUERY_STATUS_GET_STATUS:
+		return GP_POLL_STATUS;
+	case GOPRO_QUERY_STATUS_GET_SETTING:
+		return GP_POLL_SETTING;
+	default:
+		return -ENOTSUP;
+	}
+}
+
+static const struct gopro_cmd_t gopro_keep_alive = {
+	.len = 4,
+	.cmd_type = GP_CNTRL_HANDLE_SETTINGS,
+	.data = {3, GOPRO_SETTING_ID_KEEP_ALIVE, 1, GOPRO_KEEP_ALIVE_VALUE}
+};
+
+/* Срок наступил или наступит в пределах окна */
+static inline bool poll_due(uint32_t deadline_ms, uint32_t horizon_ms){
+	return (int32_t)(horizon_ms - deadline_ms) >= 0;
+}
+
+static inline uint32_t poll_min(uint32_t next_ms, uint32_t deadline_ms){
+	return ((int32_t)(deadline_ms - next_ms) < 0) ? deadline_ms : next_ms;
+}
+
+/* Раньше уже назначенного запуска - перенести, иначе он сам заберет запрос */
+static void poll_kick(uint32_t deadline_ms){
+	k_spinlock_key_t key;
+	int32_t delay_ms;
+	bool kick = false;
+
+	key = k_spin_lock(&poll_lock);
+	if(!poll_due(poll_next_ms, deadline_ms) || !k_work_delayable_is_pending(&poll_work)){
+		poll_next_ms = deadline_ms;
+		kick = true;
+	}
+	k_spin_unlock(&poll_lock, key);
+
+	if(kick){
+		delay_ms = deadline_ms - k_uptime_get_32();
+		k_work_reschedule(&poll_work, K_MSEC(MAX(delay_ms, 0)));
+	}
+}
+
+/* -ENOTCONN: камера не поднята, запрос не принят */
+static int poll_request(uint8_t cam, enum gopro_poll_kind_t kind, uint8_t id){
+	struct gopro_poll_cam_t *pc;
+	k_spinlock_key_t key;
+	uint32_t deadline_ms = 0;
+	bool kick = false;
+	int err = -ENOTCONN;
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return -EINVAL;
+	}
+
+	pc = &poll_cam[cam];
+
+	key = k_spin_lock(&poll_lock);
+	if(pc->active){
+		err = 0;
+		pc->ids[kind][id / 32] |= BIT(id % 32);
+		if(!pc->req_pending){
+			pc->req_pending = true;
+			pc->req_ms = k_uptime_get_32() + CONFIG_GOPRO_POLL_WINDOW_MS;
+			deadline_ms = pc->req_ms;
+			kick = true;
+		}
+	}
+	k_spin_unlock(&poll_lock, key);
+
+	if(kick){
+		poll_kick(deadline_ms);
+	}
+
+	return err;
+}
+
+int gopro_poll_status(uint8_t cam, uint8_t id){
+	return poll_request(cam, GP_POLL_STATUS, id);
+}
+
+int gopro_poll_setting(uint8_t cam, uint8_t id){
+	return poll_request(cam, GP_POLL_SETTING, id);
+}
+
+void gopro_poll_connected(uint8_t cam){
+	struct gopro_poll_cam_t *pc;
+	k_spinlock_key_t key;
+	uint32_t now = k_uptime_get_32();
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return;
+	}
+
+	pc = &poll_cam[cam];
+
+	//Статусы только что пришли в ответ на регистрацию, первый круг через полный период
+	key = k_spin_lock(&poll_lock);
+	memset(pc, 0, sizeof(*pc));
+	pc->active = true;
+	pc->keepalive_ms = now + CONFIG_GOPRO_KEEPALIVE_PERIOD * MSEC_PER_SEC;
+	pc->refresh_ms = now + CONFIG_GOPRO_STATUS_REFRESH_PERIOD * MSEC_PER_SEC;
+	#ifdef CONFIG_GOPRO_TIME_SYNC
+	if(cam == GOPRO_CAM_MAIN){
+		poll_time_ms = now + CONFIG_GOPRO_TIME_SYNC_PERIOD * MSEC_PER_SEC;
+	}
+	#endif
+	k_spin_unlock(&poll_lock, key);
+
+	poll_kick(now + CONFIG_GOPRO_KEEPALIVE_PERIOD * MSEC_PER_SEC);
+}
+
+void gopro_poll_disconnected(uint8_t cam){
+	k_spinlock_key_t key;
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return;
+	}
+
+	key = k_spin_lock(&poll_lock);
+	poll_cam[cam].active = false;
+	poll_cam[cam].req_pending = false;
+	poll_cam[cam].keepalive_wait = 0;
+	memset(poll_cam[cam].own, 0, sizeof(poll_cam[cam].own));
+	k_spin_unlock(&poll_lock, key);
+}
+
+/* TLV ответа запрошен планировщиком: снять отметку, на CAN его не отдавать */
+bool gopro_poll_own_take(uint8_t cam, uint8_t query, uint8_t id){
+	uint32_t *own;
+	k_spinlock_key_t key;
+	int kind = poll_kind(query);
+	bool taken;
+
+	if((cam >= CONFIG_GOPRO_CAM_MAX) || (kind < 0)){
+		return false;
+	}
+
+	own = poll_cam[cam].own[kind];
+
+	key = k_spin_lock(&poll_lock);
+	taken = (own[id / 32] & BIT(id % 32)) != 0;
+	own[id / 32] &= ~BIT(id % 32);
+	k_spin_unlock(&poll_lock, key);
+
+	return taken;
+}
+
+/*
+true - ответ на keep-alive или запрос, где все ID запросил сам планировщик.
+Если в ответе есть и чужие ID, он пересылается целиком.
+*/
+bool gopro_poll_claim(const struct gopro_packet_t *gopro_packet){
+	struct gopro_poll_cam_t *pc;
+	k_spinlock_key_t key;
+	const uint8_t *pdata = gopro_packet->data;
+	uint32_t length = gopro_packet->total_len;
+	uint32_t index = 2;
+	uint32_t count = 0;
+	bool claim = false;
+	int kind;
+
+	if((gopro_packet->cam >= CONFIG_GOPRO_CAM_MAX) || (length < 2)){
+		return false;
+	}
+
+	pc = &poll_cam[gopro_packet->cam];
+
+	if(gopro_packet->packet_type == GP_CNTRL_HANDLE_SETTINGS){
+		if(gopro_packet->feature != GOPRO_SETTING_ID_KEEP_ALIVE){
+			return false;
+		}
+
+		key = k_spin_lock(&poll_lock);
+		if(pc->keepalive_wait > 0){
+			pc->keepalive_wait--;
+			poll_stat.claimed++;
+			claim = true;
+		}
+		k_spin_unlock(&poll_lock, key);
+
+		return claim;
+	}
+
+	if(gopro_packet->packet_type != GP_CNTRL_HANDLE_QUERY){
+		return false;
+	}
+
+	kind = poll_kind(gopro_packet->feature);
+	if((kind < 0) || (gopro_packet->action != 0)){
+		return false;
+	}
+
+	key = k_spin_lock(&poll_lock);
+	claim = true;
+	while((index + 2) <= length){
+		uint8_t id = pdata[index];
+
+		if(!(pc->own[kind][id / 32] & BIT(id % 32))){
+			claim = false;
+		}
+		count++;
+		index += 2 + pdata[index + 1];
+	}
+
+	index = 2;
+	while((index + 2) <= length){
+		uint8_t id = pdata[index];
+
+		pc->own[kind][id / 32] &= ~BIT(id % 32);
+		index += 2 + pdata[index + 1];
+	}
+
+	claim = claim && (count > 0);
+	if(claim){
+		poll_stat.claimed++;
+	}
+	k_spin_unlock(&poll_lock, key);
+
+	return claim;
+}
+
+void gopro_poll_stat_get(struct gopro_poll_stat_t *stat){
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&poll_lock);
+	*stat = poll_stat;
+	k_spin_unlock(&poll_lock, key);
+}
+
+static int poll_put(const struct gopro_cmd_t *gopro_cmd){
+	k_spinlock_key_t key;
+	int err;
+
+	err = gopro_writer_put(gopro_cmd, K_NO_WAIT);
+	if(err != 0){
+		key = k_spin_lock(&poll_lock);
+		poll_stat.drops++;
+		k_spin_unlock(&poll_lock, key);
+	}
+
+	return err;
+}
+
+/* Все ID одного вида - в минимум сообщений по POLL_IDS_PER_MSG */
+static void poll_send_ids(uint8_t cam, enum gopro_poll_kind_t kind, const uint32_t *ids){
+	struct gopro_cmd_t gopro_cmd = {0};
+	k_spinlock_key_t key;
+	uint32_t count = 0;
+	uint32_t msgs = 0;
+	uint8_t n = 0;
+
+	gopro_cmd.cam = cam;
+	gopro_cmd.cmd_type = GP_CNTRL_HANDLE_QUERY;
+	gopro_cmd.data[1] = poll_query_cmd[kind];
+
+	for(uint32_t id=0; id<(POLL_ID_WORDS * 32); id++){
+		if(!(ids[id / 32] & BIT(id % 32))){
+			continue;
+		}
+
+		gopro_cmd.data[2 + n++] = id;
+		count++;
+
+		if(n == POLL_IDS_PER_MSG){
+			gopro_cmd.data[0] = n + 1;
+			gopro_cmd.len = n + 2;
+			poll_put(&gopro_cmd);
+			msgs++;
+			n = 0;
+		}
+	}
+
+	if(n > 0){
+		gopro_cmd.data[0] = n + 1;
+		gopro_cmd.len = n + 2;
+		poll_put(&gopro_cmd);
+		msgs++;
+	}
+
+	if(msgs == 0){
+		return;
+	}
+
+	key = k_spin_lock(&poll_lock);
+	if(kind == GP_POLL_STATUS){
+		poll_stat.status_msgs += msgs;
+	}else{
+		poll_stat.setting_msgs += msgs;
+	}
+	poll_stat.ids += count;
+	poll_stat.merged += count - msgs;
+	k_spin_unlock(&poll_lock, key);
+}
+
+/*
+Один проход по всем камерам: все, что наступает в пределах окна, уходит сейчас.
+Так keep-alive, обновление статусов и запросы ID сходятся в один connection event,
+а сроки периодических задач после первого совпадения дальше идут вместе.
+*/
+static void poll_work_handler(struct k_work *work){
+	uint32_t ids[GP_POLL_KIND_END][POLL_ID_WORDS];
+	struct gopro_poll_cam_t *pc;
+	k_spinlock_key_t key;
+	uint32_t now = k_uptime_get_32();
+	uint32_t horizon = now + CONFIG_GOPRO_POLL_WINDOW_MS;
+	uint32_t next = now + POLL_IDLE_MS;
+	bool keepalive;
+	bool send_ids;
+
+	//Запросы во время прохода назначают свой запуск сами
+	key = k_spin_lock(&poll_lock);
+	poll_next_ms = next;
+	k_spin_unlock(&poll_lock, key);
+
+	for(uint8_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		pc = &poll_cam[cam];
+		keepalive = false;
+		send_ids = false;
+
+		key = k_spin_lock(&poll_lock);
+		if(!pc->active){
+			k_spin_unlock(&poll_lock, key);
+			continue;
+		}
+
+		if(poll_due(pc->keepalive_ms, horizon)){
+			pc->keepalive_ms = now + CONFIG_GOPRO_KEEPALIVE_PERIOD * MSEC_PER_SEC;
+			keepalive = true;
+		}
+
+		if(poll_due(pc->refresh_ms, horizon)){
+			pc->refresh_ms = now + CONFIG_GOPRO_STATUS_REFRESH_PERIOD * MSEC_PER_SEC;
+			for(uint32_t i=0; i<ARRAY_SIZE(poll_refresh_status); i++){
+				pc->ids[GP_POLL_STATUS][poll_refresh_status[i] / 32] |= BIT(poll_refresh_status[i] % 32);
+				pc->own[GP_POLL_STATUS][poll_refresh_status[i] / 32] |= BIT(poll_refresh_status[i] % 32);
+			}
+			pc->req_pending = true;
+			pc->req_ms = now;
+		}
+
+		if(pc->req_pending && poll_due(pc->req_ms, horizon)){
+			memcpy(ids, pc->ids, sizeof(ids));
+			memset(pc->ids, 0, sizeof(pc->ids));
+			pc->req_pending = false;
+			send_ids = true;
+		}
+
+		next = poll_min(next, pc->keepalive_ms);
+		next = poll_min(next, pc->refresh_ms);
+		if(pc->req_pending){
+			next = poll_min(next, pc->req_ms);
+		}
+		k_spin_unlock(&poll_lock, key);
+
+		if(gopro_client_get_state(cam) != GP_STATE_CONNECTED){
+			continue;
+		}
+
+		if(keepalive){
+			struct gopro_cmd_t gopro_cmd = gopro_keep_alive;
+
+			gopro_cmd.cam = cam;
+			if(poll_put(&gopro_cmd) == 0){
+				key = k_spin_lock(&poll_lock);
+				poll_stat.keepalives++;
+				if(pc->keepalive_wait < UINT8_MAX){
+					pc->keepalive_wait++;
+				}
+				k_spin_unlock(&poll_lock, key);
+			}
+		}
+
+		if(send_ids){
+			for(uint32_t kind=0; kind<GP_POLL_KIND_END; kind++){
+				poll_send_ids(cam, kind, ids[kind]);
+			}
+		}
+	}
+
+	#ifdef CONFIG_GOPRO_TIME_SYNC
+	if(poll_cam[GOPRO_CAM_MAIN].active){
+		bool time_sync = false;
+
+		key = k_spin_lock(&poll_lock);
+		if(poll_due(poll_time_ms, horizon)){
+			poll_time_ms = now + CONFIG_GOPRO_TIME_SYNC_PERIOD * MSEC_PER_SEC;
+			poll_stat.time_syncs++;
+			time_sync = true;
+		}
+		next = poll_min(next, poll_time_ms);
+		k_spin_unlock(&poll_lock, key);
+
+		if(time_sync){
+			gopro_time_sync_request();
+		}
+	}
+	#endif
+
+	key = k_spin_lock(&poll_lock);
+	next = poll_min(next, poll_next_ms);
+	poll_next_ms = next;
+	k_spin_unlock(&poll_lock, key);
+
+	//Не перебивает запуск, назначенный запросом после снятия блокировки
+	k_work_schedule(&poll_work, K_MSEC(MAX((int32_t)(next - now), 0)));
+}
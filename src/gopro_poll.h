@@ -0,0 +1,37 @@
+#ifndef GOPRO_POLL_H
+#define GOPRO_POLL_H
+
+#include <zephyr/kernel.h>
+
+#include "gopro_client.h"
+#include "gopro_packet.h"
+
+#define GOPRO_SETTING_ID_KEEP_ALIVE		91
+#define GOPRO_KEEP_ALIVE_VALUE			66
+
+/*
+Весь периодический трафик к камерам: keep-alive, обновление статусов, проверка часов.
+Запросы, попавшие в одно окно CONFIG_GOPRO_POLL_WINDOW_MS, уходят одним
+GET_STATUS/GET_SETTING со списком ID. Ответы на собственные keep-alive и
+обновление статусов разбираются, но на CAN не пересылаются.
+*/
+struct gopro_poll_stat_t{
+	uint32_t keepalives;
+	uint32_t status_msgs;
+	uint32_t setting_msgs;
+	uint32_t ids;				//ID во всех запросах
+	uint32_t merged;			//ID, ушедшие не отдельным сообщением
+	uint32_t time_syncs;
+	uint32_t drops;				//Очередь записи не приняла
+	uint32_t claimed;			//Свои ответы, не ушедшие на CAN
+};
+
+int  gopro_poll_status(uint8_t cam, uint8_t id);
+int  gopro_poll_setting(uint8_t cam, uint8_t id);
+void gopro_poll_connected(uint8_t cam);
+void gopro_poll_disconnected(uint8_t cam);
+bool gopro_poll_own_take(uint8_t cam, uint8_t query, uint8_t id);
+bool gopro_poll_claim(const struct gopro_packet_t *gopro_packet);
+void gopro_poll_stat_get(struct gopro_poll_stat_t *stat);
+
+#endif
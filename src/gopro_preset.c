@@ -0,0 +1,472 @@
+#include "gopro_preset.h"
+#include "gopro_protobuf.h"
+#include "gopro_writer.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/init.h>
+#include <zephyr/sys/byteorder.h>
+#include <string.h>
+
+#include "src/protobuf/preset_status.pb.h"
+#include "src/protobuf/request_get_preset_status.pb.h"
+
+#include <pb_encode.h>
+#include <pb_decode.h>
+
+LOG_MODULE_REGISTER(gopro_preset, CONFIG_PARSE_LOG_LVL);
+
+#define PRESET_TABLE_ENTRY_LEN		6
+
+enum gopro_preset_flag_t{
+	GP_PRESET_VALID,
+	GP_PRESET_FETCHING,			//Ответ 0xF2 на свой запрос - на CAN не пересылается
+	GP_PRESET_TABLE_WAIT,		//CAN запросил таблицу до ответа камеры
+};
+
+struct gopro_preset_cache_t{
+	atomic_t flags;
+	uint32_t count;
+	uint32_t updates;
+	uint8_t  tries;
+	struct k_work_delayable fetch_work;
+	struct gopro_preset_t preset[CONFIG_GOPRO_PRESET_MAX];
+};
+
+/* Разбор идет в потоке приема BLE, для всех камер один */
+struct gopro_preset_stage_t{
+	const open_gopro_PresetGroup *group;
+	uint32_t count;
+	uint32_t skipped;
+	struct gopro_preset_t preset[CONFIG_GOPRO_PRESET_MAX];
+};
+
+static struct k_spinlock preset_lock;
+static struct gopro_preset_cache_t preset_cache[CONFIG_GOPRO_CAM_MAX];
+static struct gopro_preset_stage_t preset_stage;
+
+K_MUTEX_DEFINE(preset_table_mutex);
+
+static const uint8_t preset_register[] = {
+	open_gopro_EnumRegisterPresetStatus_REGISTER_PRESET_STATUS_PRESET,
+	open_gopro_EnumRegisterPresetStatus_REGISTER_PRESET_STATUS_PRESET_GROUP_ARRAY,
+};
+
+static bool preset_encode_register(pb_ostream_t *stream, const pb_field_t *field, void * const *arg){
+
+	for(uint32_t i=0; i<ARRAY_SIZE(preset_register); i++){
+		if(!pb_encode_tag_for_field(stream, field) || !pb_encode_varint(stream, preset_register[i])){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static uint8_t preset_group_index(const open_gopro_PresetGroup *group){
+
+	if((group == NULL) || !group->has_id){
+		return GOPRO_PRESET_GROUP_UNKNOWN;
+	}
+
+	switch (group->id)
+	{
+	case open_gopro_EnumPresetGroup_PRESET_GROUP_ID_VIDEO:
+		return 0;
+	case open_gopro_EnumPresetGroup_PRESET_GROUP_ID_PHOTO:
+		return 1;
+	case open_gopro_EnumPresetGroup_PRESET_GROUP_ID_TIMELAPSE:
+		return 2;
+	default:
+		return GOPRO_PRESET_GROUP_UNKNOWN;
+	}
+}
+
+//Список настроек и имя не нужны: без callback nanopb их пропускает
+static bool preset_decode_preset(pb_istream_t *stream, const pb_field_t *field, void **arg){
+	struct gopro_preset_stage_t *stage = (struct gopro_preset_stage_t *)*arg;
+	open_gopro_Preset msg = open_gopro_Preset_init_zero;
+	struct gopro_preset_t *preset;
+
+	if(!pb_decode(stream, open_gopro_Preset_fields, &msg)){
+		return false;
+	}
+
+	if(!msg.has_id){
+		return true;
+	}
+
+	if(stage->count >= CONFIG_GOPRO_PRESET_MAX){
+		stage->skipped++;
+		return true;
+	}
+
+	preset = &stage->preset[stage->count++];
+	preset->id = msg.id;
+	preset->mode = (msg.has_mode && (msg.mode >= 0) && (msg.mode < GOPRO_PRESET_MODE_UNKNOWN)) ? msg.mode : GOPRO_PRESET_MODE_UNKNOWN;
+	preset->group = preset_group_index(stage->group);
+	preset->title = msg.has_title_id ? MIN(msg.title_id, UINT8_MAX) : 0;
+	preset->flags = 0;
+
+	if(msg.has_user_defined && msg.user_defined){
+		preset->flags |= GOPRO_PRESET_FLAG_USER;
+	}
+
+	if(msg.has_is_modified && msg.is_modified){
+		preset->flags |= GOPRO_PRESET_FLAG_MODIFIED;
+	}
+
+	return true;
+}
+
+//id группы идет в сообщении раньше списка пресетов
+static bool preset_decode_group(pb_istream_t *stream, const pb_field_t *field, void **arg){
+	struct gopro_preset_stage_t *stage = (struct gopro_preset_stage_t *)*arg;
+	open_gopro_PresetGroup msg = open_gopro_PresetGroup_init_zero;
+	bool ret;
+
+	msg.preset_array.funcs.decode = preset_decode_preset;
+	msg.preset_array.arg = stage;
+
+	stage->group = &msg;
+	ret = pb_decode(stream, open_gopro_PresetGroup_fields, &msg);
+	stage->group = NULL;
+
+	return ret;
+}
+
+static int preset_fetch_send(uint8_t cam){
+	struct gopro_cmd_t gopro_cmd = {0};
+	int err;
+
+	open_gopro_RequestGetPresetStatus req = open_gopro_RequestGetPresetStatus_init_zero;
+
+	req.register_preset_status.funcs.encode = preset_encode_register;
+
+	pb_ostream_t stream = pb_ostream_from_buffer(&gopro_cmd.data[3], GOPRO_CMD_DATA_LEN-3);
+	if(!pb_encode(&stream, open_gopro_RequestGetPresetStatus_fields, &req)){
+		LOG_ERR("Encode failed: %s", PB_GET_ERROR(&stream));
+		return -EIO;
+	}
+
+	gopro_cmd.cmd_type = GP_CNTRL_HANDLE_QUERY;
+	gopro_cmd.cam = cam;
+	gopro_cmd.data[0] = stream.bytes_written+2;
+	gopro_cmd.data[1] = GOPRO_PRESET_FEATURE;
+	gopro_cmd.data[2] = GOPRO_PRESET_ACTION_GET;
+	gopro_cmd.len = gopro_cmd.data[0]+1;
+
+	atomic_set_bit(&preset_cache[cam].flags, GP_PRESET_FETCHING);
+
+	err = gopro_writer_put(&gopro_cmd, K_NO_WAIT);
+	if(err != 0){
+		LOG_ERR("Camera %d preset request failed: %d",cam,err);
+		atomic_clear_bit(&preset_cache[cam].flags, GP_PRESET_FETCHING);
+		return err;
+	}
+
+	k_work_reschedule(&preset_cache[cam].fetch_work, GOPRO_PRESET_FETCH_TIMEOUT);
+
+	return 0;
+}
+
+/* Ответа нет: CAN, ждущий таблицу, получает пустую */
+static void preset_fetch_fail(uint8_t cam){
+	uint8_t table[2] = {GOPRO_CTRL_PRESET_TABLE, 0};
+
+	atomic_clear_bit(&preset_cache[cam].flags, GP_PRESET_FETCHING);
+
+	if(atomic_test_and_clear_bit(&preset_cache[cam].flags, GP_PRESET_TABLE_WAIT)){
+		can_reply(GOPRO_BLE_ADDR(cam, 0xFF), table, sizeof(table));
+	}
+}
+
+static void preset_fetch_timeout(struct k_work *work){
+	struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+	struct gopro_preset_cache_t *cache = CONTAINER_OF(dwork, struct gopro_preset_cache_t, fetch_work);
+	uint8_t cam = cache - preset_cache;
+
+	if(!atomic_test_bit(&cache->flags, GP_PRESET_FETCHING)){
+		return;
+	}
+
+	if(++cache->tries < GOPRO_PRESET_FETCH_TRIES){
+		LOG_WRN("Camera %d preset request timeout, retry",cam);
+		if(preset_fetch_send(cam) == 0){
+			return;
+		}
+	}
+
+	LOG_ERR("Camera %d presets not received",cam);
+	preset_fetch_fail(cam);
+}
+
+static int gopro_preset_init(void){
+
+	for(uint32_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		k_work_init_delayable(&preset_cache[cam].fetch_work, preset_fetch_timeout);
+	}
+
+	return 0;
+}
+
+SYS_INIT(gopro_preset_init, APPLICATION, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+
+int gopro_preset_fetch(uint8_t cam){
+	int err;
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return -EINVAL;
+	}
+
+	preset_cache[cam].tries = 0;
+
+	err = preset_fetch_send(cam);
+	if(err){
+		preset_fetch_fail(cam);
+	}
+
+	return err;
+}
+
+/* Регистрация на изменения живет, пока живет соединение */
+void gopro_preset_connected(uint8_t cam){
+	gopro_preset_fetch(cam);
+}
+
+void gopro_preset_disconnected(uint8_t cam){
+	k_spinlock_key_t key;
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return;
+	}
+
+	k_work_cancel_delayable(&preset_cache[cam].fetch_work);
+
+	key = k_spin_lock(&preset_lock);
+	atomic_clear(&preset_cache[cam].flags);
+	preset_cache[cam].count = 0;
+	k_spin_unlock(&preset_lock, key);
+}
+
+/* Ответ на свой запрос хосту не нужен, он получит таблицу. Push 0xF3 уходят на CAN */
+bool gopro_preset_claim(const struct gopro_packet_t *gopro_packet){
+
+	if((gopro_packet->packet_type != GP_CNTRL_HANDLE_QUERY) || (gopro_packet->feature != GOPRO_PRESET_FEATURE) || (gopro_packet->cam >= CONFIG_GOPRO_CAM_MAX)){
+		return false;
+	}
+
+	return (gopro_packet->action == GOPRO_PRESET_ACTION_REPLY) && atomic_test_bit(&preset_cache[gopro_packet->cam].flags, GP_PRESET_FETCHING);
+}
+
+void gopro_preset_parse(const struct gopro_packet_t *gopro_packet){
+	struct gopro_preset_cache_t *cache;
+	struct gopro_preset_stage_t *stage = &preset_stage;
+	k_spinlock_key_t key;
+	bool table_wait;
+	bool notify;
+
+	if(gopro_packet->cam >= CONFIG_GOPRO_CAM_MAX){
+		return;
+	}
+
+	cache = &preset_cache[gopro_packet->cam];
+	notify = (gopro_packet->action == GOPRO_PRESET_ACTION_NOTIFY);
+
+	if(!notify){
+		k_work_cancel_delayable(&cache->fetch_work);
+		atomic_clear_bit(&cache->flags, GP_PRESET_FETCHING);
+	}
+
+	open_gopro_NotifyPresetStatus msg = open_gopro_NotifyPresetStatus_init_zero;
+	pb_istream_t stream = pb_istream_from_buffer(&gopro_packet->data[2], gopro_packet->packet_len);
+
+	memset(stage, 0, sizeof(*stage));
+	msg.preset_group_array.funcs.decode = preset_decode_group;
+	msg.preset_group_array.arg = stage;
+
+	if(!pb_decode(&stream, open_gopro_NotifyPresetStatus_fields, &msg)){
+		LOG_ERR("PB decode failed %s", PB_GET_ERROR(&stream));
+		if(!notify){
+			preset_fetch_fail(gopro_packet->cam);
+		}
+		return;
+	}
+
+	if(stage->skipped){
+		LOG_WRN("Camera %d: %d presets over cache size",gopro_packet->cam,stage->skipped);
+	}
+
+	key = k_spin_lock(&preset_lock);
+	memcpy(cache->preset, stage->preset, stage->count * sizeof(stage->preset[0]));
+	cache->count = stage->count;
+	cache->updates++;
+	k_spin_unlock(&preset_lock, key);
+
+	atomic_set_bit(&cache->flags, GP_PRESET_VALID);
+	table_wait = atomic_test_and_clear_bit(&cache->flags, GP_PRESET_TABLE_WAIT);
+
+	LOG_INF("Camera %d presets %s: %d",gopro_packet->cam,notify ? "changed" : "loaded",stage->count);
+
+	if(notify || table_wait){
+		gopro_preset_table_send(gopro_packet->cam);
+	}
+}
+
+int gopro_preset_get(uint8_t cam, struct gopro_preset_t *preset, uint32_t max_count, uint32_t *updates){
+	struct gopro_preset_cache_t *cache;
+	k_spinlock_key_t key;
+	uint32_t count;
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return -EINVAL;
+	}
+
+	cache = &preset_cache[cam];
+
+	if(!atomic_test_bit(&cache->flags, GP_PRESET_VALID)){
+		return -EAGAIN;
+	}
+
+	key = k_spin_lock(&preset_lock);
+	count = MIN(cache->count, max_count);
+	memcpy(preset, cache->preset, count * sizeof(preset[0]));
+	if(updates != NULL){
+		*updates = cache->updates;
+	}
+	k_spin_unlock(&preset_lock, key);
+
+	return count;
+}
+
+/* Кэш еще пуст - таблица уйдет после ответа камеры */
+int gopro_preset_table_send(uint8_t cam){
+	static uint8_t table[2 + CONFIG_GOPRO_PRESET_MAX * PRESET_TABLE_ENTRY_LEN];
+	static struct gopro_preset_t preset[CONFIG_GOPRO_PRESET_MAX];
+	uint8_t *ptr = &table[2];
+	int count;
+	int err;
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&preset_table_mutex, K_FOREVER);
+
+	count = gopro_preset_get(cam, preset, CONFIG_GOPRO_PRESET_MAX, NULL);
+	if(count == -EAGAIN){
+		k_mutex_unlock(&preset_table_mutex);
+
+		if(atomic_test_and_set_bit(&preset_cache[cam].flags, GP_PRESET_TABLE_WAIT)){
+			return -EINPROGRESS;
+		}
+
+		if(!atomic_test_bit(&preset_cache[cam].flags, GP_PRESET_FETCHING)){
+			gopro_preset_fetch(cam);
+		}
+		return -EINPROGRESS;
+	}
+
+	table[0] = GOPRO_CTRL_PRESET_TABLE;
+	table[1] = count;
+
+	for(int i=0; i<count; i++){
+		sys_put_be32(preset[i].id, ptr);
+		ptr[4] = preset[i].mode;
+		ptr[5] = preset[i].group;
+		ptr += PRESET_TABLE_ENTRY_LEN;
+	}
+
+	err = can_reply(GOPRO_BLE_ADDR(cam, 0xFF), table, ptr - table);
+	k_mutex_unlock(&preset_table_mutex);
+
+	if(err){
+		LOG_ERR("Camera %d preset table to CAN failed: %d",cam,err);
+	}
+
+	return err;
+}
+
+static int preset_load(uint8_t cam, int32_t id){
+	struct gopro_cmd_t gopro_cmd = {
+		.len = 7,
+		.cmd_type = GP_CNTRL_HANDLE_CMD,
+		.cam = cam,
+		.data = {6, GOPRO_CMD_LOAD_PRESET, 4},
+	};
+	int err;
+
+	sys_put_be32(id, &gopro_cmd.data[3]);
+
+	err = gopro_writer_put(&gopro_cmd, K_NO_WAIT);
+	if(err != 0){
+		LOG_ERR("Camera %d load preset 0x%08X failed: %d",cam,id,err);
+	}
+
+	return err;
+}
+
+/* Без кэша ID уходит как есть: ответ камеры на 0x40 придет на CAN */
+int gopro_preset_load_id(uint8_t cam, int32_t id){
+	struct gopro_preset_cache_t *cache;
+	k_spinlock_key_t key;
+	bool found = false;
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return -EINVAL;
+	}
+
+	cache = &preset_cache[cam];
+
+	if(atomic_test_bit(&cache->flags, GP_PRESET_VALID)){
+		key = k_spin_lock(&preset_lock);
+		for(uint32_t i=0; i<cache->count; i++){
+			if(cache->preset[i].id == id){
+				found = true;
+				break;
+			}
+		}
+		k_spin_unlock(&preset_lock, key);
+
+		if(!found){
+			LOG_WRN("Camera %d has no preset 0x%08X",cam,id);
+			return -ENOENT;
+		}
+	}
+
+	return preset_load(cam, id);
+}
+
+int gopro_preset_load_mode(uint8_t cam, uint8_t mode){
+	struct gopro_preset_cache_t *cache;
+	k_spinlock_key_t key;
+	int32_t id = 0;
+	bool found = false;
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return -EINVAL;
+	}
+
+	cache = &preset_cache[cam];
+
+	if(!atomic_test_bit(&cache->flags, GP_PRESET_VALID)){
+		LOG_WRN("Camera %d presets not loaded",cam);
+		return -EAGAIN;
+	}
+
+	key = k_spin_lock(&preset_lock);
+	for(uint32_t i=0; i<cache->count; i++){
+		if(cache->preset[i].mode == mode){
+			id = cache->preset[i].id;
+			found = true;
+			break;
+		}
+	}
+	k_spin_unlock(&preset_lock, key);
+
+	if(!found){
+		LOG_WRN("Camera %d has no preset for mode %d",cam,mode);
+		return -ENOENT;
+	}
+
+	return preset_load(cam, id);
+}
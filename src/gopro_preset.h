@@ -0,0 +1,59 @@
+#ifndef GOPRO_PRESET_H
+#define GOPRO_PRESET_H
+
+#include <zephyr/kernel.h>
+
+#include "gopro_client.h"
+#include "gopro_packet.h"
+
+/*
+https://gopro.github.io/OpenGoPro/ble/features/presets.html
+*/
+#define GOPRO_PRESET_FEATURE			0xF5
+#define GOPRO_PRESET_ACTION_GET			0x72	//RequestGetPresetStatus
+#define GOPRO_PRESET_ACTION_REPLY		0xF2	//NotifyPresetStatus на запрос
+#define GOPRO_PRESET_ACTION_NOTIFY		0xF3	//NotifyPresetStatus при изменении
+#define GOPRO_CMD_LOAD_PRESET			0x40
+
+#define GOPRO_PRESET_MODE_UNKNOWN		0xFF
+#define GOPRO_PRESET_GROUP_UNKNOWN		0xFF
+
+#define GOPRO_PRESET_FETCH_TIMEOUT		K_MSEC(2000)
+#define GOPRO_PRESET_FETCH_TRIES		3
+
+#define GOPRO_PRESET_FLAG_USER			BIT(0)
+#define GOPRO_PRESET_FLAG_MODIFIED		BIT(1)
+
+/* CAN control (0xFF): 0xB0 - таблица, 0xB1 id[4] - загрузить по ID, 0xB2 mode - первый пресет режима */
+#define GOPRO_CTRL_PRESET_TABLE			0xB0
+#define GOPRO_CTRL_PRESET_LOAD_ID		0xB1
+#define GOPRO_CTRL_PRESET_LOAD_MODE		0xB2
+
+/*
+Пресеты камеры без списка настроек. Группы запрашиваются один раз после подъема,
+дальше камера присылает изменения сама.
+Таблица на CAN: {0xB0, count, {id BE[4], mode, group} * count}, после каждого
+изменения тоже. Push 0xF3 пересылаются на CAN как есть, для хостов со своей регистрацией.
+Камера не ответила на запрос за GOPRO_PRESET_FETCH_TRIES попыток - ждущий 0xB0 получает
+пустую таблицу {0xB0, 0}.
+*/
+struct gopro_preset_t{
+	int32_t id;
+	uint8_t mode;			//EnumFlatMode
+	uint8_t group;			//0 - video, 1 - photo, 2 - timelapse
+	uint8_t title;			//EnumPresetTitle
+	uint8_t flags;
+};
+
+int  gopro_preset_fetch(uint8_t cam);
+void gopro_preset_connected(uint8_t cam);
+void gopro_preset_disconnected(uint8_t cam);
+bool gopro_preset_claim(const struct gopro_packet_t *gopro_packet);
+void gopro_preset_parse(const struct gopro_packet_t *gopro_packet);
+
+int  gopro_preset_get(uint8_t cam, struct gopro_preset_t *preset, uint32_t max_count, uint32_t *updates);
+int  gopro_preset_table_send(uint8_t cam);
+int  gopro_preset_load_id(uint8_t cam, int32_t id);
+int  gopro_preset_load_mode(uint8_t cam, uint8_t mode);
+
+#endif
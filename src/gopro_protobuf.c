@@ -20,6 +20,7 @@
 
 #include "gopro_packet.h"
 #include "canbus.h"
+#include "gopro_writer.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(gopro_protobuf, CONFIG_PARSE_LOG_LVL);
@@ -38,32 +39,52 @@ static uint32_t gopro_prepare_connect_new(uint8_t *data, uint32_t max_len);
 static uint32_t gopro_prepare_connect_saved(uint8_t *data, uint32_t max_len);
 static uint32_t gopro_prepare_finish_pairing(uint8_t *data, uint32_t max_len);
 
-static void gopro_send_big_data(uint8_t *data, uint32_t len, uint8_t type, uint8_t feature, uint8_t action);
+static void gopro_send_big_data(uint8_t cam, uint8_t *data, uint32_t len, uint8_t type, uint8_t feature, uint8_t action);
 
-static void can_rx_ble_subscriber_task(void *ptr1, void *ptr2, void *ptr3);
-
-extern struct k_sem can_isotp_rx_sem;
-extern struct gopro_state_t gopro_state;
+extern struct gopro_state_t gopro_state[CONFIG_GOPRO_CAM_MAX];
 
 K_SEM_DEFINE(can_reply_sem, 1, 1);
 
+/* Все ответы на CAN идут одной очередью: ISO-TP держит один ответ, порядок сохраняется */
+struct can_reply_t{
+    int32_t  ble_addr;
+    uint32_t len;
+    uint8_t  *data;
+};
+
+static void can_reply_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(can_reply_work, can_reply_work_handler);
+K_MSGQ_DEFINE(can_reply_msgq, sizeof(struct can_reply_t), CONFIG_CAN_REPLY_QUEUE_LEN, 4);
+
 const char pairing_str[]="nrf52";
 
 ZBUS_CHAN_DECLARE(gopro_cmd_chan);
 ZBUS_CHAN_DECLARE(can_tx_ble_chan);
 
-ZBUS_CHAN_DEFINE(can_rx_ble_chan,                           	/* Name */
-         struct mem_pkt_t,                       		      	/* Message type */
-         NULL,                                       	/* Validator */
-         NULL,                                       	/* User Data */
-         ZBUS_OBSERVERS(can_rx_ble_subscriber),  	        		/* observers */
-         ZBUS_MSG_INIT(0)       						/* Initial value */
-);
+K_MUTEX_DEFINE(gopro_send_cmd_mutex);
+K_MUTEX_DEFINE(gopro_send_settings_mutex);
+K_MUTEX_DEFINE(gopro_send_query_mutex);
+K_MUTEX_DEFINE(gopro_send_net_mutex);
 
+static struct k_mutex *const gopro_send_mutex[GP_CNTRL_HANDLE_END] = {
+    [GP_CNTRL_HANDLE_CMD] = &gopro_send_cmd_mutex,
+    [GP_CNTRL_HANDLE_SETTINGS] = &gopro_send_settings_mutex,
+    [GP_CNTRL_HANDLE_QUERY] = &gopro_send_query_mutex,
+    [GP_CNTRL_HANDLE_NET] = &gopro_send_net_mutex,
+};
 
-ZBUS_MSG_SUBSCRIBER_DEFINE(can_rx_ble_subscriber);
+struct bledata_decode_t{
+    int32_t ble_addr;
+    bool addr_seen;                 //ble_addr пришел раньше data
+    bool reorder;                   //Поле data в bledata_reorder_buf, мьютекс взят
+    int channel;
+    uint32_t len;
+};
 
-K_THREAD_DEFINE(can_rx_ble_subscriber_task_id, 2048, can_rx_ble_subscriber_task, NULL, NULL, NULL, 3, 0, 0);
+//data раньше ble_addr: поле ждет конца сообщения здесь
+static uint8_t bledata_reorder_buf[CONFIG_GOPRO_BLEDATA_REORDER_LEN];
+K_MUTEX_DEFINE(bledata_reorder_mutex);
 
 const char *pb_enum_result[8]={
     "(0)RESULT_UNKNOWN",
@@ -121,7 +142,6 @@ const char *pb_enum_cohn_netstate[9]={
 };
 
 uint8_t work_buff[WORK_BUFF_SIZE];
-uint8_t ble_data_buff[BLEDATA_BUFF_SIZE];
 uint8_t resp_ap_entries_buf[128];
 uint8_t *cert_buff = NULL;
 
@@ -453,18 +473,18 @@ static char *gopro_pb_cohn_state(open_gopro_EnumCOHNNetworkState state){
     }
 }
 
-int gopro_finish_pairing(void){
+int gopro_finish_pairing(uint8_t cam){
     LOG_DBG("Send RequestPairingFinish cmd");
 
     uint32_t len=gopro_prepare_finish_pairing(work_buff,WORK_BUFF_SIZE);
-    gopro_send_big_data(work_buff,len,GP_CNTRL_HANDLE_NET,0x03,0x01);
+    gopro_send_big_data(cam,work_buff,len,GP_CNTRL_HANDLE_NET,0x03,0x01);
 
     return 0;
 }
 
 static int gopro_pb_req_ap(uint8_t scan_id, uint8_t start_index, uint8_t count){
     int err;
-    struct gopro_cmd_t gopro_cmd;
+    struct gopro_cmd_t gopro_cmd = {0};
 
     LOG_DBG("Request AP from index %d, count %d",start_index, count);
 
@@ -584,28 +604,28 @@ static void __attribute__((unused)) gopro_connect_ap(struct ap_list_t *ap_list,
 
     for(uint32_t i=0; i<count; i++){
 
-        uint32_t min_len = strlen(gopro_state.cohn_net.wifi_ssid) > strlen(ap_list[i].ssid) ? strlen(ap_list[i].ssid) : strlen(gopro_state.cohn_net.wifi_ssid);
+        uint32_t min_len = strlen(gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid) > strlen(ap_list[i].ssid) ? strlen(ap_list[i].ssid) : strlen(gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid);
 
         if(min_len == 0){
             LOG_WRN("Empty str len, skip");
             continue;
         };
 
-        if( strncmp(ap_list[i].ssid, gopro_state.cohn_net.wifi_ssid,min_len) == 0 ){
+        if( strncmp(ap_list[i].ssid, gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid,min_len) == 0 ){
             if( (ap_list[i].flags & open_gopro_EnumScanEntryFlags_SCAN_FLAG_ASSOCIATED) > 0){
-                LOG_WRN("Already connected to SSID %s", gopro_state.cohn_net.wifi_ssid);
+                LOG_WRN("Already connected to SSID %s", gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid);
                 return;
             }
 
             if( (ap_list[i].flags & open_gopro_EnumScanEntryFlags_SCAN_FLAG_CONFIGURED) > 0){
-                LOG_INF("Connect to saved SSID %s",gopro_state.cohn_net.wifi_ssid);
+                LOG_INF("Connect to saved SSID %s",gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid);
                 int len = gopro_prepare_connect_saved(work_buff,WORK_BUFF_SIZE);
-                gopro_send_big_data(work_buff,len,GP_CNTRL_HANDLE_NET,0x02,0x04);
+                gopro_send_big_data(GOPRO_CAM_MAIN,work_buff,len,GP_CNTRL_HANDLE_NET,0x02,0x04);
 
             }else{
-                LOG_INF("Connect to new SSID %s",gopro_state.cohn_net.wifi_ssid);
+                LOG_INF("Connect to new SSID %s",gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid);
                 int len = gopro_prepare_connect_new(work_buff,WORK_BUFF_SIZE);
-                gopro_send_big_data(work_buff,len,GP_CNTRL_HANDLE_NET,0x02,0x05);
+                gopro_send_big_data(GOPRO_CAM_MAIN,work_buff,len,GP_CNTRL_HANDLE_NET,0x02,0x05);
             }
             
             break;
@@ -620,8 +640,8 @@ static uint32_t gopro_prepare_connect_new(uint8_t *data, uint32_t max_len){
     struct data_ptr_t ssid_encode;
     memset(&ssid_encode,0,sizeof(struct data_ptr_t));
     
-    ssid_encode.data=(char *)gopro_state.cohn_net.wifi_ssid;
-    ssid_encode.size=strlen(gopro_state.cohn_net.wifi_ssid);
+    ssid_encode.data=(char *)gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid;
+    ssid_encode.size=strlen(gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid);
     
     req.ssid.arg = &ssid_encode;
     req.ssid.funcs.encode=pb_encode_bytes;
@@ -629,8 +649,8 @@ static uint32_t gopro_prepare_connect_new(uint8_t *data, uint32_t max_len){
     struct data_ptr_t passw_encode;
     memset(&passw_encode,0,sizeof(struct data_ptr_t));
     
-    passw_encode.data=(char *)gopro_state.cohn_net.wifi_pass;
-    passw_encode.size=strlen(gopro_state.cohn_net.wifi_pass);
+    passw_encode.data=(char *)gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_pass;
+    passw_encode.size=strlen(gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_pass);
     
     req.password.arg = &passw_encode;
     req.password.funcs.encode=pb_encode_bytes;
@@ -650,8 +670,8 @@ static uint32_t gopro_prepare_connect_saved(uint8_t *data, uint32_t max_len){
     struct data_ptr_t ssid_encode;
     memset(&ssid_encode,0,sizeof(struct data_ptr_t));
     
-    ssid_encode.data=(char *)gopro_state.cohn_net.wifi_ssid;
-    ssid_encode.size=strlen(gopro_state.cohn_net.wifi_ssid);
+    ssid_encode.data=(char *)gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid;
+    ssid_encode.size=strlen(gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid);
     
     req.ssid.arg = &ssid_encode;
     req.ssid.funcs.encode=pb_encode_bytes;
@@ -685,30 +705,51 @@ static uint32_t gopro_prepare_finish_pairing(uint8_t *data, uint32_t max_len){
     return stream.bytes_written;
 }
 
-static void gopro_send_buf(uint8_t *data, uint32_t len, uint8_t type){
-    struct gopro_cmd_t gopro_cmd; 
+/*
+Фрагменты многопакетных сообщений идут сразу в очередь характеристики, мимо
+gopro_cmd_chan: затвор не стоит за ними в общей очереди, а отправитель
+ждет места в своей очереди, не занимая поток gopro_cmd_subscriber.
+*/
+static int gopro_send_cmd(struct gopro_cmd_t *gopro_cmd, k_timeout_t timeout){
     int err;
-    uint8_t *data_ptr;
+
+    err = gopro_writer_put(gopro_cmd, timeout);
+    if(err != 0){
+        if(err == -ENOMSG){
+            LOG_ERR("Invalid Gopro state, skip cmd");
+        }
+        LOG_ERR("CMD queue put failed: %d",err);
+    }
+
+    return err;
+}
+
+//Фрагменты читаются из потока сразу в gopro_cmd_t, мьютекс канала держится до конца пакета
+static int gopro_send_stream(pb_istream_t *stream, uint32_t len, uint8_t cam, uint8_t type){
+    struct gopro_cmd_t gopro_cmd = {0};
+    int ret = 0;
+
+    if(type >= GP_CNTRL_HANDLE_END){
+        return -EINVAL;
+    }
 
     gopro_cmd.cmd_type = type; //Адрес куда слать
+    gopro_cmd.cam = cam;
+
+    //Фрагменты одного пакета не должны перемешиваться с другими сессиями
+    k_mutex_lock(gopro_send_mutex[type], K_FOREVER);
 
     if(len <= 20){ //5bit packet
         LOG_DBG("5bit packet Len: %d",len);
         gopro_cmd.len = len;
 
-        for(uint32_t i=0; i<len; i++){
-            gopro_cmd.data[i] = data[i];
+        if(!pb_read(stream, gopro_cmd.data, len)){
+            ret = -EIO;
+            goto unlock;
         }
         
         LOG_HEXDUMP_DBG(gopro_cmd.data,gopro_cmd.len,"Packet:");
-        
-        err = zbus_chan_pub(&gopro_cmd_chan, &gopro_cmd, K_NO_WAIT);
-		if(err != 0){
-			if(err == -ENOMSG){
-				LOG_ERR("Invalid Gopro state, skip cmd");
-			}
-			LOG_ERR("CMD chan pub failed: %d",err);
-		}
+        ret = gopro_send_cmd(&gopro_cmd, GOPRO_WRITE_TIMEOUT);
 
     }else if(len < 8191){ //13bit
         LOG_DBG("13bit packet Len: %d",len);
@@ -717,21 +758,17 @@ static void gopro_send_buf(uint8_t *data, uint32_t len, uint8_t type){
         gopro_cmd.data[0] = (((len) >> 8) & 0x1f) | (1 << 5);
         gopro_cmd.data[1] = (uint8_t)((len) & 0xff);
         
-        for(uint32_t i=0; i<18; i++){
-            gopro_cmd.data[2+i] = data[i];
+        if(!pb_read(stream, &gopro_cmd.data[2], 18)){
+            ret = -EIO;
+            goto unlock;
         }
 
-        //LOG_HEXDUMP_DBG(gopro_cmd.data,gopro_cmd.len,"Packet:");
-        err = zbus_chan_pub(&gopro_cmd_chan, &gopro_cmd, K_NO_WAIT);
-		if(err != 0){
-			if(err == -ENOMSG){
-				LOG_ERR("Invalid Gopro state, skip cmd");
-			}
-			LOG_ERR("CMD chan pub failed: %d",err);
-		}
+        ret = gopro_send_cmd(&gopro_cmd, GOPRO_WRITE_TIMEOUT);
+        if(ret){
+            goto unlock;
+        }
 
         len = len - 18;
-        data_ptr = data+18;
         uint8_t packet_num = 0;
 
         while(len > 0){
@@ -741,41 +778,44 @@ static void gopro_send_buf(uint8_t *data, uint32_t len, uint8_t type){
 
             LOG_DBG("Cont packet len: %d datalen: %d",len,data_len);
 
-            for(uint32_t i=0; i<data_len; i++){
-                gopro_cmd.data[1+i]=data_ptr[i];
+            if(!pb_read(stream, &gopro_cmd.data[1], data_len)){
+                LOG_ERR("Stream broken, %d bytes left",len);
+                ret = -EIO;
+                goto unlock;
             }
 
             gopro_cmd.len = data_len+1;
 
-            //LOG_HEXDUMP_DBG(gopro_cmd.data,gopro_cmd.len,"Packet:");
-            err = zbus_chan_pub(&gopro_cmd_chan, &gopro_cmd, K_NO_WAIT);
-            if(err != 0){
-                if(err == -ENOMSG){
-                    LOG_ERR("Invalid Gopro state, skip cmd");
-                }
-                LOG_ERR("CMD chan pub failed: %d",err);
+            ret = gopro_send_cmd(&gopro_cmd, GOPRO_WRITE_TIMEOUT);
+            if(ret){
+                goto unlock;
             }
             
             packet_num++;
             
             len = len - data_len;
-            data_ptr += data_len;
         }
 
 
     }else if(len < 65535){ //16bit
         //To do...
+        ret = -ENOTSUP;
     }else{
         LOG_ERR("Packet to big: %d",len);
+        ret = -EINVAL;
     }    
+
+unlock:
+    k_mutex_unlock(gopro_send_mutex[type]);
+    return ret;
 }
 
-static void gopro_send_big_data(uint8_t *data, uint32_t len, uint8_t type, uint8_t feature, uint8_t action){
-    int err;
-    struct gopro_cmd_t gopro_cmd; 
+static void gopro_send_big_data(uint8_t cam, uint8_t *data, uint32_t len, uint8_t type, uint8_t feature, uint8_t action){
+    struct gopro_cmd_t gopro_cmd = {0};
     uint8_t *data_ptr;
 
     gopro_cmd.cmd_type = type; //Адрес куда слать
+    gopro_cmd.cam = cam;
     
     if(len <= (20 - 3)){ //5bit packet
         LOG_DBG("5bit packet Len: %d",len);
@@ -787,13 +827,9 @@ static void gopro_send_big_data(uint8_t *data, uint32_t len, uint8_t type, uint8
             gopro_cmd.data[3+i] = data[i];
         }
         LOG_HEXDUMP_DBG(gopro_cmd.data,gopro_cmd.len,"Packet:");
-        err = zbus_chan_pub(&gopro_cmd_chan, &gopro_cmd, K_NO_WAIT);
-		if(err != 0){
-			if(err == -ENOMSG){
-				LOG_ERR("Invalid Gopro state, skip cmd");
-			}
-			LOG_ERR("CMD chan pub failed: %d",err);
-		}
+        if(gopro_send_cmd(&gopro_cmd, K_NO_WAIT)){
+            return;
+        }
     }else if(len < 8191){ //13bit
         LOG_DBG("13bit packet Len: %d",len);
 
@@ -808,13 +844,9 @@ static void gopro_send_big_data(uint8_t *data, uint32_t len, uint8_t type, uint8
         }
 
         LOG_HEXDUMP_DBG(gopro_cmd.data,gopro_cmd.len,"Packet:");
-        err = zbus_chan_pub(&gopro_cmd_chan, &gopro_cmd, K_NO_WAIT);
-		if(err != 0){
-			if(err == -ENOMSG){
-				LOG_ERR("Invalid Gopro state, skip cmd");
-			}
-			LOG_ERR("CMD chan pub failed: %d",err);
-		}
+        if(gopro_send_cmd(&gopro_cmd, K_NO_WAIT)){
+            return;
+        }
 
         len = len - 16;
         data_ptr = data+16;
@@ -834,12 +866,8 @@ static void gopro_send_big_data(uint8_t *data, uint32_t len, uint8_t type, uint8
             gopro_cmd.len = data_len+1;
 
             LOG_HEXDUMP_DBG(gopro_cmd.data,gopro_cmd.len,"Packet:");
-            err = zbus_chan_pub(&gopro_cmd_chan, &gopro_cmd, K_NO_WAIT);
-            if(err != 0){
-                if(err == -ENOMSG){
-                    LOG_ERR("Invalid Gopro state, skip cmd");
-                }
-                LOG_ERR("CMD chan pub failed: %d",err);
+            if(gopro_send_cmd(&gopro_cmd, K_NO_WAIT)){
+                return;
             }
             
             packet_num++;
@@ -856,18 +884,16 @@ static void gopro_send_big_data(uint8_t *data, uint32_t len, uint8_t type, uint8
     }
 }
 
-static uint32_t gopro_decode_wifi_cred(uint8_t *data, uint32_t max_len){
+static bool gopro_decode_wifi_cred(pb_istream_t *stream){
     int err;
 
     open_gopro_RequestConnectNew req = open_gopro_RequestConnectNew_init_zero;
 
-    pb_istream_t stream = pb_istream_from_buffer(data, max_len);
-    
     struct data_ptr_t data_decode_ssid;
     memset(&data_decode_ssid,0,sizeof(struct data_ptr_t));
     
-    data_decode_ssid.data=(char *)gopro_state.cohn_net.wifi_ssid;
-    data_decode_ssid.size=sizeof(gopro_state.cohn_net.wifi_ssid);
+    data_decode_ssid.data=(char *)gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid;
+    data_decode_ssid.size=sizeof(gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_ssid);
     
     req.ssid.funcs.decode = pb_decode_bytes;
     req.ssid.arg = &data_decode_ssid;
@@ -875,92 +901,139 @@ static uint32_t gopro_decode_wifi_cred(uint8_t *data, uint32_t max_len){
     struct data_ptr_t data_decode_pasw;
     memset(&data_decode_pasw,0,sizeof(struct data_ptr_t));
     
-    data_decode_pasw.data=(char *)gopro_state.cohn_net.wifi_pass;
-    data_decode_pasw.size=sizeof(gopro_state.cohn_net.wifi_pass);
+    data_decode_pasw.data=(char *)gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_pass;
+    data_decode_pasw.size=sizeof(gopro_state[GOPRO_CAM_MAIN].cohn_net.wifi_pass);
     
     req.password.funcs.decode = pb_decode_bytes;
     req.password.arg = &data_decode_pasw;
 
-    err = pb_decode(&stream, open_gopro_RequestConnectNew_fields, &req);
+    err = pb_decode(stream, open_gopro_RequestConnectNew_fields, &req);
 
     if(!err){
-        LOG_ERR("PB decode failed %s", PB_GET_ERROR(&stream));
+        LOG_ERR("PB decode failed %s", PB_GET_ERROR(stream));
     }else{
         LOG_DBG("AP Decode OK.");
     }
-    return 0;
+    return err;
 }
 
-static void can_rx_ble_subscriber_task(void *ptr1, void *ptr2, void *ptr3){
-    struct mem_pkt_t mem_pkt;
-    ARG_UNUSED(ptr1);
-	ARG_UNUSED(ptr2);
-	ARG_UNUSED(ptr3);
-	const struct zbus_channel *chan;
-    GoproClient_bledata bledata;
+static int pb_bledata_dispatch(struct bledata_decode_t *decode, pb_istream_t *stream, uint32_t len){
+    int32_t ble_addr = decode->ble_addr;
+    uint8_t cam = GOPRO_CAM_MAIN;
 
-	while (!zbus_sub_wait_msg(&can_rx_ble_subscriber, &chan, &mem_pkt, K_FOREVER)) {
-		if (&can_rx_ble_chan == chan) {
+    if(ble_addr >= 0){
+        cam = GOPRO_BLE_ADDR_CAM(ble_addr);
+        ble_addr = GOPRO_BLE_ADDR_TYPE(ble_addr);
+    }
 
-            LOG_DBG("Unpack msg %d len",mem_pkt.len);
-            LOG_HEXDUMP_DBG(mem_pkt.data,mem_pkt.len,"Data:");
+    if((decode->channel >= 0) && (ble_addr < GP_CNTRL_HANDLE_END) && (ble_addr != decode->channel)){
+        LOG_WRN("Addr %d on channel session, use %d",ble_addr,decode->channel);
+        ble_addr = decode->channel;
+    }
 
-            memset(&bledata,0,sizeof(GoproClient_bledata));
+    LOG_DBG("Data for camera %d addr: %d size: %d",cam, ble_addr, len);
 
-            pb_istream_t stream = pb_istream_from_buffer(mem_pkt.data, mem_pkt.len);
-            
-            struct data_ptr_t data_decode;
-            memset(&data_decode,0,sizeof(struct data_ptr_t));
+    if((ble_addr >= 0) && (ble_addr < GP_CNTRL_HANDLE_END)){
+        if(gopro_client_get_state(cam) == GP_STATE_CONNECTED){
+            LOG_DBG("State connected, send data"); 
+            return gopro_send_stream(stream, len, cam, ble_addr);
+        }
+        LOG_WRN("Camera %d not connected, skip sending",cam);
+    }else if(ble_addr == BLE_ADDR_SET_WIFI_CRED){
+        LOG_DBG("Parse SET WIFI cmd");
+        return gopro_decode_wifi_cred(stream) ? 0 : -EINVAL;
+    }
 
-            data_decode.data = ble_data_buff;
-            data_decode.size = BLEDATA_BUFF_SIZE;
-            bledata.data.funcs.decode=pb_decode_bytes;
-            bledata.data.arg=&data_decode;
-            
-            int err = pb_decode(&stream, GoproClient_bledata_fields, &bledata);
+    return 0;
+}
 
-            if(!err){
-                LOG_ERR("PB decode failed %s", PB_GET_ERROR(&stream));
-            }else{
-                LOG_DBG("Data for addr: %d size: %d",bledata.ble_addr, data_decode.size);
-                LOG_HEXDUMP_DBG(data_decode.data, data_decode.size,"Decode:");
-
-                if(bledata.ble_addr < GP_CNTRL_HANDLE_END){
-                    LOG_DBG("Addr valid");
-                    if(gopro_state.state == GP_STATE_CONNECTED){
-                        LOG_DBG("State connected, send data"); 
-                        gopro_send_buf(data_decode.data, data_decode.size, bledata.ble_addr);
-                    }else{
-                        LOG_WRN("Not connected, skip sending");
-                    }
-                }else{
-                    if(bledata.ble_addr == BLE_ADDR_SET_WIFI_CRED){
-                        LOG_DBG("Parse SET WIFI cmd");
-                        gopro_decode_wifi_cred(data_decode.data,data_decode.size);
-                    }
-                };
-            };
-            LOG_DBG("Free semaphore");
-            k_sem_give(&can_isotp_rx_sem);
+/*
+Порядок полей protobuf не гарантирован. Если ble_addr уже принят, data
+идет из потока ISO-TP прямо во фрагменты BLE (одно копирование). Иначе
+поле ждет ble_addr в bledata_reorder_buf (два копирования, без кучи).
+*/
+static int pb_bledata_data(struct bledata_decode_t *decode, pb_istream_t *stream){
+    uint32_t len = stream->bytes_left;
+
+    if(decode->addr_seen){
+        //Повтор поля: действует последнее значение
+        decode->len = 0;
+        return pb_bledata_dispatch(decode, stream, len);
+    }
+
+    if(len > sizeof(bledata_reorder_buf)){
+        LOG_ERR("Data before ble_addr, %d bytes don't fit",len);
+        return -ENOMEM;
+    }
+
+    if(!decode->reorder){
+        k_mutex_lock(&bledata_reorder_mutex, K_FOREVER);
+        decode->reorder = true;
+    }
+
+    if(!pb_read(stream, bledata_reorder_buf, len)){
+        return -EIO;
+    }
+
+    decode->len = len;
+    return 0;
+}
+
+int gopro_pb_bledata_decode(pb_istream_t *stream, int channel){
+    struct bledata_decode_t decode;
+    pb_istream_t substream;
+    pb_istream_t buf_stream;
+    pb_wire_type_t wire_type;
+    uint32_t tag;
+    uint64_t value;
+    bool eof = false;
+    bool ok = true;
+    int ret = 0;
+
+    memset(&decode,0,sizeof(decode));
+    decode.channel = channel;
+
+    while(ok && (ret == 0) && pb_decode_tag(stream, &wire_type, &tag, &eof)){
+        if((tag == GoproClient_bledata_ble_addr_tag) && (wire_type == PB_WT_VARINT)){
+            ok = pb_decode_varint(stream, &value);
+            decode.ble_addr = (int32_t)value;
+            decode.addr_seen = true;
+        }else if((tag == GoproClient_bledata_data_tag) && (wire_type == PB_WT_STRING)){
+            ok = pb_make_string_substream(stream, &substream);
+            if(ok){
+                ret = pb_bledata_data(&decode, &substream);
+                ok = pb_close_string_substream(stream, &substream);
+            }
+        }else{
+            ok = pb_skip_field(stream, wire_type);
         }
-	}
-};
+    }
 
-int can_reply(int32_t ble_addr, uint8_t *data, uint32_t len){
+    if(!ok || ((ret == 0) && !eof)){
+        LOG_ERR("PB decode failed %s", PB_GET_ERROR(stream));
+        ret = -EINVAL;
+    }else if((ret == 0) && decode.reorder && (decode.len > 0)){
+        //ble_addr после data или не пришел вовсе (0 по умолчанию)
+        buf_stream = pb_istream_from_buffer(bledata_reorder_buf, decode.len);
+        ret = pb_bledata_dispatch(&decode, &buf_stream, decode.len);
+    }
+
+    if(decode.reorder){
+        k_mutex_unlock(&bledata_reorder_mutex);
+    }
+
+    return ret;
+}
+
+static int can_reply_send(int32_t ble_addr, uint8_t *data, uint32_t len){
     int err;
     struct mem_pkt_t mem_pkt;
     GoproClient_bledata replyreq;
 
     LOG_DBG("CAN reply %d bytes",len);
 
-    if(len > WORK_BUFF_SIZE){
-        LOG_ERR("Reply too big %d of %d",len,WORK_BUFF_SIZE);
-        return -EINVAL;
-    }
-
-    if( k_sem_take(&can_reply_sem, K_MSEC(10)) != 0 ){
-        LOG_ERR("Sem busy");
-        return -EINVAL;
+    if( k_sem_take(&can_reply_sem, K_NO_WAIT) != 0 ){
+        return -EBUSY;
     }
 
     memset(&mem_pkt,0,sizeof(struct mem_pkt_t));
@@ -991,6 +1064,7 @@ int can_reply(int32_t ble_addr, uint8_t *data, uint32_t len){
 
     } else {
         LOG_ERR("Memory not allocated");
+        k_sem_give(&can_reply_sem);
         return -ENOMEM;
     }
 
@@ -1004,4 +1078,56 @@ int can_reply(int32_t ble_addr, uint8_t *data, uint32_t len){
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+static void can_reply_work_handler(struct k_work *work){
+    struct can_reply_t reply;
+    int err;
+
+    while(k_msgq_peek(&can_reply_msgq, &reply) == 0){
+        err = can_reply_send(reply.ble_addr, reply.data, reply.len);
+        if(err == -EBUSY){
+            k_work_reschedule(&can_reply_work, CAN_REPLY_RETRY);
+            return;
+        }
+
+        if(err){
+            LOG_WRN("Reply to CAN failed: %d",err);
+        }
+
+        k_msgq_get(&can_reply_msgq, &reply, K_NO_WAIT);
+        k_free(reply.data);
+    }
+}
+
+/* Данные копируются, ответ уходит из work в порядке вызова */
+int can_reply(int32_t ble_addr, uint8_t *data, uint32_t len){
+    struct can_reply_t reply;
+
+    if(len > WORK_BUFF_SIZE){
+        LOG_ERR("Reply too big %d of %d",len,WORK_BUFF_SIZE);
+        return -EINVAL;
+    }
+
+    reply.ble_addr = ble_addr;
+    reply.len = len;
+    reply.data = k_malloc(MAX(len, 1));
+
+    if(reply.data == NULL){
+        LOG_ERR("Memory not allocated");
+        return -ENOMEM;
+    }
+
+    memcpy(reply.data, data, len);
+
+    if(k_msgq_put(&can_reply_msgq, &reply, K_NO_WAIT) != 0){
+        LOG_WRN("CAN reply queue full, drop");
+        k_free(reply.data);
+        return -ENOBUFS;
+    }
+
+    //Уже запланированный повтор через CAN_REPLY_RETRY не сдвигается
+    k_work_schedule(&can_reply_work, K_NO_WAIT);
+
+    return 0;
+}
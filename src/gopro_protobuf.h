@@ -4,9 +4,9 @@
 #include <zephyr/kernel.h>
 #include "gopro_client.h"
 #include "gopro_packet.h"
+#include <pb_decode.h>
 
 #define WORK_BUFF_SIZE 2048
-#define BLEDATA_BUFF_SIZE 2048
 #define CERT_BUFF_SIZE  2048
 
 #define MAX_SSID_LEN        40
@@ -17,6 +17,13 @@ struct data_ptr_t{
     uint8_t *data;
 };
 
+/* ble_addr: младший байт - канал или команда, следующий - камера (0 - основная) */
+#define GOPRO_BLE_ADDR(cam, type)   ((int32_t)(((cam) << 8) | (type)))
+#define GOPRO_BLE_ADDR_CAM(addr)    (((addr) >> 8) & 0xFF)
+#define GOPRO_BLE_ADDR_TYPE(addr)   ((addr) & 0xFF)
+
+#define CAN_REPLY_RETRY             K_MSEC(5)       //ISO-TP занят предыдущим ответом
+
 enum ble_addr_ext_t{
     BLE_ADDR_SET_WIFI_CRED = 0xF0,
     BLE_ADDR_START_AP_SCAN = 0x50,
@@ -37,7 +44,7 @@ struct ap_list_t{
 // int gopro_parse_net_reply(struct gopro_cmd_t *gopro_cmd);
 // int gopro_build_packet_cohn_status(uint8_t *data, uint32_t len, int32_t packet_len);
 // int gopro_build_packet_cohn_cert(uint8_t *data, uint32_t len, int32_t packet_len);
-int gopro_finish_pairing(void);
+int gopro_finish_pairing(uint8_t cam);
 void gopro_parse_start_scaning(uint8_t *data, uint32_t len);
 int  gopro_parse_ap_entries(struct gopro_packet_t *gopro_packet);
 void gopro_parse_response_generic(uint8_t *data, uint32_t len);
@@ -49,4 +56,5 @@ void gopro_parse_response_cohn_status(uint8_t *data, uint32_t len);
 void gopro_parse_response_cohn_cert(uint8_t *data, uint32_t len);
 
 int can_reply(int32_t ble_addr, uint8_t *data, uint32_t len);
+int gopro_pb_bledata_decode(pb_istream_t *stream, int channel);
 #endif
\ No newline at end of file
@@ -0,0 +1,253 @@
+#include "gopro_ready.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/settings/settings.h>
+
+LOG_MODULE_REGISTER(gopro_ready, CONFIG_BLE_LOG_LVL);
+
+#define READY_SAVE_DELAY		K_SECONDS(5)	//Несколько камер подряд - одна запись во flash
+
+/* Подъем в процессе: время меток, мс */
+struct gopro_ready_trace_t{
+	bool	 active;
+	uint16_t marks;
+	uint32_t t[GP_READY_MARK_END];
+};
+
+/* Хранится в settings как есть: gpready/stat */
+struct gopro_ready_hist_t{
+	uint32_t count;
+	uint32_t stalls;
+	uint32_t min_ms;
+	uint32_t max_ms;
+	uint64_t sum_ms;
+	uint16_t last_ms[CONFIG_GOPRO_READY_HISTORY];
+	uint8_t  head;
+};
+
+BUILD_ASSERT(GP_READY_MARK_END <= 16, "Mark mask is 16 bit");
+BUILD_ASSERT(CONFIG_GOPRO_READY_HISTORY <= UINT8_MAX, "History head is 8 bit");
+
+static void ready_save_work_handler(struct k_work *work);
+
+static K_WORK_DELAYABLE_DEFINE(ready_save_work, ready_save_work_handler);
+
+static struct k_spinlock ready_lock;
+static struct gopro_ready_trace_t ready_trace[CONFIG_GOPRO_CAM_MAX];
+static struct gopro_ready_hist_t ready_hist[GP_READY_PHASE_END];
+
+static void ready_add(uint32_t phase, uint32_t ms){
+	struct gopro_ready_hist_t *hist = &ready_hist[phase];
+
+	if((hist->count == 0) || (ms < hist->min_ms)){
+		hist->min_ms = ms;
+	}
+
+	if(ms > hist->max_ms){
+		hist->max_ms = ms;
+	}
+
+	hist->count++;
+	hist->sum_ms += ms;
+
+	hist->last_ms[hist->head] = MIN(ms, UINT16_MAX);
+	hist->head = (hist->head + 1) % CONFIG_GOPRO_READY_HISTORY;
+}
+
+/* Этап до метки считается от последней поставленной перед ней: пропущенные метки не теряют время */
+static uint32_t ready_finish(struct gopro_ready_trace_t *trace){
+	uint32_t first = 0;
+	uint32_t prev = 0;
+	bool init = false;
+
+	for(uint32_t mark=0; mark<GP_READY_MARK_END; mark++){
+		if(!(trace->marks & BIT(mark))){
+			continue;
+		}
+
+		if(!init){
+			first = trace->t[mark];
+			init = true;
+		}else{
+			ready_add(mark - 1, trace->t[mark] - prev);
+		}
+
+		prev = trace->t[mark];
+	}
+
+	ready_add(GP_READY_PHASE_TOTAL, prev - first);
+	trace->active = false;
+
+	return prev - first;
+}
+
+void gopro_ready_mark(uint8_t cam, enum gopro_ready_mark_t mark){
+	struct gopro_ready_trace_t *trace;
+	k_spinlock_key_t key;
+	uint32_t now = k_uptime_get_32();
+	uint32_t total_ms = 0;
+	bool done = false;
+
+	if((cam >= CONFIG_GOPRO_CAM_MAX) || (mark >= GP_READY_MARK_END)){
+		return;
+	}
+
+	trace = &ready_trace[cam];
+
+	key = k_spin_lock(&ready_lock);
+
+	//Новый подъем: совпадение рекламы или соединение, установленное контроллером
+	if((mark == GP_READY_MATCH) || (!trace->active && (mark == GP_READY_CONNECTED))){
+		trace->active = true;
+		trace->marks = 0;
+	}
+
+	if(trace->active){
+		trace->t[mark] = now;
+		trace->marks |= BIT(mark);
+
+		if(mark == GP_READY_STARTUP){
+			total_ms = ready_finish(trace);
+			done = true;
+		}
+	}
+
+	k_spin_unlock(&ready_lock, key);
+
+	if(done){
+		LOG_INF("Camera %d ready in %d ms",cam,total_ms);
+		k_work_reschedule(&ready_save_work, READY_SAVE_DELAY);
+	}
+}
+
+/* Соединение оборвалось до готовности: застрял этап после последней метки */
+void gopro_ready_abort(uint8_t cam){
+	struct gopro_ready_trace_t *trace;
+	k_spinlock_key_t key;
+	bool stalled = false;
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return;
+	}
+
+	trace = &ready_trace[cam];
+
+	key = k_spin_lock(&ready_lock);
+	if(trace->active && trace->marks){
+		uint32_t last = 31 - __builtin_clz(trace->marks);
+
+		if(last < GP_READY_PHASE_TOTAL){
+			ready_hist[last].stalls++;
+			ready_hist[GP_READY_PHASE_TOTAL].stalls++;
+			stalled = true;
+		}
+	}
+	trace->active = false;
+	k_spin_unlock(&ready_lock, key);
+
+	if(stalled){
+		k_work_reschedule(&ready_save_work, READY_SAVE_DELAY);
+	}
+}
+
+void gopro_ready_stat_get(uint32_t phase, struct gopro_ready_stat_t *stat){
+	uint16_t last[CONFIG_GOPRO_READY_HISTORY];
+	struct gopro_ready_hist_t *hist;
+	k_spinlock_key_t key;
+	uint32_t n;
+
+	memset(stat, 0, sizeof(*stat));
+
+	if(phase >= GP_READY_PHASE_END){
+		return;
+	}
+
+	hist = &ready_hist[phase];
+
+	key = k_spin_lock(&ready_lock);
+	stat->count = hist->count;
+	stat->stalls = hist->stalls;
+	stat->min_ms = hist->min_ms;
+	stat->max_ms = hist->max_ms;
+	stat->avg_ms = hist->count ? (uint32_t)(hist->sum_ms / hist->count) : 0;
+	n = MIN(hist->count, CONFIG_GOPRO_READY_HISTORY);
+	memcpy(last, hist->last_ms, n * sizeof(last[0]));
+	k_spin_unlock(&ready_lock, key);
+
+	if(n == 0){
+		return;
+	}
+
+	//Выборка маленькая, сортировка вставками
+	for(uint32_t i=1; i<n; i++){
+		uint16_t val = last[i];
+		uint32_t j = i;
+
+		while((j > 0) && (last[j - 1] > val)){
+			last[j] = last[j - 1];
+			j--;
+		}
+		last[j] = val;
+	}
+
+	stat->p95_ms = last[((n * 95 + 99) / 100) - 1];
+}
+
+void gopro_ready_reset(void){
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&ready_lock);
+	memset(ready_hist, 0, sizeof(ready_hist));
+	k_spin_unlock(&ready_lock, key);
+
+	k_work_cancel_delayable(&ready_save_work);
+	settings_delete("gpready/stat");
+}
+
+static void ready_save_work_handler(struct k_work *work){
+	static struct gopro_ready_hist_t hist[GP_READY_PHASE_END];
+	k_spinlock_key_t key;
+	int err;
+
+	key = k_spin_lock(&ready_lock);
+	memcpy(hist, ready_hist, sizeof(hist));
+	k_spin_unlock(&ready_lock, key);
+
+	err = settings_save_one("gpready/stat", hist, sizeof(hist));
+	if(err){
+		LOG_ERR("Failed to save ready stats: %d",err);
+	}
+}
+
+static int ready_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg){
+	static struct gopro_ready_hist_t hist[GP_READY_PHASE_END];
+	const char *next;
+	k_spinlock_key_t key;
+	int rc;
+
+	if(!settings_name_steq(name, "stat", &next) || next){
+		return -ENOENT;
+	}
+
+	//Другое число этапов или размер истории - начать заново
+	if(len != sizeof(hist)){
+		return 0;
+	}
+
+	rc = read_cb(cb_arg, hist, sizeof(hist));
+	if(rc < 0){
+		return rc;
+	}
+
+	for(uint32_t i=0; i<GP_READY_PHASE_END; i++){
+		hist[i].head %= CONFIG_GOPRO_READY_HISTORY;
+	}
+
+	key = k_spin_lock(&ready_lock);
+	memcpy(ready_hist, hist, sizeof(ready_hist));
+	k_spin_unlock(&ready_lock, key);
+
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(gpready, "gpready", NULL, ready_settings_set, NULL, NULL);
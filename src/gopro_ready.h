@@ -0,0 +1,41 @@
+#ifndef GOPRO_READY_H
+#define GOPRO_READY_H
+
+#include <zephyr/kernel.h>
+
+#include "gopro_client.h"
+
+/*
+Метки подъема камеры от рекламы до ответа на регистрацию статусов.
+Этап i - время от предыдущей поставленной метки до метки i+1.
+*/
+enum gopro_ready_mark_t{
+	GP_READY_MATCH,			//реклама камеры прошла фильтр
+	GP_READY_CREATE,		//bt_conn_le_create
+	GP_READY_CONNECTED,
+	GP_READY_SECURITY,
+	GP_READY_DISCOVERY,		//сервисы найдены или взяты из кэша
+	GP_READY_SUBSCRIBE,
+	GP_READY_HW_INFO,
+	GP_READY_STARTUP,		//ответ на регистрацию статусов
+	GP_READY_MARK_END
+};
+
+#define GP_READY_PHASE_TOTAL	(GP_READY_MARK_END - 1)
+#define GP_READY_PHASE_END		GP_READY_MARK_END
+
+struct gopro_ready_stat_t{
+	uint32_t count;
+	uint32_t stalls;		//Соединение оборвалось на этом этапе
+	uint32_t min_ms;
+	uint32_t avg_ms;
+	uint32_t max_ms;
+	uint32_t p95_ms;		//По последним CONFIG_GOPRO_READY_HISTORY
+};
+
+void gopro_ready_mark(uint8_t cam, enum gopro_ready_mark_t mark);
+void gopro_ready_abort(uint8_t cam);
+void gopro_ready_stat_get(uint32_t phase, struct gopro_ready_stat_t *stat);
+void gopro_ready_reset(void);
+
+#endif
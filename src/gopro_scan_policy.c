@@ -0,0 +1,154 @@
+#include "gopro_scan_policy.h"
+#include "gopro_ble_discovery.h"
+
+#include <zephyr/logging/log.h>
+
+LOG_MODULE_REGISTER(gopro_scan, CONFIG_BLE_LOG_LVL);
+
+/*
+После старта, разрыва или пробуждения CAN сканирование идет непрерывно
+CONFIG_GOPRO_SCAN_FAST_TIME_S, затем обычный режим. Если за
+CONFIG_GOPRO_SCAN_SLOW_DELAY_S ни одна камера не сообщила online или pairing,
+сканирование переходит в экономный режим до следующего события.
+Все переходы выполняются в системной очереди.
+*/
+
+struct scan_policy_t{
+	uint16_t interval;
+	uint16_t window;
+	bool	 active;
+};
+
+static const struct scan_policy_t scan_policy[GP_SCAN_MODE_END] = {
+	[GP_SCAN_FAST] = {CONFIG_GOPRO_SCAN_FAST_INTERVAL, CONFIG_GOPRO_SCAN_FAST_WINDOW, true},
+	[GP_SCAN_NORMAL] = {CONFIG_GOPRO_SCAN_NORMAL_INTERVAL, CONFIG_GOPRO_SCAN_NORMAL_WINDOW, true},
+	[GP_SCAN_SLOW] = {CONFIG_GOPRO_SCAN_SLOW_INTERVAL, CONFIG_GOPRO_SCAN_SLOW_WINDOW, !IS_ENABLED(CONFIG_GOPRO_SCAN_SLOW_PASSIVE)},
+};
+
+BUILD_ASSERT(CONFIG_GOPRO_SCAN_FAST_WINDOW <= CONFIG_GOPRO_SCAN_FAST_INTERVAL);
+BUILD_ASSERT(CONFIG_GOPRO_SCAN_NORMAL_WINDOW <= CONFIG_GOPRO_SCAN_NORMAL_INTERVAL);
+BUILD_ASSERT(CONFIG_GOPRO_SCAN_SLOW_WINDOW <= CONFIG_GOPRO_SCAN_SLOW_INTERVAL);
+
+static const char *const scan_mode_str[GP_SCAN_MODE_END] = {"fast", "normal", "slow"};
+
+static void scan_fast_work_handler(struct k_work *work);
+static void scan_online_work_handler(struct k_work *work);
+static void scan_fast_end_work_handler(struct k_work *work);
+static void scan_slow_work_handler(struct k_work *work);
+
+K_WORK_DEFINE(scan_fast_work, scan_fast_work_handler);
+K_WORK_DEFINE(scan_online_work, scan_online_work_handler);
+K_WORK_DELAYABLE_DEFINE(scan_fast_end_work, scan_fast_end_work_handler);
+K_WORK_DELAYABLE_DEFINE(scan_slow_work, scan_slow_work_handler);
+
+static atomic_t scan_mode = ATOMIC_INIT(GP_SCAN_FAST);
+static atomic_t scan_started;
+static uint32_t scan_mode_since;
+static uint32_t scan_can_rx_ms;
+static struct gopro_scan_stat_t scan_stat;
+
+static void scan_mode_set(enum gopro_scan_mode_t mode){
+	const struct scan_policy_t *policy = &scan_policy[mode];
+
+	if(atomic_set(&scan_mode, mode) == mode){
+		return;
+	}
+
+	scan_mode_since = k_uptime_get_32();
+	scan_stat.entered[mode]++;
+
+	LOG_INF("Scan %s: interval %d window %d %s",scan_mode_str[mode],policy->interval,policy->window,policy->active ? "active" : "passive");
+
+	//Новые параметры вступают в силу с перезапуском сканирования
+	gopro_bt_scan_restart();
+}
+
+static void scan_fast_work_handler(struct k_work *work){
+	k_work_cancel_delayable(&scan_slow_work);
+	k_work_reschedule(&scan_fast_end_work, K_SECONDS(CONFIG_GOPRO_SCAN_FAST_TIME_S));
+	scan_mode_set(GP_SCAN_FAST);
+}
+
+static void scan_fast_end_work_handler(struct k_work *work){
+	k_work_reschedule(&scan_slow_work, K_SECONDS(CONFIG_GOPRO_SCAN_SLOW_DELAY_S));
+	scan_mode_set(GP_SCAN_NORMAL);
+}
+
+static void scan_online_work_handler(struct k_work *work){
+	if(atomic_get(&scan_mode) == GP_SCAN_FAST){
+		return;
+	}
+
+	k_work_reschedule(&scan_slow_work, K_SECONDS(CONFIG_GOPRO_SCAN_SLOW_DELAY_S));
+	scan_mode_set(GP_SCAN_NORMAL);
+}
+
+static void scan_slow_work_handler(struct k_work *work){
+	if(atomic_get(&scan_mode) == GP_SCAN_NORMAL){
+		scan_mode_set(GP_SCAN_SLOW);
+	}
+}
+
+/* Параметры для bt_scan_params_set, возвращает BT_SCAN_TYPE_* */
+int gopro_scan_policy_get(struct bt_le_scan_param *param){
+	enum gopro_scan_mode_t mode;
+
+	if(atomic_set(&scan_started, 1) == 0){
+		scan_mode_since = k_uptime_get_32();
+		scan_stat.entered[GP_SCAN_FAST]++;
+		k_work_reschedule(&scan_fast_end_work, K_SECONDS(CONFIG_GOPRO_SCAN_FAST_TIME_S));
+	}
+
+	mode = atomic_get(&scan_mode);
+
+	memset(param, 0, sizeof(*param));
+	param->type = scan_policy[mode].active ? BT_LE_SCAN_TYPE_ACTIVE : BT_LE_SCAN_TYPE_PASSIVE;
+	param->options = BT_LE_SCAN_OPT_FILTER_DUPLICATE;
+	param->interval = scan_policy[mode].interval;
+	param->window = scan_policy[mode].window;
+
+	return scan_policy[mode].active ? BT_SCAN_TYPE_SCAN_ACTIVE : BT_SCAN_TYPE_SCAN_PASSIVE;
+}
+
+void gopro_scan_policy_disconnected(void){
+	k_work_submit(&scan_fast_work);
+}
+
+/* Из rx_callback CAN: первый кадр после тишины CONFIG_GOPRO_SCAN_WAKE_GAP_S - пробуждение */
+void gopro_scan_policy_can_rx(void){
+	uint32_t now = k_uptime_get_32();
+	uint32_t last = scan_can_rx_ms;
+
+	scan_can_rx_ms = now;
+
+	if((last != 0) && ((now - last) < (CONFIG_GOPRO_SCAN_WAKE_GAP_S * MSEC_PER_SEC))){
+		return;
+	}
+
+	scan_stat.wakes++;
+	k_work_submit(&scan_fast_work);
+}
+
+//Камера сообщила online или pairing
+void gopro_scan_policy_online(void){
+	k_work_submit(&scan_online_work);
+}
+
+//Пассивное сканирование не получает scan response с состоянием камеры
+void gopro_scan_policy_seen(void){
+	if((atomic_get(&scan_mode) == GP_SCAN_SLOW) && !scan_policy[GP_SCAN_SLOW].active){
+		k_work_submit(&scan_online_work);
+	}
+}
+
+void gopro_scan_policy_stat_get(struct gopro_scan_stat_t *stat){
+	enum gopro_scan_mode_t mode = atomic_get(&scan_mode);
+
+	*stat = scan_stat;
+	stat->mode = mode;
+	stat->active = scan_policy[mode].active;
+	stat->interval = scan_policy[mode].interval;
+	stat->window = scan_policy[mode].window;
+	stat->duty = (scan_policy[mode].window * 100) / scan_policy[mode].interval;
+	stat->mode_ms = k_uptime_get_32() - scan_mode_since;
+}
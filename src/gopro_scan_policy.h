@@ -0,0 +1,32 @@
+#ifndef GOPRO_SCAN_POLICY_H
+#define GOPRO_SCAN_POLICY_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/bluetooth/bluetooth.h>
+
+enum gopro_scan_mode_t{
+	GP_SCAN_FAST,		//После разрыва или пробуждения CAN: окно во весь интервал
+	GP_SCAN_NORMAL,
+	GP_SCAN_SLOW,		//Камера давно offline или не видна: короткое окно, длинный интервал
+	GP_SCAN_MODE_END
+};
+
+struct gopro_scan_stat_t{
+	enum gopro_scan_mode_t mode;
+	bool	 active;
+	uint16_t interval;			//0.625 мс
+	uint16_t window;
+	uint8_t  duty;				//Окно / интервал, %
+	uint32_t mode_ms;			//В текущем режиме
+	uint32_t entered[GP_SCAN_MODE_END];
+	uint32_t wakes;
+};
+
+int gopro_scan_policy_get(struct bt_le_scan_param *param);
+void gopro_scan_policy_disconnected(void);
+void gopro_scan_policy_can_rx(void);
+void gopro_scan_policy_online(void);
+void gopro_scan_policy_seen(void);
+void gopro_scan_policy_stat_get(struct gopro_scan_stat_t *stat);
+
+#endif
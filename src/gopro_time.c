@@ -0,0 +1,360 @@
+#include "gopro_time.h"
+
+#include <time.h>
+#include <stdlib.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/zbus/zbus.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/timeutil.h>
+
+#include "gopro_client.h"
+
+LOG_MODULE_REGISTER(gopro_time, CONFIG_BLE_LOG_LVL);
+
+/*
+Часы камеры идут с точностью до секунды, поэтому:
+- смещение камеры относительно мастера оценивается серией Get Date Time подряд,
+  каждый ответ сужает интервал [lo, hi], после смены секунды на камере
+  ширина интервала близка к RTT;
+- Set Local Time отправляется так, чтобы дойти до камеры (через RTT/2)
+  ровно на границе секунды мастера.
+*/
+
+struct time_master_t{
+	int64_t epoch_ms;		//UTC мастера в момент приема кадра
+	int64_t uptime_ms;		//k_uptime в момент приема кадра
+	int16_t tz_min;
+	bool 	valid;
+};
+
+struct time_reply_t{
+	int64_t uptime_ms;
+	int64_t cam_ms;
+	int 	status;
+};
+
+static void time_sync_thread(void *arg1, void *arg2, void *arg3);
+
+K_THREAD_DEFINE(time_sync_thread_id, TIME_SYNC_THREAD_STACK_SIZE, time_sync_thread, NULL, NULL, NULL, TIME_SYNC_THREAD_PRIORITY, 0, 0);
+
+K_SEM_DEFINE(time_sync_req_sem, 0, 1);
+K_SEM_DEFINE(time_get_sem, 0, 1);
+K_SEM_DEFINE(time_set_sem, 0, 1);
+
+ZBUS_CHAN_DECLARE(gopro_cmd_chan);
+
+static struct k_spinlock time_lock;
+static struct time_master_t time_master;
+static struct time_reply_t time_reply;
+static struct gopro_time_stat_t time_stat;
+
+static const struct gopro_cmd_t gopro_get_date_time = {
+	.len = 2,
+	.cmd_type = GP_CNTRL_HANDLE_CMD,
+	.data = {1, GOPRO_CMD_GET_DATE_TIME}
+};
+
+static bool time_master_local(int64_t uptime_ms, int64_t *local_ms){
+	k_spinlock_key_t key = k_spin_lock(&time_lock);
+	bool valid = time_master.valid;
+
+	if(valid){
+		*local_ms = time_master.epoch_ms + (uptime_ms - time_master.uptime_ms) + (int64_t)time_master.tz_min * 60 * MSEC_PER_SEC;
+	}
+
+	k_spin_unlock(&time_lock, key);
+	return valid;
+}
+
+static void time_master_update(int64_t epoch_ms, int16_t tz_min, int64_t uptime_ms){
+	k_spinlock_key_t key = k_spin_lock(&time_lock);
+	bool jump = !time_master.valid;
+
+	if(time_master.valid){
+		int64_t expected = time_master.epoch_ms + (uptime_ms - time_master.uptime_ms);
+
+		jump = (llabs(epoch_ms - expected) > CONFIG_GOPRO_TIME_SYNC_THRESHOLD_MS) || (tz_min != time_master.tz_min);
+	}
+
+	time_master.epoch_ms = epoch_ms;
+	time_master.uptime_ms = uptime_ms;
+	time_master.tz_min = tz_min;
+	time_master.valid = true;
+	time_stat.master_frames++;
+
+	k_spin_unlock(&time_lock, key);
+
+	//Первое время или скачок у мастера - перепроверить камеру, не дожидаясь периода
+	if(jump){
+		k_sem_give(&time_sync_req_sem);
+	}
+}
+
+/* Вызывается из callback приема CAN */
+void gopro_time_master_set(const uint8_t *data, uint8_t len){
+	int64_t uptime_ms = k_uptime_get();
+	int64_t epoch_ms;
+	int16_t tz_min = 0;
+
+	if(len < TIME_FRAME_MIN_LEN){
+		return;
+	}
+
+	epoch_ms = (int64_t)sys_get_le32(data) * MSEC_PER_SEC + sys_get_le16(&data[4]);
+	if(len >= TIME_FRAME_MIN_LEN + 2){
+		tz_min = (int16_t)sys_get_le16(&data[6]);
+	}
+
+	time_master_update(epoch_ms, tz_min, uptime_ms);
+}
+
+void gopro_time_master_set_epoch(int64_t epoch_ms, int16_t tz_min){
+	time_master_update(epoch_ms, tz_min, k_uptime_get());
+}
+
+void gopro_time_sync_request(void){
+	k_sem_give(&time_sync_req_sem);
+}
+
+void gopro_time_stat_get(struct gopro_time_stat_t *stat){
+	k_spinlock_key_t key = k_spin_lock(&time_lock);
+
+	*stat = time_stat;
+	stat->master_valid = time_master.valid;
+	stat->tz_min = time_master.tz_min;
+
+	k_spin_unlock(&time_lock, key);
+}
+
+/* Ответ на Get Date Time: [0x0E][status][7][год u16 BE][мес][день][час][мин][сек] */
+void gopro_time_on_get_reply(const struct gopro_packet_t *gopro_packet){
+	const uint8_t *pdata = &gopro_packet->data[2];
+	struct tm tm = {0};
+
+	time_reply.uptime_ms = k_uptime_get();
+	time_reply.status = gopro_packet->action;
+
+	if((gopro_packet->action == 0) && (gopro_packet->total_len >= 10) && (pdata[0] == 7)){
+		tm.tm_year = sys_get_be16(&pdata[1]) - 1900;
+		tm.tm_mon = pdata[3] - 1;
+		tm.tm_mday = pdata[4];
+		tm.tm_hour = pdata[5];
+		tm.tm_min = pdata[6];
+		tm.tm_sec = pdata[7];
+		time_reply.cam_ms = timeutil_timegm64(&tm) * MSEC_PER_SEC;
+	}else if(gopro_packet->action == 0){
+		LOG_WRN("Invalid date time len: %d",gopro_packet->total_len);
+		time_reply.status = -EINVAL;
+	}
+
+	k_sem_give(&time_get_sem);
+}
+
+void gopro_time_on_set_reply(uint8_t status){
+	time_reply.status = status;
+	k_sem_give(&time_set_sem);
+}
+
+static int time_probe(int64_t *t_send, int64_t *t_reply, int64_t *cam_ms){
+	int err;
+
+	k_sem_reset(&time_get_sem);
+	*t_send = k_uptime_get();
+
+	err = zbus_chan_pub(&gopro_cmd_chan, &gopro_get_date_time, K_MSEC(100));
+	if(err != 0){
+		return err;
+	}
+
+	err = k_sem_take(&time_get_sem, K_MSEC(TIME_SYNC_REPLY_TIMEOUT_MS));
+	if(err != 0){
+		return err;
+	}
+
+	*t_reply = time_reply.uptime_ms;
+	*cam_ms = time_reply.cam_ms;
+
+	return time_reply.status;
+}
+
+static int time_measure(int32_t *offset_ms, uint32_t *precision_ms, uint32_t *rtt_ms){
+	int64_t lo = INT64_MIN;
+	int64_t hi = INT64_MAX;
+	int64_t t_send, t_reply, cam_ms, m_send, m_reply;
+	int64_t first_cam_ms = 0;
+	uint32_t probes;
+	int err;
+
+	*rtt_ms = UINT32_MAX;
+
+	for(probes = 0; probes < TIME_SYNC_MAX_PROBES; probes++){
+		err = time_probe(&t_send, &t_reply, &cam_ms);
+		if(err != 0){
+			LOG_WRN("Get date time failed: %d",err);
+			return (err > 0) ? -EIO : err;
+		}
+
+		if(!time_master_local(t_send, &m_send) || !time_master_local(t_reply, &m_reply)){
+			return -ENODATA;
+		}
+
+		*rtt_ms = MIN(*rtt_ms, (uint32_t)(t_reply - t_send));
+
+		//Камера прочитала часы где-то между отправкой и ответом, дробная часть секунды неизвестна
+		lo = MAX(lo, cam_ms - m_reply);
+		hi = MIN(hi, cam_ms + MSEC_PER_SEC - m_send);
+
+		if(lo >= hi){
+			LOG_WRN("Offset interval empty, master time changed?");
+			return -EAGAIN;
+		}
+
+		if(probes == 0){
+			first_cam_ms = cam_ms;
+		}
+
+		//После смены секунды интервал уже не сузится сильнее RTT
+		if(((hi - lo) <= CONFIG_GOPRO_TIME_SYNC_PRECISION_MS) || (cam_ms != first_cam_ms)){
+			probes++;
+			break;
+		}
+	}
+
+	*offset_ms = (int32_t)((lo + hi) / 2);
+	*precision_ms = (uint32_t)(hi - lo);
+
+	LOG_DBG("Offset %d ms +/- %d ms, rtt %d ms, %d probes",*offset_ms,*precision_ms/2,*rtt_ms,probes);
+
+	return 0;
+}
+
+static int time_set(uint32_t rtt_ms){
+	struct gopro_cmd_t gopro_cmd = {0};
+	k_spinlock_key_t key;
+	int64_t local_ms, target_ms;
+	time_t target_s;
+	struct tm tm;
+	int16_t tz_min;
+	int err;
+
+	if(!time_master_local(k_uptime_get(), &local_ms)){
+		return -ENODATA;
+	}
+
+	//Ближайшая граница секунды, к которой команда успевает дойти до камеры
+	target_ms = ((local_ms + rtt_ms/2 + TIME_SYNC_SET_LEAD_MS) / MSEC_PER_SEC + 1) * MSEC_PER_SEC;
+	k_msleep((int32_t)(target_ms - rtt_ms/2 - local_ms));
+
+	target_s = (time_t)(target_ms / MSEC_PER_SEC);
+	gmtime_r(&target_s, &tm);
+
+	key = k_spin_lock(&time_lock);
+	tz_min = time_master.tz_min;
+	k_spin_unlock(&time_lock, key);
+
+	gopro_cmd.cmd_type = GP_CNTRL_HANDLE_CMD;
+	gopro_cmd.len = 15;
+	gopro_cmd.data[0] = 14;
+	gopro_cmd.data[1] = GOPRO_CMD_SET_LOCAL_DATE_TIME;
+	gopro_cmd.data[2] = 7;
+	sys_put_be16(tm.tm_year + 1900, &gopro_cmd.data[3]);
+	gopro_cmd.data[5] = tm.tm_mon + 1;
+	gopro_cmd.data[6] = tm.tm_mday;
+	gopro_cmd.data[7] = tm.tm_hour;
+	gopro_cmd.data[8] = tm.tm_min;
+	gopro_cmd.data[9] = tm.tm_sec;
+	gopro_cmd.data[10] = 2;
+	sys_put_be16((uint16_t)tz_min, &gopro_cmd.data[11]);
+	gopro_cmd.data[13] = 1;
+	gopro_cmd.data[14] = 0;	//DST уже учтен в смещении мастера
+
+	k_sem_reset(&time_set_sem);
+
+	err = zbus_chan_pub(&gopro_cmd_chan, &gopro_cmd, K_NO_WAIT);
+	if(err != 0){
+		LOG_ERR("Chan pub failed: %d",err);
+		return err;
+	}
+
+	err = k_sem_take(&time_set_sem, K_MSEC(TIME_SYNC_REPLY_TIMEOUT_MS));
+	if(err != 0){
+		return err;
+	}
+
+	if(time_reply.status != 0){
+		return -EIO;
+	}
+
+	LOG_INF("Camera time set: %04d-%02d-%02d %02d:%02d:%02d tz %d",tm.tm_year + 1900,tm.tm_mon + 1,tm.tm_mday,tm.tm_hour,tm.tm_min,tm.tm_sec,tz_min);
+
+	return 0;
+}
+
+static int time_check(void){
+	int32_t offset_ms;
+	uint32_t precision_ms, rtt_ms;
+	int err;
+
+	err = time_measure(&offset_ms, &precision_ms, &rtt_ms);
+	time_stat.checks++;
+	if(err != 0){
+		return err;
+	}
+
+	time_stat.offset_ms = offset_ms;
+	time_stat.precision_ms = precision_ms;
+	time_stat.rtt_ms = rtt_ms;
+	time_stat.offset_valid = true;
+
+	if(abs(offset_ms) <= CONFIG_GOPRO_TIME_SYNC_THRESHOLD_MS){
+		return 0;
+	}
+
+	LOG_INF("Camera clock off by %d ms (+/- %d), rtt %d ms, sync",offset_ms,precision_ms/2,rtt_ms);
+
+	err = time_set(rtt_ms);
+	if(err != 0){
+		LOG_ERR("Set local time failed: %d",err);
+		return err;
+	}
+
+	time_stat.syncs++;
+	time_stat.last_sync_ms = k_uptime_get_32();
+
+	//Контрольное измерение после установки
+	err = time_measure(&offset_ms, &precision_ms, &rtt_ms);
+	if(err == 0){
+		time_stat.offset_ms = offset_ms;
+		time_stat.precision_ms = precision_ms;
+		time_stat.rtt_ms = rtt_ms;
+		LOG_INF("Camera clock offset after sync: %d ms (+/- %d)",offset_ms,precision_ms/2);
+	}
+
+	return 0;
+}
+
+static void time_sync_thread(void *arg1, void *arg2, void *arg3){
+	int64_t local_ms;
+
+	while (1) {
+		#ifdef CONFIG_GOPRO_POLL
+		//Период ведет планировщик опроса вместе с остальным трафиком к камере
+		k_sem_take(&time_sync_req_sem, K_FOREVER);
+		#else
+		k_sem_take(&time_sync_req_sem, K_SECONDS(CONFIG_GOPRO_TIME_SYNC_PERIOD));
+		#endif
+
+		if(gopro_client_get_state(GOPRO_CAM_MAIN) != GP_STATE_CONNECTED){
+			time_stat.offset_valid = false;
+			continue;
+		}
+
+		if(!time_master_local(k_uptime_get(), &local_ms)){
+			continue;
+		}
+
+		if(time_check() != 0){
+			time_stat.failures++;
+		}
+	}
+}
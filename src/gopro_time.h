@@ -0,0 +1,47 @@
+#ifndef GOPRO_TIME_H
+#define GOPRO_TIME_H
+
+#include <zephyr/kernel.h>
+
+#include "gopro_packet.h"
+
+#define TIME_SYNC_THREAD_PRIORITY 		4		//Выше остальных фоновых, чтобы попасть на границу секунды
+#define TIME_SYNC_THREAD_STACK_SIZE		1536
+
+#define TIME_SYNC_REPLY_TIMEOUT_MS		1000
+#define TIME_SYNC_MAX_PROBES			40
+#define TIME_SYNC_SET_LEAD_MS			20		//Запас на пробуждение перед отправкой Set Local Time
+
+#define GOPRO_CMD_GET_DATE_TIME			GOPRO_QUERY_STATUS_GET_DATE
+#define GOPRO_CMD_SET_LOCAL_DATE_TIME	0x0F
+
+/*
+Кадр времени от мастера CAN (GPCAN_INPUT_TIME_ID), little-endian:
+[UTC, сек u32][мс u16][смещение пояса, мин i16]
+Без последних двух байт смещение пояса считается нулевым.
+*/
+#define TIME_FRAME_MIN_LEN				6
+
+struct gopro_time_stat_t{
+	bool	 master_valid;
+	bool	 offset_valid;
+	int16_t  tz_min;
+	uint32_t master_frames;
+	uint32_t checks;
+	uint32_t syncs;
+	uint32_t failures;
+	int32_t  offset_ms;			//Камера минус мастер, середина интервала оценки
+	uint32_t precision_ms;		//Ширина интервала оценки
+	uint32_t rtt_ms;			//Минимальный RTT за последнюю проверку
+	uint32_t last_sync_ms;		//uptime последней установки часов
+};
+
+void gopro_time_master_set(const uint8_t *data, uint8_t len);
+void gopro_time_master_set_epoch(int64_t epoch_ms, int16_t tz_min);
+void gopro_time_sync_request(void);
+void gopro_time_stat_get(struct gopro_time_stat_t *stat);
+
+void gopro_time_on_get_reply(const struct gopro_packet_t *gopro_packet);
+void gopro_time_on_set_reply(uint8_t status);
+
+#endif
@@ -0,0 +1,265 @@
+#include "gopro_writer.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/init.h>
+#ifdef CONFIG_GOPRO_LINK_POLICY
+#include "gopro_conn_policy.h"
+#endif
+
+LOG_MODULE_REGISTER(gopro_writer, CONFIG_BLE_LOG_LVL);
+
+extern struct bt_gopro_client gopro_client[CONFIG_GOPRO_CAM_MAX];
+
+static void gopro_writer_task(void *ptr1, void *ptr2, void *ptr3);
+
+#define GOPRO_WRITE_SLOTS		(3 * CONFIG_GOPRO_WRITE_QUEUE_LEN + CONFIG_GOPRO_WRITE_BULK_QUEUE_LEN)
+#define GOPRO_WRITE_PRIO_END	3
+
+static const uint8_t gopro_write_len[GP_CNTRL_HANDLE_END] = {
+	[GP_CNTRL_HANDLE_CMD] = CONFIG_GOPRO_WRITE_QUEUE_LEN,
+	[GP_CNTRL_HANDLE_SETTINGS] = CONFIG_GOPRO_WRITE_QUEUE_LEN,
+	[GP_CNTRL_HANDLE_QUERY] = CONFIG_GOPRO_WRITE_QUEUE_LEN,
+	[GP_CNTRL_HANDLE_NET] = CONFIG_GOPRO_WRITE_BULK_QUEUE_LEN,
+};
+
+/* Строгий приоритет: затвор и highlight, затем настройки и запросы, затем NET */
+static const uint8_t gopro_write_prio[GP_CNTRL_HANDLE_END] = {
+	[GP_CNTRL_HANDLE_CMD] = 0,
+	[GP_CNTRL_HANDLE_SETTINGS] = 1,
+	[GP_CNTRL_HANDLE_QUERY] = 1,
+	[GP_CNTRL_HANDLE_NET] = 2,
+};
+
+/* Очереди у каждой камеры свои: занятая характеристика одной камеры не держит другие */
+static struct gopro_cmd_t gopro_write_buf[CONFIG_GOPRO_CAM_MAX][GOPRO_WRITE_SLOTS];
+static struct k_msgq gopro_write_msgq[CONFIG_GOPRO_CAM_MAX][GP_CNTRL_HANDLE_END];
+
+K_SEM_DEFINE(gopro_write_kick_sem, 0, 1);
+
+static atomic_t write_inflight[CONFIG_GOPRO_CAM_MAX][GP_CNTRL_HANDLE_END];
+static int64_t request_start[CONFIG_GOPRO_CAM_MAX][GP_CNTRL_HANDLE_END];
+static struct gopro_writer_stat_t writer_stat;
+
+static int gopro_writer_init(void){
+	uint32_t offset;
+
+	for(uint32_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		offset = 0;
+		for(uint32_t i=0; i<GP_CNTRL_HANDLE_END; i++){
+			k_msgq_init(&gopro_write_msgq[cam][i], (char *)&gopro_write_buf[cam][offset], sizeof(struct gopro_cmd_t), gopro_write_len[i]);
+			offset += gopro_write_len[i];
+		}
+	}
+
+	return 0;
+}
+
+SYS_INIT(gopro_writer_init, APPLICATION, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+
+K_THREAD_DEFINE(gopro_writer_task_id, GOPRO_WRITER_THREAD_STACK_SIZE, gopro_writer_task, NULL, NULL, NULL, GOPRO_WRITER_THREAD_PRIORITY, 0, 0);
+
+int gopro_writer_put(const struct gopro_cmd_t *gopro_cmd, k_timeout_t timeout){
+	struct k_msgq *msgq;
+	uint8_t depth;
+	int err;
+
+	if(gopro_cmd->cmd_type >= GP_CNTRL_HANDLE_END){
+		return -ENOTSUP;
+	}
+
+	if(gopro_cmd->cam >= CONFIG_GOPRO_CAM_MAX){
+		return -EINVAL;
+	}
+
+	if(gopro_client_get_state(gopro_cmd->cam) != GP_STATE_CONNECTED){
+		return -ENOMSG;
+	}
+
+	#ifdef CONFIG_GOPRO_LINK_POLICY
+	if((gopro_cmd->cmd_type == GP_CNTRL_HANDLE_CMD) || (gopro_cmd->cmd_type == GP_CNTRL_HANDLE_NET)){
+		gopro_conn_policy_activity();
+	}
+	#endif
+
+	msgq = &gopro_write_msgq[gopro_cmd->cam][gopro_cmd->cmd_type];
+
+	err = k_msgq_put(msgq, gopro_cmd, timeout);
+	if(err){
+		writer_stat.drops++;
+		LOG_WRN("Write queue %d:%d full, drop",gopro_cmd->cam,gopro_cmd->cmd_type);
+		return err;
+	}
+
+	writer_stat.queued++;
+	depth = k_msgq_num_used_get(msgq);
+	if(depth > writer_stat.max_depth[gopro_cmd->cmd_type]){
+		writer_stat.max_depth[gopro_cmd->cmd_type] = depth;
+	}
+
+	k_sem_give(&gopro_write_kick_sem);
+
+	return 0;
+}
+
+/* Вызывается из on_sent_data и из callback записи без ответа */
+void gopro_writer_sent(uint8_t cam, uint32_t handle_index){
+
+	if((cam >= CONFIG_GOPRO_CAM_MAX) || (handle_index >= GP_CNTRL_HANDLE_END)){
+		return;
+	}
+
+	if(atomic_dec(&write_inflight[cam][handle_index]) <= 0){
+		atomic_set(&write_inflight[cam][handle_index], 0);
+	}
+
+	k_sem_give(&gopro_write_kick_sem);
+}
+
+/* После разрыва подтверждения записей без ответа могут не прийти */
+void gopro_writer_reset(uint8_t cam){
+
+	if(cam >= CONFIG_GOPRO_CAM_MAX){
+		return;
+	}
+
+	for(uint32_t i=0; i<GP_CNTRL_HANDLE_END; i++){
+		k_msgq_purge(&gopro_write_msgq[cam][i]);
+		atomic_set(&write_inflight[cam][i], 0);
+		request_start[cam][i] = 0;
+	}
+}
+
+//Глубина и запись в полете - сумма по всем камерам
+void gopro_writer_stat_get(struct gopro_writer_stat_t *stat){
+
+	*stat = writer_stat;
+
+	for(uint32_t i=0; i<GP_CNTRL_HANDLE_END; i++){
+		stat->depth[i] = 0;
+		stat->inflight[i] = 0;
+
+		for(uint32_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+			stat->depth[i] += k_msgq_num_used_get(&gopro_write_msgq[cam][i]);
+			stat->inflight[i] += atomic_get(&write_inflight[cam][i]);
+		}
+	}
+}
+
+/*
+Каждая характеристика своя очередь: запрос записи ждет ответа только
+от своей характеристики. Продолжения пакета, если камера разрешает запись
+без ответа, уходят окном до CONFIG_GOPRO_WRITE_WINDOW и попадают
+в соседние connection event, а не по одному на round trip. Запись без ответа
+обходит очередь запросов ATT, поэтому продолжения ждут подтверждения
+первого фрагмента: иначе камера получит их раньше начала и отбросит пакет.
+*/
+static void gopro_writer_pump(uint32_t cam, uint32_t handle_index){
+	struct bt_gopro_client *gp_client = &gopro_client[cam];
+	struct k_msgq *msgq = &gopro_write_msgq[cam][handle_index];
+	struct gopro_cmd_t gopro_cmd;
+	bool unacked;
+	int err;
+
+	while(k_msgq_peek(msgq, &gopro_cmd) == 0){
+		unacked = bt_gopro_client_unacked(gp_client, &gopro_cmd);
+
+		if(bt_gopro_client_write_busy(gp_client, handle_index)){
+			return;
+		}
+
+		if(unacked && (atomic_get(&write_inflight[cam][handle_index]) >= CONFIG_GOPRO_WRITE_WINDOW)){
+			return;
+		}
+
+		k_msgq_get(msgq, &gopro_cmd, K_NO_WAIT);
+
+		atomic_inc(&write_inflight[cam][handle_index]);
+
+		err = bt_gopro_client_send(gp_client, &gopro_cmd);
+		if(err){
+			atomic_dec(&write_inflight[cam][handle_index]);
+			writer_stat.drops++;
+			LOG_WRN("Failed to send data over BLE connection (err %d)", err);
+			continue;
+		}
+
+		if(unacked){
+			writer_stat.commands++;
+		}else{
+			writer_stat.requests++;
+			request_start[cam][handle_index] = k_uptime_get();
+		}
+	}
+}
+
+/*
+Очередь обслуживается, только если более приоритетные очереди той же
+камеры пусты или ждут ответа на свой запрос записи: занятая характеристика
+не держит остальные. Длинная передача прерывается между фрагментами: пока
+команда ждет окна, следующий фрагмент NET не уходит. Перед командой в стеке
+остаются максимум окно уже отправленных фрагментов и один запрос NET.
+Внешний цикл по приоритету: команды CMD всех камер уходят одна за другой,
+раньше настроек и NET любой из них.
+*/
+static void gopro_writer_schedule(void){
+	uint8_t waiting_prio[CONFIG_GOPRO_CAM_MAX];
+
+	memset(waiting_prio, UINT8_MAX, sizeof(waiting_prio));
+
+	for(uint8_t prio=0; prio<GOPRO_WRITE_PRIO_END; prio++){
+		for(uint32_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+			for(uint32_t i=0; i<GP_CNTRL_HANDLE_END; i++){
+				if(gopro_write_prio[i] != prio){
+					continue;
+				}
+
+				if(prio > waiting_prio[cam]){
+					if(k_msgq_num_used_get(&gopro_write_msgq[cam][i]) > 0){
+						writer_stat.held++;
+					}
+					continue;
+				}
+
+				gopro_writer_pump(cam, i);
+
+				if((k_msgq_num_used_get(&gopro_write_msgq[cam][i]) > 0) &&
+				   !bt_gopro_client_write_busy(&gopro_client[cam], i)){
+					waiting_prio[cam] = MIN(waiting_prio[cam], prio);
+				}
+			}
+		}
+	}
+}
+
+static void gopro_writer_check_timeout(void){
+	int64_t now = k_uptime_get();
+
+	for(uint32_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		for(uint32_t i=0; i<GP_CNTRL_HANDLE_END; i++){
+			if(request_start[cam][i] == 0){
+				continue;
+			}
+
+			if(!bt_gopro_client_write_busy(&gopro_client[cam], i)){
+				request_start[cam][i] = 0;
+			}else if((now - request_start[cam][i]) > k_ticks_to_ms_floor64(GOPRO_WRITE_TIMEOUT.ticks)){
+				LOG_WRN("Data send timeout, camera %d handle %d",cam,i);
+				writer_stat.timeouts++;
+				request_start[cam][i] = 0;
+			}
+		}
+	}
+}
+
+static void gopro_writer_task(void *ptr1, void *ptr2, void *ptr3){
+	ARG_UNUSED(ptr1);
+	ARG_UNUSED(ptr2);
+	ARG_UNUSED(ptr3);
+
+	while(1){
+		k_sem_take(&gopro_write_kick_sem, GOPRO_WRITE_TIMEOUT);
+
+		gopro_writer_schedule();
+		gopro_writer_check_timeout();
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef GOPRO_WRITER_H
+#define GOPRO_WRITER_H
+
+#include <zephyr/kernel.h>
+
+#include "gopro_client.h"
+
+#define GOPRO_WRITER_THREAD_PRIORITY 	3
+#define GOPRO_WRITER_THREAD_STACK_SIZE	1024
+
+#define GOPRO_WRITE_TIMEOUT				K_MSEC(1200)	//Ожидание ответа на запрос записи и места в очереди
+
+struct gopro_writer_stat_t{
+	uint32_t queued;
+	uint32_t requests;		//Запись с ответом, одна на характеристику
+	uint32_t commands;		//Запись без ответа, до CONFIG_GOPRO_WRITE_WINDOW
+	uint32_t drops;			//Очередь переполнена или ошибка записи
+	uint32_t timeouts;
+	uint32_t held;			//Проходы, когда очередь ждала более приоритетную
+	uint16_t depth[GP_CNTRL_HANDLE_END];		//Сумма по камерам
+	uint8_t  max_depth[GP_CNTRL_HANDLE_END];	//Одной очереди
+	uint16_t inflight[GP_CNTRL_HANDLE_END];
+};
+
+int gopro_writer_put(const struct gopro_cmd_t *gopro_cmd, k_timeout_t timeout);
+void gopro_writer_sent(uint8_t cam, uint32_t handle_index);
+void gopro_writer_reset(uint8_t cam);
+void gopro_writer_stat_get(struct gopro_writer_stat_t *stat);
+
+#endif
@@ -51,11 +51,19 @@ void led_idle_timer_start(uint8_t enable){
 }
 
 static void led_idle_handler(struct k_work *work){
-	if(gopro_client_get_state() != GP_STATE_UNKNOWN){
-		LOG_DBG("Set LED to idle state");
+	enum gopro_state_list_t state;
+
+	for(uint8_t cam=0; cam<CONFIG_GOPRO_CAM_MAX; cam++){
+		state = gopro_client_get_state(cam);
+		if((state != GP_STATE_UNKNOWN) && (state != GP_STATE_CONNECTED)){
+			LOG_DBG("Camera %d to idle state",cam);
+			gopro_client_set_sate(cam, GP_STATE_UNKNOWN);
+			gopro_client_setname(cam, NULL, 0);
+		}
+	}
+
+	if(gopro_client_connected_count() == 0){
 		gopro_led_mode_set(LED_NUM_BT,LED_MODE_BLINK_5S);
-		gopro_client_set_sate(GP_STATE_UNKNOWN);
-		gopro_client_setname(NULL,0);
 	}
 }
 
@@ -198,6 +198,48 @@ struct bt_scan_filters {
 	bool all_mode;
 };
 
+/* Enabled filters compiled into flat tables.
+ * Rebuilt every time the filters are added, removed, enabled or disabled,
+ * so that the advertising data is walked once per report without
+ * per-filter callbacks and UUID conversions.
+ */
+struct bt_scan_matcher {
+	/* Enabled filter types, BT_SCAN_*_FILTER bits. */
+	uint8_t required;
+
+	/* Enabled filter types that are looked up in the AD data. */
+	uint8_t ad_types;
+
+	bool all_mode;
+
+	/* Every UUID filter in each advertised width it can match. */
+	struct {
+		uint16_t val;
+		uint8_t idx;
+	} uuid16[CONFIG_BT_SCAN_UUID_CNT];
+	uint8_t uuid16_cnt;
+
+	struct {
+		uint32_t val;
+		uint8_t idx;
+	} uuid32[CONFIG_BT_SCAN_UUID_CNT];
+	uint8_t uuid32_cnt;
+
+	struct {
+		uint8_t val[BT_SCAN_UUID_128_SIZE];
+		uint8_t idx;
+	} uuid128[CONFIG_BT_SCAN_UUID_CNT];
+	uint8_t uuid128_cnt;
+
+	/* UUID filter indexes that must be found in the all filter mode. */
+	uint32_t uuid_all;
+
+	uint8_t name_len[CONFIG_BT_SCAN_NAME_CNT];
+	uint8_t short_name_len[CONFIG_BT_SCAN_SHORT_NAME_CNT];
+};
+
+BUILD_ASSERT(CONFIG_BT_SCAN_UUID_CNT <= 32, "UUID match mask is 32 bit");
+
 #if CONFIG_BT_SCAN_CONN_ATTEMPTS_FILTER
 /* Connection attempts filter device */
 struct conn_attempts_device {
@@ -240,6 +282,9 @@ static struct bt_scan {
 	/* Filter data. */
 	struct bt_scan_filters scan_filters;
 
+	/* Enabled filters compiled for scan_recv. */
+	struct bt_scan_matcher matcher;
+
 #if CONFIG_BT_CENTRAL
 	/* If set to true, the module automatically connects
 	 * after a filter match.
@@ -655,7 +700,9 @@ static int scan_name_filter_add(const char *name)
 		}
 	}
 
-	/* Add name to filter. */
+	/* Add name to filter. The slot may keep a longer removed name. */
+	memset(bt_scan.scan_filters.name.target_name[counter], 0,
+	       CONFIG_BT_SCAN_NAME_MAX_LEN);
 	memcpy(bt_scan.scan_filters.name.target_name[counter],
 	       name, name_len);
 
@@ -755,6 +802,8 @@ static int scan_short_name_filter_add(const struct bt_scan_short_name *short_nam
 
 	/* Add name to the filter. */
 	short_name_filter->name[counter].min_len = short_name->min_len;
+	memset(short_name_filter->name[counter].target_name, 0,
+	       CONFIG_BT_SCAN_SHORT_NAME_MAX_LEN);
 	memcpy(short_name_filter->name[counter].target_name,
 	       short_name->name,
 	       name_len);
@@ -1122,6 +1171,120 @@ static bool check_filter_mode(uint8_t mode)
 	return (mode & MODE_CHECK) != 0;
 }
 
+/* Bluetooth Base UUID without the leading 32 bits, little endian. */
+static const uint8_t uuid_base[BT_SCAN_UUID_128_SIZE - sizeof(uint32_t)] = {
+	0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+	0x00, 0x10, 0x00, 0x00
+};
+
+/* Same equality as bt_uuid_cmp: UUIDs of different types are compared
+ * as 128-bit, so a filter goes to every table it can be found in.
+ */
+static void matcher_uuid_add(struct bt_scan_matcher *matcher,
+			     uint8_t idx,
+			     struct bt_uuid *uuid)
+{
+	uint8_t val[BT_SCAN_UUID_128_SIZE];
+	uint32_t short_val;
+	bool is_short = true;
+
+	switch (uuid->type) {
+	case BT_UUID_TYPE_16:
+		short_val = BT_UUID_16(uuid)->val;
+		break;
+
+	case BT_UUID_TYPE_32:
+		short_val = BT_UUID_32(uuid)->val;
+		break;
+
+	case BT_UUID_TYPE_128:
+		memcpy(val, BT_UUID_128(uuid)->val, sizeof(val));
+		is_short = (memcmp(val, uuid_base, sizeof(uuid_base)) == 0);
+		short_val = sys_get_le32(&val[sizeof(uuid_base)]);
+		break;
+
+	default:
+		return;
+	}
+
+	if (uuid->type != BT_UUID_TYPE_128) {
+		memcpy(val, uuid_base, sizeof(uuid_base));
+		sys_put_le32(short_val, &val[sizeof(uuid_base)]);
+	}
+
+	memcpy(matcher->uuid128[matcher->uuid128_cnt].val, val, sizeof(val));
+	matcher->uuid128[matcher->uuid128_cnt].idx = idx;
+	matcher->uuid128_cnt++;
+
+	if (!is_short) {
+		return;
+	}
+
+	matcher->uuid32[matcher->uuid32_cnt].val = short_val;
+	matcher->uuid32[matcher->uuid32_cnt].idx = idx;
+	matcher->uuid32_cnt++;
+
+	if (short_val <= UINT16_MAX) {
+		matcher->uuid16[matcher->uuid16_cnt].val = short_val;
+		matcher->uuid16[matcher->uuid16_cnt].idx = idx;
+		matcher->uuid16_cnt++;
+	}
+}
+
+/* Must be called with scan_mutex held. */
+static void scan_matcher_compile(void)
+{
+	struct bt_scan_matcher *matcher = &bt_scan.matcher;
+	struct bt_scan_filters *filters = &bt_scan.scan_filters;
+
+	memset(matcher, 0, sizeof(*matcher));
+
+	matcher->all_mode = filters->all_mode;
+
+	if (is_addr_filter_enabled()) {
+		matcher->required |= BT_SCAN_ADDR_FILTER;
+	}
+
+	if (is_name_filter_enabled()) {
+		matcher->required |= BT_SCAN_NAME_FILTER;
+
+		for (size_t i = 0; i < filters->name.cnt; i++) {
+			matcher->name_len[i] =
+				strnlen(filters->name.target_name[i],
+					CONFIG_BT_SCAN_NAME_MAX_LEN);
+		}
+	}
+
+	if (is_short_name_filter_enabled()) {
+		matcher->required |= BT_SCAN_SHORT_NAME_FILTER;
+
+		for (size_t i = 0; i < filters->short_name.cnt; i++) {
+			matcher->short_name_len[i] =
+				strnlen(filters->short_name.name[i].target_name,
+					CONFIG_BT_SCAN_SHORT_NAME_MAX_LEN);
+		}
+	}
+
+	if (is_uuid_filter_enabled()) {
+		matcher->required |= BT_SCAN_UUID_FILTER;
+		matcher->uuid_all = BIT_MASK(filters->uuid.cnt);
+
+		for (size_t i = 0; i < filters->uuid.cnt; i++) {
+			matcher_uuid_add(matcher, i, filters->uuid.uuid[i].uuid);
+		}
+	}
+
+	if (is_appearance_filter_enabled()) {
+		matcher->required |= BT_SCAN_APPEARANCE_FILTER;
+	}
+
+	if (is_manufacturer_data_filter_enabled()) {
+		matcher->required |= BT_SCAN_MANUFACTURER_DATA_FILTER;
+	}
+
+	matcher->ad_types = matcher->required & ~BT_SCAN_ADDR_FILTER;
+}
+
 static void scan_default_param_set(void)
 {
 	struct bt_le_scan_param *scan_param = BT_LE_SCAN_PASSIVE;
@@ -1211,6 +1374,10 @@ int bt_scan_filter_add(enum bt_scan_filter_type type,
 		break;
 	}
 
+	if (!err) {
+		scan_matcher_compile();
+	}
+
 	k_mutex_unlock(&scan_mutex);
 
 	return err;
@@ -1244,10 +1411,12 @@ void bt_scan_filter_remove_all(void)
 		&bt_scan.scan_filters.manufacturer_data;
 	manufacturer_data_filter->cnt = 0;
 
+	scan_matcher_compile();
+
 	k_mutex_unlock(&scan_mutex);
 }
 
-void bt_scan_filter_disable(void)
+static void scan_filter_disable(void)
 {
 	/* Disable all filters. */
 	bt_scan.scan_filters.name.enabled = false;
@@ -1258,6 +1427,16 @@ void bt_scan_filter_disable(void)
 	bt_scan.scan_filters.manufacturer_data.enabled = false;
 }
 
+void bt_scan_filter_disable(void)
+{
+	k_mutex_lock(&scan_mutex, K_FOREVER);
+
+	scan_filter_disable();
+	scan_matcher_compile();
+
+	k_mutex_unlock(&scan_mutex);
+}
+
 int bt_scan_filter_enable(uint8_t mode, bool match_all)
 {
 	/* Check if the mode is correct. */
@@ -1265,8 +1444,10 @@ int bt_scan_filter_enable(uint8_t mode, bool match_all)
 		return -EINVAL;
 	}
 
+	k_mutex_lock(&scan_mutex, K_FOREVER);
+
 	/* Disable filters. */
-	bt_scan_filter_disable();
+	scan_filter_disable();
 
 	struct bt_scan_filters *filters = &bt_scan.scan_filters;
 
@@ -1298,6 +1479,10 @@ int bt_scan_filter_enable(uint8_t mode, bool match_all)
 	/* Select the filter mode. */
 	filters->all_mode = match_all;
 
+	scan_matcher_compile();
+
+	k_mutex_unlock(&scan_mutex);
+
 	return 0;
 }
 
@@ -1338,7 +1523,10 @@ void bt_scan_init(const struct bt_scan_init_param *init)
 	bt_le_scan_cb_register(&scan_cb);
 
 	/* Disable all scanning filters. */
+	k_mutex_lock(&scan_mutex, K_FOREVER);
 	memset(&bt_scan.scan_filters, 0, sizeof(bt_scan.scan_filters));
+	scan_matcher_compile();
+	k_mutex_unlock(&scan_mutex);
 
 	/* If the pointer to the initialization structure exist,
 	 * use it to scan the configuration.
@@ -1493,31 +1681,338 @@ static void filter_state_check(struct bt_scan_control *control,
 	}
 }
 
-static void scan_recv(const struct bt_le_scan_recv_info *info,
-		      struct net_buf_simple *ad)
+/* Per-filter matching through bt_data_parse callbacks. */
+static void scan_match_legacy(struct bt_scan_control *control,
+			      const bt_addr_le_t *addr,
+			      struct net_buf_simple *ad)
 {
-	struct bt_scan_control scan_control;
 	struct net_buf_simple_state state;
 
-	memset(&scan_control, 0, sizeof(scan_control));
-
-	scan_control.all_mode = bt_scan.scan_filters.all_mode;
+	control->all_mode = bt_scan.scan_filters.all_mode;
 
-	check_enabled_filters(&scan_control);
-
-	/* Check id device is connectable. */
-	scan_control.connectable =
-		(info->adv_props & BT_GAP_ADV_PROP_CONNECTABLE) != 0;
+	check_enabled_filters(control);
 
 	/* Check the address filter. */
-	check_addr(&scan_control, info->addr);
+	check_addr(control, addr);
 
 	/* Save advertising buffer state to transfer it
 	 * data to application if futher processing is needed.
 	 */
 	net_buf_simple_save(ad, &state);
-	bt_data_parse(ad, adv_data_found, (void *)&scan_control);
+	bt_data_parse(ad, adv_data_found, (void *)control);
 	net_buf_simple_restore(ad, &state);
+}
+
+static uint8_t ad_filter_type(uint8_t ad_type)
+{
+	switch (ad_type) {
+	case BT_DATA_NAME_COMPLETE:
+		return BT_SCAN_NAME_FILTER;
+
+	case BT_DATA_NAME_SHORTENED:
+		return BT_SCAN_SHORT_NAME_FILTER;
+
+	case BT_DATA_GAP_APPEARANCE:
+		return BT_SCAN_APPEARANCE_FILTER;
+
+	case BT_DATA_UUID16_SOME:
+	case BT_DATA_UUID16_ALL:
+	case BT_DATA_UUID32_SOME:
+	case BT_DATA_UUID32_ALL:
+	case BT_DATA_UUID128_SOME:
+	case BT_DATA_UUID128_ALL:
+		return BT_SCAN_UUID_FILTER;
+
+	case BT_DATA_MANUFACTURER_DATA:
+		return BT_SCAN_MANUFACTURER_DATA_FILTER;
+
+	default:
+		return 0;
+	}
+}
+
+static bool match_name(struct bt_scan_control *control,
+		       const uint8_t *data,
+		       uint8_t data_len)
+{
+	const struct bt_scan_name_filter *name_filter =
+			&bt_scan.scan_filters.name;
+
+	for (size_t i = 0; i < name_filter->cnt; i++) {
+		if ((data_len <= bt_scan.matcher.name_len[i]) &&
+		    (memcmp(name_filter->target_name[i], data, data_len) == 0)) {
+			control->filter_status.name.name =
+				name_filter->target_name[i];
+			control->filter_status.name.len = data_len;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool match_short_name(struct bt_scan_control *control,
+			     const uint8_t *data,
+			     uint8_t data_len)
+{
+	const struct bt_scan_short_name_filter *name_filter =
+			&bt_scan.scan_filters.short_name;
+
+	for (size_t i = 0; i < name_filter->cnt; i++) {
+		if ((data_len >= name_filter->name[i].min_len) &&
+		    (data_len <= bt_scan.matcher.short_name_len[i]) &&
+		    (memcmp(name_filter->name[i].target_name, data, data_len) == 0)) {
+			control->filter_status.short_name.name =
+				name_filter->name[i].target_name;
+			control->filter_status.short_name.len = data_len;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* UUIDs found so far are accumulated in uuid_found across the AD structures. */
+static bool match_uuid(uint8_t ad_type,
+		       const uint8_t *data,
+		       uint8_t data_len,
+		       uint32_t *uuid_found)
+{
+	const struct bt_scan_matcher *matcher = &bt_scan.matcher;
+
+	switch (ad_type) {
+	case BT_DATA_UUID16_SOME:
+	case BT_DATA_UUID16_ALL:
+		for (size_t i = 0; i + sizeof(uint16_t) <= data_len; i += sizeof(uint16_t)) {
+			uint16_t val = sys_get_le16(&data[i]);
+
+			for (size_t j = 0; j < matcher->uuid16_cnt; j++) {
+				if (matcher->uuid16[j].val == val) {
+					*uuid_found |= BIT(matcher->uuid16[j].idx);
+				}
+			}
+		}
+		break;
+
+	case BT_DATA_UUID32_SOME:
+	case BT_DATA_UUID32_ALL:
+		for (size_t i = 0; i + sizeof(uint32_t) <= data_len; i += sizeof(uint32_t)) {
+			uint32_t val = sys_get_le32(&data[i]);
+
+			for (size_t j = 0; j < matcher->uuid32_cnt; j++) {
+				if (matcher->uuid32[j].val == val) {
+					*uuid_found |= BIT(matcher->uuid32[j].idx);
+				}
+			}
+		}
+		break;
+
+	default:
+		for (size_t i = 0; i + BT_SCAN_UUID_128_SIZE <= data_len; i += BT_SCAN_UUID_128_SIZE) {
+			for (size_t j = 0; j < matcher->uuid128_cnt; j++) {
+				if (memcmp(matcher->uuid128[j].val, &data[i],
+					   BT_SCAN_UUID_128_SIZE) == 0) {
+					*uuid_found |= BIT(matcher->uuid128[j].idx);
+				}
+			}
+		}
+		break;
+	}
+
+	if (matcher->all_mode) {
+		return (*uuid_found & matcher->uuid_all) == matcher->uuid_all;
+	}
+
+	return *uuid_found != 0;
+}
+
+static bool match_appearance(struct bt_scan_control *control,
+			     const uint8_t *data,
+			     uint8_t data_len)
+{
+	const struct bt_scan_appearance_filter *appearance_filter =
+			&bt_scan.scan_filters.appearance;
+	uint16_t appearance;
+
+	if (data_len != sizeof(uint16_t)) {
+		return false;
+	}
+
+	appearance = sys_get_le16(data);
+
+	for (size_t i = 0; i < appearance_filter->cnt; i++) {
+		if (appearance_filter->appearance[i] == appearance) {
+			control->filter_status.appearance.appearance =
+					&appearance_filter->appearance[i];
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool match_manufacturer_data(struct bt_scan_control *control,
+				    const uint8_t *data,
+				    uint8_t data_len)
+{
+	const struct bt_scan_manufacturer_data_filter *md_filter =
+		&bt_scan.scan_filters.manufacturer_data;
+
+	for (size_t i = 0; i < md_filter->cnt; i++) {
+		if (adv_manufacturer_data_cmp(data, data_len,
+				md_filter->manufacturer_data[i].data,
+				md_filter->manufacturer_data[i].data_len)) {
+			control->filter_status.manufacturer_data.data =
+				md_filter->manufacturer_data[i].data;
+			control->filter_status.manufacturer_data.len =
+				md_filter->manufacturer_data[i].data_len;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Single pass over the AD structures with the compiled filters.
+ * Stops at the first match in the normal mode and as soon as
+ * every enabled filter type is matched in the all filter mode.
+ */
+static void scan_match(struct bt_scan_control *control,
+		       const bt_addr_le_t *addr,
+		       const uint8_t *data,
+		       uint16_t len)
+{
+	const struct bt_scan_matcher *matcher = &bt_scan.matcher;
+	uint32_t uuid_found = 0;
+	uint8_t matched = 0;
+	uint8_t pending = matcher->ad_types;
+
+	control->all_mode = matcher->all_mode;
+	control->filter_cnt = POPCOUNT(matcher->required);
+
+	if (matcher->required & BT_SCAN_ADDR_FILTER) {
+		if (adv_addr_compare(addr, control)) {
+			control->filter_status.addr.match = true;
+			matched |= BT_SCAN_ADDR_FILTER;
+		}
+
+		/* The AD data can no longer change the result. */
+		if (matcher->all_mode != !!matched) {
+			pending = 0;
+		}
+	}
+
+	while (pending && (len > 1)) {
+		uint8_t field_len = data[0];
+		uint8_t ad_type;
+		const uint8_t *field;
+		uint8_t filter;
+		bool found = false;
+
+		/* Same termination rules as bt_data_parse. */
+		if ((field_len == 0) || (field_len > (len - 1))) {
+			break;
+		}
+
+		ad_type = data[1];
+		field = &data[2];
+		field_len--;
+
+		data += field_len + 2;
+		len -= field_len + 2;
+
+		filter = ad_filter_type(ad_type) & pending;
+
+		switch (filter) {
+		case BT_SCAN_NAME_FILTER:
+			found = match_name(control, field, field_len);
+			break;
+
+		case BT_SCAN_SHORT_NAME_FILTER:
+			found = match_short_name(control, field, field_len);
+			break;
+
+		case BT_SCAN_UUID_FILTER:
+			found = match_uuid(ad_type, field, field_len, &uuid_found);
+			break;
+
+		case BT_SCAN_APPEARANCE_FILTER:
+			found = match_appearance(control, field, field_len);
+			break;
+
+		case BT_SCAN_MANUFACTURER_DATA_FILTER:
+			found = match_manufacturer_data(control, field, field_len);
+			break;
+
+		default:
+			break;
+		}
+
+		if (!found) {
+			continue;
+		}
+
+		matched |= filter;
+		pending &= ~filter;
+
+		if (!matcher->all_mode) {
+			break;
+		}
+	}
+
+	if (matched & BT_SCAN_NAME_FILTER) {
+		control->filter_status.name.match = true;
+	}
+
+	if (matched & BT_SCAN_SHORT_NAME_FILTER) {
+		control->filter_status.short_name.match = true;
+	}
+
+	if (matched & BT_SCAN_APPEARANCE_FILTER) {
+		control->filter_status.appearance.match = true;
+	}
+
+	if (matched & BT_SCAN_MANUFACTURER_DATA_FILTER) {
+		control->filter_status.manufacturer_data.match = true;
+	}
+
+	if (matched & BT_SCAN_UUID_FILTER) {
+		struct bt_scan_uuid_filter_status *status =
+			&control->filter_status.uuid;
+
+		status->match = true;
+		for (size_t i = 0; i < bt_scan.scan_filters.uuid.cnt; i++) {
+			if (uuid_found & BIT(i)) {
+				status->uuid[status->count++] =
+					bt_scan.scan_filters.uuid.uuid[i].uuid;
+			}
+		}
+	}
+
+	control->filter_match_cnt = POPCOUNT(matched);
+	control->filter_match = (matched != 0);
+}
+
+static void scan_recv(const struct bt_le_scan_recv_info *info,
+		      struct net_buf_simple *ad)
+{
+	struct bt_scan_control scan_control;
+
+	memset(&scan_control, 0, sizeof(scan_control));
+
+	/* Check id device is connectable. */
+	scan_control.connectable =
+		(info->adv_props & BT_GAP_ADV_PROP_CONNECTABLE) != 0;
+
+	if (IS_ENABLED(CONFIG_BT_SCAN_FILTER_COMPILED)) {
+		scan_match(&scan_control, info->addr, ad->data, ad->len);
+	} else {
+		scan_match_legacy(&scan_control, info->addr, ad);
+	}
 
 	scan_control.device_info.recv_info = info;
 	scan_control.device_info.conn_param = &bt_scan.conn_param;
@@ -1640,4 +2135,184 @@ void bt_scan_update_connect_if_match(bool connect_if_match)
 }
 #endif /* CONFIG_BT_CENTRAL */
 
+#if CONFIG_BT_SCAN_BENCH
+/* Synthetic advertising stream: a camera among the usual neighbours. */
+static const uint8_t bench_adv_gopro[] = {
+	0x02, BT_DATA_FLAGS, 0x06,
+	0x03, BT_DATA_UUID16_ALL, 0xa6, 0xfe,
+	0x0b, BT_DATA_MANUFACTURER_DATA, 0xf2, 0x02, 0x02, 0x01, 0x38,
+	0x00, 0x00, 0x00, 0x12, 0x34,
+};
+
+static const uint8_t bench_adv_phone[] = {
+	0x02, BT_DATA_FLAGS, 0x1a,
+	0x0a, BT_DATA_MANUFACTURER_DATA, 0x4c, 0x00, 0x10, 0x05, 0x01,
+	0x18, 0x1c, 0x3f, 0x8a,
+};
+
+static const uint8_t bench_adv_beacon[] = {
+	0x02, BT_DATA_FLAGS, 0x06,
+	0x1a, BT_DATA_MANUFACTURER_DATA, 0x4c, 0x00, 0x02, 0x15,
+	0xe2, 0xc5, 0x6d, 0xb5, 0xdf, 0xfb, 0x48, 0xd2,
+	0xb0, 0x60, 0xd0, 0xf5, 0xa7, 0x10, 0x96, 0xe0,
+	0x00, 0x01, 0x00, 0x02, 0xc5,
+};
+
+static const uint8_t bench_adv_sensor[] = {
+	0x02, BT_DATA_FLAGS, 0x06,
+	0x11, BT_DATA_UUID128_ALL,
+	0x9e, 0xca, 0xdc, 0x24, 0x0e, 0xe5, 0xa9, 0xe0,
+	0x93, 0xf3, 0xa3, 0xb5, 0x01, 0x00, 0x40, 0x6e,
+	0x07, BT_DATA_NAME_COMPLETE, 'S', 'e', 'n', 's', 'o', 'r',
+};
+
+static const uint8_t bench_adv_band[] = {
+	0x02, BT_DATA_FLAGS, 0x06,
+	0x05, BT_DATA_UUID16_SOME, 0x0d, 0x18, 0x0f, 0x18,
+	0x03, BT_DATA_GAP_APPEARANCE, 0x41, 0x03,
+	0x05, BT_DATA_NAME_SHORTENED, 'B', 'a', 'n', 'd',
+};
+
+static const uint8_t bench_adv_swift[] = {
+	0x1e, BT_DATA_MANUFACTURER_DATA, 0x06, 0x00, 0x03, 0x00, 0x80,
+	0x4a, 0x1f, 0x7c, 0x28, 0x55, 0x03, 0x11, 0x42, 0x9c, 0x01,
+	0x6a, 0x33, 0x07, 0xe1, 0x5d, 0x20, 0x8b, 0x39, 0x4f, 0xd2,
+	0x08, 0x86, 0xc4, 0x21,
+};
+
+static const struct {
+	const uint8_t *data;
+	uint8_t len;
+} bench_adv[] = {
+	{bench_adv_gopro, sizeof(bench_adv_gopro)},
+	{bench_adv_phone, sizeof(bench_adv_phone)},
+	{bench_adv_beacon, sizeof(bench_adv_beacon)},
+	{bench_adv_sensor, sizeof(bench_adv_sensor)},
+	{bench_adv_band, sizeof(bench_adv_band)},
+	{bench_adv_swift, sizeof(bench_adv_swift)},
+};
+
+static void bench_addr(bt_addr_le_t *addr, uint32_t i)
+{
+	addr->type = BT_ADDR_LE_RANDOM;
+	sys_put_le32(i * 2654435761U, &addr->a.val[0]);
+	sys_put_le16(0xc000 | (i % ARRAY_SIZE(bench_adv)), &addr->a.val[4]);
+}
+
+#if CONFIG_ARCH_POSIX
+/* native_sim: the cycle counter only moves while the CPU idles. */
+extern uint64_t bt_scan_bench_host_ns(void);
+
+static uint64_t bench_start(void)
+{
+	return bt_scan_bench_host_ns();
+}
+
+static uint64_t bench_elapsed_ns(uint64_t start)
+{
+	return bt_scan_bench_host_ns() - start;
+}
+#else
+static uint64_t bench_start(void)
+{
+	return k_cycle_get_32();
+}
+
+static uint64_t bench_elapsed_ns(uint64_t start)
+{
+	return k_cyc_to_ns_floor64(k_cycle_get_32() - (uint32_t)start);
+}
+#endif
+
+static uint32_t bench_rate(uint32_t count, uint64_t ns)
+{
+	return (uint32_t)(((uint64_t)count * NSEC_PER_SEC) / MAX(ns, 1));
+}
+
+/* Runs both matchers over the same stream with the filters that are set now. */
+int bt_scan_bench(uint32_t count, struct bt_scan_bench_result *result)
+{
+	struct bt_scan_control control;
+	struct bt_scan_control legacy;
+	struct net_buf_simple ad;
+	bt_addr_le_t addr;
+	uint64_t compiled_ns;
+	uint64_t legacy_ns;
+	uint64_t start;
+
+	if ((result == NULL) || (count == 0)) {
+		return -EINVAL;
+	}
+
+	memset(result, 0, sizeof(*result));
+	result->count = count;
+	result->lap = ARRAY_SIZE(bench_adv);
+
+	k_mutex_lock(&scan_mutex, K_FOREVER);
+
+	start = bench_start();
+	for (uint32_t i = 0; i < count; i++) {
+		size_t n = i % ARRAY_SIZE(bench_adv);
+
+		bench_addr(&addr, i);
+		memset(&control, 0, sizeof(control));
+		scan_match(&control, &addr, bench_adv[n].data, bench_adv[n].len);
+	}
+	compiled_ns = bench_elapsed_ns(start);
+
+	start = bench_start();
+	for (uint32_t i = 0; i < count; i++) {
+		size_t n = i % ARRAY_SIZE(bench_adv);
+
+		bench_addr(&addr, i);
+		net_buf_simple_init_with_data(&ad, (void *)bench_adv[n].data,
+					      bench_adv[n].len);
+		memset(&legacy, 0, sizeof(legacy));
+		scan_match_legacy(&legacy, &addr, &ad);
+	}
+	legacy_ns = bench_elapsed_ns(start);
+
+	/* One lap of the stream to check that both agree. */
+	for (uint32_t i = 0; i < ARRAY_SIZE(bench_adv); i++) {
+		bool match;
+		bool legacy_match;
+
+		bench_addr(&addr, i);
+		memset(&control, 0, sizeof(control));
+		scan_match(&control, &addr, bench_adv[i].data, bench_adv[i].len);
+
+		net_buf_simple_init_with_data(&ad, (void *)bench_adv[i].data,
+					      bench_adv[i].len);
+		memset(&legacy, 0, sizeof(legacy));
+		scan_match_legacy(&legacy, &addr, &ad);
+
+		match = control.all_mode ?
+			(control.filter_match_cnt == control.filter_cnt) :
+			control.filter_match;
+		legacy_match = legacy.all_mode ?
+			(legacy.filter_match_cnt == legacy.filter_cnt) :
+			legacy.filter_match;
+
+		if (match) {
+			result->matched++;
+		}
+
+		if (match != legacy_match) {
+			result->mismatch++;
+		}
+	}
+
+	k_mutex_unlock(&scan_mutex);
+
+	result->compiled_us = (uint32_t)(compiled_ns / NSEC_PER_USEC);
+	result->legacy_us = (uint32_t)(legacy_ns / NSEC_PER_USEC);
+	result->compiled_ns_per_adv = (uint32_t)(compiled_ns / count);
+	result->legacy_ns_per_adv = (uint32_t)(legacy_ns / count);
+	result->compiled_rate = bench_rate(count, compiled_ns);
+	result->legacy_rate = bench_rate(count, legacy_ns);
+
+	return 0;
+}
+#endif /* CONFIG_BT_SCAN_BENCH */
+
 #endif
\ No newline at end of file
@@ -572,6 +572,47 @@ void bt_scan_blocklist_clear(void);
  */
 void bt_scan_update_connect_if_match(bool connect_if_match);
 
+#if CONFIG_BT_SCAN_BENCH
+/**@brief Filter matcher benchmark result. */
+struct bt_scan_bench_result {
+	/** Advertising reports fed to each matcher. */
+	uint32_t count;
+
+	/** Time spent by the compiled matcher. */
+	uint32_t compiled_us;
+
+	/** Time spent by the per-filter bt_data_parse matcher. */
+	uint32_t legacy_us;
+
+	/** Time per report. */
+	uint32_t compiled_ns_per_adv;
+	uint32_t legacy_ns_per_adv;
+
+	/** Reports per second. */
+	uint32_t compiled_rate;
+	uint32_t legacy_rate;
+
+	/** Different reports in the stream. */
+	uint32_t lap;
+
+	/** Reports of one stream lap matched by the current filters. */
+	uint32_t matched;
+
+	/** Reports of one stream lap where the matchers disagree. */
+	uint32_t mismatch;
+};
+
+/**@brief Feed a synthetic advertising stream through both filter matchers.
+ *
+ * @param[in] count Number of advertising reports.
+ * @param[out] result Time and throughput of each matcher.
+ *
+ * @retval 0 If the operation was successful. Otherwise, a (negative) error
+ *	     code is returned.
+ */
+int bt_scan_bench(uint32_t count, struct bt_scan_bench_result *result);
+#endif /* CONFIG_BT_SCAN_BENCH */
+
 #ifdef __cplusplus
 }
 #endif
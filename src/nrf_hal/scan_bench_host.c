@@ -0,0 +1,19 @@
+/*
+ * Runner side of the scan filter benchmark on native_sim: built with the host
+ * libc, outside the embedded image.
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+/* Simulated time does not advance in a busy loop, the host clock does. */
+uint64_t bt_scan_bench_host_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
@@ -1,6 +1,22 @@
 #include "shell.h"
 
 #include <stdlib.h>
+#include <string.h>
+#include <canbus_isotp.h>
+#include <canbus_dfu.h>
+#include <gopro_time.h>
+#include <gopro_conn_policy.h>
+#include <gopro_writer.h>
+#include <gopro_latency.h>
+#include <gopro_group.h>
+#include <gopro_adv_cache.h>
+#include <gopro_scan_policy.h>
+#include <gopro_autoconn.h>
+#include <gopro_ready.h>
+#include <gopro_poll.h>
+#include <gopro_batch.h>
+#include <gopro_preset.h>
+#include <zephyr/zbus/zbus.h>
 
 #if CONFIG_SHELL
 static int gopro_cmd_handler(const struct shell *sh, size_t argc, char **argv)
@@ -36,10 +52,547 @@ static int cmd_gopro_ping(const struct shell *sh, size_t argc, char **argv)
 	return 0;
 }
 
+static int cmd_isotp_fc(const struct shell *sh, size_t argc, char **argv)
+{
+	struct isotp_fc_cfg_t cfg;
+	struct isotp_fc_stat_t stat[ISOTP_SESSION_END];
+	int err;
+
+	if (argc >= 3) {
+		bool adaptive = (argc >= 4) ? (strtoul(argv[3], NULL, 0) != 0) : false;
+
+		err = canbus_isotp_fc_set(strtoul(argv[1], NULL, 0), strtoul(argv[2], NULL, 0), adaptive);
+		if (err) {
+			shell_error(sh, "FC set failed: %d", err);
+			return err;
+		}
+	}
+
+	canbus_isotp_fc_get(&cfg, stat);
+	shell_print(sh, "cfg: bs=%d stmin=0x%02X adaptive=%d", cfg.bs, cfg.stmin, cfg.adaptive);
+	for (uint8_t i = 0; i < ISOTP_SESSION_END; i++) {
+		shell_print(sh, "%s: stmin=0x%02X (%d us), rx %d msgs %d bytes, overruns %d, tightened %d, backoffs %d",
+			    canbus_isotp_session_name(i), stat[i].stmin, canbus_isotp_stmin_us(stat[i].stmin),
+			    stat[i].rx_msgs, stat[i].rx_bytes, stat[i].overruns, stat[i].tightened, stat[i].backoffs);
+	}
+
+	return 0;
+}
+
+static int cmd_isotp_health(const struct shell *sh, size_t argc, char **argv)
+{
+	struct isotp_health_t health;
+
+	canbus_isotp_health_get(&health);
+	shell_print(sh, "rx: errors %d, recoveries %d, bind failures %d, down %d ms (max %d ms)",
+		    health.rx_errors, health.rx_recoveries, health.rx_bind_failures,
+		    health.rx_unavail_ms, health.rx_recover_max_ms);
+	shell_print(sh, "tx: errors %d, recoveries %d, down %d ms",
+		    health.tx_errors, health.tx_recoveries, health.tx_unavail_ms);
+
+	return 0;
+}
+
+static int cmd_isotp_bench(const struct shell *sh, size_t argc, char **argv)
+{
+	static const uint8_t bench_bs[] = {0, 8};
+	static const uint8_t bench_stmin[] = {0x00, 0xF5, 1, 5, 10};
+	uint32_t size = (argc >= 2) ? strtoul(argv[1], NULL, 0) : 2048;
+	uint32_t rate;
+	int err;
+
+	shell_print(sh, "ISO-TP loopback, %d bytes per transfer", size);
+
+	for (size_t i = 0; i < ARRAY_SIZE(bench_bs); i++) {
+		for (size_t j = 0; j < ARRAY_SIZE(bench_stmin); j++) {
+			err = canbus_isotp_bench(bench_bs[i], bench_stmin[j], size, &rate);
+			if (err) {
+				shell_print(sh, "bs=%3d stmin=0x%02X: failed %d", bench_bs[i], bench_stmin[j], err);
+			} else {
+				shell_print(sh, "bs=%3d stmin=0x%02X: %d B/s", bench_bs[i], bench_stmin[j], rate);
+			}
+		}
+	}
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_isotp,
+        SHELL_CMD_ARG(fc,    NULL, "Show or set flow control: fc [<bs> <stmin> [adaptive]]", cmd_isotp_fc, 1, 3),
+        SHELL_CMD(health,    NULL, "Receive/transmit recovery counters", cmd_isotp_health),
+        SHELL_CMD_ARG(bench, NULL, "Loopback throughput per FC setting on the isotp-bench controller: bench [size]", cmd_isotp_bench, 1, 1),
+        SHELL_SUBCMD_SET_END
+);
+
 /* Creating subcommands (level 1 command) array for command "demo". */
+#if CONFIG_CAN_DFU
+static int cmd_dfu_status(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const state_str[] = {"idle", "receiving", "done", "error"};
+	struct dfu_status_t status;
+
+	canbus_dfu_status(&status);
+	shell_print(sh, "state: %s err %d", state_str[status.state], status.err);
+	shell_print(sh, "image %d bytes: received %d, written %d, verified %d",
+		    status.image_size, status.received, status.written, status.verified);
+	shell_print(sh, "chunks %d, crc errors %d, %d ms",
+		    status.chunks, status.crc_errors, status.elapsed_ms);
+
+	return 0;
+}
+#endif
+
+#if CONFIG_GOPRO_TIME_SYNC
+static int cmd_time_status(const struct shell *sh, size_t argc, char **argv)
+{
+	struct gopro_time_stat_t stat;
+
+	gopro_time_stat_get(&stat);
+	shell_print(sh, "master: %s, tz %d min, %d frames",
+		    stat.master_valid ? "valid" : "none", stat.tz_min, stat.master_frames);
+	if (stat.offset_valid) {
+		shell_print(sh, "camera offset %d ms +/- %d ms, rtt %d ms",
+			    stat.offset_ms, stat.precision_ms / 2, stat.rtt_ms);
+	} else {
+		shell_print(sh, "camera offset unknown");
+	}
+	shell_print(sh, "checks %d, syncs %d, failures %d, last sync at %d ms",
+		    stat.checks, stat.syncs, stat.failures, stat.last_sync_ms);
+
+	return 0;
+}
+
+static int cmd_time_set(const struct shell *sh, size_t argc, char **argv)
+{
+	int16_t tz_min = (argc >= 3) ? (int16_t)strtol(argv[2], NULL, 0) : 0;
+
+	gopro_time_master_set_epoch((int64_t)strtoull(argv[1], NULL, 0) * MSEC_PER_SEC, tz_min);
+
+	return 0;
+}
+
+static int cmd_time_sync(const struct shell *sh, size_t argc, char **argv)
+{
+	gopro_time_sync_request();
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_time,
+        SHELL_CMD_ARG(set, NULL, "Set master time without CAN: set <utc_s> [tz_min]", cmd_time_set, 2, 1),
+        SHELL_CMD(sync,    NULL, "Check camera clock now", cmd_time_sync),
+        SHELL_SUBCMD_SET_END
+);
+#endif
+
+#if CONFIG_GOPRO_LINK_POLICY
+static int cmd_link_status(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const mode_str[] = {"none", "active", "idle"};
+	struct gopro_link_stat_t stat;
+
+	gopro_conn_policy_stat_get(&stat);
+	shell_print(sh, "mode: %s", mode_str[stat.mode]);
+	shell_print(sh, "interval %d us, latency %d, timeout %d ms, phy tx 0x%X rx 0x%X",
+		    stat.interval * 1250, stat.latency, stat.timeout * 10, stat.tx_phy, stat.rx_phy);
+	shell_print(sh, "to active %d, to idle %d, update errors %d",
+		    stat.to_active, stat.to_idle, stat.update_errors);
+
+	return 0;
+}
+#endif
+
+static int cmd_write_status(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const handle_str[] = {"cmd", "settings", "query", "net"};
+	struct gopro_writer_stat_t stat;
+
+	gopro_writer_stat_get(&stat);
+	shell_print(sh, "queued %d, requests %d, commands %d, drops %d, timeouts %d, held %d",
+		    stat.queued, stat.requests, stat.commands, stat.drops, stat.timeouts, stat.held);
+	for (int i = 0; i < GP_CNTRL_HANDLE_END; i++) {
+		shell_print(sh, "%-8s depth %d (max %d) in flight %d",
+			    handle_str[i], stat.depth[i], stat.max_depth[i], stat.inflight[i]);
+	}
+
+	return 0;
+}
+
+#if CONFIG_GOPRO_ADV_CACHE
+static int cmd_adv_status(const struct shell *sh, size_t argc, char **argv)
+{
+	struct gopro_adv_cache_stat_t stat;
+	int err;
+
+	if ((argc >= 2) && (strcmp(argv[1], "check") == 0)) {
+		err = gopro_adv_cache_check();
+		if (err) {
+			shell_error(sh, "ADV_IND/SCAN_RSP pair does not hit: %d", err);
+			return err;
+		}
+		shell_print(sh, "ADV_IND/SCAN_RSP pair hits");
+		return 0;
+	}
+
+	gopro_adv_cache_stat_get(&stat);
+	shell_print(sh, "lookups %d, dropped %d (%d%%), changed %d, expired %d, evictions %d",
+		    stat.lookups, stat.hits, stat.lookups ? (stat.hits * 100 / stat.lookups) : 0,
+		    stat.changed, stat.expired, stat.evictions);
+
+	return 0;
+}
+#endif
+
+#if CONFIG_BT_SCAN_BENCH
+static int cmd_scan_bench(const struct shell *sh, size_t argc, char **argv)
+{
+	struct bt_scan_bench_result result;
+	uint32_t count = 100000;
+	int err;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], NULL, 0);
+	}
+
+	err = bt_scan_bench(count, &result);
+	if (err) {
+		shell_error(sh, "bench failed: %d", err);
+		return err;
+	}
+
+	shell_print(sh, "%d adv, %d of %d stream reports match the filters", result.count,
+		    result.matched, result.lap);
+	shell_print(sh, "compiled: %d us, %d ns/adv, %d adv/s", result.compiled_us,
+		    result.compiled_ns_per_adv, result.compiled_rate);
+	shell_print(sh, "bt_data_parse: %d us, %d ns/adv, %d adv/s", result.legacy_us,
+		    result.legacy_ns_per_adv, result.legacy_rate);
+	if (result.mismatch) {
+		shell_warn(sh, "matchers disagree on %d reports", result.mismatch);
+	}
+
+	return 0;
+}
+#endif
+
+#if CONFIG_GOPRO_SCAN_POLICY
+static int cmd_scan_status(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const mode_str[] = {"fast", "normal", "slow"};
+	struct gopro_scan_stat_t stat;
+
+	gopro_scan_policy_stat_get(&stat);
+	shell_print(sh, "mode: %s for %d s, %s", mode_str[stat.mode], stat.mode_ms / 1000,
+		    stat.active ? "active" : "passive");
+	shell_print(sh, "interval %d us, window %d us, duty %d%%",
+		    stat.interval * 625, stat.window * 625, stat.duty);
+	shell_print(sh, "entered fast %d, normal %d, slow %d, CAN wakes %d",
+		    stat.entered[GP_SCAN_FAST], stat.entered[GP_SCAN_NORMAL], stat.entered[GP_SCAN_SLOW], stat.wakes);
+
+	return 0;
+}
+#endif
+
+#if CONFIG_GOPRO_ACCEPT_LIST
+static int cmd_autoconn_status(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const path_str[] = {"scan", "accept list"};
+	struct gopro_autoconn_stat_t stat;
+	struct gopro_conn_lat_t *lat;
+
+	gopro_autoconn_stat_get(&stat);
+	shell_print(sh, "accept list %d, auto connect %s, backoff %d ms (step %d)",
+		    stat.listed, stat.pending ? "pending" : "off", stat.backoff_ms, stat.backoff_step);
+	for (int i = 0; i < GP_CONN_PATH_END; i++) {
+		lat = &stat.lat[i];
+		if (lat->count == 0) {
+			shell_print(sh, "%-11s no connects, failures %d", path_str[i], lat->failures);
+			continue;
+		}
+		shell_print(sh, "%-11s n %d min %d avg %d max %d ms, failures %d", path_str[i], lat->count,
+			    lat->min_ms, (uint32_t)(lat->sum_ms / lat->count), lat->max_ms, lat->failures);
+	}
+
+	return 0;
+}
+#endif
+
+static int cmd_cams_status(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const state_str[] = {"unknown", "offline", "online", "connected", "need pairing", "pairing"};
+	extern struct gopro_state_t gopro_state[CONFIG_GOPRO_CAM_MAX];
+	char addr[BT_ADDR_LE_STR_LEN];
+	struct gopro_state_t *state;
+
+	for (int cam = 0; cam < CONFIG_GOPRO_CAM_MAX; cam++) {
+		state = &gopro_state[cam];
+		bt_addr_le_to_str(&state->addr, addr, sizeof(addr));
+		shell_print(sh, "%d %-12s rec %d battery %d videos %d %s '%s'", cam,
+			    (state->state < ARRAY_SIZE(state_str)) ? state_str[state->state] : "?",
+			    state->record, state->battery, state->video_count, addr, state->name);
+	}
+
+	return 0;
+}
+
+static int cmd_wifi_status(const struct shell *sh, size_t argc, char **argv)
+{
+	extern struct gopro_state_t gopro_state[CONFIG_GOPRO_CAM_MAX];
+	uint8_t cam = (argc >= 2) ? strtoul(argv[1], NULL, 0) : GOPRO_CAM_MAIN;
+	int err;
+
+	if (cam >= CONFIG_GOPRO_CAM_MAX) {
+		shell_error(sh, "camera %d out of range", cam);
+		return -EINVAL;
+	}
+
+	if ((argc >= 3) && (strcmp(argv[2], "reset") == 0)) {
+		gopro_client_wifi_invalidate(cam);
+		shell_print(sh, "camera %d WiFi cache cleared", cam);
+		return 0;
+	}
+
+	err = gopro_client_wifi_get(cam);
+	if (err == -EINPROGRESS) {
+		shell_print(sh, "camera %d reading WiFi credentials, repeat", cam);
+		return 0;
+	}
+	if (err) {
+		shell_error(sh, "camera %d WiFi credentials unavailable (err %d)", cam, err);
+		return err;
+	}
+
+	shell_print(sh, "camera %d SSID '%s' pass '%s'", cam, gopro_state[cam].wifi_ssid,
+		    gopro_state[cam].wifi_pass);
+
+	return 0;
+}
+
+#if CONFIG_GOPRO_GROUP_SHUTTER
+ZBUS_CHAN_DECLARE(gopro_cmd_chan);
+
+static int cmd_group_status(const struct shell *sh, size_t argc, char **argv)
+{
+	struct gopro_group_stat_t stat;
+
+	gopro_group_stat_get(&stat);
+	shell_print(sh, "shots %d, partial %d, cameras %d", stat.shots, stat.partial, stat.cams);
+	if (stat.skew_count == 0) {
+		shell_print(sh, "skew: no samples");
+		return 0;
+	}
+
+	shell_print(sh, "last skew %d us (issue %d us)", stat.skew_us, stat.issue_skew_us);
+	shell_print(sh, "skew n %d min %d avg %d max %d us", stat.skew_count, stat.skew_min_us,
+		    (uint32_t)(stat.skew_sum_us / stat.skew_count), stat.skew_max_us);
+
+	return 0;
+}
+
+static int cmd_group_shutter(const struct shell *sh, size_t argc, char **argv)
+{
+	struct gopro_cmd_t gopro_cmd = {
+		.len = 4,
+		.cmd_type = GP_CNTRL_HANDLE_CMD,
+		.cam = GOPRO_CAM_ALL,
+		.data = {0x03, 0x01, 0x01, 0x00},
+	};
+	int err;
+
+	gopro_cmd.data[3] = (strtol(argv[1], NULL, 0) != 0);
+
+	#ifdef CONFIG_GOPRO_LATENCY_TRACE
+	gopro_latency_stamp(&gopro_cmd);
+	#endif
+
+	err = zbus_chan_pub(&gopro_cmd_chan, &gopro_cmd, K_NO_WAIT);
+	if (err) {
+		shell_error(sh, "publish failed: %d", err);
+		return err;
+	}
+
+	shell_print(sh, "shutter %d sent to %d cameras", gopro_cmd.data[3], gopro_client_connected_count());
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_group,
+        SHELL_CMD_ARG(shutter, NULL, "Shutter on all cameras: shutter <0|1>", cmd_group_shutter, 2, 0),
+        SHELL_SUBCMD_SET_END
+);
+#endif
+
+#if CONFIG_GOPRO_READY_TRACE
+static int cmd_ready_status(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const phase_str[] = {"create", "connect", "security", "discovery",
+						"subscribe", "hw info", "startup", "total"};
+	struct gopro_ready_stat_t stat;
+
+	for (int i = 0; i < GP_READY_PHASE_END; i++) {
+		gopro_ready_stat_get(i, &stat);
+		if (stat.count == 0) {
+			shell_print(sh, "%-9s no samples, stalls %d", phase_str[i], stat.stalls);
+			continue;
+		}
+
+		shell_print(sh, "%-9s n %d min %d avg %d max %d p95 %d ms, stalls %d", phase_str[i], stat.count,
+			    stat.min_ms, stat.avg_ms, stat.max_ms, stat.p95_ms, stat.stalls);
+	}
+
+	return 0;
+}
+
+static int cmd_ready_reset(const struct shell *sh, size_t argc, char **argv)
+{
+	gopro_ready_reset();
+	shell_print(sh, "ready stats cleared");
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_ready,
+        SHELL_CMD(reset, NULL, "Clear phase stats", cmd_ready_reset),
+        SHELL_SUBCMD_SET_END
+);
+#endif
+
+#if CONFIG_GOPRO_POLL
+static int cmd_poll_status(const struct shell *sh, size_t argc, char **argv)
+{
+	struct gopro_poll_stat_t stat;
+
+	gopro_poll_stat_get(&stat);
+	shell_print(sh, "keep-alive %d, time checks %d, drops %d, own replies %d", stat.keepalives, stat.time_syncs, stat.drops, stat.claimed);
+	shell_print(sh, "GET_STATUS %d, GET_SETTING %d messages for %d IDs (%d merged)", stat.status_msgs,
+		    stat.setting_msgs, stat.ids, stat.merged);
+
+#if CONFIG_GOPRO_QUERY_BATCH
+	struct gopro_batch_stat_t batch;
+
+	gopro_batch_stat_get(&batch);
+	shell_print(sh, "CAN queries %d (%d duplicate), split replies %d, drops %d", batch.requests,
+		    batch.duplicates, batch.replies, batch.drops);
+#endif
+
+	return 0;
+}
+#endif
+
+#if CONFIG_GOPRO_PRESET_CACHE
+static int cmd_preset_status(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const group_str[] = {"video", "photo", "timelapse"};
+	static struct gopro_preset_t preset[CONFIG_GOPRO_PRESET_MAX];
+	uint8_t cam = (argc >= 2) ? strtoul(argv[1], NULL, 0) : GOPRO_CAM_MAIN;
+	uint32_t updates;
+	int count;
+
+	if (cam >= CONFIG_GOPRO_CAM_MAX) {
+		shell_error(sh, "camera %d out of range", cam);
+		return -EINVAL;
+	}
+
+	count = gopro_preset_get(cam, preset, ARRAY_SIZE(preset), &updates);
+	if (count < 0) {
+		shell_print(sh, "camera %d presets not loaded", cam);
+		return 0;
+	}
+
+	shell_print(sh, "camera %d: %d presets, %d updates", cam, count, updates);
+	for (int i = 0; i < count; i++) {
+		shell_print(sh, "0x%08X %-9s mode %3d title %3d%s%s", preset[i].id,
+			    (preset[i].group < ARRAY_SIZE(group_str)) ? group_str[preset[i].group] : "?",
+			    preset[i].mode, preset[i].title,
+			    (preset[i].flags & GOPRO_PRESET_FLAG_USER) ? " user" : "",
+			    (preset[i].flags & GOPRO_PRESET_FLAG_MODIFIED) ? " modified" : "");
+	}
+
+	return 0;
+}
+#endif
+
+#if CONFIG_GOPRO_LATENCY_TRACE
+static int cmd_latency_status(const struct shell *sh, size_t argc, char **argv)
+{
+	static const char *const stage_str[] = {"queue", "writer", "ack", "response", "to ack", "to response"};
+	struct gopro_lat_hist_t hist;
+
+	for (int i = 0; i < GP_LAT_STAGE_END; i++) {
+		gopro_latency_hist_get(i, &hist);
+		if (hist.count == 0) {
+			shell_print(sh, "%-11s no samples", stage_str[i]);
+			continue;
+		}
+
+		shell_print(sh, "%-11s n %d min %d avg %d max %d us", stage_str[i], hist.count,
+			    hist.min_us, (uint32_t)(hist.sum_us / hist.count), hist.max_us);
+		for (int j = 0; j < GP_LAT_BUCKETS; j++) {
+			if (hist.bucket[j]) {
+				shell_print(sh, "%13s<%d us: %d", "", 2 << j, hist.bucket[j]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+static int cmd_latency_reset(const struct shell *sh, size_t argc, char **argv)
+{
+	gopro_latency_reset();
+	shell_print(sh, "latency histograms cleared");
+
+	return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_latency,
+        SHELL_CMD(reset, NULL, "Clear histograms", cmd_latency_reset),
+        SHELL_SUBCMD_SET_END
+);
+#endif
+
 SHELL_STATIC_SUBCMD_SET_CREATE(sub_demo,
         SHELL_CMD(params, NULL, "Print params command.", cmd_gopro_params),
         SHELL_CMD(ping,   NULL, "Ping command.", cmd_gopro_ping),
+        SHELL_CMD(isotp,  &sub_isotp, "ISO-TP transport.", NULL),
+        SHELL_CMD(write,  NULL, "GATT write queues.", cmd_write_status),
+        SHELL_CMD(cams,   NULL, "Camera slots.", cmd_cams_status),
+        SHELL_CMD_ARG(wifi, NULL, "Camera AP credentials, read on demand: wifi [cam] [reset]", cmd_wifi_status, 1, 2),
+#if CONFIG_GOPRO_ACCEPT_LIST
+        SHELL_CMD(reconnect, NULL, "Accept list, auto connect and connect latency.", cmd_autoconn_status),
+#endif
+#if CONFIG_BT_SCAN_BENCH
+        SHELL_CMD_ARG(scanbench, NULL, "Scan filter matcher throughput: scanbench [count]", cmd_scan_bench, 1, 1),
+#endif
+#if CONFIG_GOPRO_SCAN_POLICY
+        SHELL_CMD(scan,   NULL, "Scan mode and duty cycle.", cmd_scan_status),
+#endif
+#if CONFIG_GOPRO_ADV_CACHE
+        SHELL_CMD_ARG(adv, NULL, "Advertising dedupe cache hit rate: adv [check]", cmd_adv_status, 1, 1),
+#endif
+#if CONFIG_GOPRO_GROUP_SHUTTER
+        SHELL_CMD(group,  &sub_group, "Group shutter start skew.", cmd_group_status),
+#endif
+#if CONFIG_GOPRO_READY_TRACE
+        SHELL_CMD(ready,  &sub_ready, "Time to ready by connect phase.", cmd_ready_status),
+#endif
+#if CONFIG_GOPRO_POLL
+        SHELL_CMD(poll,   NULL, "Keep-alive and status poll scheduler.", cmd_poll_status),
+#endif
+#if CONFIG_GOPRO_PRESET_CACHE
+        SHELL_CMD_ARG(presets, NULL, "Cached camera presets: presets [cam]", cmd_preset_status, 1, 1),
+#endif
+#if CONFIG_GOPRO_LATENCY_TRACE
+        SHELL_CMD(latency, &sub_latency, "CMD latency from button/CAN to camera reply.", cmd_latency_status),
+#endif
+#if CONFIG_CAN_DFU
+        SHELL_CMD(dfu,    NULL, "CAN DFU status.", cmd_dfu_status),
+#endif
+#if CONFIG_GOPRO_LINK_POLICY
+        SHELL_CMD(link,   NULL, "Connection parameters and PHY.", cmd_link_status),
+#endif
+#if CONFIG_GOPRO_TIME_SYNC
+        SHELL_CMD(time,   &sub_time, "Camera clock sync status.", cmd_time_status),
+#endif
         SHELL_SUBCMD_SET_END
 );
 /* Creating root (level 0) command "demo" */